@@ -13,6 +13,11 @@ test:
 
 check: test
 
+bench:
+	cd src\optipng
+	$(MAKE) -f build\bcc32.mk bench
+	cd ..\..
+
 clean:
 	cd src\optipng
 	$(MAKE) -f build\bcc32.mk clean
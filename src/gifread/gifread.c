@@ -43,13 +43,44 @@
 #define LZW_BITS_MAX 12
 #define LZW_CODE_MAX ((1 << LZW_BITS_MAX) - 1)
 
+/*
+ * The LZW decoder state.
+ * Each table entry holds a string as a (prefix code, suffix byte) pair,
+ * together with the string length and the first byte of the string,
+ * so that whole strings can be emitted at once.
+ */
+static struct
+{
+    unsigned char  buffer[256];
+    unsigned int   bufPos, bufLen;
+    int            endOfData, endOfCodes;
+    unsigned long  bitBuffer;
+    unsigned int   bitCount;
+    unsigned int   codeSize, initCodeSize;
+    unsigned int   clearCode, endCode, nextCode;
+    int            oldCode;
+    unsigned int   numColors;
+    int            warnedCode, warnedValue;
+    unsigned short prefix[LZW_CODE_MAX + 1];
+    unsigned short length[LZW_CODE_MAX + 1];
+    unsigned char  suffix[LZW_CODE_MAX + 1];
+    unsigned char  first[LZW_CODE_MAX + 1];
+    unsigned char  output[LZW_CODE_MAX + 1];
+} LZWState;
+
 
 static void GIFReadNextImage(struct GIFImage *image, FILE *stream);
 static void GIFReadImageData(struct GIFImage *image, FILE *stream);
+static void GIFSkipImageData(struct GIFImage *image, int minCodeSize,
+                             FILE *stream);
+static unsigned int GIFNextRow(unsigned int ypos, unsigned int *pass,
+                               unsigned int height, int interlaced);
 static int  GIFReadDataBlock(unsigned char *buffer, FILE *stream);
 static void GIFSkipDataBlocks(FILE *stream);
-static int  LZWGetCode(int code_size, int init_flag, FILE *stream);
-static int  LZWDecodeByte(int init_flag, int input_code_size, FILE *stream);
+static void LZWInit(int minCodeSize, unsigned int numColors);
+static int  LZWGetCode(FILE *stream);
+static int  LZWNextString(FILE *stream);
+static void LZWCopyString(int code, unsigned char *dest);
 static void GIFReadNextExtension(struct GIFExtension *ext, FILE *stream);
 
 static int  GetByte(FILE *stream);
@@ -210,8 +241,10 @@ static void GIFReadImageData(struct GIFImage *image, FILE *stream)
     unsigned int  width, height, interlaced;
     unsigned char *colors;
     unsigned int  numColors;
-    unsigned int  xpos, ypos;
-    int           pass, val;
+    unsigned int  xpos, ypos, pass;
+    unsigned int  length, count;
+    unsigned char *ptr;
+    int           code;
 
     GIF_TRACE(("Reading Image Data\n"));
 
@@ -220,21 +253,13 @@ static void GIFReadImageData(struct GIFImage *image, FILE *stream)
     if (minCodeSize >= LZW_BITS_MAX)
         GIFError("Invalid LZW code size");
 
-    if (LZWDecodeByte(LZW_TRUE, minCodeSize, stream) < 0)
-        GIFError("Error decoding GIF image");
-
-    /* Ignore the picture if it is "uninteresting". */
+    /* Ignore the picture if it is "uninteresting",
+     * but still validate its LZW data stream.
+     */
     rows = image->Rows;
     if (rows == NULL)
     {
-#if 0
-        while (LZWDecodeByte(LZW_FALSE, minCodeSize, stream) >= 0)
-        {
-        }
-#else
-        /* This is faster, but possible LZW errors may go undetected. */
-        GIFSkipDataBlocks(stream);
-#endif
+        GIFSkipImageData(image, minCodeSize, stream);
         return;
     }
 
@@ -242,73 +267,119 @@ static void GIFReadImageData(struct GIFImage *image, FILE *stream)
     height     = image->Height;
     interlaced = image->InterlaceFlag;
     GIFGetColorTable(&colors, &numColors, image);
-    xpos = ypos = 0;
-    pass = 0;
-    while ((val = LZWDecodeByte(LZW_FALSE, minCodeSize, stream)) >= 0)
+    LZWInit(minCodeSize, numColors);
+
+    /* Decode one string per step, straight into the image rows.
+     * Only the strings that straddle a row boundary are staged.
+     */
+    xpos = ypos = pass = 0;
+    while (ypos < height)
     {
-        if ((unsigned int)val >= numColors)
+        if ((code = LZWNextString(stream)) < 0)
+            break;
+        length = LZWState.length[code];
+        if (xpos + length <= width)
         {
-            GIFWarning("Pixel value out of range in GIF image");
-            val = numColors - 1;
+            LZWCopyString(code, rows[ypos] + xpos);
+            xpos += length;
         }
-        rows[ypos][xpos] = (unsigned char)val;
-        if (++xpos == width)
+        else
         {
-            xpos = 0;
-            if (interlaced)
+            LZWCopyString(code, LZWState.output);
+            ptr = LZWState.output;
+            for ( ; ; )
             {
-                switch (pass)
-                {
-                case 0:
-                case 1:
-                    ypos += 8;
-                    break;
-                case 2:
-                    ypos += 4;
+                count = width - xpos;
+                if (count > length)
+                    count = length;
+                memcpy(rows[ypos] + xpos, ptr, count);
+                xpos += count;
+                ptr += count;
+                length -= count;
+                if (length == 0)
                     break;
-                case 3:
-                    ypos += 2;
-                    break;
-                }
+                xpos = 0;
+                ypos = GIFNextRow(ypos, &pass, height, interlaced);
                 if (ypos >= height)
-                {
-                    switch (++pass)
-                    {
-                    case 1:
-                        ypos = 4;
-                        break;
-                    case 2:
-                        ypos = 2;
-                        break;
-                    case 3:
-                        ypos = 1;
-                        break;
-                    default:
-                        goto fini;
-                    }
-                }
+                    break;
             }
-            else
-                ++ypos;
         }
-        if (ypos >= height)
-            break;
+        if (xpos == width)
+        {
+            xpos = 0;
+            ypos = GIFNextRow(ypos, &pass, height, interlaced);
+        }
+    }
+
+    if (ypos < height)
+    {
+        if (!LZWState.endOfCodes)
+            GIFError("Ran off the end of input bits in LZW decoding");
+    }
+    else
+    {
+        /* Ignore the trailing garbage. */
+        while (LZWNextString(stream) >= 0)
+        {
+        }
     }
-fini:
-    /* Ignore the trailing garbage. */
-    while (LZWDecodeByte(LZW_FALSE, minCodeSize, stream) >= 0)
+    if (!LZWState.endOfData)
+        GIFSkipDataBlocks(stream);
+}
+
+/*
+ * Skips the image data, checking the structure of the LZW data stream
+ * without storing the pixels.
+ */
+static void GIFSkipImageData(struct GIFImage *image, int minCodeSize,
+                             FILE *stream)
+{
+    unsigned long numPixels;
+    unsigned int  length;
+    int           code;
+
+    LZWInit(minCodeSize, 1U << minCodeSize);
+    numPixels = (unsigned long)image->Width * image->Height;
+    while ((code = LZWNextString(stream)) >= 0)
     {
+        length = LZWState.length[code];
+        numPixels -= (numPixels > length) ? length : numPixels;
     }
+
+    /* The pixels are not needed, so a truncated stream is not fatal. */
+    if (numPixels > 0 && !LZWState.endOfCodes)
+        GIFWarning("Ran off the end of input bits in LZW decoding");
+    if (!LZWState.endOfData)
+        GIFSkipDataBlocks(stream);
 }
 
-static int DataBlockSize = 0;
+/*
+ * Returns the row that follows ypos in the (possibly interlaced) order
+ * of the image rows, or height if the image is complete.
+ */
+static unsigned int GIFNextRow(unsigned int ypos, unsigned int *pass,
+                               unsigned int height, int interlaced)
+{
+    static const unsigned int passStart[4] = { 0, 4, 2, 1 };
+    static const unsigned int passStep[4]  = { 8, 8, 4, 2 };
+
+    if (!interlaced)
+        return ypos + 1;
+    ypos += passStep[*pass];
+    while (ypos >= height)
+    {
+        if (++*pass >= 4)
+            return height;
+        ypos = passStart[*pass];
+    }
+    return ypos;
+}
 
 static int GIFReadDataBlock(unsigned char *buffer, FILE *stream)
 {
     int count;
 
     count = GetByte(stream);
-    DataBlockSize = count;
     if (count > 0)
         ReadBytes(buffer, count, stream);
     return count;
@@ -329,179 +400,176 @@ static void GIFSkipDataBlocks(FILE *stream)
     }
 }
 
-static int LZWGetCode(int code_size, int init_flag, FILE *stream)
+/*
+ * Initializes the LZW decoder.
+ * The root codes are set up once per image; a clear code only needs
+ * to reset the code size and the next free code.
+ */
+static void LZWInit(int minCodeSize, unsigned int numColors)
 {
-    static unsigned char buffer[280];
-    static int           curbit, lastbit, done, last_byte;
-    int                  count, i, j, ret;
-
-    if (init_flag)
+    unsigned int i;
+
+    LZWState.bufPos       = LZWState.bufLen = 0;
+    LZWState.endOfData    = LZW_FALSE;
+    LZWState.endOfCodes   = LZW_FALSE;
+    LZWState.bitBuffer    = 0;
+    LZWState.bitCount     = 0;
+    LZWState.initCodeSize = minCodeSize + 1;
+    LZWState.codeSize     = LZWState.initCodeSize;
+    LZWState.clearCode    = 1U << minCodeSize;
+    LZWState.endCode      = LZWState.clearCode + 1;
+    LZWState.nextCode     = LZWState.clearCode + 2;
+    LZWState.oldCode      = -1;
+    LZWState.numColors    = numColors;
+    LZWState.warnedCode   = LZW_FALSE;
+    LZWState.warnedValue  = LZW_FALSE;
+
+    /* Pixel values that are out of range are clamped right in the table,
+     * and so are all the strings that derive from them.
+     */
+    for (i = 0; i < LZWState.clearCode; ++i)
     {
-        curbit = 0;
-        lastbit = 0;
-        last_byte = 2;
-        done = LZW_FALSE;
-        return 0;
+        LZWState.suffix[i] = LZWState.first[i] =
+            (unsigned char)((i < numColors) ? i : numColors - 1);
+        LZWState.length[i] = 1;
     }
+}
+
+/*
+ * Reads the next LZW code from the data sub-blocks.
+ * Returns -1 at the end of the image data.
+ */
+static int LZWGetCode(FILE *stream)
+{
+    unsigned int code;
+    int          count;
 
-    if ((curbit + code_size) >= lastbit)
+    while (LZWState.bitCount < LZWState.codeSize)
     {
-        if (done)
+        if (LZWState.bufPos >= LZWState.bufLen)
         {
-            if (curbit >= lastbit)
-                GIFError("Ran off the end of input bits in LZW decoding");
-            return -1;
+            if (LZWState.endOfData)
+                return -1;
+            if ((count = GIFReadDataBlock(LZWState.buffer, stream)) == 0)
+            {
+                LZWState.endOfData = LZW_TRUE;
+                return -1;
+            }
+            LZWState.bufLen = (unsigned int)count;
+            LZWState.bufPos = 0;
         }
-        buffer[0] = buffer[last_byte - 2];
-        buffer[1] = buffer[last_byte - 1];
-
-        if ((count = GIFReadDataBlock(&buffer[2], stream)) == 0)
-            done = LZW_TRUE;
-
-        last_byte = 2 + count;
-        curbit = (curbit - lastbit) + 16;
-        lastbit = (2 + count) * 8;
+        LZWState.bitBuffer |=
+            (unsigned long)LZWState.buffer[LZWState.bufPos++]
+                << LZWState.bitCount;
+        LZWState.bitCount += 8;
     }
 
-    ret = 0;
-    for (i = curbit, j = 0; j < code_size; ++i, ++j)
-        ret |= ((buffer[i / 8] & (1 << (i % 8))) != 0) << j;
-
-    curbit += code_size;
-    return ret;
+    code = (unsigned int)LZWState.bitBuffer
+           & ((1U << LZWState.codeSize) - 1);
+    LZWState.bitBuffer >>= LZWState.codeSize;
+    LZWState.bitCount -= LZWState.codeSize;
+    return (int)code;
 }
 
-static int LZWDecodeByte(int init_flag, int input_code_size, FILE *stream)
+/*
+ * Decodes the next LZW code and updates the string table.
+ * Returns the code of the decoded string, or -1 at the end of the
+ * LZW data stream.
+ */
+static int LZWNextString(FILE *stream)
 {
-    static int fresh = LZW_FALSE;
-    static int code_size, set_code_size;
-    static int max_code, max_code_size;
-    static int firstcode, oldcode;
-    static int clear_code, end_code;
-    static int table[2][LZW_CODE_MAX + 1];
-    static int stack[(LZW_CODE_MAX + 1) * 2], *sp;
-    int        code, incode;
-    int        i;
-
-    if (init_flag)
-    {
-        fresh = LZW_TRUE;
-        set_code_size = input_code_size;
-        code_size = set_code_size + 1;
-        clear_code = 1 << set_code_size;
-        end_code = clear_code + 1;
-        max_code_size = 2 * clear_code;
-        max_code = clear_code + 2;
+    unsigned int  code, newCode;
+    unsigned char firstByte;
+    int           inCode, oldCode;
 
-        LZWGetCode(0, LZW_TRUE, stream);
-
-        for (i = 0; i < clear_code; ++i)
+    for ( ; ; )
+    {
+        if (LZWState.endOfCodes || (inCode = LZWGetCode(stream)) < 0)
+            return -1;
+        code = (unsigned int)inCode;
+        if (code == LZWState.clearCode)
         {
-            table[0][i] = 0;
-            table[1][i] = i;
+            LZWState.codeSize = LZWState.initCodeSize;
+            LZWState.nextCode = LZWState.clearCode + 2;
+            LZWState.oldCode  = -1;
+            continue;
         }
-        for ( ; i <= LZW_CODE_MAX; ++i)
+        if (code == LZWState.endCode)
         {
-            table[0][i] = 0;
-            table[1][i] = 0;
+            LZWState.endOfCodes = LZW_TRUE;
+            return -1;
         }
-
-        sp = stack;
-        return 0;
+        break;
     }
-    else if (fresh)
-    {
-        fresh = LZW_FALSE;
-        do
-        {
-            firstcode = oldcode = LZWGetCode(code_size, LZW_FALSE, stream);
-        } while (firstcode == clear_code);
-        return firstcode;
-    }
-
-    if (sp > stack)
-        return *--sp;
 
-    while ((code = LZWGetCode(code_size, LZW_FALSE, stream)) >= 0)
+    oldCode = LZWState.oldCode;
+    if (oldCode < 0)
     {
-        if (code == clear_code)
+        /* The first code after a clear code must be a root code. */
+        if (code >= LZWState.clearCode)
         {
-            for (i = 0; i < clear_code; ++i)
-            {
-                table[0][i] = 0;
-                table[1][i] = i;
-            }
-            for ( ; i <= LZW_CODE_MAX; ++i)
-            {
-                table[0][i] = 0;
-                table[1][i] = 0;
-            }
-
-            code_size = set_code_size + 1;
-            max_code_size = 2 * clear_code;
-            max_code = clear_code + 2;
-            sp = stack;
-            firstcode = oldcode = LZWGetCode(code_size, LZW_FALSE, stream);
-            return firstcode;
+            if (!LZWState.warnedCode)
+                GIFWarning("Invalid code in LZW data stream");
+            LZWState.warnedCode = LZW_TRUE;
+            code = 0;
         }
-        else if (code == end_code)
+    }
+    else
+    {
+        newCode = LZWState.nextCode;
+        if (code >= newCode)
         {
-            int           count;
-            unsigned char buffer[260];
-
-            if (DataBlockSize == 0)
-                return -2;
-
-            while ((count = GIFReadDataBlock(buffer, stream)) > 0)
+            /* The KwKwK case: the code is about to be defined. */
+            if (code > newCode && !LZWState.warnedCode)
             {
+                GIFWarning("Invalid code in LZW data stream");
+                LZWState.warnedCode = LZW_TRUE;
             }
-
-#if 0       /* too noisy */
-            if (count != 0)
-                GIFWarning("Missing EOD in LZW data stream");
-#else
-            (void)count;
-#endif
-            return -2;
-        }
-
-        incode = code;
-
-        if (code >= max_code)
-        {
-            *sp++ = firstcode;
-            code = oldcode;
+            firstByte = LZWState.first[oldCode];
+            code = newCode;
         }
+        else
+            firstByte = LZWState.first[code];
 
-        while (code >= clear_code)
+        if (newCode <= LZW_CODE_MAX)
         {
-            *sp++ = table[1][code];
-            if ((code == table[0][code]) ||
-                    ((size_t)(sp - stack) >= sizeof(stack) / sizeof(stack[0])))
-                GIFError("Circular dependency found in LZW table");
-            code = table[0][code];
+            LZWState.prefix[newCode] = (unsigned short)oldCode;
+            LZWState.suffix[newCode] = firstByte;
+            LZWState.first[newCode]  = LZWState.first[oldCode];
+            LZWState.length[newCode] =
+                (unsigned short)(LZWState.length[oldCode] + 1);
+            LZWState.nextCode = ++newCode;
+            if (newCode >= (1U << LZWState.codeSize) &&
+                    LZWState.codeSize < LZW_BITS_MAX)
+                ++LZWState.codeSize;
         }
+    }
 
-        *sp++ = firstcode = table[1][code];
-
-        if ((code = max_code) <= LZW_CODE_MAX)
-        {
-            table[0][code] = oldcode;
-            table[1][code] = firstcode;
-            ++max_code;
-            if ((max_code >= max_code_size) && (max_code_size <= LZW_CODE_MAX))
-            {
-                max_code_size *= 2;
-                ++code_size;
-            }
-        }
+    if (code < LZWState.clearCode && code >= LZWState.numColors &&
+            !LZWState.warnedValue)
+    {
+        GIFWarning("Pixel value out of range in GIF image");
+        LZWState.warnedValue = LZW_TRUE;
+    }
+    LZWState.oldCode = (int)code;
+    return (int)code;
+}
 
-        oldcode = incode;
+/*
+ * Copies the string of the given LZW code into the destination buffer.
+ * The buffer must have room for LZWState.length[code] bytes.
+ */
+static void LZWCopyString(int code, unsigned char *dest)
+{
+    unsigned char *ptr;
 
-        if (sp > stack)
-            return *--sp;
+    ptr = dest + LZWState.length[code];
+    while (code >= (int)LZWState.clearCode)
+    {
+        *--ptr = LZWState.suffix[code];
+        code = LZWState.prefix[code];
     }
-    return code;
+    *--ptr = LZWState.suffix[code];
 }
 
 /*
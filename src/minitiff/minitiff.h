@@ -1,7 +1,7 @@
 /*
  * minitiff.h
  * Minimal I/O interface to the Tagged Image File Format (TIFF).
- * Version 0.2 (draft).
+ * Version 0.3 (draft).
  *
  * Copyright (C) 2006-2017 Cosmin Truta.
  *
@@ -52,6 +52,13 @@ struct minitiff_info
     unsigned int orientation;
     unsigned int samples_per_pixel;
     size_t rows_per_strip;
+    size_t strip_byte_counts_count;
+    unsigned long *strip_byte_counts;
+    unsigned int predictor;
+    /* The decoder buffers, allocated on demand by minitiff_read_strip(). */
+    unsigned char *strip_buf;
+    size_t strip_buf_size;
+    void *lzw_table;
 };
 
 
@@ -69,6 +76,9 @@ void minitiff_read_info(struct minitiff_info *info_ptr, FILE *stream);
 void minitiff_read_row(struct minitiff_info *info_ptr,
                        unsigned char *row_ptr, size_t row_index,
                        FILE *stream);
+size_t minitiff_read_strip(struct minitiff_info *info_ptr,
+                           unsigned char **row_pointers, size_t strip_index,
+                           FILE *stream);
 
 /*
  * Output functions.
@@ -19,7 +19,8 @@ static int tiff2pnm(const char *in_path, const char *out_path)
     FILE *in_stream;
     FILE *out_stream;
     struct minitiff_info info;
-    size_t width, height, depth, y;
+    size_t width, height, depth, strip_height, y, i, num_rows, strip_index;
+    unsigned char **rows;
     unsigned char *row;
     int ioerr;
 
@@ -47,8 +48,12 @@ static int tiff2pnm(const char *in_path, const char *out_path)
         return -1;
     }
 
-    row = (unsigned char *)malloc(depth * width);
-    if (row == NULL)
+    strip_height = info.rows_per_strip;
+    if (strip_height > height)
+        strip_height = height;
+    rows = (unsigned char **)malloc(strip_height * sizeof(unsigned char *));
+    row = (unsigned char *)malloc(strip_height * depth * width);
+    if (rows == NULL || row == NULL)
     {
         fprintf(stderr, "critical error: Out of memory\n");
         minitiff_destroy_info(&info);
@@ -64,10 +69,13 @@ static int tiff2pnm(const char *in_path, const char *out_path)
                 "P%c\n%lu %lu\n255\n",
                 (depth == 1) ? '5' : '6',
                 (unsigned long)width, (unsigned long)height);
-        for (y = 0; y < height; ++y)
+        for (i = 0; i < strip_height; ++i)
+            rows[i] = row + i * depth * width;
+        for (y = strip_index = 0; y < height; y += num_rows, ++strip_index)
         {
-            minitiff_read_row(&info, row, y, in_stream);
-            fwrite(row, depth, width, out_stream);
+            num_rows =
+                minitiff_read_strip(&info, rows, strip_index, in_stream);
+            fwrite(row, depth * width, num_rows, out_stream);
         }
         if (ferror(in_stream))
         {
@@ -89,9 +97,10 @@ static int tiff2pnm(const char *in_path, const char *out_path)
         fprintf(stderr, "error: Can't open output PNM file: %s\n", out_path);
     }
 
+    free(row);
+    free(rows);
     minitiff_destroy_info(&info);
     fclose(in_stream);
-    fclose(out_stream);
     return ioerr ? -1 : 1;
 }
 
@@ -143,6 +143,39 @@ static unsigned int cast_ulong_to_uint(struct minitiff_info *info_ptr,
     ((size_t)cast_ulong_to_uint(info_ptr, value))
 #endif
 
+/*
+ * Type size calculator.
+ * Returns the size of an unsigned integer value, or 0 if unsupported.
+ */
+static size_t get_type_size(int tag_type)
+{
+    switch (tag_type)
+    {
+    case MINITIFF_TYPE_BYTE:
+        return 1;
+    case MINITIFF_TYPE_SHORT:
+        return 2;
+    case MINITIFF_TYPE_LONG:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * File offset calculator.
+ * The values that fit in 4 bytes are stored inside the directory entry.
+ */
+static long get_values_offset(const struct minitiff_getter *getter_ptr,
+                              int tag_type, size_t count,
+                              long entry_offset, const unsigned char *vbuf)
+{
+    size_t value_size = get_type_size(tag_type);
+    if (value_size != 0 && count <= 4 / value_size)
+        return entry_offset + 8;
+    return (long)getter_ptr->get_ulong(vbuf);
+}
+
 /*
  * File reader.
  */
@@ -155,20 +188,9 @@ static size_t read_ulong_values(const struct minitiff_getter *getter_ptr,
     size_t value_size;
     size_t i;
 
-    switch (tag_type)
-    {
-    case MINITIFF_TYPE_BYTE:
-        value_size = 1;
-        break;
-    case MINITIFF_TYPE_SHORT:
-        value_size = 2;
-        break;
-    case MINITIFF_TYPE_LONG:
-        value_size = 4;
-        break;
-    default:
+    value_size = get_type_size(tag_type);
+    if (value_size == 0)
         return 0;  /* read nothing */
-    }
 
     for (i = 0; i < count; ++i)
     {
@@ -208,7 +230,9 @@ void minitiff_read_info(struct minitiff_info *info_ptr, FILE *stream)
     size_t count;
     size_t bits_per_sample_count;
     unsigned int bits_per_sample_tag_type, strip_offsets_tag_type;
+    unsigned int strip_byte_counts_tag_type;
     long bits_per_sample_offset, strip_offsets_offset;
+    long strip_byte_counts_offset;
     int unknown_metadata_found;
 
     /* Read the TIFF header. */
@@ -240,6 +264,8 @@ void minitiff_read_info(struct minitiff_info *info_ptr, FILE *stream)
     bits_per_sample_count = 0;
     bits_per_sample_tag_type = strip_offsets_tag_type = 0;
     bits_per_sample_offset = strip_offsets_offset = 0;
+    strip_byte_counts_tag_type = 0;
+    strip_byte_counts_offset = 0;
     dir_offset = (long)getter.get_ulong(buf + 4);
     if (dir_offset >= 0 && dir_offset < 8)
         goto err_invalid;
@@ -291,7 +317,9 @@ void minitiff_read_info(struct minitiff_info *info_ptr, FILE *stream)
             {
                 bits_per_sample_count = count;
                 bits_per_sample_tag_type = tag_type;
-                bits_per_sample_offset = (long)getter.get_ulong(vbuf);
+                bits_per_sample_offset =
+                    get_values_offset(&getter, tag_type, count,
+                                      dir_offset + 2 + 12 * (long)i, vbuf);
             }
             break;
         case MINITIFF_TAG_COMPRESSION:
@@ -319,7 +347,9 @@ void minitiff_read_info(struct minitiff_info *info_ptr, FILE *stream)
             else
             {
                 strip_offsets_tag_type = tag_type;
-                strip_offsets_offset = (long)getter.get_ulong(vbuf);
+                strip_offsets_offset =
+                    get_values_offset(&getter, tag_type, count,
+                                      dir_offset + 2 + 12 * (long)i, vbuf);
             }
             break;
         case MINITIFF_TAG_ORIENTATION:
@@ -341,13 +371,33 @@ void minitiff_read_info(struct minitiff_info *info_ptr, FILE *stream)
             info_ptr->rows_per_strip = cast_ulong_to_size(info_ptr, ulval);
             break;
         case MINITIFF_TAG_STRIP_BYTE_COUNTS:
-            /* ignored for uncompressed images */
+            info_ptr->strip_byte_counts_count = count;
+            if (count == 1)
+            {
+                if (info_ptr->strip_byte_counts != NULL)
+                    goto err_invalid;
+                info_ptr->strip_byte_counts = alloc_ulong_array(info_ptr, 1);
+                info_ptr->strip_byte_counts[0] =
+                    get_ulong_value(&getter, tag_type, vbuf);
+            }
+            else
+            {
+                strip_byte_counts_tag_type = tag_type;
+                strip_byte_counts_offset =
+                    get_values_offset(&getter, tag_type, count,
+                                      dir_offset + 2 + 12 * (long)i, vbuf);
+            }
             break;
         case MINITIFF_TAG_PLANAR_CONFIGURATION:
-        case MINITIFF_TAG_PREDICTOR:
             if (count != 1 || get_ulong_value(&getter, tag_type, vbuf) != 1)
                 goto err_unsupported;
             break;
+        case MINITIFF_TAG_PREDICTOR:
+            if (count != 1)
+                goto err_unsupported;
+            ulval = get_ulong_value(&getter, tag_type, vbuf);
+            info_ptr->predictor = cast_ulong_to_uint(info_ptr, ulval);
+            break;
         case MINITIFF_TAG_XMP:
         case MINITIFF_TAG_IPTC:
         case MINITIFF_TAG_EXIF_IFD:
@@ -401,6 +451,20 @@ void minitiff_read_info(struct minitiff_info *info_ptr, FILE *stream)
                               stream) != count)
             goto err_read;
     }
+    if (strip_byte_counts_offset != 0)
+    {
+        count = info_ptr->strip_byte_counts_count;
+        if (count == 0 || count > info_ptr->height)
+            goto err_invalid;
+        if (info_ptr->strip_byte_counts != NULL)
+            goto err_invalid;
+        info_ptr->strip_byte_counts = alloc_ulong_array(info_ptr, count);
+        seek_to_offset(info_ptr, strip_byte_counts_offset, stream);
+        if (read_ulong_values(&getter, strip_byte_counts_tag_type,
+                              info_ptr->strip_byte_counts, count,
+                              stream) != count)
+            goto err_read;
+    }
 
     /* Return successfully. */
     return;
@@ -414,23 +478,516 @@ err_unsupported:
     minitiff_error(info_ptr, msg_err_unsupported);
 }
 
+/*
+ * TIFF row size calculator.
+ * The sub-byte samples are packed in the file, and unpacked in memory.
+ */
+static void get_row_sizes(const struct minitiff_info *info_ptr,
+                          size_t *row_size_ptr, size_t *packed_row_size_ptr)
+{
+    size_t sample_count;
+    unsigned int bits_per_sample;
+
+    sample_count = info_ptr->width * info_ptr->samples_per_pixel;
+    bits_per_sample = info_ptr->bits_per_sample;
+    if (bits_per_sample < 8)
+    {
+        *row_size_ptr = sample_count;
+        *packed_row_size_ptr = (sample_count * bits_per_sample + 7) / 8;
+    }
+    else
+    {
+        *row_size_ptr = *packed_row_size_ptr =
+            sample_count * ((bits_per_sample + 7) / 8);
+    }
+}
+
+/*
+ * TIFF row adjuster.
+ * Undoes the horizontal differencing, unpacks the sub-byte samples, and
+ * inverts the samples whose minimum value is white.
+ */
+static void adjust_row(const struct minitiff_info *info_ptr,
+                       unsigned char *row_ptr, size_t row_size)
+{
+    unsigned int bits_per_sample, sample_max, shift, mask, value;
+    size_t pixel_size, i;
+
+    bits_per_sample = info_ptr->bits_per_sample;
+    if (info_ptr->predictor == 2)
+    {
+        /* Horizontal differencing is only allowed on 8- and 16-bit samples.
+         * Each sample is added to the same sample of the previous pixel.
+         */
+        if (bits_per_sample == 8)
+        {
+            pixel_size = info_ptr->samples_per_pixel;
+            for (i = pixel_size; i < row_size; ++i)
+                row_ptr[i] =
+                    (unsigned char)(row_ptr[i] + row_ptr[i - pixel_size]);
+        }
+        else
+        {
+            pixel_size = 2 * info_ptr->samples_per_pixel;
+            for (i = pixel_size; i < row_size; i += 2)
+            {
+                if (info_ptr->byte_order == 'M')
+                {
+                    value = ((unsigned int)row_ptr[i] << 8) + row_ptr[i + 1] +
+                            ((unsigned int)row_ptr[i - pixel_size] << 8) +
+                            row_ptr[i - pixel_size + 1];
+                    row_ptr[i] = (unsigned char)((value >> 8) & 0xff);
+                    row_ptr[i + 1] = (unsigned char)(value & 0xff);
+                }
+                else
+                {
+                    value = ((unsigned int)row_ptr[i + 1] << 8) + row_ptr[i] +
+                            ((unsigned int)row_ptr[i - pixel_size + 1] << 8) +
+                            row_ptr[i - pixel_size];
+                    row_ptr[i] = (unsigned char)(value & 0xff);
+                    row_ptr[i + 1] = (unsigned char)((value >> 8) & 0xff);
+                }
+            }
+        }
+    }
+
+    /* Unpack the samples from the last one to the first one,
+     * so that they can be expanded in place.
+     */
+    if (bits_per_sample < 8)
+    {
+        mask = (1U << bits_per_sample) - 1;
+        for (i = row_size; i-- > 0; )
+        {
+            shift = 8 - bits_per_sample - (unsigned int)
+                ((i * bits_per_sample) % 8);
+            row_ptr[i] = (unsigned char)
+                ((row_ptr[i * bits_per_sample / 8] >> shift) & mask);
+        }
+    }
+
+    if (info_ptr->photometric == MINITIFF_PHOTOMETRIC_MINWHITE)
+    {
+        /* White is zero. */
+        if (bits_per_sample <= 8)
+        {
+            sample_max = (1U << bits_per_sample) - 1;
+            for (i = 0; i < row_size; ++i)
+                row_ptr[i] = (unsigned char)(sample_max - row_ptr[i]);
+        }
+        else if (bits_per_sample == 16)
+        {
+            for (i = 0; i < row_size; ++i)
+                row_ptr[i] ^= 0xff;
+        }
+        else if (bits_per_sample < 16)
+        {
+            sample_max = (1U << bits_per_sample) - 1;
+            for (i = 0; i < row_size; i += 2)
+            {
+                if (info_ptr->byte_order == 'M')
+                {
+                    value = sample_max -
+                        (((unsigned int)row_ptr[i] << 8) + row_ptr[i + 1]);
+                    row_ptr[i] = (unsigned char)(value >> 8);
+                    row_ptr[i + 1] = (unsigned char)(value & 0xff);
+                }
+                else
+                {
+                    value = sample_max -
+                        (((unsigned int)row_ptr[i + 1] << 8) + row_ptr[i]);
+                    row_ptr[i] = (unsigned char)(value & 0xff);
+                    row_ptr[i + 1] = (unsigned char)(value >> 8);
+                }
+            }
+        }
+        else
+            minitiff_error(info_ptr, msg_err_unsupported);
+    }
+}
+
+/*
+ * Row writer structure.
+ * The decompressed strip data is written across the strip rows.
+ */
+struct minitiff_row_writer
+{
+    unsigned char **row_pointers;
+    size_t num_rows;
+    size_t row_size;
+    size_t row_index;
+    size_t pos;
+};
+
+/*
+ * Row writer.
+ */
+static void put_bytes(struct minitiff_row_writer *writer_ptr,
+                      const unsigned char *buf_ptr, size_t count)
+{
+    size_t chunk;
+
+    while (count > 0 && writer_ptr->row_index < writer_ptr->num_rows)
+    {
+        chunk = writer_ptr->row_size - writer_ptr->pos;
+        if (chunk > count)
+            chunk = count;
+        memcpy(writer_ptr->row_pointers[writer_ptr->row_index] +
+               writer_ptr->pos, buf_ptr, chunk);
+        buf_ptr += chunk;
+        count -= chunk;
+        writer_ptr->pos += chunk;
+        if (writer_ptr->pos == writer_ptr->row_size)
+        {
+            writer_ptr->pos = 0;
+            ++writer_ptr->row_index;
+        }
+    }
+}
+
+/*
+ * Row writer.
+ */
+static void put_run(struct minitiff_row_writer *writer_ptr,
+                    int value, size_t count)
+{
+    size_t chunk;
+
+    while (count > 0 && writer_ptr->row_index < writer_ptr->num_rows)
+    {
+        chunk = writer_ptr->row_size - writer_ptr->pos;
+        if (chunk > count)
+            chunk = count;
+        memset(writer_ptr->row_pointers[writer_ptr->row_index] +
+               writer_ptr->pos, value, chunk);
+        count -= chunk;
+        writer_ptr->pos += chunk;
+        if (writer_ptr->pos == writer_ptr->row_size)
+        {
+            writer_ptr->pos = 0;
+            ++writer_ptr->row_index;
+        }
+    }
+}
+
+/*
+ * PackBits decoder.
+ */
+static void decode_packbits(struct minitiff_row_writer *writer_ptr,
+                            const unsigned char *buf_ptr, size_t buf_size)
+{
+    size_t count;
+    unsigned int header;
+
+    while (buf_size > 0 && writer_ptr->row_index < writer_ptr->num_rows)
+    {
+        header = *buf_ptr++;
+        --buf_size;
+        if (header < 128)
+        {
+            /* Copy the next (header + 1) bytes literally. */
+            count = header + 1;
+            if (count > buf_size)
+                count = buf_size;
+            put_bytes(writer_ptr, buf_ptr, count);
+            buf_ptr += count;
+            buf_size -= count;
+        }
+        else if (header > 128)
+        {
+            /* Repeat the next byte (257 - header) times. */
+            if (buf_size == 0)
+                break;
+            put_run(writer_ptr, *buf_ptr++, 257 - header);
+            --buf_size;
+        }
+        /* else header == 128: no operation */
+    }
+}
+
+/*
+ * LZW decoder constants.
+ */
+#define LZW_BITS_MIN 9
+#define LZW_BITS_MAX 12
+#define LZW_CODE_MAX ((1 << LZW_BITS_MAX) - 1)
+#define LZW_CODE_CLEAR 256
+#define LZW_CODE_EOI   257
+#define LZW_CODE_FIRST 258
+
+/*
+ * LZW string table.
+ */
+struct minitiff_lzw_table
+{
+    unsigned short prefix[LZW_CODE_MAX + 1];
+    unsigned short length[LZW_CODE_MAX + 1];
+    unsigned char  suffix[LZW_CODE_MAX + 1];
+    unsigned char  first[LZW_CODE_MAX + 1];
+    unsigned char  output[LZW_CODE_MAX + 1];
+};
+
+/*
+ * LZW string copier.
+ * The string is written backwards, from its last byte to its first byte.
+ */
+static void copy_lzw_string(const struct minitiff_lzw_table *table_ptr,
+                            unsigned int code, unsigned char *dest_ptr)
+{
+    unsigned char *ptr;
+
+    ptr = dest_ptr + table_ptr->length[code];
+    while (code >= LZW_CODE_FIRST)
+    {
+        *--ptr = table_ptr->suffix[code];
+        code = table_ptr->prefix[code];
+    }
+    *--ptr = (unsigned char)code;
+}
+
+/*
+ * LZW decoder.
+ * The codes are stored MSB-first, and the code size is incremented one
+ * code earlier than in GIF ("early change").
+ * Returns 1 on success, or 0 on invalid data.
+ */
+static int decode_lzw(struct minitiff_info *info_ptr,
+                      struct minitiff_row_writer *writer_ptr,
+                      const unsigned char *buf_ptr, size_t buf_size)
+{
+    struct minitiff_lzw_table *table_ptr;
+    unsigned long bit_buf;
+    unsigned int bit_count, code_size, code, old_code, next_code;
+    unsigned char *row_ptr;
+    size_t length;
+    unsigned int i;
+
+    /* The old-style (LSB-first) LZW is not supported. */
+    if (buf_size >= 2 && buf_ptr[0] == 0 && (buf_ptr[1] & 1) != 0)
+        minitiff_error(info_ptr, msg_err_unsupported);
+
+    table_ptr = (struct minitiff_lzw_table *)info_ptr->lzw_table;
+    if (table_ptr == NULL)
+    {
+        table_ptr = (struct minitiff_lzw_table *)
+            malloc(sizeof(struct minitiff_lzw_table));
+        if (table_ptr == NULL)
+            minitiff_error(info_ptr, msg_err_alloc);
+        for (i = 0; i < 256; ++i)
+        {
+            table_ptr->length[i] = 1;
+            table_ptr->first[i] = (unsigned char)i;
+        }
+        info_ptr->lzw_table = table_ptr;
+    }
+
+    bit_buf = 0;
+    bit_count = 0;
+    code_size = LZW_BITS_MIN;
+    next_code = LZW_CODE_FIRST;
+    old_code = LZW_CODE_CLEAR;
+    while (writer_ptr->row_index < writer_ptr->num_rows)
+    {
+        /* Get the next code. */
+        while (bit_count < code_size)
+        {
+            if (buf_size == 0)
+                return 0;  /* premature end of data */
+            bit_buf = (bit_buf << 8) + *buf_ptr++;
+            --buf_size;
+            bit_count += 8;
+        }
+        bit_count -= code_size;
+        code = (unsigned int)(bit_buf >> bit_count) & ((1U << code_size) - 1);
+        bit_buf &= (1UL << bit_count) - 1;
+
+        if (code == LZW_CODE_CLEAR)
+        {
+            code_size = LZW_BITS_MIN;
+            next_code = LZW_CODE_FIRST;
+            old_code = LZW_CODE_CLEAR;
+            continue;
+        }
+        if (code == LZW_CODE_EOI)
+            break;
+        if (old_code == LZW_CODE_CLEAR)
+        {
+            /* The first code after a clear code must be a literal. */
+            if (code >= 256)
+                return 0;
+        }
+        else if (code <= next_code && next_code <= LZW_CODE_MAX)
+        {
+            /* Add a new string: the old string followed by the first byte
+             * of the current string (which is the old string itself, if
+             * the current code is the one being added).
+             */
+            table_ptr->prefix[next_code] = (unsigned short)old_code;
+            table_ptr->suffix[next_code] = (code < next_code) ?
+                table_ptr->first[code] : table_ptr->first[old_code];
+            table_ptr->first[next_code] = table_ptr->first[old_code];
+            table_ptr->length[next_code] =
+                (unsigned short)(table_ptr->length[old_code] + 1);
+            ++next_code;
+            if (next_code >= (1U << code_size) - 1 &&
+                code_size < LZW_BITS_MAX)
+                ++code_size;
+        }
+        else if (code >= next_code)
+            return 0;
+        old_code = code;
+
+        /* Write the string, straight into the row if it fits. */
+        length = table_ptr->length[code];
+        if (writer_ptr->pos + length <= writer_ptr->row_size)
+        {
+            row_ptr = writer_ptr->row_pointers[writer_ptr->row_index];
+            copy_lzw_string(table_ptr, code, row_ptr + writer_ptr->pos);
+            writer_ptr->pos += length;
+            if (writer_ptr->pos == writer_ptr->row_size)
+            {
+                writer_ptr->pos = 0;
+                ++writer_ptr->row_index;
+            }
+        }
+        else
+        {
+            copy_lzw_string(table_ptr, code, table_ptr->output);
+            put_bytes(writer_ptr, table_ptr->output, length);
+        }
+    }
+    return 1;
+}
+
+/*
+ * TIFF compressed strip reader.
+ * Reads the strip data into the strip buffer, and decodes it into rows.
+ */
+static void read_compressed_strip(struct minitiff_info *info_ptr,
+                                  struct minitiff_row_writer *writer_ptr,
+                                  size_t strip_index, FILE *stream)
+{
+    unsigned char *strip_buf;
+    size_t byte_count, max_byte_count;
+    int result;
+
+    byte_count =
+        cast_ulong_to_size(info_ptr, info_ptr->strip_byte_counts[strip_index]);
+
+    /* Neither decoder needs more than about two input bytes per output byte.
+     * Limit the strip buffer accordingly, in case the byte count is bogus.
+     */
+    max_byte_count = writer_ptr->num_rows * writer_ptr->row_size;
+    if (max_byte_count < ((size_t)(-1) - 16) / 2)
+        max_byte_count = 2 * max_byte_count + 16;
+    if (byte_count > max_byte_count)
+        byte_count = max_byte_count;
+    if (byte_count > info_ptr->strip_buf_size)
+    {
+        strip_buf = (unsigned char *)realloc(info_ptr->strip_buf, byte_count);
+        if (strip_buf == NULL)
+            minitiff_error(info_ptr, msg_err_alloc);
+        info_ptr->strip_buf = strip_buf;
+        info_ptr->strip_buf_size = byte_count;
+    }
+    if (byte_count > 0 &&
+        fread(info_ptr->strip_buf, byte_count, 1, stream) != 1)
+        minitiff_error(info_ptr, msg_err_read);
+
+    if (info_ptr->compression == MINITIFF_COMPRESSION_PACKBITS)
+    {
+        decode_packbits(writer_ptr, info_ptr->strip_buf, byte_count);
+        result = 1;
+    }
+    else  /* MINITIFF_COMPRESSION_LZW */
+        result = decode_lzw(info_ptr, writer_ptr,
+                            info_ptr->strip_buf, byte_count);
+    if (!result || writer_ptr->row_index < writer_ptr->num_rows)
+        minitiff_error(info_ptr, msg_err_invalid);
+}
+
+/*
+ * TIFF strip reader.
+ * Reads all the rows of a strip, with a single file repositioning.
+ * The compressed strips are decoded directly into the rows.
+ * Returns the number of rows read.
+ */
+size_t minitiff_read_strip(struct minitiff_info *info_ptr,
+                           unsigned char **row_pointers, size_t strip_index,
+                           FILE *stream)
+{
+    struct minitiff_row_writer writer;
+    size_t row_size, packed_row_size, first_row, num_rows;
+    size_t i;
+
+    /* Do not do validation here. */
+    /* Call minitiff_validate_info() before calling this function. */
+
+    get_row_sizes(info_ptr, &row_size, &packed_row_size);
+    if (strip_index >= info_ptr->strip_offsets_count)
+        goto err_invalid;
+    first_row = strip_index * info_ptr->rows_per_strip;
+    if (first_row >= info_ptr->height ||
+        first_row / info_ptr->rows_per_strip != strip_index)
+        goto err_invalid;
+    num_rows = info_ptr->height - first_row;
+    if (num_rows > info_ptr->rows_per_strip)
+        num_rows = info_ptr->rows_per_strip;
+
+    /* Position the file pointer to the beginning of the strip. */
+    if ((long)info_ptr->strip_offsets[strip_index] < 0)
+        goto err_range;
+    seek_to_offset(info_ptr, (long)info_ptr->strip_offsets[strip_index],
+                   stream);
+
+    /* Read the rows, which are stored contiguously inside the strip. */
+    if (info_ptr->compression == MINITIFF_COMPRESSION_NONE)
+    {
+        for (i = 0; i < num_rows; ++i)
+        {
+            if (fread(row_pointers[i], packed_row_size, 1, stream) != 1)
+                minitiff_error(info_ptr, msg_err_read);
+        }
+    }
+    else
+    {
+        writer.row_pointers = row_pointers;
+        writer.num_rows = num_rows;
+        writer.row_size = packed_row_size;
+        writer.row_index = writer.pos = 0;
+        read_compressed_strip(info_ptr, &writer, strip_index, stream);
+    }
+    for (i = 0; i < num_rows; ++i)
+        adjust_row(info_ptr, row_pointers[i], row_size);
+
+    /* Return successfully. */
+    return num_rows;
+
+    /* Quick and dirty goto labels. */
+err_invalid:
+    minitiff_error(info_ptr, msg_err_invalid);
+err_range:
+    minitiff_error(info_ptr, msg_err_range);
+    return 0;
+}
+
 /*
  * TIFF row reader.
+ * Only the uncompressed rows can be read individually;
+ * use minitiff_read_strip() to read the compressed rows.
  */
 void minitiff_read_row(struct minitiff_info *info_ptr,
                        unsigned char *row_ptr, size_t row_index, FILE *stream)
 {
-    size_t row_size, strip_index;
-    unsigned int bytes_per_sample, sample_max;
+    size_t row_size, packed_row_size, strip_index;
     long offset;
-    size_t i;
 
     /* Do not do validation here. */
     /* Call minitiff_validate_info() before calling this function. */
 
-    bytes_per_sample = (info_ptr->bits_per_sample + 7) / 8;
-    row_size =
-        info_ptr->width * info_ptr->samples_per_pixel * bytes_per_sample;
+    if (info_ptr->compression != MINITIFF_COMPRESSION_NONE)
+        goto err_unsupported;
+    get_row_sizes(info_ptr, &row_size, &packed_row_size);
 
     /* Position the file pointer to the beginning of the row,
      * if that has not been done already.
@@ -441,21 +998,13 @@ void minitiff_read_row(struct minitiff_info *info_ptr,
     if ((long)info_ptr->strip_offsets[strip_index] < 0)
         goto err_range;
     offset = (long)(info_ptr->strip_offsets[strip_index] +
-                    row_size * (row_index % info_ptr->rows_per_strip));
+                    packed_row_size * (row_index % info_ptr->rows_per_strip));
     seek_to_offset(info_ptr, offset, stream);
 
     /* Read the row, and do all the necessary adjustments. */
-    if (fread(row_ptr, row_size, 1, stream) != 1)
+    if (fread(row_ptr, packed_row_size, 1, stream) != 1)
         goto err_read;
-    if (info_ptr->photometric == 0)
-    {
-        /* White is zero. */
-        if (bytes_per_sample > 1)
-            goto err_unsupported;
-        sample_max = (1 << info_ptr->bits_per_sample) - 1;
-        for (i = 0; i < row_size; ++i)
-            row_ptr[i] = (unsigned char)(sample_max - row_ptr[i]);
-    }
+    adjust_row(info_ptr, row_ptr, row_size);
 
     /* Return successfully. */
     return;
@@ -22,6 +22,7 @@ void minitiff_init_info(struct minitiff_info *info_ptr)
 {
     memset(info_ptr, 0, sizeof(*info_ptr));
     info_ptr->photometric = (unsigned int)(-1);
+    info_ptr->predictor = 1;
 }
 
 /*
@@ -35,9 +36,19 @@ void minitiff_validate_info(const struct minitiff_info *info_ptr)
         minitiff_error(info_ptr, "Invalid pixel info in TIFF file");
     if (info_ptr->strip_offsets == NULL || info_ptr->rows_per_strip == 0)
         minitiff_error(info_ptr, "Invalid strip info in TIFF file");
-    if (info_ptr->compression != MINITIFF_COMPRESSION_NONE)
+    if (info_ptr->compression != MINITIFF_COMPRESSION_NONE &&
+        info_ptr->compression != MINITIFF_COMPRESSION_LZW &&
+        info_ptr->compression != MINITIFF_COMPRESSION_PACKBITS)
         minitiff_error(info_ptr,
                        "Unsupported compression method in TIFF file");
+    if (info_ptr->compression != MINITIFF_COMPRESSION_NONE &&
+        (info_ptr->strip_byte_counts == NULL ||
+         info_ptr->strip_byte_counts_count != info_ptr->strip_offsets_count))
+        minitiff_error(info_ptr, "Invalid strip info in TIFF file");
+    if (info_ptr->predictor != 1 &&
+        (info_ptr->predictor != 2 ||
+         (info_ptr->bits_per_sample != 8 && info_ptr->bits_per_sample != 16)))
+        minitiff_error(info_ptr, "Unsupported predictor in TIFF file");
     if (info_ptr->photometric >= MINITIFF_PHOTOMETRIC_PALETTE)
         minitiff_error(info_ptr,
                        "Unsupported photometric interpretation in TIFF file");
@@ -50,6 +61,12 @@ void minitiff_destroy_info(struct minitiff_info *info_ptr)
 {
     if (info_ptr->strip_offsets != NULL)
         free(info_ptr->strip_offsets);
+    if (info_ptr->strip_byte_counts != NULL)
+        free(info_ptr->strip_byte_counts);
+    if (info_ptr->strip_buf != NULL)
+        free(info_ptr->strip_buf);
+    if (info_ptr->lzw_table != NULL)
+        free(info_ptr->lzw_table);
 }
 
 /*
@@ -16,6 +16,7 @@ RM_F = del /q
 
 ZDIR = ..\zlib
 PNGDIR = ..\libpng
+PNGXDIR = ..\pngxtern
 
 OPNGREDUC_LIB = opngreduc.lib
 
@@ -26,7 +27,8 @@ OPNGREDUC_DEPINCLUDE_ZLIB = -I$(ZDIR)
 OPNGREDUC_DEPINCLUDE_LIBPNG = -I$(PNGDIR)
 OPNGREDUC_DEPINCLUDES = \
   $(OPNGREDUC_DEPINCLUDE_ZLIB) \
-  $(OPNGREDUC_DEPINCLUDE_LIBPNG)
+  $(OPNGREDUC_DEPINCLUDE_LIBPNG) \
+  -I$(PNGXDIR)
 
 all: $(OPNGREDUC_LIB)
 
@@ -40,7 +42,7 @@ check: test
 $(OPNGREDUC_LIB): $(OPNGREDUC_OBJS)
 	$(AR) $(ARFLAGS) $@ $(OPNGREDUC_LIBOBJS)
 
-opngreduc.obj: opngreduc.c opngreduc.h
+opngreduc.obj: opngreduc.c opngreduc.h $(PNGXDIR)\pngxutil.h
 
 clean:
 	-$(RM_F) $(OPNGREDUC_LIB) $(OPNGREDUC_OBJS)
@@ -21,6 +21,7 @@ RM_F = rm -f
 
 ZDIR = ../zlib
 PNGDIR = ../libpng
+PNGXDIR = ../pngxtern
 
 OPNGREDUC_LIB = libopngreduc.a
 
@@ -32,7 +33,8 @@ OPNGREDUC_DEPINCLUDE_LIBPNG = -I$(PNGDIR)
 #OPNGREDUC_DEPINCLUDE_LIBPNG =
 OPNGREDUC_DEPINCLUDES = \
   $(OPNGREDUC_DEPINCLUDE_ZLIB) \
-  $(OPNGREDUC_DEPINCLUDE_LIBPNG)
+  $(OPNGREDUC_DEPINCLUDE_LIBPNG) \
+  -I$(PNGXDIR)
 
 all: $(OPNGREDUC_LIB)
 
@@ -47,7 +49,7 @@ $(OPNGREDUC_LIB): $(OPNGREDUC_OBJS)
 	$(AR) $(ARFLAGS) $@ $(OPNGREDUC_OBJS)
 	$(RANLIB) $@
 
-opngreduc.o: opngreduc.c opngreduc.h
+opngreduc.o: opngreduc.c opngreduc.h $(PNGXDIR)/pngxutil.h
 
 clean:
 	-$(RM_F) $(OPNGREDUC_LIB) $(OPNGREDUC_OBJS)
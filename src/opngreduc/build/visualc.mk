@@ -16,6 +16,7 @@ RM_F = del /q
 
 ZDIR = ..\zlib
 PNGDIR = ..\libpng
+PNGXDIR = ..\pngxtern
 
 OPNGREDUC_LIB = opngreduc.lib
 
@@ -25,7 +26,8 @@ OPNGREDUC_DEPINCLUDE_ZLIB = -I$(ZDIR)
 OPNGREDUC_DEPINCLUDE_LIBPNG = -I$(PNGDIR)
 OPNGREDUC_DEPINCLUDES = \
   $(OPNGREDUC_DEPINCLUDE_ZLIB) \
-  $(OPNGREDUC_DEPINCLUDE_LIBPNG)
+  $(OPNGREDUC_DEPINCLUDE_LIBPNG) \
+  -I$(PNGXDIR)
 
 all: $(OPNGREDUC_LIB)
 
@@ -39,7 +41,7 @@ check: test
 $(OPNGREDUC_LIB): $(OPNGREDUC_OBJS)
 	$(AR) $(ARFLAGS) -out:$@ $(OPNGREDUC_OBJS)
 
-opngreduc.obj: opngreduc.c opngreduc.h
+opngreduc.obj: opngreduc.c opngreduc.h $(PNGXDIR)\pngxutil.h
 
 clean:
 	-$(RM_F) $(OPNGREDUC_LIB) $(OPNGREDUC_OBJS)
@@ -19,6 +19,7 @@
  */
 
 #include "opngreduc.h"
+#include "pngxutil.h"
 
 #include <string.h>
 
@@ -586,7 +587,7 @@ opng_reduce_bits(png_structp png_ptr, png_infop info_ptr,
       }
       if (reductions & OPNG_REDUCE_RGB_TO_GRAY)
       {
-         if (trans_color->red == trans_color->green ||
+         if (trans_color->red == trans_color->green &&
              trans_color->red == trans_color->blue)
             trans_color->gray = trans_color->red;
          else
@@ -648,55 +649,27 @@ opng_reduce_bits(png_structp png_ptr, png_infop info_ptr,
 }
 
 /*
- * Reduce the bit depth of a palette image to the lowest possible value.
- * The parameter reductions should contain OPNG_REDUCE_8_TO_4_2_1.
- * The function returns OPNG_REDUCE_8_TO_4_2_1 if successful.
+ * Translate the samples of a single-channel image through tran_tbl[],
+ * and pack them in place, from src_bit_depth to dest_bit_depth.
+ * Both bit depths must be 8 or less, and dest_bit_depth cannot be larger
+ * than src_bit_depth. The tran_tbl[] array must have 256 entries.
  */
-static png_uint_32 /* PRIVATE */
-opng_reduce_palette_bits(png_structp png_ptr, png_infop info_ptr,
-   png_uint_32 reductions)
+static void /* PRIVATE */
+opng_pack_rows(png_structp png_ptr, png_infop info_ptr,
+   int src_bit_depth, int dest_bit_depth, png_const_bytep tran_tbl)
 {
    png_bytepp row_ptr;
    png_bytep src_sample_ptr, dest_sample_ptr;
    png_uint_32 width, height;
-   int color_type, interlace_type, compression_type, filter_type;
-   int src_bit_depth, dest_bit_depth;
    unsigned int src_mask_init, src_mask, src_shift, dest_shift;
    unsigned int sample, dest_buf;
-   png_colorp palette;
-   int num_palette;
    png_uint_32 i, j;
 
-   opng_debug(1, "in opng_reduce_palette_bits");
+   opng_debug(1, "in opng_pack_rows");
 
-   /* Check if the reduction applies. */
-   if (!(reductions & OPNG_REDUCE_8_TO_4_2_1))
-      return OPNG_REDUCE_NONE;
-   png_get_IHDR(png_ptr, info_ptr, &width, &height, &src_bit_depth,
-      &color_type, &interlace_type, &compression_type, &filter_type);
-   if (color_type != PNG_COLOR_TYPE_PALETTE)
-      return OPNG_REDUCE_NONE;
-   if (!png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette))
-      num_palette = 0;
-
-   /* Find the smallest possible bit depth. */
-   if (num_palette > 16)
-      return OPNG_REDUCE_NONE;
-   else if (num_palette > 4)  /* 5 .. 16 entries */
-      dest_bit_depth = 4;
-   else if (num_palette > 2)  /* 3 or 4 entries */
-      dest_bit_depth = 2;
-   else  /* 1 or 2 entries */
-   {
-      OPNG_ASSERT(num_palette > 0);
-      dest_bit_depth = 1;
-   }
-
-   if (src_bit_depth <= dest_bit_depth)
-   {
-      OPNG_ASSERT(src_bit_depth == dest_bit_depth);
-      return OPNG_REDUCE_NONE;
-   }
+   OPNG_ASSERT(dest_bit_depth <= src_bit_depth && src_bit_depth <= 8);
+   width = png_get_image_width(png_ptr, info_ptr);
+   height = png_get_image_height(png_ptr, info_ptr);
 
    /* Iterate through all sample values. */
    row_ptr = png_get_rows(png_ptr, info_ptr);
@@ -709,18 +682,19 @@ opng_reduce_palette_bits(png_structp png_ptr, png_infop info_ptr,
          dest_buf = 0;
          for (j = 0; j < width; ++j)
          {
+            sample = tran_tbl[*src_sample_ptr];
             dest_shift -= dest_bit_depth;
             if (dest_shift > 0)
-               dest_buf |= *src_sample_ptr << dest_shift;
+               dest_buf |= sample << dest_shift;
             else
             {
-               *dest_sample_ptr++ = (png_byte)(dest_buf | *src_sample_ptr);
+               *dest_sample_ptr++ = (png_byte)(dest_buf | sample);
                dest_shift = 8;
                dest_buf = 0;
             }
             ++src_sample_ptr;
          }
-         if (dest_shift != 0)
+         if (dest_shift != 8)
             *dest_sample_ptr = (png_byte)dest_buf;
       }
    }
@@ -737,7 +711,7 @@ opng_reduce_palette_bits(png_structp png_ptr, png_infop info_ptr,
          {
             src_shift -= src_bit_depth;
             src_mask >>= src_bit_depth;
-            sample = (*src_sample_ptr & src_mask) >> src_shift;
+            sample = tran_tbl[(*src_sample_ptr & src_mask) >> src_shift];
             dest_shift -= dest_bit_depth;
             if (dest_shift > 0)
                dest_buf |= sample << dest_shift;
@@ -754,10 +728,64 @@ opng_reduce_palette_bits(png_structp png_ptr, png_infop info_ptr,
                ++src_sample_ptr;
             }
          }
-         if (dest_shift != 0)
+         if (dest_shift != 8)
             *dest_sample_ptr = (png_byte)dest_buf;
       }
    }
+}
+
+/*
+ * Reduce the bit depth of a palette image to the lowest possible value.
+ * The parameter reductions should contain OPNG_REDUCE_8_TO_4_2_1.
+ * The function returns OPNG_REDUCE_8_TO_4_2_1 if successful.
+ */
+static png_uint_32 /* PRIVATE */
+opng_reduce_palette_bits(png_structp png_ptr, png_infop info_ptr,
+   png_uint_32 reductions)
+{
+   png_uint_32 width, height;
+   int color_type, interlace_type, compression_type, filter_type;
+   int src_bit_depth, dest_bit_depth;
+   png_byte tran_tbl[256];
+   png_colorp palette;
+   int num_palette;
+   int k;
+
+   opng_debug(1, "in opng_reduce_palette_bits");
+
+   /* Check if the reduction applies. */
+   if (!(reductions & OPNG_REDUCE_8_TO_4_2_1))
+      return OPNG_REDUCE_NONE;
+   png_get_IHDR(png_ptr, info_ptr, &width, &height, &src_bit_depth,
+      &color_type, &interlace_type, &compression_type, &filter_type);
+   if (color_type != PNG_COLOR_TYPE_PALETTE)
+      return OPNG_REDUCE_NONE;
+   if (!png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette))
+      num_palette = 0;
+
+   /* Find the smallest possible bit depth. */
+   if (num_palette > 16)
+      return OPNG_REDUCE_NONE;
+   else if (num_palette > 4)  /* 5 .. 16 entries */
+      dest_bit_depth = 4;
+   else if (num_palette > 2)  /* 3 or 4 entries */
+      dest_bit_depth = 2;
+   else  /* 1 or 2 entries */
+   {
+      OPNG_ASSERT(num_palette > 0);
+      dest_bit_depth = 1;
+   }
+
+   if (src_bit_depth <= dest_bit_depth)
+   {
+      OPNG_ASSERT(src_bit_depth == dest_bit_depth);
+      return OPNG_REDUCE_NONE;
+   }
+
+   /* Pack the palette indices, which remain unchanged. */
+   for (k = 0; k < 256; ++k)
+      tran_tbl[k] = (png_byte)k;
+   opng_pack_rows(png_ptr, info_ptr, src_bit_depth, dest_bit_depth, tran_tbl);
 
    /* Update the image information. */
    png_set_IHDR(png_ptr, info_ptr, width, height, dest_bit_depth,
@@ -986,6 +1014,12 @@ opng_reduce_to_palette(png_structp png_ptr, png_infop info_ptr,
    png_set_PLTE(png_ptr, info_ptr, palette, num_palette);
    if (num_trans > 0)
       png_set_tRNS(png_ptr, info_ptr, trans_alpha, num_trans, NULL);
+   else if (trans_color != NULL)
+   {
+      /* The tRNS color is not in the image: all pixels are 100% opaque. */
+      png_free_data(png_ptr, info_ptr, PNG_FREE_TRNS, -1);
+      png_set_invalid(png_ptr, info_ptr, PNG_INFO_tRNS);
+   }
    /* bKGD (if present) is automatically updated. */
 
    png_free(png_ptr, alpha_row);
@@ -1063,6 +1097,140 @@ opng_analyze_sample_usage(png_structp png_ptr, png_infop info_ptr,
 #endif
 }
 
+/*
+ * Get the smallest grayscale bit depth that can represent the given
+ * 8-bit gray level exactly, i.e. 1, 2, 4 or 8.
+ */
+static int /* PRIVATE */
+opng_get_gray_bit_depth(unsigned int gray)
+{
+   if (gray % 255 == 0)
+      return 1;
+   if (gray % 85 == 0)
+      return 2;
+   if (gray % 17 == 0)
+      return 4;
+   return 8;
+}
+
+/*
+ * Reduce the bit depth of a grayscale image to the lowest possible value.
+ * A gray level can be stored with 4, 2 or 1 bits if it is a multiple of
+ * 17, 85 or 255, respectively, at the 8-bit scale.
+ * The parameter reductions should contain OPNG_REDUCE_8_TO_4_2_1.
+ * The function returns OPNG_REDUCE_8_TO_4_2_1 if successful.
+ */
+static png_uint_32 /* PRIVATE */
+opng_reduce_gray_bits(png_structp png_ptr, png_infop info_ptr,
+   png_uint_32 reductions)
+{
+   png_uint_32 width, height;
+   int color_type, interlace_type, compression_type, filter_type;
+   int src_bit_depth, dest_bit_depth, palette_bit_depth;
+   unsigned int src_scale, dest_scale, max_sample;
+   png_byte is_used[256];
+   png_byte tran_tbl[256];
+   png_color_16p trans_color;
+   int num_used, k;
+#ifdef PNG_bKGD_SUPPORTED
+   png_color_16p background;
+#endif
+#ifdef PNG_sBIT_SUPPORTED
+   png_color_8p sig_bits;
+#endif
+
+   opng_debug(1, "in opng_reduce_gray_bits");
+
+   /* Check if the reduction applies. */
+   if (!(reductions & OPNG_REDUCE_8_TO_4_2_1))
+      return OPNG_REDUCE_NONE;
+   png_get_IHDR(png_ptr, info_ptr, &width, &height, &src_bit_depth,
+      &color_type, &interlace_type, &compression_type, &filter_type);
+   if (color_type != PNG_COLOR_TYPE_GRAY || src_bit_depth == 1 ||
+       src_bit_depth > 8)
+      return OPNG_REDUCE_NONE;
+   max_sample = (1U << src_bit_depth) - 1;
+   src_scale = 255 / max_sample;
+
+   /* Find the smallest bit depth that can represent all gray levels.
+    * (The bKGD index of a grayscale image is 0, so it does no harm.)
+    */
+   opng_analyze_sample_usage(png_ptr, info_ptr, is_used);
+   dest_bit_depth = 1;
+   num_used = 0;
+   for (k = 0; k <= (int)max_sample; ++k)
+   {
+      if (!is_used[k])
+         continue;
+      ++num_used;
+      if (dest_bit_depth < opng_get_gray_bit_depth(k * src_scale))
+         dest_bit_depth = opng_get_gray_bit_depth(k * src_scale);
+   }
+
+   /* tRNS and bKGD must remain representable. */
+   if (png_get_tRNS(png_ptr, info_ptr, NULL, NULL, &trans_color))
+   {
+      if (trans_color->gray > max_sample)
+         return OPNG_REDUCE_NONE;
+      if (dest_bit_depth < opng_get_gray_bit_depth(trans_color->gray *
+                                                   src_scale))
+         dest_bit_depth =
+            opng_get_gray_bit_depth(trans_color->gray * src_scale);
+   }
+   else
+      trans_color = NULL;
+#ifdef PNG_bKGD_SUPPORTED
+   if (png_get_bKGD(png_ptr, info_ptr, &background))
+   {
+      if (background->gray > max_sample)
+         return OPNG_REDUCE_NONE;
+      if (dest_bit_depth < opng_get_gray_bit_depth(background->gray *
+                                                   src_scale))
+         dest_bit_depth =
+            opng_get_gray_bit_depth(background->gray * src_scale);
+   }
+#endif
+   if (dest_bit_depth >= src_bit_depth)
+      return OPNG_REDUCE_NONE;
+
+   /* Leave the image to opng_reduce_to_palette(), if a palette image
+    * can have a smaller bit depth.
+    */
+   if ((reductions & OPNG_REDUCE_GRAY_TO_PALETTE) && src_bit_depth == 8)
+   {
+      palette_bit_depth =
+         (num_used > 4) ? 4 : (num_used > 2) ? 2 : 1;
+      if (palette_bit_depth < dest_bit_depth)
+         return OPNG_REDUCE_NONE;
+   }
+
+   /* Rescale and pack the samples. */
+   dest_scale = 255 / ((1U << dest_bit_depth) - 1);
+   for (k = 0; k < 256; ++k)
+      tran_tbl[k] = (png_byte)((k & max_sample) * src_scale / dest_scale);
+   opng_pack_rows(png_ptr, info_ptr, src_bit_depth, dest_bit_depth, tran_tbl);
+
+   /* Update the ancillary information. */
+   if (trans_color != NULL)
+      trans_color->gray = tran_tbl[trans_color->gray];
+#ifdef PNG_bKGD_SUPPORTED
+   if (png_get_bKGD(png_ptr, info_ptr, &background))
+      background->gray = tran_tbl[background->gray];
+#endif
+#ifdef PNG_sBIT_SUPPORTED
+   if (png_get_sBIT(png_ptr, info_ptr, &sig_bits))
+   {
+      if (sig_bits->gray > dest_bit_depth)
+         sig_bits->gray = (png_byte)dest_bit_depth;
+   }
+#endif
+
+   /* Update the image information. */
+   png_set_IHDR(png_ptr, info_ptr, width, height, dest_bit_depth,
+      color_type, interlace_type, compression_type, filter_type);
+   return OPNG_REDUCE_8_TO_4_2_1;
+}
+
 /*
  * Reduce the palette. (Only the fast method is implemented.)
  * The parameter reductions indicates the intended reductions.
@@ -1075,15 +1243,16 @@ opng_reduce_palette(png_structp png_ptr, png_infop info_ptr,
    png_uint_32 result;
    png_colorp palette;
    png_bytep trans_alpha;
-   png_bytepp row_ptr;
    png_uint_32 width, height;
    int bit_depth, color_type, interlace_type, compression_type, filter_type;
    int num_palette, num_trans;
    int last_color_index, last_trans_index;
    png_byte crt_trans_value, last_trans_value;
    png_byte is_used[256];
+   png_byte tran_tbl[256];
    png_color_16 gray_trans;
-   int is_gray;
+   int is_gray, gray_bit_depth;
+   unsigned int gray_scale;
 #ifdef PNG_bKGD_SUPPORTED
    png_color_16p background;
 #endif
@@ -1093,7 +1262,6 @@ opng_reduce_palette(png_structp png_ptr, png_infop info_ptr,
 #ifdef PNG_sBIT_SUPPORTED
    png_color_8p sig_bits;
 #endif
-   png_uint_32 i, j;
    int k;
 
    opng_debug(1, "in opng_reduce_palette");
@@ -1102,7 +1270,6 @@ opng_reduce_palette(png_structp png_ptr, png_infop info_ptr,
 
    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth,
       &color_type, &interlace_type, &compression_type, &filter_type);
-   row_ptr = png_get_rows(png_ptr, info_ptr);
    if (!png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette))
    {
       palette = NULL;
@@ -1117,8 +1284,7 @@ opng_reduce_palette(png_structp png_ptr, png_infop info_ptr,
       OPNG_ASSERT(trans_alpha != NULL && num_trans > 0);
 
    opng_analyze_sample_usage(png_ptr, info_ptr, is_used);
-   /* Palette-to-gray does not work (yet) if the bit depth is below 8. */
-   is_gray = (reductions & OPNG_REDUCE_PALETTE_TO_GRAY) && (bit_depth == 8);
+   is_gray = (reductions & OPNG_REDUCE_PALETTE_TO_GRAY) ? 1 : 0;
    last_color_index = last_trans_index = -1;
    for (k = 0; k < 256; ++k)
    {
@@ -1220,22 +1386,40 @@ opng_reduce_palette(png_structp png_ptr, png_infop info_ptr,
       /* Refresh the image information. */
       bit_depth = png_get_bit_depth(png_ptr, info_ptr);
    }
-   if ((bit_depth < 8) || !is_gray)
+   if (!is_gray)
       return result;
 
-   /* Reduce palette --> grayscale. */
-   for (i = 0; i < height; ++i)
+   /* Find the smallest gray bit depth that can represent all colors.
+    * The grayscale image cannot be larger than the palette image.
+    */
+   gray_bit_depth = 1;
+   for (k = 0; k <= last_color_index; ++k)
    {
-      for (j = 0; j < width; ++j)
-         row_ptr[i][j] = palette[row_ptr[i][j]].red;
+      if (is_used[k] &&
+          gray_bit_depth < opng_get_gray_bit_depth(palette[k].red))
+         gray_bit_depth = opng_get_gray_bit_depth(palette[k].red);
    }
+   if (gray_bit_depth < bit_depth && !(reductions & OPNG_REDUCE_8_TO_4_2_1))
+      gray_bit_depth = bit_depth;
+   if (gray_bit_depth > bit_depth)
+      return result;
+
+   /* Reduce palette --> grayscale. */
+   gray_scale = 255 / ((1U << gray_bit_depth) - 1);
+   for (k = 0; k < 256; ++k)
+      tran_tbl[k] =
+         (k < num_palette) ? (png_byte)(palette[k].red / gray_scale) : 0;
+   opng_pack_rows(png_ptr, info_ptr, bit_depth, gray_bit_depth, tran_tbl);
 
    /* Update the ancillary information. */
    if (num_trans > 0)
+   {
+      gray_trans.gray /= gray_scale;
       png_set_tRNS(png_ptr, info_ptr, NULL, 0, &gray_trans);
+   }
 #ifdef PNG_bKGD_SUPPORTED
    if (png_get_bKGD(png_ptr, info_ptr, &background))
-      background->gray = palette[background->index].red;
+      background->gray = tran_tbl[background->index];
 #endif
 #ifdef PNG_hIST_SUPPORTED
    if (png_get_hIST(png_ptr, info_ptr, &hist))
@@ -1252,16 +1436,272 @@ opng_reduce_palette(png_structp png_ptr, png_infop info_ptr,
          max_sig_bits = sig_bits->green;
       if (max_sig_bits < sig_bits->blue)
          max_sig_bits = sig_bits->blue;
+      if (max_sig_bits > gray_bit_depth)
+         max_sig_bits = (png_byte)gray_bit_depth;
       sig_bits->gray = max_sig_bits;
    }
 #endif
 
    /* Update the image information. */
-   png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth,
+   png_set_IHDR(png_ptr, info_ptr, width, height, gray_bit_depth,
       PNG_COLOR_TYPE_GRAY, interlace_type, compression_type, filter_type);
    png_free_data(png_ptr, info_ptr, PNG_FREE_PLTE, -1);
    png_set_invalid(png_ptr, info_ptr, PNG_INFO_PLTE);
-   return OPNG_REDUCE_PALETTE_TO_GRAY;  /* ignore the former result */
+   /* Ignore the former result. */
+   if (gray_bit_depth < bit_depth)
+      return OPNG_REDUCE_PALETTE_TO_GRAY | OPNG_REDUCE_8_TO_4_2_1;
+   return OPNG_REDUCE_PALETTE_TO_GRAY;
+}
+
+/*
+ * Expand the palette image to RGB, or to RGB+alpha if tRNS is present.
+ * The parameter reductions should contain OPNG_REDUCE_PALETTE_TO_RGB.
+ * The function returns OPNG_REDUCE_PALETTE_TO_RGB if successful.
+ * The rows are reallocated, because the expanded rows are larger.
+ * The old rows must be in a single memory block that starts with the
+ * row index, as allocated by pngx_malloc_rows(); the new rows are
+ * allocated in the same manner.
+ */
+static png_uint_32 /* PRIVATE */
+opng_expand_palette(png_structp png_ptr, png_infop info_ptr,
+   png_uint_32 reductions)
+{
+   png_bytepp row_ptr, dest_rows;
+   png_bytep src_sample_ptr, dest_row, dest_ptr;
+   pngx_alloc_size_t dest_row_size, dest_row_stride, index_size, block_size;
+   png_uint_32 width, height;
+   int bit_depth, color_type, interlace_type, compression_type, filter_type;
+   int dest_color_type, dest_channels;
+   png_colorp palette;
+   png_bytep trans_alpha;
+   int num_palette, num_trans;
+   png_byte rgba_tbl[256][4];
+   unsigned int init_shift, shift, mask, index;
+#ifdef PNG_bKGD_SUPPORTED
+   png_color_16p background;
+#endif
+#ifdef PNG_hIST_SUPPORTED
+   png_uint_16p hist;
+#endif
+#ifdef PNG_sBIT_SUPPORTED
+   png_color_8p sig_bits;
+#endif
+   png_uint_32 i, j;
+   int k;
+
+   opng_debug(1, "in opng_expand_palette");
+
+   /* Check if the expansion applies. */
+   if (!(reductions & OPNG_REDUCE_PALETTE_TO_RGB))
+      return OPNG_REDUCE_NONE;
+   png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth,
+      &color_type, &interlace_type, &compression_type, &filter_type);
+   if (color_type != PNG_COLOR_TYPE_PALETTE)
+      return OPNG_REDUCE_NONE;
+   if (!png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette))
+      return OPNG_REDUCE_NONE;
+   if (!png_get_tRNS(png_ptr, info_ptr, &trans_alpha, &num_trans, NULL))
+   {
+      trans_alpha = NULL;
+      num_trans = 0;
+   }
+
+   /* Pre-compute the RGBA lookup table.
+    * The missing palette entries, if any, are expanded to opaque black.
+    */
+   dest_color_type = PNG_COLOR_TYPE_RGB;
+   for (k = 0; k < 256; ++k)
+   {
+      if (k < num_palette)
+      {
+         rgba_tbl[k][0] = palette[k].red;
+         rgba_tbl[k][1] = palette[k].green;
+         rgba_tbl[k][2] = palette[k].blue;
+      }
+      else
+         rgba_tbl[k][0] = rgba_tbl[k][1] = rgba_tbl[k][2] = 0;
+      if (k < num_trans && k < num_palette)
+      {
+         rgba_tbl[k][3] = trans_alpha[k];
+         if (trans_alpha[k] < 255)
+            dest_color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+      }
+      else
+         rgba_tbl[k][3] = 255;
+   }
+   dest_channels = (dest_color_type == PNG_COLOR_TYPE_RGB_ALPHA) ? 4 : 3;
+   dest_row_size = (pngx_alloc_size_t)width * dest_channels;
+   block_size = pngx_get_rows_layout(height, dest_row_size,
+      &index_size, &dest_row_stride);
+   if (dest_row_size / dest_channels != width || block_size == 0)
+      return OPNG_REDUCE_NONE;  /* the expanded rows would be too large */
+
+   /* Expand the rows into a new block, laid out like the old one:
+    * the row index first, followed by the contiguous rows.
+    */
+   dest_rows = (png_bytepp)png_malloc(png_ptr, block_size);
+   init_shift = 8 - bit_depth;
+   mask = (1U << bit_depth) - 1;
+   row_ptr = png_get_rows(png_ptr, info_ptr);
+   for (i = 0; i < height; ++i)
+   {
+      dest_row = (png_bytep)dest_rows + index_size + dest_row_stride * i;
+      dest_rows[i] = dest_row;
+      src_sample_ptr = row_ptr[i];
+      dest_ptr = dest_row;
+      shift = init_shift;
+      for (j = 0; j < width; ++j, dest_ptr += dest_channels)
+      {
+         index = (*src_sample_ptr >> shift) & mask;
+         if (shift == 0)
+         {
+            shift = init_shift;
+            ++src_sample_ptr;
+         }
+         else
+            shift -= bit_depth;
+         memcpy(dest_ptr, rgba_tbl[index], (size_t)dest_channels);
+      }
+   }
+   png_set_rows(png_ptr, info_ptr, dest_rows);
+   /* The old row block may be stored out of core. */
+   if (!pngx_unmap_rows(row_ptr))
+      png_free(png_ptr, row_ptr);
+
+   /* Update the ancillary information. */
+#ifdef PNG_bKGD_SUPPORTED
+   if (png_get_bKGD(png_ptr, info_ptr, &background))
+   {
+      background->red = rgba_tbl[background->index][0];
+      background->green = rgba_tbl[background->index][1];
+      background->blue = rgba_tbl[background->index][2];
+   }
+#endif
+#ifdef PNG_hIST_SUPPORTED
+   if (png_get_hIST(png_ptr, info_ptr, &hist))
+   {
+      png_free_data(png_ptr, info_ptr, PNG_FREE_HIST, -1);
+      png_set_invalid(png_ptr, info_ptr, PNG_INFO_hIST);
+   }
+#endif
+#ifdef PNG_sBIT_SUPPORTED
+   if (png_get_sBIT(png_ptr, info_ptr, &sig_bits))
+   {
+      if (dest_color_type == PNG_COLOR_TYPE_RGB_ALPHA)
+         sig_bits->alpha = 8;
+   }
+#endif
+   if (num_trans > 0)
+   {
+      png_free_data(png_ptr, info_ptr, PNG_FREE_TRNS, -1);
+      png_set_invalid(png_ptr, info_ptr, PNG_INFO_tRNS);
+   }
+
+   /* Update the image information. */
+   png_set_IHDR(png_ptr, info_ptr, width, height, 8, dest_color_type,
+      interlace_type, compression_type, filter_type);
+   png_free_data(png_ptr, info_ptr, PNG_FREE_PLTE, -1);
+   png_set_invalid(png_ptr, info_ptr, PNG_INFO_PLTE);
+   return OPNG_REDUCE_PALETTE_TO_RGB;
+}
+
+/*
+ * Normalize the color of the fully transparent pixels, by replacing it
+ * with the value predicted by the PNG filter selected in reductions.
+ * The prediction is done byte by byte, exactly as in PNG filtering,
+ * therefore the filtered residual of the replaced bytes is zero.
+ * (In interlaced images, the neighbors used in prediction are only
+ * approximations of the neighbors inside the interlaced passes.)
+ * The function returns OPNG_REDUCE_TRANSPARENT_COLOR if any pixel
+ * has been modified.
+ */
+static png_uint_32 /* PRIVATE */
+opng_reduce_transparent_colors(png_structp png_ptr, png_infop info_ptr,
+   png_uint_32 reductions)
+{
+   png_bytepp row_ptr;
+   png_bytep crt_row, prev_row, pixel_ptr;
+   png_uint_32 width, height;
+   int bit_depth, color_type, byte_depth, channels, sample_size, color_size;
+   int filter_value;
+   int left, up, upleft, pred, p, pa, pb, pc;
+   int modified;
+   png_uint_32 i, j;
+   int k;
+
+   opng_debug(1, "in opng_reduce_transparent_colors");
+
+   /* Check if the reduction applies. */
+   if (!(reductions & OPNG_REDUCE_TRANSPARENT_COLOR))
+      return OPNG_REDUCE_NONE;
+   png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+      NULL, NULL, NULL);
+   if (!(color_type & PNG_COLOR_MASK_ALPHA))
+      return OPNG_REDUCE_NONE;  /* palette and tRNS are not handled here */
+
+   filter_value = (int)((reductions & OPNG_REDUCE_TRANSPARENT_FILTER_MASK)
+      >> 16);
+   byte_depth = bit_depth / 8;
+   channels = png_get_channels(png_ptr, info_ptr);
+   sample_size = channels * byte_depth;
+   color_size = (channels - 1) * byte_depth;
+
+   modified = 0;
+   row_ptr = png_get_rows(png_ptr, info_ptr);
+   prev_row = NULL;
+   for (i = 0; i < height; ++i, prev_row = crt_row)
+   {
+      crt_row = row_ptr[i];
+      pixel_ptr = crt_row;
+      for (j = 0; j < width; ++j, pixel_ptr += sample_size)
+      {
+         /* The alpha sample is last in the pixel. */
+         if (pixel_ptr[color_size] != 0 ||
+             (byte_depth == 2 && pixel_ptr[color_size + 1] != 0))
+            continue;
+         for (k = 0; k < color_size; ++k)
+         {
+            left = (j > 0) ? pixel_ptr[k - sample_size] : 0;
+            up = (prev_row != NULL) ? prev_row[j * sample_size + k] : 0;
+            switch (filter_value)
+            {
+            case PNG_FILTER_VALUE_SUB:
+               pred = left;
+               break;
+            case PNG_FILTER_VALUE_UP:
+               pred = up;
+               break;
+            case PNG_FILTER_VALUE_AVG:
+               pred = (left + up) / 2;
+               break;
+            case PNG_FILTER_VALUE_PAETH:
+               upleft = (j > 0 && prev_row != NULL) ?
+                  prev_row[(j - 1) * sample_size + k] : 0;
+               p = left + up - upleft;
+               pa = (p > left) ? (p - left) : (left - p);
+               pb = (p > up) ? (p - up) : (up - p);
+               pc = (p > upleft) ? (p - upleft) : (upleft - p);
+               if (pa <= pb && pa <= pc)
+                  pred = left;
+               else if (pb <= pc)
+                  pred = up;
+               else
+                  pred = upleft;
+               break;
+            default:
+               pred = 0;
+               break;
+            }
+            if (pixel_ptr[k] != pred)
+            {
+               pixel_ptr[k] = (png_byte)pred;
+               modified = 1;
+            }
+         }
+      }
+   }
+
+   return modified ? OPNG_REDUCE_TRANSPARENT_COLOR : OPNG_REDUCE_NONE;
 }
 
 /*
@@ -1292,8 +1732,29 @@ opng_reduce_image(png_structp png_ptr, png_infop info_ptr,
 
    /* The reductions below must be applied in this particular order. */
 
+   /* Try to expand the palette image, if requested.
+    * The expanded image may be reduced further, but not back to palette.
+    */
+   result = OPNG_REDUCE_NONE;
+   if (color_type == PNG_COLOR_TYPE_PALETTE &&
+       (reductions & OPNG_REDUCE_PALETTE_TO_RGB))
+   {
+      result = opng_expand_palette(png_ptr, info_ptr, reductions);
+      if (result != OPNG_REDUCE_NONE)
+      {
+         color_type = png_get_color_type(png_ptr, info_ptr);
+         reductions &= ~(OPNG_REDUCE_RGB_TO_PALETTE |
+            OPNG_REDUCE_GRAY_TO_PALETTE | OPNG_REDUCE_PALETTE);
+      }
+   }
+
+   /* Normalize the fully transparent pixels, if requested.
+    * This is done before the other reductions, which may benefit from it.
+    */
+   result |= opng_reduce_transparent_colors(png_ptr, info_ptr, reductions);
+
    /* Try to reduce the high bits and color/alpha channels. */
-   result = opng_reduce_bits(png_ptr, info_ptr, reductions);
+   result |= opng_reduce_bits(png_ptr, info_ptr, reductions);
 
    /* Try to reduce the palette image. */
    if (color_type == PNG_COLOR_TYPE_PALETTE &&
@@ -1303,6 +1764,11 @@ opng_reduce_image(png_structp png_ptr, png_infop info_ptr,
          OPNG_REDUCE_8_TO_4_2_1)))
       result |= opng_reduce_palette(png_ptr, info_ptr, reductions);
 
+   /* Try to reduce the grayscale image below 8 bits. */
+   if (png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_GRAY &&
+       (reductions & OPNG_REDUCE_8_TO_4_2_1))
+      result |= opng_reduce_gray_bits(png_ptr, info_ptr, reductions);
+
    /* Try to reduce RGB to palette or grayscale to palette. */
    if (((color_type & ~PNG_COLOR_MASK_ALPHA) == PNG_COLOR_TYPE_GRAY &&
         (reductions & OPNG_REDUCE_GRAY_TO_PALETTE)) ||
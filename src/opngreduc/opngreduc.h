@@ -51,6 +51,13 @@ int PNGAPI opng_validate_image(png_structp png_ptr, png_infop info_ptr);
  * or by loading IDAT.
  * The parameter reductions indicates the intended reductions.
  * The function returns the successful reductions.
+ *
+ * OPNG_REDUCE_PALETTE_TO_RGB is not a reduction in itself: it expands
+ * the palette image, before any other reduction is attempted. It should
+ * be requested only when the expanded image is evaluated as an alternative
+ * to the (possibly reduced) palette image. The expansion reallocates the
+ * rows, which must be stored in a single memory block, starting with the
+ * row index (e.g., by calling pngx_malloc_rows()).
  */
 png_uint_32 PNGAPI opng_reduce_image(png_structp png_ptr, png_infop info_ptr,
    png_uint_32 reductions);
@@ -64,13 +71,15 @@ png_uint_32 PNGAPI opng_reduce_image(png_structp png_ptr, png_infop info_ptr,
 #define OPNG_REDUCE_RGB_TO_GRAY      0x0004  /* ...also RGBA to GA */
 #define OPNG_REDUCE_STRIP_ALPHA      0x0008  /* ...and create tRNS if needed */
 #define OPNG_REDUCE_RGB_TO_PALETTE   0x0010  /* ...also RGBA to palette/tRNS */
-#define OPNG_REDUCE_PALETTE_TO_RGB   0x0020  /* TODO */
+#define OPNG_REDUCE_PALETTE_TO_RGB   0x0020  /* ...also palette/tRNS to RGBA */
 #define OPNG_REDUCE_GRAY_TO_PALETTE  0x0040  /* ...also GA to palette/tRNS */
 #define OPNG_REDUCE_PALETTE_TO_GRAY  0x0080  /* ...also palette/tRNS to GA */
 #define OPNG_REDUCE_PALETTE_SLOW     0x0100  /* TODO: remove all sterile entries
                                                 and reorder PLTE */
 #define OPNG_REDUCE_PALETTE_FAST     0x0200  /* remove trailing sterile entries
                                                 only; do not reorder PLTE */
+#define OPNG_REDUCE_TRANSPARENT_COLOR 0x0400 /* normalize the color of fully
+                                                transparent pixels */
 #define OPNG_REDUCE_METADATA         0x1000  /* TODO */
 #define OPNG_REDUCE_REPAIR           0x2000  /* repair broken image data */
 
@@ -89,6 +98,17 @@ png_uint_32 PNGAPI opng_reduce_image(png_structp png_ptr, png_infop info_ptr,
    (OPNG_REDUCE_BIT_DEPTH | OPNG_REDUCE_COLOR_TYPE | \
     OPNG_REDUCE_PALETTE | OPNG_REDUCE_METADATA)
 
+/*
+ * OPNG_REDUCE_TRANSPARENT_COLOR is not lossless: it discards the color of
+ * the invisible pixels, and it is therefore excluded from OPNG_REDUCE_ALL.
+ * The new color is the value predicted by the given PNG filter (e.g. zero
+ * for PNG_FILTER_VALUE_NONE, the left neighbor for PNG_FILTER_VALUE_SUB),
+ * which makes the filtered residual zero.
+ */
+#define OPNG_REDUCE_TRANSPARENT_FILTER(filter_value)  \
+   (OPNG_REDUCE_TRANSPARENT_COLOR | (((png_uint_32)(filter_value) & 7) << 16))
+#define OPNG_REDUCE_TRANSPARENT_FILTER_MASK  0x00070000
+
 #endif /* OPNG_IMAGE_REDUCTIONS_SUPPORTED */
 
 
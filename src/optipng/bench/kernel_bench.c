@@ -0,0 +1,1026 @@
+/*
+ * kernel_bench.c
+ * Micro-benchmarks for the filtering, compression and reduction kernels.
+ *
+ * Copyright (C) 2001-2017 Cosmin Truta and the Contributing Authors.
+ *
+ * This software is distributed under the zlib license.
+ * Please see the accompanying LICENSE file.
+ *
+ * The kernels are static inside libpng, zlib, opngreduc and gifread, so
+ * they are reached through the narrowest public entry points that run
+ * them, and only these calls are timed:
+ *   filter_*        png_write_rows(), with a single filter and with
+ *                   the adaptive filtering, at zlib level 0;
+ *   deflate_*       deflate() at level 3 (deflate_fast), at level 9
+ *                   (deflate_slow and longest_match), and with the
+ *                   Z_RLE and Z_HUFFMAN_ONLY strategies;
+ *   crc32, adler32  the zlib checksums;
+ *   opng_analyze_bits
+ *                   opng_reduce_image(), with the bit depth and channel
+ *                   reductions, which are applied only if possible;
+ *   opng_reduce_to_palette
+ *                   opng_reduce_image(), with the palette reductions;
+ *                   both run only on the images whose analysis goes all
+ *                   the way, without exiting early;
+ *   gif_lzw_decode  the GIF decoding of all the frames.
+ *
+ * The inputs are synthetic images, generated deterministically, and the
+ * image files given in the command line. Each result is printed on one
+ * line, in a stable format:
+ *   <kernel> <input> <bytes> <iterations> <median ms> <MB/s>
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "png.h"
+#include "zlib.h"
+#include "opngreduc.h"
+#include "pngxtern.h"
+#include "gifread.h"
+#include "ioutil.h"
+
+#include "cexcept.h"
+define_exception_type(const char *);
+struct exception_context the_exception_context[1];
+
+
+/*
+ * Benchmark limits.
+ */
+#define BENCH_MIN_ITERATIONS   5
+#define BENCH_MAX_ITERATIONS   10000
+#define BENCH_TIME_DEFAULT     100  /* ms per kernel and input */
+
+/*
+ * The synthetic image size.
+ */
+#define SYNTH_WIDTH   640
+#define SYNTH_HEIGHT  480
+
+/*
+ * A benchmark input: an image raster, or a GIF stream.
+ */
+struct bench_input
+{
+    char *name;
+    int is_gif;
+
+    /* The image raster. */
+    png_uint_32 width, height;
+    int bit_depth, color_type;
+    png_size_t rowbytes;
+    png_bytep data;          /* the original data, height * rowbytes */
+    png_bytepp rows;         /* the rows of the original data */
+    png_bytep work_data;     /* a copy, modified by the reductions */
+    png_bytepp work_rows;
+    png_color palette[256];
+    int num_palette;
+    int has_trans;
+    png_byte trans_alpha[256];
+    int num_trans;
+    png_color_16 trans_color;
+
+    /* The GIF stream. */
+    FILE *stream;
+    unsigned long num_pixels;  /* in all the frames */
+    unsigned char **screen_rows;
+};
+
+/*
+ * A kernel.
+ */
+struct bench_kernel
+{
+    const char *name;
+    int is_gif;
+    int (*is_applicable_fn)(const struct bench_input *input);
+    double (*run_fn)(struct bench_input *input, int param1, int param2);
+    int param1, param2;
+};
+
+static struct bench_input **inputs;
+static size_t num_inputs;
+static double min_time = BENCH_TIME_DEFAULT / 1000.0;
+
+
+/*
+ * Error handling.
+ */
+static void
+error(const char *fmt, ...)
+{
+    va_list arg_ptr;
+
+    fprintf(stderr, "kernel_bench: ");
+    va_start(arg_ptr, fmt);
+    vfprintf(stderr, fmt, arg_ptr);
+    va_end(arg_ptr);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+static void
+bench_png_error(png_structp png_ptr, png_const_charp message)
+{
+    (void)png_ptr;
+    error("libpng error: %s", message);
+}
+
+static void
+bench_png_read_error(png_structp png_ptr, png_const_charp message)
+{
+    /* The message may be stored in a libpng stack frame, which is about
+     * to be unwound.
+     */
+    static char msg_buf[256];
+
+    (void)png_ptr;
+    strncpy(msg_buf, message, sizeof(msg_buf) - 1);
+    msg_buf[sizeof(msg_buf) - 1] = 0;
+    Throw msg_buf;
+}
+
+static void
+bench_png_warning(png_structp png_ptr, png_const_charp message)
+{
+    (void)png_ptr;
+    (void)message;
+}
+
+static void
+bench_gif_error(const char *message)
+{
+    error("GIF error: %s", message);
+}
+
+static void
+bench_gif_warning(const char *message)
+{
+    (void)message;
+}
+
+static void *
+bench_malloc(size_t size)
+{
+    void *ptr;
+
+    if ((ptr = malloc(size > 0 ? size : 1)) == NULL)
+        error("Out of memory");
+    return ptr;
+}
+
+/*
+ * The deterministic pseudo-random generator of the synthetic inputs.
+ */
+static unsigned long synth_seed;
+
+static unsigned int
+synth_random(void)
+{
+    synth_seed = (synth_seed * 1103515245UL + 12345UL) & 0xffffffffUL;
+    return (unsigned int)(synth_seed >> 16) & 0x7fff;
+}
+
+/*
+ * Adds an input.
+ */
+static struct bench_input *
+bench_new_input(const char *name, int is_gif)
+{
+    struct bench_input *input;
+
+    inputs = (struct bench_input **)
+        realloc(inputs, (num_inputs + 1) * sizeof(*inputs));
+    if (inputs == NULL)
+        error("Out of memory");
+    input = (struct bench_input *)bench_malloc(sizeof(*input));
+    memset(input, 0, sizeof(*input));
+    input->name = (char *)bench_malloc(strlen(name) + 1);
+    strcpy(input->name, name);
+    input->is_gif = is_gif;
+    inputs[num_inputs++] = input;
+    return input;
+}
+
+/*
+ * Allocates the raster of an input.
+ */
+static void
+bench_alloc_raster(struct bench_input *input,
+                   png_uint_32 width, png_uint_32 height,
+                   int bit_depth, int color_type)
+{
+    static const int type_channels[8] = {1, 0, 3, 1, 2, 0, 4, 0};
+    png_uint_32 i;
+
+    input->width = width;
+    input->height = height;
+    input->bit_depth = bit_depth;
+    input->color_type = color_type;
+    input->rowbytes =
+        ((png_size_t)width * type_channels[color_type] * bit_depth + 7) / 8;
+    input->data = (png_bytep)bench_malloc(height * input->rowbytes);
+    input->work_data = (png_bytep)bench_malloc(height * input->rowbytes);
+    input->rows = (png_bytepp)bench_malloc(height * sizeof(png_bytep));
+    input->work_rows = (png_bytepp)bench_malloc(height * sizeof(png_bytep));
+    for (i = 0; i < height; ++i)
+    {
+        input->rows[i] = input->data + i * input->rowbytes;
+        input->work_rows[i] = input->work_data + i * input->rowbytes;
+    }
+}
+
+/*
+ * Stores the raster in a PNG image info, for the reduction kernels.
+ */
+static void
+bench_set_image(png_structp png_ptr, png_infop info_ptr,
+                struct bench_input *input)
+{
+    png_set_IHDR(png_ptr, info_ptr, input->width, input->height,
+                 input->bit_depth, input->color_type, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    if (input->num_palette > 0)
+        png_set_PLTE(png_ptr, info_ptr, input->palette, input->num_palette);
+    if (input->has_trans)
+        png_set_tRNS(png_ptr, info_ptr,
+                     (input->num_trans > 0) ? input->trans_alpha : NULL,
+                     input->num_trans, &input->trans_color);
+}
+
+/*
+ * The PNG output sink.
+ */
+static void
+bench_png_write(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    unsigned long *count = (unsigned long *)png_get_io_ptr(png_ptr);
+
+    (void)data;
+    *count += (unsigned long)length;
+}
+
+static void
+bench_png_flush(png_structp png_ptr)
+{
+    (void)png_ptr;
+}
+
+/*
+ * The filter kernels.
+ */
+static double
+bench_filter(struct bench_input *input, int filter, int param2)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    unsigned long count;
+    double start_time, elapsed_time;
+
+    (void)param2;
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                      bench_png_error, bench_png_warning);
+    if (png_ptr == NULL ||
+        (info_ptr = png_create_info_struct(png_ptr)) == NULL)
+        error("Out of memory");
+    count = 0;
+    png_set_write_fn(png_ptr, &count, bench_png_write, bench_png_flush);
+    png_set_compression_level(png_ptr, Z_NO_COMPRESSION);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filter);
+    bench_set_image(png_ptr, info_ptr, input);
+    png_write_info(png_ptr, info_ptr);
+
+    start_time = opng_os_wall_clock();
+    png_write_rows(png_ptr, input->rows, input->height);
+    elapsed_time = opng_os_wall_clock() - start_time;
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return elapsed_time;
+}
+
+/*
+ * The deflate kernels, run on the unfiltered image data.
+ */
+static double
+bench_deflate(struct bench_input *input, int level, int strategy)
+{
+    z_stream zstream;
+    static Bytef *out_buf;
+    static uLong out_size;
+    uLong in_size, size;
+    double start_time, elapsed_time;
+
+    in_size = (uLong)(input->height * input->rowbytes);
+    memset(&zstream, 0, sizeof(zstream));
+    if (deflateInit2(&zstream, level, Z_DEFLATED, 15, 9, strategy) != Z_OK)
+        error("Can't initialize zlib");
+    size = deflateBound(&zstream, in_size);
+    if (size > out_size)
+    {
+        free(out_buf);
+        out_buf = (Bytef *)bench_malloc(size);
+        out_size = size;
+    }
+    zstream.next_in = input->data;
+    zstream.avail_in = (uInt)in_size;
+    zstream.next_out = out_buf;
+    zstream.avail_out = (uInt)out_size;
+
+    start_time = opng_os_wall_clock();
+    if (deflate(&zstream, Z_FINISH) != Z_STREAM_END)
+        error("Can't compress the data of %s", input->name);
+    elapsed_time = opng_os_wall_clock() - start_time;
+
+    deflateEnd(&zstream);
+    return elapsed_time;
+}
+
+/*
+ * The checksum kernels.
+ */
+static double
+bench_crc32(struct bench_input *input, int param1, int param2)
+{
+    double start_time;
+    volatile uLong crc;
+
+    (void)param1;
+    (void)param2;
+    start_time = opng_os_wall_clock();
+    crc = crc32(crc32(0, Z_NULL, 0), input->data,
+                (uInt)(input->height * input->rowbytes));
+    (void)crc;
+    return opng_os_wall_clock() - start_time;
+}
+
+static double
+bench_adler32(struct bench_input *input, int param1, int param2)
+{
+    double start_time;
+    volatile uLong adler;
+
+    (void)param1;
+    (void)param2;
+    start_time = opng_os_wall_clock();
+    adler = adler32(adler32(0, Z_NULL, 0), input->data,
+                    (uInt)(input->height * input->rowbytes));
+    (void)adler;
+    return opng_os_wall_clock() - start_time;
+}
+
+/*
+ * The reduction kernels, run on a fresh copy of the image.
+ */
+static double
+bench_reduce(struct bench_input *input, int reductions, int param2)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    double start_time, elapsed_time;
+
+    (void)param2;
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                      bench_png_error, bench_png_warning);
+    if (png_ptr == NULL ||
+        (info_ptr = png_create_info_struct(png_ptr)) == NULL)
+        error("Out of memory");
+    memcpy(input->work_data, input->data, input->height * input->rowbytes);
+    bench_set_image(png_ptr, info_ptr, input);
+    png_set_rows(png_ptr, info_ptr, input->work_rows);
+
+    start_time = opng_os_wall_clock();
+    opng_reduce_image(png_ptr, info_ptr, (png_uint_32)reductions);
+    elapsed_time = opng_os_wall_clock() - start_time;
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return elapsed_time;
+}
+
+/*
+ * Checks if the analysis of the bits goes through all the rows of an
+ * image, i.e. if a reduction is still possible before the last row.
+ * Otherwise, the analysis exits early, and its time can't be compared
+ * with the size of the image.
+ */
+static int
+bench_is_bits_scan_complete(const struct bench_input *input)
+{
+    png_bytep ptr;
+    png_uint_32 x, y;
+    int byte_depth, channels, k;
+    int can_reduce_16, can_reduce_rgb, can_strip_alpha;
+
+    if (input->bit_depth < 8 ||
+        (input->color_type & PNG_COLOR_MASK_PALETTE))
+        return 0;
+    byte_depth = input->bit_depth / 8;
+    channels = (int)(input->rowbytes / input->width / byte_depth);
+    can_reduce_16 = (input->bit_depth == 16);
+    can_reduce_rgb = (input->color_type & PNG_COLOR_MASK_COLOR) != 0;
+    can_strip_alpha = (input->color_type & PNG_COLOR_MASK_ALPHA) != 0;
+    for (y = 0; y + 1 < input->height; ++y)
+    {
+        ptr = input->rows[y];
+        for (x = 0; x < input->width; ++x, ptr += channels * byte_depth)
+        {
+            for (k = 0; can_reduce_16 && k < channels; ++k)
+            {
+                if (ptr[2 * k] != ptr[2 * k + 1])
+                    can_reduce_16 = 0;
+            }
+            if (can_reduce_rgb &&
+                (memcmp(ptr, ptr + byte_depth, byte_depth) != 0 ||
+                 memcmp(ptr, ptr + 2 * byte_depth, byte_depth) != 0))
+                can_reduce_rgb = 0;
+            for (k = 0; can_strip_alpha && k < byte_depth; ++k)
+            {
+                if (ptr[(channels - 1) * byte_depth + k] != 255)
+                    can_strip_alpha = 0;
+            }
+        }
+        if (!can_reduce_16 && !can_reduce_rgb && !can_strip_alpha)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Checks if the palette analysis goes through all the pixels of an image,
+ * i.e. if the image has at most 256 colors, including the transparency.
+ * Otherwise, the analysis exits early, at the 257th color.
+ */
+static int
+bench_is_palette_scan_complete(const struct bench_input *input)
+{
+    static png_uint_32 colors[256];
+    png_uint_32 color, prev_color;
+    png_bytep ptr;
+    png_uint_32 x, y;
+    int channels, num_colors, alpha, k;
+
+    if (input->bit_depth != 8 ||
+        (input->color_type & PNG_COLOR_MASK_PALETTE))
+        return 0;
+    channels = (int)(input->rowbytes / input->width);
+    num_colors = 0;
+    prev_color = 0xffffffffUL;
+    for (y = 0; y < input->height; ++y)
+    {
+        ptr = input->rows[y];
+        for (x = 0; x < input->width; ++x, ptr += channels)
+        {
+            if (input->color_type & PNG_COLOR_MASK_ALPHA)
+                alpha = ptr[channels - 1];
+            else if (!input->has_trans)
+                alpha = 255;
+            else if (input->color_type & PNG_COLOR_MASK_COLOR)
+                alpha = (ptr[0] == (png_byte)input->trans_color.red &&
+                         ptr[1] == (png_byte)input->trans_color.green &&
+                         ptr[2] == (png_byte)input->trans_color.blue) ?
+                        0 : 255;
+            else
+                alpha = (ptr[0] == (png_byte)input->trans_color.gray) ?
+                        0 : 255;
+            if (input->color_type & PNG_COLOR_MASK_COLOR)
+                color = ((png_uint_32)ptr[0] << 24) |
+                        ((png_uint_32)ptr[1] << 16) |
+                        ((png_uint_32)ptr[2] << 8) | (png_uint_32)alpha;
+            else
+                color = ((png_uint_32)ptr[0] << 8) | (png_uint_32)alpha;
+            if (color == prev_color)
+                continue;
+            prev_color = color;
+            for (k = 0; k < num_colors; ++k)
+            {
+                if (colors[k] == color)
+                    break;
+            }
+            if (k < num_colors)
+                continue;
+            if (num_colors == 256)
+                return 0;
+            colors[num_colors++] = color;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Decodes all the frames of a GIF stream.
+ * The function returns the number of pixels decoded.
+ */
+static unsigned long
+bench_decode_gif(struct bench_input *input)
+{
+    struct GIFScreen screen;
+    struct GIFImage image;
+    unsigned long num_pixels;
+    int block_code;
+
+    GIFError = bench_gif_error;
+    GIFWarning = bench_gif_warning;
+    GIFReadScreen(&screen, input->stream);
+    GIFInitImage(&image, &screen, input->screen_rows);
+    num_pixels = 0;
+    while ((block_code = GIFReadNextBlock(&image, NULL, input->stream))
+           != GIF_TERMINATOR)
+    {
+        if (block_code == GIF_IMAGE)
+            num_pixels += (unsigned long)image.Width * image.Height;
+    }
+    GIFDestroyImage(&image);
+    return num_pixels;
+}
+
+/*
+ * The GIF decoding kernel.
+ */
+static double
+bench_gif_decode(struct bench_input *input, int param1, int param2)
+{
+    double start_time;
+
+    (void)param1;
+    (void)param2;
+    rewind(input->stream);
+    start_time = opng_os_wall_clock();
+    bench_decode_gif(input);
+    return opng_os_wall_clock() - start_time;
+}
+
+/*
+ * The kernel table.
+ */
+static const struct bench_kernel kernels[] =
+{
+    { "filter_none", 0, NULL, bench_filter, PNG_FILTER_NONE, 0 },
+    { "filter_sub", 0, NULL, bench_filter, PNG_FILTER_SUB, 0 },
+    { "filter_up", 0, NULL, bench_filter, PNG_FILTER_UP, 0 },
+    { "filter_avg", 0, NULL, bench_filter, PNG_FILTER_AVG, 0 },
+    { "filter_paeth", 0, NULL, bench_filter, PNG_FILTER_PAETH, 0 },
+    { "filter_adaptive", 0, NULL, bench_filter, PNG_ALL_FILTERS, 0 },
+    { "deflate_fast", 0, NULL, bench_deflate, 3, Z_DEFAULT_STRATEGY },
+    { "deflate_slow", 0, NULL, bench_deflate, 9, Z_DEFAULT_STRATEGY },
+    { "deflate_rle", 0, NULL, bench_deflate, 9, Z_RLE },
+    { "deflate_huffman", 0, NULL, bench_deflate, 9, Z_HUFFMAN_ONLY },
+    { "crc32", 0, NULL, bench_crc32, 0, 0 },
+    { "adler32", 0, NULL, bench_adler32, 0, 0 },
+    { "opng_analyze_bits", 0, bench_is_bits_scan_complete, bench_reduce,
+      OPNG_REDUCE_16_TO_8 | OPNG_REDUCE_RGB_TO_GRAY |
+      OPNG_REDUCE_STRIP_ALPHA, 0 },
+    { "opng_reduce_to_palette", 0,
+      bench_is_palette_scan_complete, bench_reduce,
+      OPNG_REDUCE_RGB_TO_PALETTE | OPNG_REDUCE_GRAY_TO_PALETTE, 0 },
+    { "gif_lzw_decode", 1, NULL, bench_gif_decode, 0, 0 }
+};
+
+/*
+ * Compares two times, for sorting.
+ */
+static int
+bench_compare_times(const void *val1, const void *val2)
+{
+    double t1 = *(const double *)val1;
+    double t2 = *(const double *)val2;
+
+    return (t1 < t2) ? -1 : (t1 > t2) ? 1 : 0;
+}
+
+/*
+ * Runs a kernel on an input, and prints the result.
+ * The kernel runs at least BENCH_MIN_ITERATIONS times, and until its
+ * accumulated time reaches min_time, or until the untimed preparations
+ * take too long; the median time is reported.
+ */
+static void
+bench_run(const struct bench_kernel *kernel, struct bench_input *input)
+{
+    static double times[BENCH_MAX_ITERATIONS];
+    unsigned long num_bytes;
+    double total_time, median_time, start_time;
+    int i;
+
+    num_bytes = input->is_gif ? input->num_pixels :
+                (unsigned long)(input->height * input->rowbytes);
+    kernel->run_fn(input, kernel->param1, kernel->param2);  /* warm-up */
+    total_time = 0;
+    start_time = opng_os_wall_clock();
+    for (i = 0; i < BENCH_MAX_ITERATIONS; ++i)
+    {
+        if (i >= BENCH_MIN_ITERATIONS &&
+            (total_time >= min_time ||
+             opng_os_wall_clock() - start_time >= 10 * min_time))
+            break;
+        times[i] = kernel->run_fn(input, kernel->param1, kernel->param2);
+        total_time += times[i];
+    }
+    qsort(times, (size_t)i, sizeof(double), bench_compare_times);
+    median_time = times[i / 2];
+    printf("%-24s %-24s %10lu %6d %10.4f %9.2f\n",
+           kernel->name, input->name, num_bytes, i, 1000 * median_time,
+           (median_time > 0) ? num_bytes / median_time / 1000000 : 0);
+    fflush(stdout);
+}
+
+/*
+ * Makes the synthetic rasters.
+ */
+static void
+synth_make_rasters(void)
+{
+    struct bench_input *input;
+    png_bytep ptr;
+    png_uint_32 x, y;
+    unsigned int k, val;
+
+    /* A smooth RGB image with a little noise, like a photograph. */
+    synth_seed = 1;
+    input = bench_new_input("synthetic-rgb8", 0);
+    bench_alloc_raster(input, SYNTH_WIDTH, SYNTH_HEIGHT,
+                       8, PNG_COLOR_TYPE_RGB);
+    for (y = 0, ptr = input->data; y < SYNTH_HEIGHT; ++y)
+    {
+        for (x = 0; x < SYNTH_WIDTH; ++x)
+        {
+            *ptr++ = (png_byte)((x * 255 / SYNTH_WIDTH) +
+                                synth_random() % 5);
+            *ptr++ = (png_byte)((y * 255 / SYNTH_HEIGHT) +
+                                synth_random() % 5);
+            *ptr++ = (png_byte)(((x + y) * 127 / SYNTH_WIDTH) +
+                                synth_random() % 5);
+        }
+    }
+
+    /* An RGBA image with 240 colors and translucency, in 8x8 tiles,
+     * which is reducible to palette, but not in its bit depth.
+     */
+    input = bench_new_input("synthetic-rgba8", 0);
+    bench_alloc_raster(input, SYNTH_WIDTH, SYNTH_HEIGHT,
+                       8, PNG_COLOR_TYPE_RGB_ALPHA);
+    for (y = 0, ptr = input->data; y < SYNTH_HEIGHT; ++y)
+    {
+        for (x = 0; x < SYNTH_WIDTH; ++x)
+        {
+            k = ((x / 8) * 7 + (y / 8) * 13) % 240;
+            *ptr++ = (png_byte)(k * 37);
+            *ptr++ = (png_byte)(k * 91 + 17);
+            *ptr++ = (png_byte)(255 - k);
+            *ptr++ = (png_byte)((k % 3 == 0) ? 255 : k);
+        }
+    }
+
+    /* A 16-bit RGBA image that is gray, opaque and reducible to 8 bits,
+     * except for its last pixel, so that the analysis of its bits goes
+     * all the way without finding any reduction.
+     */
+    input = bench_new_input("synthetic-rgba16", 0);
+    bench_alloc_raster(input, SYNTH_WIDTH, SYNTH_HEIGHT,
+                       16, PNG_COLOR_TYPE_RGB_ALPHA);
+    for (y = 0, ptr = input->data; y < SYNTH_HEIGHT; ++y)
+    {
+        for (x = 0; x < SYNTH_WIDTH; ++x)
+        {
+            val = (x + y) & 0xff;
+            for (k = 0; k < 6; ++k)
+                *ptr++ = (png_byte)val;
+            *ptr++ = 0xff;
+            *ptr++ = 0xff;
+        }
+    }
+    memcpy(ptr - 8, "\x12\x34\x56\x78\x9a\xbc\x12\x34", 8);
+
+    /* A noisy 16-bit grayscale image. */
+    input = bench_new_input("synthetic-gray16", 0);
+    bench_alloc_raster(input, SYNTH_WIDTH, SYNTH_HEIGHT,
+                       16, PNG_COLOR_TYPE_GRAY);
+    for (y = 0, ptr = input->data; y < SYNTH_HEIGHT; ++y)
+    {
+        for (x = 0; x < SYNTH_WIDTH; ++x)
+        {
+            val = (x * 65535U / SYNTH_WIDTH) ^ synth_random();
+            *ptr++ = (png_byte)(val >> 8);
+            *ptr++ = (png_byte)val;
+        }
+    }
+}
+
+/*
+ * The LZW encoder of the synthetic GIF image.
+ * It follows the code size rules of the reference GIF encoders.
+ */
+struct synth_lzw_writer
+{
+    FILE *stream;
+    unsigned char block[255];
+    int block_len;
+    unsigned long bit_buf;
+    int bit_count;
+    int code_size;
+};
+
+static void
+synth_lzw_put_byte(struct synth_lzw_writer *writer, int byte)
+{
+    writer->block[writer->block_len++] = (unsigned char)byte;
+    if (writer->block_len == 255)
+    {
+        putc(255, writer->stream);
+        fwrite(writer->block, 1, 255, writer->stream);
+        writer->block_len = 0;
+    }
+}
+
+static void
+synth_lzw_put_code(struct synth_lzw_writer *writer, int code)
+{
+    writer->bit_buf |= (unsigned long)code << writer->bit_count;
+    writer->bit_count += writer->code_size;
+    while (writer->bit_count >= 8)
+    {
+        synth_lzw_put_byte(writer, (int)(writer->bit_buf & 0xff));
+        writer->bit_buf >>= 8;
+        writer->bit_count -= 8;
+    }
+}
+
+static void
+synth_lzw_encode(FILE *stream, const unsigned char *pixels, size_t count)
+{
+    enum { CLEAR_CODE = 256, EOI_CODE = 257, MAX_CODE = 4095 };
+    struct synth_lzw_writer writer;
+    unsigned short *table;  /* next code, by prefix code and pixel */
+    int prefix, next_code, pixel;
+    size_t i;
+
+    table = (unsigned short *)bench_malloc(4096 * 256 * sizeof(*table));
+    memset(table, 0, 4096 * 256 * sizeof(*table));
+    memset(&writer, 0, sizeof(writer));
+    writer.stream = stream;
+    writer.code_size = 9;
+    next_code = EOI_CODE + 1;
+    putc(8, stream);  /* the minimum code size */
+    synth_lzw_put_code(&writer, CLEAR_CODE);
+    prefix = pixels[0];
+    for (i = 1; i < count; ++i)
+    {
+        pixel = pixels[i];
+        if (table[prefix * 256 + pixel] != 0)
+        {
+            prefix = table[prefix * 256 + pixel];
+            continue;
+        }
+        synth_lzw_put_code(&writer, prefix);
+        if (next_code >= (1 << writer.code_size))
+            ++writer.code_size;
+        if (next_code >= MAX_CODE)
+        {
+            synth_lzw_put_code(&writer, CLEAR_CODE);
+            memset(table, 0, 4096 * 256 * sizeof(*table));
+            next_code = EOI_CODE + 1;
+            writer.code_size = 9;
+        }
+        else
+            table[prefix * 256 + pixel] = (unsigned short)next_code++;
+        prefix = pixel;
+    }
+    synth_lzw_put_code(&writer, prefix);
+    if (next_code >= (1 << writer.code_size))
+        ++writer.code_size;
+    synth_lzw_put_code(&writer, EOI_CODE);
+    if (writer.bit_count > 0)
+        synth_lzw_put_byte(&writer, (int)(writer.bit_buf & 0xff));
+    if (writer.block_len > 0)
+    {
+        putc(writer.block_len, stream);
+        fwrite(writer.block, 1, (size_t)writer.block_len, stream);
+    }
+    putc(0, stream);  /* the block terminator */
+    free(table);
+}
+
+/*
+ * Allocates the screen rows of a GIF input, and validates its decoding.
+ */
+static void
+bench_init_gif(struct bench_input *input)
+{
+    struct GIFScreen screen;
+    unsigned int i;
+
+    GIFError = bench_gif_error;
+    GIFWarning = bench_gif_warning;
+    rewind(input->stream);
+    GIFReadScreen(&screen, input->stream);
+    input->screen_rows = (unsigned char **)
+        bench_malloc(screen.Height * sizeof(unsigned char *));
+    for (i = 0; i < screen.Height; ++i)
+        input->screen_rows[i] = (unsigned char *)bench_malloc(screen.Width);
+    rewind(input->stream);
+    input->num_pixels = bench_decode_gif(input);
+}
+
+/*
+ * Makes the synthetic GIF image: a palette image with runs, tiles and
+ * noise, encoded with LZW, and checked against the decoder.
+ */
+static void
+synth_make_gif(void)
+{
+    struct bench_input *input;
+    unsigned char *pixels;
+    png_uint_32 x, y;
+    int i;
+
+    synth_seed = 2;
+    pixels = (unsigned char *)bench_malloc(SYNTH_WIDTH * SYNTH_HEIGHT);
+    for (y = 0; y < SYNTH_HEIGHT; ++y)
+    {
+        for (x = 0; x < SYNTH_WIDTH; ++x)
+        {
+            if (y < SYNTH_HEIGHT / 3)
+                pixels[y * SYNTH_WIDTH + x] = (unsigned char)(x / 40);
+            else if (y < 2 * SYNTH_HEIGHT / 3)
+                pixels[y * SYNTH_WIDTH + x] =
+                    (unsigned char)(((x / 8) * 7 + (y / 8) * 13) % 240);
+            else
+                pixels[y * SYNTH_WIDTH + x] =
+                    (unsigned char)(synth_random() % 64);
+        }
+    }
+
+    input = bench_new_input("synthetic-gif", 1);
+    if ((input->stream = tmpfile()) == NULL)
+        error("Can't create a temporary file");
+    fwrite("GIF89a", 1, 6, input->stream);
+    putc(SYNTH_WIDTH & 0xff, input->stream);
+    putc(SYNTH_WIDTH >> 8, input->stream);
+    putc(SYNTH_HEIGHT & 0xff, input->stream);
+    putc(SYNTH_HEIGHT >> 8, input->stream);
+    putc(0xf7, input->stream);  /* a global color table of 256 entries */
+    putc(0, input->stream);
+    putc(0, input->stream);
+    for (i = 0; i < 256; ++i)
+    {
+        putc(i, input->stream);
+        putc(255 - i, input->stream);
+        putc(i * 7, input->stream);
+    }
+    fwrite(",\0\0\0\0", 1, 5, input->stream);
+    putc(SYNTH_WIDTH & 0xff, input->stream);
+    putc(SYNTH_WIDTH >> 8, input->stream);
+    putc(SYNTH_HEIGHT & 0xff, input->stream);
+    putc(SYNTH_HEIGHT >> 8, input->stream);
+    putc(0, input->stream);
+    synth_lzw_encode(input->stream, pixels, SYNTH_WIDTH * SYNTH_HEIGHT);
+    putc(';', input->stream);
+    if (fflush(input->stream) != 0)
+        error("Can't write the synthetic GIF image");
+
+    bench_init_gif(input);
+    for (y = 0; y < SYNTH_HEIGHT; ++y)
+    {
+        if (memcmp(input->screen_rows[y], pixels + y * SYNTH_WIDTH,
+                   SYNTH_WIDTH) != 0)
+            error("Can't decode the synthetic GIF image");
+    }
+    free(pixels);
+}
+
+/*
+ * Loads an image file, and adds it as a raster input.
+ * A GIF file is also added as a GIF input.
+ */
+static void
+bench_load_file(const char *file_name)
+{
+    FILE *stream;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_bytepp rows;
+    png_colorp palette;
+    png_bytep trans_alpha;
+    png_color_16p trans_color;
+    png_const_charp fmt_name;
+    struct bench_input *input;
+    png_uint_32 width, height, i;
+    int bit_depth, color_type, num_palette, num_trans;
+    const char * volatile err_msg;  /* volatile is required by cexcept */
+
+    if ((stream = fopen(file_name, "rb")) == NULL)
+    {
+        fprintf(stderr, "kernel_bench: Can't open: %s\n", file_name);
+        return;
+    }
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                     bench_png_read_error, bench_png_warning);
+    if (png_ptr == NULL ||
+        (info_ptr = png_create_info_struct(png_ptr)) == NULL)
+        error("Out of memory");
+    Try
+    {
+        png_init_io(png_ptr, stream);
+        fmt_name = NULL;
+        if (pngx_read_image(png_ptr, info_ptr, &fmt_name, NULL) <= 0)
+            Throw "Unrecognized image file format";
+    }
+    Catch (err_msg)
+    {
+        fprintf(stderr, "kernel_bench: %s: %s\n", file_name, err_msg);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        fclose(stream);
+        return;
+    }
+
+    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+                 NULL, NULL, NULL);
+    rows = png_get_rows(png_ptr, info_ptr);
+    input = bench_new_input(file_name, 0);
+    bench_alloc_raster(input, width, height, bit_depth, color_type);
+    for (i = 0; i < height; ++i)
+        memcpy(input->rows[i], rows[i], input->rowbytes);
+    if (png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette))
+    {
+        memcpy(input->palette, palette, num_palette * sizeof(png_color));
+        input->num_palette = num_palette;
+    }
+    if (png_get_tRNS(png_ptr, info_ptr, &trans_alpha, &num_trans,
+                     &trans_color))
+    {
+        input->has_trans = 1;
+        if (trans_alpha != NULL && num_trans > 0)
+        {
+            memcpy(input->trans_alpha, trans_alpha, (size_t)num_trans);
+            input->num_trans = num_trans;
+        }
+        if (trans_color != NULL)
+            input->trans_color = *trans_color;
+    }
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+    if (fmt_name != NULL && strcmp(fmt_name, "GIF") == 0)
+    {
+        input = bench_new_input(file_name, 1);
+        input->stream = stream;
+        bench_init_gif(input);
+    }
+    else
+        fclose(stream);
+}
+
+/*
+ * The main function.
+ */
+int
+main(int argc, char *argv[])
+{
+    const struct bench_kernel *kernel;
+    struct bench_input *input;
+    char *end;
+    size_t i, j;
+    int k;
+
+    for (k = 1; k < argc && argv[k][0] == '-'; k += 2)
+    {
+        if (strcmp(argv[k], "-time") == 0 && k + 1 < argc)
+        {
+            min_time = strtod(argv[k + 1], &end) / 1000;
+            if (*end != 0 || min_time < 0)
+                error("Invalid time: %s", argv[k + 1]);
+        }
+        else
+        {
+            fprintf(stderr,
+                "Usage: kernel_bench [-time <ms>] [files...]\n"
+                "The default time per kernel and input is %d ms.\n",
+                BENCH_TIME_DEFAULT);
+            return EXIT_FAILURE;
+        }
+    }
+
+    synth_make_rasters();
+    synth_make_gif();
+    for ( ; k < argc; ++k)
+        bench_load_file(argv[k]);
+
+    printf("# kernel_bench: kernel input bytes iterations median-ms MB/s\n");
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+    {
+        kernel = &kernels[i];
+        for (j = 0; j < num_inputs; ++j)
+        {
+            input = inputs[j];
+            if (input->is_gif != kernel->is_gif)
+                continue;
+            if (kernel->is_applicable_fn != NULL &&
+                !kernel->is_applicable_fn(input))
+                continue;
+            bench_run(kernel, input);
+        }
+    }
+    return EXIT_SUCCESS;
+}
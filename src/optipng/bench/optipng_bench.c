@@ -0,0 +1,750 @@
+/*
+ * optipng_bench.c
+ * Benchmark driver for the OptiPNG engine.
+ *
+ * Copyright (C) 2001-2017 Cosmin Truta and the Contributing Authors.
+ *
+ * This software is distributed under the zlib license.
+ * Please see the accompanying LICENSE file.
+ *
+ * The driver runs the engine over the image files of a corpus, at several
+ * optimization levels, repeating each run, and reports the throughput,
+ * the trial counts, the per-file latency and the size savings.
+ * The results can be saved, and compared against the saved results of
+ * a baseline run, to detect the speed and compression ratio regressions.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined WIN32 || defined _WIN32 || defined __WIN32__ || defined __NT__
+#  define BENCH_OS_WINDOWS
+#  include <windows.h>
+#else
+#  include <dirent.h>
+#endif
+
+#include "optipng.h"
+#include "bitset.h"
+#include "ioutil.h"
+
+
+/*
+ * Default settings.
+ */
+#define BENCH_LEVELS_DEFAULT     "1,2,5"
+#define BENCH_REPEAT_DEFAULT     3
+#define BENCH_TOLERANCE_DEFAULT  5.0
+#define BENCH_DIR_DEFAULT        "optipng-bench.out"
+#define BENCH_LEVEL_SET_MASK     ((1 << (OPNG_OPTIM_LEVEL_MAX + 1)) - 1)
+
+/*
+ * The maximum path length.
+ */
+#ifdef FILENAME_MAX
+#  if FILENAME_MAX > 4096
+#    define BENCH_PATH_MAX FILENAME_MAX
+#  else
+#    define BENCH_PATH_MAX 4096
+#  endif
+#else
+#  define BENCH_PATH_MAX 4096
+#endif
+
+/*
+ * The file extensions accepted when listing a corpus directory.
+ */
+static const char *corpus_extensions[] =
+{
+    ".png", ".apng", ".gif", ".bmp", ".pnm", ".pbm", ".pgm", ".ppm",
+    ".tif", ".tiff", NULL
+};
+
+/*
+ * The benchmark settings.
+ */
+static struct bench_settings_struct
+{
+    opng_bitset_t level_set;
+    int repeat;
+    double tolerance;
+    const char *dir_name;
+    const char *save_name;
+    const char *baseline_name;
+} settings;
+
+/*
+ * The corpus.
+ */
+static struct bench_corpus_struct
+{
+    char **file_names;
+    size_t num_files;
+    size_t max_files;
+} corpus;
+
+/*
+ * The engine statistics record of a single run.
+ */
+struct bench_record
+{
+    int is_ok;
+    double width, height;
+    double in_file_size, out_file_size;
+    unsigned long num_trials;
+};
+
+/*
+ * The results of a level.
+ */
+struct bench_result
+{
+    int level;
+    unsigned long num_files, num_errors;
+    unsigned long num_trials;
+    double pixels, in_bytes, out_bytes;
+    double seconds;
+    double median_ms, p90_ms, p99_ms;
+};
+
+/*
+ * The engine statistics are captured in a temporary file.
+ */
+static FILE *stats_file;
+
+
+/*
+ * Error handling.
+ */
+static void
+error(const char *fmt, ...)
+{
+    va_list arg_ptr;
+
+    fprintf(stderr, "optipng-bench: ");
+    va_start(arg_ptr, fmt);
+    vfprintf(stderr, fmt, arg_ptr);
+    va_end(arg_ptr);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * User interface callbacks.
+ * The engine runs quietly; only its statistics are captured.
+ */
+static void
+bench_printf(const char *fmt, ...)
+{
+    if (fmt == NULL)
+        return;
+}
+
+static void
+bench_print_cntrl(int cntrl_code)
+{
+    if (cntrl_code == 0)
+        return;
+}
+
+static void
+bench_progress(unsigned long current_step, unsigned long total_steps)
+{
+    if (current_step && total_steps)
+        return;
+}
+
+static void
+bench_panic(const char *msg)
+{
+    fprintf(stderr, "\n** INTERNAL ERROR: %s\n", msg);
+    fflush(stderr);
+    exit(70);  /* EX_SOFTWARE */
+}
+
+static void
+bench_stats_printf(const char *fmt, ...)
+{
+    va_list arg_ptr;
+
+    va_start(arg_ptr, fmt);
+    vfprintf(stats_file, fmt, arg_ptr);
+    va_end(arg_ptr);
+}
+
+/*
+ * Adds a file to the corpus.
+ */
+static void
+bench_add_file(const char *dir_name, const char *file_name)
+{
+    char **file_names;
+    char *path;
+    size_t dir_len, len;
+
+    if (corpus.num_files >= corpus.max_files)
+    {
+        corpus.max_files = (corpus.max_files > 0) ? 2 * corpus.max_files : 64;
+        file_names = (char **)
+            realloc(corpus.file_names, corpus.max_files * sizeof(char *));
+        if (file_names == NULL)
+            error("Out of memory");
+        corpus.file_names = file_names;
+    }
+    dir_len = (dir_name != NULL) ? strlen(dir_name) : 0;
+    len = dir_len + 1 + strlen(file_name);
+    if (len >= BENCH_PATH_MAX)
+        error("File name too long: %s", file_name);
+    if ((path = (char *)malloc(len + 1)) == NULL)
+        error("Out of memory");
+    if (dir_name != NULL)
+    {
+        strcpy(path, dir_name);
+        if (dir_len > 0 && dir_name[dir_len - 1] != '/'
+#ifdef BENCH_OS_WINDOWS
+            && dir_name[dir_len - 1] != '\\'
+#endif
+            )
+            strcat(path, "/");
+        strcat(path, file_name);
+    }
+    else
+        strcpy(path, file_name);
+    corpus.file_names[corpus.num_files++] = path;
+}
+
+/*
+ * Checks if a file name has one of the corpus extensions.
+ */
+static int
+bench_is_corpus_file(const char *file_name)
+{
+    const char *ext;
+    size_t i, j;
+
+    if ((ext = strrchr(file_name, '.')) == NULL)
+        return 0;
+    for (i = 0; corpus_extensions[i] != NULL; ++i)
+    {
+        for (j = 0; ext[j] != 0; ++j)
+        {
+            int ch = ext[j];
+            if (ch >= 'A' && ch <= 'Z')
+                ch += 'a' - 'A';
+            if (ch != corpus_extensions[i][j])
+                break;
+        }
+        if (ext[j] == 0 && corpus_extensions[i][j] == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Adds the image files from a directory to the corpus.
+ */
+static void
+bench_add_dir(const char *dir_name)
+{
+#ifdef BENCH_OS_WINDOWS
+
+    WIN32_FIND_DATAA find_data;
+    HANDLE find_handle;
+    char pattern[BENCH_PATH_MAX];
+
+    if (strlen(dir_name) + 3 >= sizeof(pattern))
+        error("Directory name too long: %s", dir_name);
+    strcpy(pattern, dir_name);
+    strcat(pattern, "\\*");
+    find_handle = FindFirstFileA(pattern, &find_data);
+    if (find_handle == INVALID_HANDLE_VALUE)
+        error("Can't open the corpus: %s", dir_name);
+    do
+    {
+        if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+            bench_is_corpus_file(find_data.cFileName))
+            bench_add_file(dir_name, find_data.cFileName);
+    } while (FindNextFileA(find_handle, &find_data));
+    FindClose(find_handle);
+
+#else  /* dirent */
+
+    DIR *dir;
+    struct dirent *entry;
+
+    if ((dir = opendir(dir_name)) == NULL)
+        error("Can't open the corpus: %s", dir_name);
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (bench_is_corpus_file(entry->d_name))
+            bench_add_file(dir_name, entry->d_name);
+    }
+    closedir(dir);
+
+#endif
+}
+
+/*
+ * Compares two file names, for sorting.
+ */
+static int
+bench_compare_names(const void *name1, const void *name2)
+{
+    return strcmp(*(char * const *)name1, *(char * const *)name2);
+}
+
+/*
+ * Compares two numbers, for sorting.
+ */
+static int
+bench_compare_doubles(const void *val1, const void *val2)
+{
+    double d1 = *(const double *)val1;
+    double d2 = *(const double *)val2;
+
+    return (d1 < d2) ? -1 : (d1 > d2) ? 1 : 0;
+}
+
+/*
+ * Returns the nearest-rank percentile of a sorted array.
+ */
+static double
+bench_percentile(const double *sorted_vals, size_t count, int pct)
+{
+    size_t rank;
+
+    if (count == 0)
+        return 0;
+    rank = (count * (size_t)pct + 99) / 100;
+    return sorted_vals[(rank > 0) ? rank - 1 : 0];
+}
+
+/*
+ * Finds a numeric field in an engine statistics record.
+ */
+static double
+bench_get_field(const char *line, const char *key)
+{
+    const char *ptr;
+
+    if ((ptr = strstr(line, key)) == NULL)
+        return 0;
+    return strtod(ptr + strlen(key), NULL);
+}
+
+/*
+ * Reads the engine statistics record of the latest run.
+ * The top-level fields precede the trial array, and are read from the
+ * beginning of the record; the trials are counted as the record is read.
+ */
+static void
+bench_read_record(struct bench_record *record)
+{
+    static char head[BENCH_PATH_MAX + 1024];
+    static const char trial_key[] = "{\"candidate\":";
+    size_t len, match;
+    int ch;
+
+    memset(record, 0, sizeof(*record));
+    if (fseek(stats_file, 0, SEEK_SET) != 0)
+        error("Can't read the engine statistics");
+    len = match = 0;
+    while ((ch = getc(stats_file)) != EOF && ch != '\n')
+    {
+        if (len < sizeof(head) - 1)
+            head[len++] = (char)ch;
+        if (ch == trial_key[match])
+        {
+            if (trial_key[++match] == 0)
+            {
+                ++record->num_trials;
+                match = 0;
+            }
+        }
+        else
+            match = (ch == trial_key[0]) ? 1 : 0;
+    }
+    head[len] = 0;
+    if (fseek(stats_file, 0, SEEK_SET) != 0)
+        error("Can't read the engine statistics");
+
+    record->is_ok = (strstr(head, ",\"status\":\"ok\"") != NULL);
+    record->width = bench_get_field(head, ",\"width\":");
+    record->height = bench_get_field(head, ",\"height\":");
+    record->in_file_size = bench_get_field(head, ",\"in_file_size\":");
+    record->out_file_size = bench_get_field(head, ",\"out_file_size\":");
+}
+
+/*
+ * Removes the output files of a run, so that the next run starts afresh.
+ */
+static void
+bench_remove_output(const char *file_name)
+{
+    char out_name[BENCH_PATH_MAX], png_name[BENCH_PATH_MAX];
+
+    if (opng_path_replace_dir(out_name, sizeof(out_name),
+                              file_name, settings.dir_name) == NULL)
+        return;
+    opng_os_unlink(out_name);
+    if (opng_path_replace_ext(png_name, sizeof(png_name),
+                              out_name, ".png") != NULL)
+        opng_os_unlink(png_name);
+}
+
+/*
+ * Runs the engine over the corpus, at one optimization level.
+ */
+static void
+bench_run_level(struct bench_result *result, int level)
+{
+    struct opng_options options;
+    struct opng_ui ui;
+    struct bench_record record;
+    double *times, *latencies;
+    double start_time;
+    size_t i, num_latencies;
+    int j;
+
+    memset(&options, 0, sizeof(options));
+    options.clobber = 1;
+    options.quiet = 1;
+    options.dir_name = settings.dir_name;
+    options.optim_level = level;
+    options.interlace = -1;
+    ui.printf_fn = bench_printf;
+    ui.print_cntrl_fn = bench_print_cntrl;
+    ui.progress_fn = bench_progress;
+    ui.panic_fn = bench_panic;
+    ui.stats_printf_fn = bench_stats_printf;
+    ui.trace_fn = NULL;
+    if (opng_initialize(&options, &ui) != 0)
+        error("Can't initialize the engine");
+
+    times = (double *)malloc(settings.repeat * sizeof(double));
+    latencies = (double *)malloc(corpus.num_files * sizeof(double));
+    if (times == NULL || latencies == NULL)
+        error("Out of memory");
+
+    memset(result, 0, sizeof(*result));
+    result->level = level;
+    num_latencies = 0;
+    for (i = 0; i < corpus.num_files; ++i)
+    {
+        for (j = 0; j < settings.repeat; ++j)
+        {
+            start_time = opng_os_wall_clock();
+            opng_optimize(corpus.file_names[i]);
+            times[j] = opng_os_wall_clock() - start_time;
+            bench_remove_output(corpus.file_names[i]);
+            bench_read_record(&record);
+            if (!record.is_ok)
+                break;
+        }
+        if (!record.is_ok)
+        {
+            fprintf(stderr, "optipng-bench: -o%d: Can't optimize: %s\n",
+                    level, corpus.file_names[i]);
+            ++result->num_errors;
+            continue;
+        }
+
+        /* The latency of a file is the median of its repeated runs. */
+        qsort(times, (size_t)settings.repeat, sizeof(double),
+              bench_compare_doubles);
+        latencies[num_latencies++] = times[settings.repeat / 2];
+        result->seconds += times[settings.repeat / 2];
+        ++result->num_files;
+        result->num_trials += record.num_trials;
+        result->pixels += record.width * record.height;
+        result->in_bytes += record.in_file_size;
+        result->out_bytes += record.out_file_size;
+    }
+
+    qsort(latencies, num_latencies, sizeof(double), bench_compare_doubles);
+    result->median_ms = 1000 * bench_percentile(latencies, num_latencies, 50);
+    result->p90_ms = 1000 * bench_percentile(latencies, num_latencies, 90);
+    result->p99_ms = 1000 * bench_percentile(latencies, num_latencies, 99);
+
+    free(latencies);
+    free(times);
+    opng_finalize();
+}
+
+/*
+ * Computes the throughput of a level, in millions of units per second.
+ */
+static double
+bench_rate(double amount, double seconds)
+{
+    return (seconds > 0) ? amount / seconds / 1000000 : 0;
+}
+
+/*
+ * Computes the size savings of a level, in percents.
+ */
+static double
+bench_savings(const struct bench_result *result)
+{
+    if (result->in_bytes <= 0)
+        return 0;
+    return 100 * (result->in_bytes - result->out_bytes) / result->in_bytes;
+}
+
+/*
+ * Prints the results.
+ */
+static void
+bench_print_results(const struct bench_result *results, int num_results)
+{
+    const struct bench_result *result;
+    int i;
+
+    printf("%-6s%7s%8s%9s%9s%11s%10s%10s%9s\n",
+           "Level", "Files", "Trials", "MPix/s", "MB/s",
+           "Median ms", "P90 ms", "P99 ms", "Savings");
+    for (i = 0; i < num_results; ++i)
+    {
+        result = &results[i];
+        printf("-o%-4d%7lu%8lu%9.2f%9.2f%11.2f%10.2f%10.2f%8.2f%%\n",
+               result->level, result->num_files, result->num_trials,
+               bench_rate(result->pixels, result->seconds),
+               bench_rate(result->in_bytes, result->seconds),
+               result->median_ms, result->p90_ms, result->p99_ms,
+               bench_savings(result));
+        if (result->num_errors > 0)
+            printf("      (%lu file(s) could not be optimized)\n",
+                   result->num_errors);
+    }
+}
+
+/*
+ * Saves the results, in the baseline format.
+ */
+static void
+bench_save_results(const struct bench_result *results, int num_results)
+{
+    FILE *stream;
+    int i;
+
+    if ((stream = fopen(settings.save_name, "w")) == NULL)
+        error("Can't open the results file: %s", settings.save_name);
+    fprintf(stream,
+            "# optipng-bench: level files pixels in-bytes out-bytes trials"
+            " seconds\n");
+    for (i = 0; i < num_results; ++i)
+    {
+        fprintf(stream, "%d %lu %.0f %.0f %.0f %lu %.6f\n",
+                results[i].level, results[i].num_files,
+                results[i].pixels, results[i].in_bytes, results[i].out_bytes,
+                results[i].num_trials, results[i].seconds);
+    }
+    if (fclose(stream) != 0)
+        error("Can't write the results file: %s", settings.save_name);
+}
+
+/*
+ * Compares the results against the baseline.
+ * The function returns the number of regressions.
+ */
+static int
+bench_compare_results(const struct bench_result *results, int num_results)
+{
+    FILE *stream;
+    struct bench_result base;
+    const struct bench_result *result;
+    char line[256];
+    double speed, base_speed, ratio, base_ratio, speed_change;
+    int i, num_regressions, is_found;
+
+    if ((stream = fopen(settings.baseline_name, "r")) == NULL)
+        error("Can't open the baseline file: %s", settings.baseline_name);
+    printf("\nBaseline: %s (tolerance: %.1f%%)\n",
+           settings.baseline_name, settings.tolerance);
+    num_regressions = 0;
+    for (i = 0; i < num_results; ++i)
+    {
+        result = &results[i];
+        is_found = 0;
+        rewind(stream);
+        while (fgets(line, sizeof(line), stream) != NULL)
+        {
+            memset(&base, 0, sizeof(base));
+            if (line[0] != '#' &&
+                sscanf(line, "%d %lu %lf %lf %lf %lu %lf",
+                       &base.level, &base.num_files,
+                       &base.pixels, &base.in_bytes, &base.out_bytes,
+                       &base.num_trials, &base.seconds) == 7 &&
+                base.level == result->level)
+            {
+                is_found = 1;
+                break;
+            }
+        }
+        if (!is_found)
+        {
+            printf("-o%-4d not in baseline\n", result->level);
+            continue;
+        }
+        if (base.num_files != result->num_files ||
+            base.pixels != result->pixels ||
+            base.in_bytes != result->in_bytes)
+            printf("-o%-4d the corpus differs from the baseline\n",
+                   result->level);
+
+        /* A speed regression is a throughput drop beyond the tolerance. */
+        speed = bench_rate(result->pixels, result->seconds);
+        base_speed = bench_rate(base.pixels, base.seconds);
+        speed_change = (base_speed > 0) ?
+            100 * (speed - base_speed) / base_speed : 0;
+        printf("-o%-4d speed %+8.2f%%  trials %+ld  ", result->level,
+               speed_change,
+               (long)result->num_trials - (long)base.num_trials);
+        if (speed_change < -settings.tolerance)
+        {
+            printf("SPEED REGRESSION\n");
+            ++num_regressions;
+        }
+        else
+            printf("ok\n");
+
+        /* A ratio regression is any growth of the compressed size. */
+        ratio = (result->in_bytes > 0) ?
+            result->out_bytes / result->in_bytes : 0;
+        base_ratio = (base.in_bytes > 0) ?
+            base.out_bytes / base.in_bytes : 0;
+        printf("-o%-4d ratio %8.4f -> %.4f  ", result->level,
+               base_ratio, ratio);
+        if (ratio > base_ratio * (1 + 1e-9))
+        {
+            printf("RATIO REGRESSION\n");
+            ++num_regressions;
+        }
+        else
+            printf("ok\n");
+    }
+    fclose(stream);
+    return num_regressions;
+}
+
+/*
+ * Prints the usage.
+ */
+static void
+bench_usage(void)
+{
+    fprintf(stderr,
+        "Usage: optipng-bench [options] <corpus-dir | files...>\n"
+        "Options:\n"
+        "    -o <levels>\t\toptimization levels (default: %s)\n"
+        "    -repeat <n>\t\trepeat each run n times (default: %d)\n"
+        "    -dir <directory>\twrite the output files to directory\n"
+        "\t\t\t(default: %s)\n"
+        "    -save <file>\tsave the results to file\n"
+        "    -baseline <file>\tcompare the results against a baseline\n"
+        "    -tolerance <pct>\tspeed regression tolerance (default: %.0f)\n",
+        BENCH_LEVELS_DEFAULT, BENCH_REPEAT_DEFAULT, BENCH_DIR_DEFAULT,
+        BENCH_TOLERANCE_DEFAULT);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Parses the command line.
+ */
+static void
+bench_parse_args(int argc, char *argv[])
+{
+    const char *levels;
+    char *end;
+    int i;
+
+    levels = BENCH_LEVELS_DEFAULT;
+    settings.repeat = BENCH_REPEAT_DEFAULT;
+    settings.tolerance = BENCH_TOLERANCE_DEFAULT;
+    settings.dir_name = BENCH_DIR_DEFAULT;
+    for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (i + 1 >= argc)
+            bench_usage();
+        if (strcmp(argv[i], "-o") == 0)
+            levels = argv[++i];
+        else if (strcmp(argv[i], "-repeat") == 0)
+        {
+            settings.repeat = (int)strtol(argv[++i], &end, 10);
+            if (*end != 0 || settings.repeat < 1 || settings.repeat > 1000)
+                error("Invalid repeat count: %s", argv[i]);
+        }
+        else if (strcmp(argv[i], "-dir") == 0)
+            settings.dir_name = argv[++i];
+        else if (strcmp(argv[i], "-save") == 0)
+            settings.save_name = argv[++i];
+        else if (strcmp(argv[i], "-baseline") == 0)
+            settings.baseline_name = argv[++i];
+        else if (strcmp(argv[i], "-tolerance") == 0)
+        {
+            settings.tolerance = strtod(argv[++i], &end);
+            if (*end != 0 || settings.tolerance < 0)
+                error("Invalid tolerance: %s", argv[i]);
+        }
+        else
+            bench_usage();
+    }
+    if (i >= argc)
+        bench_usage();
+    if (opng_strparse_rangeset_to_bitset(&settings.level_set, levels,
+                                         BENCH_LEVEL_SET_MASK) != 0 ||
+        settings.level_set == OPNG_BITSET_EMPTY)
+        error("Invalid optimization levels: %s", levels);
+
+    /* Collect the corpus. */
+    for ( ; i < argc; ++i)
+    {
+        if (opng_os_test(argv[i], "f") == 0)
+            bench_add_file(NULL, argv[i]);
+        else
+            bench_add_dir(argv[i]);
+    }
+    if (corpus.num_files == 0)
+        error("The corpus is empty");
+    qsort(corpus.file_names, corpus.num_files, sizeof(char *),
+          bench_compare_names);
+}
+
+/*
+ * The main function.
+ */
+int
+main(int argc, char *argv[])
+{
+    struct bench_result results[OPNG_OPTIM_LEVEL_MAX + 1];
+    int level, num_results, num_regressions;
+    size_t i;
+
+    bench_parse_args(argc, argv);
+    if ((stats_file = tmpfile()) == NULL)
+        error("Can't create a temporary file");
+
+    printf("Corpus: %lu file(s), %d run(s) per file\n\n",
+           (unsigned long)corpus.num_files, settings.repeat);
+    num_results = 0;
+    for (level = OPNG_OPTIM_LEVEL_MIN; level <= OPNG_OPTIM_LEVEL_MAX; ++level)
+    {
+        if (opng_bitset_test(settings.level_set, level))
+            bench_run_level(&results[num_results++], level);
+    }
+    bench_print_results(results, num_results);
+
+    if (settings.save_name != NULL)
+        bench_save_results(results, num_results);
+    num_regressions = 0;
+    if (settings.baseline_name != NULL)
+        num_regressions = bench_compare_results(results, num_results);
+
+    fclose(stats_file);
+    for (i = 0; i < corpus.num_files; ++i)
+        free(corpus.file_names[i]);
+    free(corpus.file_names);
+    return (num_regressions == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
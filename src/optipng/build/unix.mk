@@ -4,7 +4,7 @@
 #
 # Usage: make -f build/unix.mk
 
-.PHONY: all test check clean distclean install uninstall
+.PHONY: all test check bench clean distclean install uninstall
 .PRECIOUS: Makefile
 .SUFFIXES: .c .o .a
 
@@ -63,6 +63,8 @@ OPTIPNG_OBJS = \
   optipng.o \
   optim.o \
   bitset.o \
+  cache.o \
+  digest.o \
   ioutil.o \
   ratio.o \
   wildargs.o
@@ -93,12 +95,32 @@ OPTIPNG_DEPINCLUDES = \
   -I$(PNGXTERN_DIR)
 
 OPTIPNG_TESTS = \
+  test/apng_test$(EXEEXT) \
   test/bitset_test$(EXEEXT) \
+  test/digest_test$(EXEEXT) \
   test/ratio_test$(EXEEXT)
 OPTIPNG_TESTOBJS = \
+  test/apng_test.o \
   test/bitset_test.o \
+  test/digest_test.o \
   test/ratio_test.o
-OPTIPNG_TESTOUT = *.out.png test/*.out
+OPTIPNG_TESTOUT = *.out.png test/*.png test/*.out
+
+OPTIPNG_BENCH = bench/optipng-bench$(EXEEXT)
+OPTIPNG_BENCHOBJS = \
+  bench/optipng_bench.o \
+  optim.o \
+  bitset.o \
+  cache.o \
+  digest.o \
+  ioutil.o \
+  ratio.o
+KERNEL_BENCH = bench/kernel_bench$(EXEEXT)
+KERNEL_BENCHOBJS = \
+  bench/kernel_bench.o \
+  ioutil.o
+BENCH_CORPUS = img
+BENCH_FLAGS =
 
 all: optipng$(EXEEXT)
 
@@ -109,8 +131,10 @@ optipng$(EXEEXT): $(OPTIPNG_OBJS) $(OPTIPNG_DEPLIBS)
 	$(CC) -c $(CPPFLAGS) $(CFLAGS) $(OPTIPNG_DEPINCLUDES) -o $@ $<
 
 optipng.o: optipng.c optipng.h bitset.h proginfo.h $(OPTIPNG_DEPLIBS)
-optim.o: optim.c optipng.h bitset.h ioutil.h ratio.h $(OPTIPNG_DEPLIBS)
+optim.o: optim.c optipng.h bitset.h cache.h digest.h ioutil.h ratio.h $(OPTIPNG_DEPLIBS)
 bitset.o: bitset.c bitset.h
+cache.o: cache.c cache.h digest.h
+digest.o: digest.c digest.h
 ioutil.o: ioutil.c ioutil.h
 ratio.o: ratio.c ratio.h
 wildargs.o: wildargs.c
@@ -159,26 +183,44 @@ $(TIFF_DIR)/$(TIFF_LIB):
 test: local-test test-gifread test-minitiff
 
 .PHONY: local-test
-local-test: optipng$(EXEEXT) $(OPTIPNG_TESTS)
+local-test: optipng$(EXEEXT) $(OPTIPNG_TESTS) $(KERNEL_BENCH)
 	-@$(RM_F) pngtest.out.png
 	./optipng$(EXEEXT) -o1 -q img/pngtest.png -out=pngtest.out.png
 	-@echo optipng ... ok
+	test/apng_test$(EXEEXT) ./optipng$(EXEEXT) > test/apng_test.out
+	-@echo apng_test ... ok
 	test/bitset_test$(EXEEXT) > test/bitset_test.out
 	-@echo bitset_test ... ok
+	test/digest_test$(EXEEXT) > test/digest_test.out
+	-@echo digest_test ... ok
 	test/ratio_test$(EXEEXT) > test/ratio_test.out
 	-@echo ratio_test ... ok
 
+test/apng_test$(EXEEXT): test/apng_test.o $(OPTIPNG_DEPLIB_ZLIB)
+	$(LD) $(LDFLAGS) -o $@ \
+	  test/apng_test.o $(OPTIPNG_DEPLIB_ZLIB) $(ALL_LIBS)
+
 test/bitset_test$(EXEEXT): test/bitset_test.o bitset.o
 	$(LD) $(LDFLAGS) -o $@ \
 	  test/bitset_test.o bitset.o $(LIBS)
 
+test/digest_test$(EXEEXT): test/digest_test.o digest.o
+	$(LD) $(LDFLAGS) -o $@ \
+	  test/digest_test.o digest.o $(LIBS)
+
 test/ratio_test$(EXEEXT): test/ratio_test.o ratio.o
 	$(LD) $(LDFLAGS) -o $@ \
 	  test/ratio_test.o ratio.o $(LIBS)
 
+test/apng_test.o: test/apng_test.c
+	$(CC) -c -I. $(OPTIPNG_DEPINCLUDE_ZLIB) $(CPPFLAGS) $(CFLAGS) -o $@ $*.c
+
 test/bitset_test.o: test/bitset_test.c bitset.h
 	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) -o $@ $*.c
 
+test/digest_test.o: test/digest_test.c digest.h
+	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) -o $@ $*.c
+
 test/ratio_test.o: test/ratio_test.c ratio.h
 	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) -o $@ $*.c
 
@@ -196,6 +238,25 @@ test-minitiff:
 
 check: test
 
+bench: $(KERNEL_BENCH) $(OPTIPNG_BENCH)
+	./$(KERNEL_BENCH)
+	./$(OPTIPNG_BENCH) $(BENCH_FLAGS) $(BENCH_CORPUS)
+
+$(OPTIPNG_BENCH): $(OPTIPNG_BENCHOBJS) $(OPTIPNG_DEPLIBS)
+	$(LD) $(LDFLAGS) -o $@ \
+	  $(OPTIPNG_BENCHOBJS) $(OPTIPNG_DEPLIBS) $(ALL_LIBS)
+
+bench/optipng_bench.o: bench/optipng_bench.c optipng.h bitset.h ioutil.h
+	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) -o $@ $*.c
+
+$(KERNEL_BENCH): $(KERNEL_BENCHOBJS) $(OPTIPNG_DEPLIBS)
+	$(LD) $(LDFLAGS) -o $@ \
+	  $(KERNEL_BENCHOBJS) $(OPTIPNG_DEPLIBS) $(ALL_LIBS)
+
+bench/kernel_bench.o: bench/kernel_bench.c ioutil.h $(OPTIPNG_DEPLIBS)
+	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) $(OPTIPNG_DEPINCLUDES) \
+	  -I$(GIF_DIR) -o $@ $*.c
+
 clean: \
   local-clean \
   clean-opngreduc \
@@ -207,6 +268,8 @@ clean: \
 local-clean:
 	-$(RM_F) optipng$(EXEEXT) $(OPTIPNG_OBJS)
 	-$(RM_F) $(OPTIPNG_TESTS) $(OPTIPNG_TESTOBJS) $(OPTIPNG_TESTOUT)
+	-$(RM_F) $(OPTIPNG_BENCH) bench/optipng_bench.o
+	-$(RM_F) $(KERNEL_BENCH) bench/kernel_bench.o
 
 .PHONY: clean-opngreduc
 clean-opngreduc:
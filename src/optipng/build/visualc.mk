@@ -49,6 +49,8 @@ OPTIPNG_OBJS = \
   optipng.obj \
   optim.obj \
   bitset.obj \
+  cache.obj \
+  digest.obj \
   ioutil.obj \
   ratio.obj \
   wildargs.obj
@@ -75,12 +77,32 @@ OPTIPNG_DEPINCLUDES = \
   -I$(PNGXTERN_DIR)
 
 OPTIPNG_TESTS = \
+  test\apng_test.exe \
   test\bitset_test.exe \
+  test\digest_test.exe \
   test\ratio_test.exe
 OPTIPNG_TESTOBJS = \
+  test\apng_test.obj \
   test\bitset_test.obj \
+  test\digest_test.obj \
   test\ratio_test.obj
-OPTIPNG_TESTOUT = *.out.png test\*.out
+OPTIPNG_TESTOUT = *.out.png test\*.png test\*.out
+
+OPTIPNG_BENCH = bench\optipng-bench.exe
+OPTIPNG_BENCHOBJS = \
+  bench\optipng_bench.obj \
+  optim.obj \
+  bitset.obj \
+  cache.obj \
+  digest.obj \
+  ioutil.obj \
+  ratio.obj
+KERNEL_BENCH = bench\kernel_bench.exe
+KERNEL_BENCHOBJS = \
+  bench\kernel_bench.obj \
+  ioutil.obj
+BENCH_CORPUS = img
+BENCH_FLAGS =
 
 all: optipng.exe
 
@@ -91,8 +113,10 @@ optipng.exe: $(OPTIPNG_OBJS) $(OPTIPNG_DEPLIBS)
 	$(CC) -c $(CPPFLAGS) $(CFLAGS) $(OPTIPNG_DEPINCLUDES) -Fo$@ $<
 
 optipng.obj: optipng.c optipng.h bitset.h proginfo.h $(OPTIPNG_DEPLIBS)
-optim.obj: optim.c optipng.h bitset.h ioutil.h ratio.h $(OPTIPNG_DEPLIBS)
+optim.obj: optim.c optipng.h bitset.h cache.h digest.h ioutil.h ratio.h $(OPTIPNG_DEPLIBS)
 bitset.obj: bitset.c bitset.h
+cache.obj: cache.c cache.h digest.h
+digest.obj: digest.c digest.h
 ioutil.obj: ioutil.c ioutil.h
 ratio.obj: ratio.c ratio.h
 wildargs.obj: wildargs.c
@@ -140,26 +164,44 @@ $(TIFF_DIR)\$(TIFF_LIB):
 
 test: local-test test-gifread test-minitiff
 
-local-test: optipng.exe $(OPTIPNG_TESTS)
+local-test: optipng.exe $(OPTIPNG_TESTS) $(KERNEL_BENCH)
 	-@$(RM_F) pngtest.out.png
 	.\optipng.exe -o1 -q img\pngtest.png -out=pngtest.out.png
 	-@echo optipng ... ok
+	test\apng_test.exe optipng.exe > test\apng_test.out
+	-@echo apng_test ... ok
 	test\bitset_test.exe > test\bitset_test.out
 	-@echo bitset_test ... ok
+	test\digest_test.exe > test\digest_test.out
+	-@echo digest_test ... ok
 	test\ratio_test.exe > test\ratio_test.out
 	-@echo ratio_test ... ok
 
+test\apng_test.exe: test\apng_test.obj $(OPTIPNG_DEPLIB_ZLIB)
+	$(LD) $(LDFLAGS) -out:$@ \
+	  test\apng_test.obj $(OPTIPNG_DEPLIB_ZLIB) $(ALL_LIBS)
+
 test\bitset_test.exe: test\bitset_test.obj bitset.obj
 	$(LD) $(LDFLAGS) -out:$@ \
 	  test\bitset_test.obj bitset.obj $(LIBS)
 
+test\digest_test.exe: test\digest_test.obj digest.obj
+	$(LD) $(LDFLAGS) -out:$@ \
+	  test\digest_test.obj digest.obj $(LIBS)
+
 test\ratio_test.exe: test\ratio_test.obj ratio.obj
 	$(LD) $(LDFLAGS) -out:$@ \
 	  test\ratio_test.obj ratio.obj $(LIBS)
 
+test\apng_test.obj: test\apng_test.c
+	$(CC) -c -I. $(OPTIPNG_DEPINCLUDE_ZLIB) $(CPPFLAGS) $(CFLAGS) -Fo$@ $*.c
+
 test\bitset_test.obj: test\bitset_test.c bitset.h
 	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) -Fo$@ $*.c
 
+test\digest_test.obj: test\digest_test.c digest.h
+	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) -Fo$@ $*.c
+
 test\ratio_test.obj: test\ratio_test.c ratio.h
 	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) -Fo$@ $*.c
 
@@ -175,6 +217,25 @@ test-minitiff:
 
 check: test
 
+bench: $(KERNEL_BENCH) $(OPTIPNG_BENCH)
+	.\$(KERNEL_BENCH)
+	.\$(OPTIPNG_BENCH) $(BENCH_FLAGS) $(BENCH_CORPUS)
+
+$(OPTIPNG_BENCH): $(OPTIPNG_BENCHOBJS) $(OPTIPNG_DEPLIBS)
+	$(LD) $(LDFLAGS) -out:$@ \
+	  $(OPTIPNG_BENCHOBJS) $(OPTIPNG_DEPLIBS) $(ALL_LIBS)
+
+bench\optipng_bench.obj: bench\optipng_bench.c optipng.h bitset.h ioutil.h
+	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) -Fo$@ $*.c
+
+$(KERNEL_BENCH): $(KERNEL_BENCHOBJS) $(OPTIPNG_DEPLIBS)
+	$(LD) $(LDFLAGS) -out:$@ \
+	  $(KERNEL_BENCHOBJS) $(OPTIPNG_DEPLIBS) $(ALL_LIBS)
+
+bench\kernel_bench.obj: bench\kernel_bench.c ioutil.h $(OPTIPNG_DEPLIBS)
+	$(CC) -c -I. $(CPPFLAGS) $(CFLAGS) $(OPTIPNG_DEPINCLUDES) \
+	  -I$(GIF_DIR) -Fo$@ $*.c
+
 clean: \
   local-clean \
   clean-opngreduc \
@@ -185,6 +246,8 @@ clean: \
 local-clean:
 	-$(RM_F) optipng.exe optipng.exe.manifest $(OPTIPNG_OBJS)
 	-$(RM_F) $(OPTIPNG_TESTS) $(OPTIPNG_TESTOBJS) $(OPTIPNG_TESTOUT)
+	-$(RM_F) $(OPTIPNG_BENCH) $(OPTIPNG_BENCH).manifest bench\optipng_bench.obj
+	-$(RM_F) $(KERNEL_BENCH) $(KERNEL_BENCH).manifest bench\kernel_bench.obj
 
 clean-opngreduc:
 	cd $(OPNGREDUC_DIR)
@@ -0,0 +1,190 @@
+/*
+ * cache.c
+ * Persistent cache of optimization results.
+ *
+ * Copyright (C) 2001-2017 Cosmin Truta and the Contributing Authors.
+ *
+ * This software is distributed under the zlib license.
+ * Please see the accompanying LICENSE file.
+ *
+ * The cache file is a text file, with one record per line:
+ *   <input digest> <output digest> <zc> <zm> <zs> <f> <type> <depth> <WxH>
+ * The image attributes (color type, bit depth, width and height) may be
+ * missing. The lines that begin with '#' are comments.
+ */
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const char *cache_header =
+    "# OptiPNG cache: input-digest output-digest zc zm zs f type depth WxH\n";
+
+/*
+ * Parses a record line.
+ */
+static int
+cache_parse_record(struct opng_cache_record *record, const char *line)
+{
+    char in_hex[OPNG_DIGEST_HEX_SIZE], out_hex[OPNG_DIGEST_HEX_SIZE];
+    int num_fields;
+
+    num_fields = sscanf(line, "%64s %64s %d %d %d %d %d %d %lux%lu",
+                        in_hex, out_hex,
+                        &record->compr_level, &record->mem_level,
+                        &record->strategy, &record->filter,
+                        &record->color_type, &record->bit_depth,
+                        &record->width, &record->height);
+    if (num_fields == 6)
+    {
+        record->color_type = record->bit_depth = -1;
+        record->width = record->height = 0;
+    }
+    else if (num_fields != 10)
+        return -1;
+    if (opng_digest_from_hex(record->in_digest, in_hex) != 0 ||
+        opng_digest_from_hex(record->out_digest, out_hex) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Stores a record in memory.
+ */
+static int
+cache_store_record(struct opng_cache *cache,
+                   const struct opng_cache_record *record)
+{
+    struct opng_cache_record *records;
+    size_t max_records;
+
+    if (cache->num_records >= cache->max_records)
+    {
+        max_records = (cache->max_records > 0) ? 2 * cache->max_records : 64;
+        records = (struct opng_cache_record *)
+            realloc(cache->records, max_records * sizeof(*records));
+        if (records == NULL)
+            return -1;
+        cache->records = records;
+        cache->max_records = max_records;
+    }
+    cache->records[cache->num_records++] = *record;
+    return 0;
+}
+
+/*
+ * Opens the cache file and loads its records.
+ */
+int
+opng_cache_open(struct opng_cache *cache, const char *file_name)
+{
+    struct opng_cache_record record;
+    char line[256];
+    int skip_line;
+
+    memset(cache, 0, sizeof(*cache));
+    if ((cache->stream = fopen(file_name, "a+")) == NULL)
+        return -1;
+    rewind(cache->stream);
+
+    skip_line = 0;
+    while (fgets(line, sizeof(line), cache->stream) != NULL)
+    {
+        /* Skip the remainder of the lines that are too long. */
+        if (skip_line)
+        {
+            skip_line = (strchr(line, '\n') == NULL);
+            continue;
+        }
+        skip_line = (strchr(line, '\n') == NULL);
+        if (line[0] == '#' || cache_parse_record(&record, line) != 0)
+            continue;
+        if (cache_store_record(cache, &record) != 0)
+            break;
+    }
+
+    /* Prepare for appending. */
+    if (ferror(cache->stream) || fseek(cache->stream, 0, SEEK_END) != 0)
+    {
+        opng_cache_close(cache);
+        return -1;
+    }
+    if (ftell(cache->stream) == 0)
+        fputs(cache_header, cache->stream);
+    return 0;
+}
+
+/*
+ * Finds the most recent matching record.
+ */
+const struct opng_cache_record *
+opng_cache_find(const struct opng_cache *cache,
+                const unsigned char digest[OPNG_DIGEST_SIZE], int by_output)
+{
+    const struct opng_cache_record *record;
+    size_t i;
+
+    for (i = cache->num_records; i > 0; --i)
+    {
+        record = &cache->records[i - 1];
+        if (memcmp(by_output ? record->out_digest : record->in_digest,
+                   digest, OPNG_DIGEST_SIZE) == 0)
+            return record;
+    }
+    return NULL;
+}
+
+/*
+ * Adds a record to the cache.
+ */
+int
+opng_cache_add(struct opng_cache *cache,
+               const struct opng_cache_record *record)
+{
+    const struct opng_cache_record *old_record;
+    char in_hex[OPNG_DIGEST_HEX_SIZE], out_hex[OPNG_DIGEST_HEX_SIZE];
+
+    old_record = opng_cache_find(cache, record->in_digest, 0);
+    if (old_record != NULL &&
+        memcmp(old_record->out_digest, record->out_digest,
+               OPNG_DIGEST_SIZE) == 0 &&
+        old_record->compr_level == record->compr_level &&
+        old_record->mem_level == record->mem_level &&
+        old_record->strategy == record->strategy &&
+        old_record->filter == record->filter &&
+        old_record->color_type == record->color_type &&
+        old_record->bit_depth == record->bit_depth &&
+        old_record->width == record->width &&
+        old_record->height == record->height)
+        return 0;
+    if (cache_store_record(cache, record) != 0)
+        return -1;
+
+    /* Write the whole line at once, for the benefit of the concurrent
+     * processes that append to the same cache file.
+     */
+    opng_digest_to_hex(in_hex, record->in_digest);
+    opng_digest_to_hex(out_hex, record->out_digest);
+    fprintf(cache->stream, "%s %s %d %d %d %d %d %d %lux%lu\n",
+            in_hex, out_hex,
+            record->compr_level, record->mem_level,
+            record->strategy, record->filter,
+            record->color_type, record->bit_depth,
+            record->width, record->height);
+    return (fflush(cache->stream) == 0) ? 0 : -1;
+}
+
+/*
+ * Closes the cache file.
+ */
+void
+opng_cache_close(struct opng_cache *cache)
+{
+    if (cache->stream != NULL)
+        fclose(cache->stream);
+    free(cache->records);
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,92 @@
+/*
+ * cache.h
+ * Persistent cache of optimization results.
+ *
+ * Copyright (C) 2001-2017 Cosmin Truta and the Contributing Authors.
+ *
+ * This software is distributed under the zlib license.
+ * Please see the accompanying LICENSE file.
+ */
+
+#ifndef OPNG_CACHE_H_
+#define OPNG_CACHE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "digest.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * The cache record.
+ * The digests identify the input and the output files, the parameters
+ * are the ones that have produced the output, and the image attributes
+ * describe the output image.
+ */
+struct opng_cache_record
+{
+    unsigned char in_digest[OPNG_DIGEST_SIZE];
+    unsigned char out_digest[OPNG_DIGEST_SIZE];
+    int compr_level, mem_level, strategy, filter;  /* -1 if unknown */
+    int color_type, bit_depth;                     /* -1 if unknown */
+    unsigned long width, height;                   /* 0 if unknown */
+};
+
+/*
+ * The cache.
+ * The records are loaded in memory, and the new records are appended to
+ * the cache file as soon as they are added.
+ */
+struct opng_cache
+{
+    struct opng_cache_record *records;
+    size_t num_records;
+    size_t max_records;
+    FILE *stream;
+};
+
+
+/*
+ * Opens the cache file, creating it if necessary, and loads its records.
+ * The lines that are not valid records are ignored.
+ * On success, the function returns 0. On error, it returns -1.
+ */
+int
+opng_cache_open(struct opng_cache *cache, const char *file_name);
+
+/*
+ * Finds the most recent record whose input digest or, if by_output is
+ * non-zero, whose output digest matches the given digest.
+ * If there is no such record, the function returns NULL.
+ */
+const struct opng_cache_record *
+opng_cache_find(const struct opng_cache *cache,
+                const unsigned char digest[OPNG_DIGEST_SIZE], int by_output);
+
+/*
+ * Adds a record to the cache, and appends it to the cache file.
+ * A record that already exists is not added again.
+ * On success, the function returns 0. On error, it returns -1.
+ */
+int
+opng_cache_add(struct opng_cache *cache,
+               const struct opng_cache_record *record);
+
+/*
+ * Closes the cache file and releases the records.
+ */
+void
+opng_cache_close(struct opng_cache *cache);
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+
+#endif  /* OPNG_CACHE_H_ */
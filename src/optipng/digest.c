@@ -0,0 +1,230 @@
+/*
+ * digest.c
+ * SHA-256 message digests.
+ *
+ * Copyright (C) 2001-2017 Cosmin Truta and the Contributing Authors.
+ *
+ * This software is distributed under the zlib license.
+ * Please see the accompanying LICENSE file.
+ *
+ * The algorithm is specified in FIPS PUB 180-4, Secure Hash Standard.
+ */
+
+#include "digest.h"
+
+#include <string.h>
+
+
+/*
+ * The arithmetic is done in unsigned long, which has at least 32 bits.
+ */
+#define U32(x) ((x) & 0xffffffffUL)
+#define ROTR(x, n) U32(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define CH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define BSIG0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define BSIG1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SSIG0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static const unsigned long round_constants[64] =
+{
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+    0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+    0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+    0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+    0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+    0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+    0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+    0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+    0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+    0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+    0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+    0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+    0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+/*
+ * Processes a 64-byte block.
+ */
+static void
+digest_block(unsigned long state[8], const unsigned char *block)
+{
+    unsigned long w[64];
+    unsigned long a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; ++i, block += 4)
+        w[i] = ((unsigned long)block[0] << 24) |
+               ((unsigned long)block[1] << 16) |
+               ((unsigned long)block[2] << 8) |
+               (unsigned long)block[3];
+    for ( ; i < 64; ++i)
+        w[i] = U32(SSIG1(w[i - 2]) + w[i - 7] + SSIG0(w[i - 15]) + w[i - 16]);
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+    for (i = 0; i < 64; ++i)
+    {
+        t1 = U32(h + BSIG1(e) + CH(e, f, g) + round_constants[i] + w[i]);
+        t2 = U32(BSIG0(a) + MAJ(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = U32(d + t1);
+        d = c;
+        c = b;
+        b = a;
+        a = U32(t1 + t2);
+    }
+    state[0] = U32(state[0] + a);
+    state[1] = U32(state[1] + b);
+    state[2] = U32(state[2] + c);
+    state[3] = U32(state[3] + d);
+    state[4] = U32(state[4] + e);
+    state[5] = U32(state[5] + f);
+    state[6] = U32(state[6] + g);
+    state[7] = U32(state[7] + h);
+}
+
+/*
+ * Initializes the digest computation.
+ */
+void
+opng_digest_init(struct opng_digest_ctx *ctx)
+{
+    ctx->state[0] = 0x6a09e667UL;
+    ctx->state[1] = 0xbb67ae85UL;
+    ctx->state[2] = 0x3c6ef372UL;
+    ctx->state[3] = 0xa54ff53aUL;
+    ctx->state[4] = 0x510e527fUL;
+    ctx->state[5] = 0x9b05688cUL;
+    ctx->state[6] = 0x1f83d9abUL;
+    ctx->state[7] = 0x5be0cd19UL;
+    ctx->count_lo = ctx->count_hi = 0;
+}
+
+/*
+ * Adds a block of data to the digest computation.
+ */
+void
+opng_digest_update(struct opng_digest_ctx *ctx,
+                   const void *data, size_t size)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+    size_t used, count;
+
+    used = (size_t)(ctx->count_lo & 63);
+    while (size > 0)
+    {
+        count = 64 - used;
+        if (count > size)
+            count = size;
+        if (used == 0 && count == 64)
+        {
+            /* Process the whole blocks in place. */
+            digest_block(ctx->state, ptr);
+        }
+        else
+        {
+            memcpy(ctx->block + used, ptr, count);
+            if (used + count == 64)
+                digest_block(ctx->state, ctx->block);
+        }
+        ctx->count_lo = U32(ctx->count_lo + count);
+        if (ctx->count_lo < count)
+            ctx->count_hi = U32(ctx->count_hi + 1);
+        used = (used + count) & 63;
+        ptr += count;
+        size -= count;
+    }
+}
+
+/*
+ * Finalizes the digest computation, and stores the digest.
+ */
+void
+opng_digest_final(struct opng_digest_ctx *ctx,
+                  unsigned char digest[OPNG_DIGEST_SIZE])
+{
+    unsigned char trailer[72];
+    unsigned long bits_lo, bits_hi;
+    size_t used, pad_size;
+    int i;
+
+    /* Append the 0x80 marker, the zero padding and the message size,
+     * in bits, as a 64-bit big-endian number.
+     */
+    bits_lo = U32(ctx->count_lo << 3);
+    bits_hi = U32((ctx->count_hi << 3) | (ctx->count_lo >> 29));
+    used = (size_t)(ctx->count_lo & 63);
+    pad_size = (used < 56) ? (56 - used) : (120 - used);
+    memset(trailer, 0, sizeof(trailer));
+    trailer[0] = 0x80;
+    for (i = 0; i < 4; ++i)
+    {
+        trailer[pad_size + i] = (unsigned char)(bits_hi >> (24 - 8 * i));
+        trailer[pad_size + 4 + i] = (unsigned char)(bits_lo >> (24 - 8 * i));
+    }
+    opng_digest_update(ctx, trailer, pad_size + 8);
+
+    for (i = 0; i < OPNG_DIGEST_SIZE; ++i)
+        digest[i] = (unsigned char)(ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+/*
+ * Converts a digest to a hexadecimal string.
+ */
+void
+opng_digest_to_hex(char hex[OPNG_DIGEST_HEX_SIZE],
+                   const unsigned char digest[OPNG_DIGEST_SIZE])
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < OPNG_DIGEST_SIZE; ++i)
+    {
+        hex[2 * i] = hex_digits[digest[i] >> 4];
+        hex[2 * i + 1] = hex_digits[digest[i] & 15];
+    }
+    hex[2 * OPNG_DIGEST_SIZE] = '\0';
+}
+
+/*
+ * Converts a hexadecimal string to a digest.
+ */
+int
+opng_digest_from_hex(unsigned char digest[OPNG_DIGEST_SIZE],
+                     const char *hex)
+{
+    int i, val, nibble;
+
+    val = 0;
+    for (i = 0; i < 2 * OPNG_DIGEST_SIZE; ++i)
+    {
+        if (hex[i] >= '0' && hex[i] <= '9')
+            nibble = hex[i] - '0';
+        else if (hex[i] >= 'a' && hex[i] <= 'f')
+            nibble = hex[i] - 'a' + 10;
+        else if (hex[i] >= 'A' && hex[i] <= 'F')
+            nibble = hex[i] - 'A' + 10;
+        else
+            return -1;
+        if (i % 2 == 0)
+            val = nibble << 4;
+        else
+            digest[i / 2] = (unsigned char)(val | nibble);
+    }
+    return (hex[i] == '\0') ? 0 : -1;
+}
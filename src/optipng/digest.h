@@ -0,0 +1,86 @@
+/*
+ * digest.h
+ * SHA-256 message digests.
+ *
+ * Copyright (C) 2001-2017 Cosmin Truta and the Contributing Authors.
+ *
+ * This software is distributed under the zlib license.
+ * Please see the accompanying LICENSE file.
+ */
+
+#ifndef OPNG_DIGEST_H_
+#define OPNG_DIGEST_H_
+
+#include <stddef.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * The digest size, in bytes.
+ */
+#define OPNG_DIGEST_SIZE 32
+
+/*
+ * The size of a digest written in hexadecimal, including the terminator.
+ */
+#define OPNG_DIGEST_HEX_SIZE (2 * OPNG_DIGEST_SIZE + 1)
+
+
+/*
+ * The digest computation context.
+ */
+struct opng_digest_ctx
+{
+    unsigned long state[8];
+    unsigned long count_lo, count_hi;  /* message size, in bytes */
+    unsigned char block[64];
+};
+
+
+/*
+ * Initializes the digest computation.
+ */
+void
+opng_digest_init(struct opng_digest_ctx *ctx);
+
+/*
+ * Adds a block of data to the digest computation.
+ */
+void
+opng_digest_update(struct opng_digest_ctx *ctx,
+                   const void *data, size_t size);
+
+/*
+ * Finalizes the digest computation, and stores the digest.
+ */
+void
+opng_digest_final(struct opng_digest_ctx *ctx,
+                  unsigned char digest[OPNG_DIGEST_SIZE]);
+
+/*
+ * Converts a digest to a hexadecimal string.
+ */
+void
+opng_digest_to_hex(char hex[OPNG_DIGEST_HEX_SIZE],
+                   const unsigned char digest[OPNG_DIGEST_SIZE]);
+
+/*
+ * Converts a hexadecimal string to a digest.
+ * On success, the function returns 0.
+ * If the string is not a valid digest, it returns -1.
+ */
+int
+opng_digest_from_hex(unsigned char digest[OPNG_DIGEST_SIZE],
+                     const char *hex);
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+
+#endif  /* OPNG_DIGEST_H_ */
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 
 /*
@@ -87,6 +88,25 @@
 #  endif
 #endif
 
+#if defined OPNG_OS_UNIX && \
+    defined _POSIX_MAPPED_FILES && _POSIX_MAPPED_FILES > 0
+#  include <sys/mman.h>
+#  define OPNG_MMAP_SUPPORTED
+#endif
+
+#if defined OPNG_OS_UNIX && \
+    defined _POSIX_TIMERS && _POSIX_TIMERS > 0 && defined CLOCK_MONOTONIC
+#  define OPNG_CLOCK_GETTIME_SUPPORTED
+#elif defined OPNG_OS_UNIX
+#  include <sys/time.h>
+#endif
+
+#if defined __linux__
+#  include <sys/sendfile.h>
+#  include <sys/syscall.h>
+#  define OPNG_SENDFILE_SUPPORTED
+#endif
+
 #if defined OPNG_OS_WINDOWS || \
     defined OPNG_OS_DOSISH || defined OPNG_OS_UNIXISH
 #  include <io.h>
@@ -270,6 +290,74 @@ opng_fwriteo(FILE *stream, opng_foffset_t offset, int whence,
     return result;
 }
 
+/*
+ * Copies a block of data from the specified file offset of a stream
+ * to the current position of another stream.
+ */
+size_t
+opng_fcopyo(FILE *dest_stream, FILE *src_stream, opng_foffset_t offset,
+            size_t blocksize)
+{
+    unsigned char buf[0x1000];
+    size_t result, count;
+
+    if (fflush(dest_stream) != 0)
+        return 0;
+    result = 0;
+
+#if defined OPNG_SENDFILE_SUPPORTED
+
+    /* Let the kernel move the data between the two files.
+     * The source stream is accessed at an explicit offset, therefore
+     * its buffer and its file-position indicator are left untouched.
+     */
+    {
+        int src_fd = fileno(src_stream);
+        int dest_fd = fileno(dest_stream);
+        off_t src_offset;
+        ssize_t ret;
+
+        while (result < blocksize)
+        {
+#if defined SYS_copy_file_range
+            loff_t src_loffset = (loff_t)offset + result;
+            ret = syscall(SYS_copy_file_range, src_fd, &src_loffset,
+                          dest_fd, NULL, blocksize - result, 0);
+            if (ret > 0)
+            {
+                result += (size_t)ret;
+                continue;
+            }
+#endif
+            src_offset = (off_t)offset + result;
+            ret = sendfile(dest_fd, src_fd, &src_offset, blocksize - result);
+            if (ret <= 0)
+                break;
+            result += (size_t)ret;
+        }
+        /* Resynchronize the destination stream with its file descriptor. */
+        if (result > 0 && opng_fseeko(dest_stream, 0, SEEK_CUR) != 0)
+            return 0;
+    }
+
+#endif  /* OPNG_SENDFILE_SUPPORTED */
+
+    /* Copy the rest (or everything, by default) through a buffer. */
+    while (result < blocksize)
+    {
+        count = blocksize - result;
+        if (count > sizeof(buf))
+            count = sizeof(buf);
+        if (opng_freado(src_stream, offset + (opng_foffset_t)result, SEEK_SET,
+                        buf, count) != count)
+            break;
+        if (fwrite(buf, 1, count, dest_stream) != count)
+            break;
+        result += count;
+    }
+    return result;
+}
+
 /*
  * Gets the size of the specified file stream.
  */
@@ -314,6 +402,60 @@ opng_fgetsize(FILE *stream, opng_fsize_t *size)
 #endif
 }
 
+/*
+ * Maps the entire file into memory, for reading.
+ */
+const void *
+opng_fmap(FILE *stream, opng_fsize_t *size)
+{
+#if defined OPNG_MMAP_SUPPORTED
+
+    struct stat sbuf;
+    void *ptr;
+
+    if (fstat(fileno(stream), &sbuf) != 0)
+        return NULL;
+    if (!S_ISREG(sbuf.st_mode) || sbuf.st_size <= 0 ||
+        (opng_fsize_t)(size_t)sbuf.st_size != (opng_fsize_t)sbuf.st_size)
+        return NULL;
+    ptr = mmap(NULL, (size_t)sbuf.st_size, PROT_READ, MAP_PRIVATE,
+               fileno(stream), 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+#ifdef MADV_SEQUENTIAL
+    madvise(ptr, (size_t)sbuf.st_size, MADV_SEQUENTIAL);
+#endif
+    *size = (opng_fsize_t)sbuf.st_size;
+    return ptr;
+
+#else  /* generic */
+
+    (void)stream;
+    (void)size;
+    return NULL;
+
+#endif
+}
+
+/*
+ * Unmaps a file mapped by opng_fmap().
+ */
+int
+opng_funmap(const void *ptr, opng_fsize_t size)
+{
+#if defined OPNG_MMAP_SUPPORTED
+
+    return munmap((void *)ptr, (size_t)size);
+
+#else  /* generic */
+
+    (void)ptr;
+    (void)size;
+    return -1;
+
+#endif
+}
+
 /*
  * Makes a new path name by replacing the directory component of
  * a specified path name.
@@ -805,3 +947,77 @@ opng_os_unlink(const char *path)
 
 #endif
 }
+
+/*
+ * Reads the wall clock.
+ */
+double
+opng_os_wall_clock(void)
+{
+#if defined OPNG_OS_WINDOWS
+
+    LARGE_INTEGER count, frequency;
+
+    if (QueryPerformanceCounter(&count) &&
+        QueryPerformanceFrequency(&frequency))
+        return (double)count.QuadPart / (double)frequency.QuadPart;
+    return (double)GetTickCount() / 1000;
+
+#elif defined OPNG_CLOCK_GETTIME_SUPPORTED
+
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+    return (double)time(NULL);
+
+#elif defined OPNG_OS_UNIX
+
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) == 0)
+        return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+    return (double)time(NULL);
+
+#else  /* generic */
+
+    return (double)time(NULL);
+
+#endif
+}
+
+/*
+ * Reads the processor time of the current process.
+ */
+double
+opng_os_cpu_clock(void)
+{
+#if defined OPNG_OS_WINDOWS
+
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+
+    if (GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time,
+                        &kernel_time, &user_time))
+    {
+        /* The times are given in units of 100 nanoseconds. */
+        return ((double)kernel_time.dwLowDateTime +
+                (double)kernel_time.dwHighDateTime * 4294967296.0 +
+                (double)user_time.dwLowDateTime +
+                (double)user_time.dwHighDateTime * 4294967296.0) / 10000000;
+    }
+    return (double)clock() / CLOCKS_PER_SEC;
+
+#elif defined OPNG_CLOCK_GETTIME_SUPPORTED && defined CLOCK_PROCESS_CPUTIME_ID
+
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0)
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+    return (double)clock() / CLOCKS_PER_SEC;
+
+#else  /* generic */
+
+    return (double)clock() / CLOCKS_PER_SEC;
+
+#endif
+}
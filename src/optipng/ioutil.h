@@ -139,6 +139,18 @@ size_t
 opng_fwriteo(FILE *stream, opng_foffset_t offset, int whence,
              const void *block, size_t blocksize);
 
+/*
+ * Copies a block of data from the specified file offset of the source
+ * stream to the current position of the destination stream, bypassing
+ * the stdio buffers if the system allows it.
+ * The file-position indicator of the source stream is not changed.
+ * On success, the function returns the number of bytes copied.
+ * On error, it returns a smaller number (possibly 0).
+ */
+size_t
+opng_fcopyo(FILE *dest_stream, FILE *src_stream, opng_foffset_t offset,
+            size_t blocksize);
+
 /*
  * Gets the size of the specified file stream.
  * This function may change the file position indicator.
@@ -147,6 +159,23 @@ opng_fwriteo(FILE *stream, opng_foffset_t offset, int whence,
 int
 opng_fgetsize(FILE *stream, opng_fsize_t *size);
 
+/*
+ * Maps the entire contents of the specified file stream into memory,
+ * for reading. The file-position indicator is not changed.
+ * On success, the function returns the mapped block and stores its size.
+ * On error, or if the system does not support memory-mapped files,
+ * it returns NULL.
+ */
+const void *
+opng_fmap(FILE *stream, opng_fsize_t *size);
+
+/*
+ * Unmaps a block returned by opng_fmap().
+ * On success, the function returns 0. On error, it returns -1.
+ */
+int
+opng_funmap(const void *ptr, opng_fsize_t size);
+
 /*
  * Makes a new path name by replacing the directory component of
  * a specified path name.
@@ -245,6 +274,21 @@ opng_os_test_eq(const char *path1, const char *path2);
 int
 opng_os_unlink(const char *path);
 
+/*
+ * Reads the wall clock, preferably a monotonic one.
+ * The function returns the time in seconds, measured from an unspecified
+ * moment in the past.
+ */
+double
+opng_os_wall_clock(void);
+
+/*
+ * Reads the processor time used by the current process.
+ * The function returns the time in seconds.
+ */
+double
+opng_os_cpu_clock(void);
+
 
 #ifdef __cplusplus
 }  /* extern "C" */
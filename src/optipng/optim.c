@@ -9,6 +9,7 @@
  */
 
 #include <limits.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +19,8 @@
 #include "proginfo.h"
 
 #include "bitset.h"
+#include "cache.h"
+#include "digest.h"
 #include "ioutil.h"
 #include "opngreduc.h"
 #include "png.h"
@@ -44,19 +47,53 @@ static const struct opng_preset
     const char *mem_level;
     const char *strategy;
     const char *filter;
+    int candidates;
 } presets[OPNG_OPTIM_LEVEL_MAX + 1] =
 {
-/*  { -zc    -zm    -zs   -f    }  */
-    { "",    "",    "",   ""    },  /* -o0 */
-    { "",    "",    "",   ""    },  /* -o1 */
-    { "9",   "8",   "0-", "0,5" },  /* -o2 */
-    { "9",   "8-9", "0-", "0,5" },  /* -o3 */
-    { "9",   "8",   "0-", "0-"  },  /* -o4 */
-    { "9",   "8-9", "0-", "0-"  },  /* -o5 */
-    { "1-9", "8",   "0-", "0-"  },  /* -o6 */
-    { "1-9", "8-9", "0-", "0-"  }   /* -o7 */
+/*  { -zc    -zm    -zs   -f     images }  */
+    { "",    "",    "",   "",    1 },  /* -o0 */
+    { "",    "",    "",   "",    1 },  /* -o1 */
+    { "9",   "8",   "0-", "0,5", 1 },  /* -o2 */
+    { "9",   "8-9", "0-", "0,5", 2 },  /* -o3 */
+    { "9",   "8",   "0-", "0-",  2 },  /* -o4 */
+    { "9",   "8-9", "0-", "0-",  3 },  /* -o5 */
+    { "1-9", "8",   "0-", "0-",  3 },  /* -o6 */
+    { "1-9", "8-9", "0-", "0-",  3 }   /* -o7 */
 };
 
+/*
+ * The automatic optimization level selection.
+ * The trials are assumed to compress the image data at the throughput
+ * below, and the trials of the selected level must fit in the time below,
+ * unless the time budget is given.
+ */
+#define OPNG_AUTO_THROUGHPUT  (32.0 * 1024 * 1024)  /* bytes per second */
+#define OPNG_AUTO_TIME        2.0                   /* seconds */
+
+/*
+ * The maximum number of image candidates (i.e. the greedily-reduced image,
+ * the unreduced image and the expanded palette image) that undergo trials.
+ */
+#define OPNG_IMAGE_CANDIDATES_MAX 3
+
+/*
+ * The maximum trial rank, in the canonical iteration order
+ * (filter, strategy, decreasing compression level, decreasing memory level).
+ */
+#define OPNG_TRIAL_RANK_MAX \
+    ((OPNG_FILTER_MAX + 1) * (OPNG_STRATEGY_MAX + 1) * 10 * 10 - 1)
+
+/*
+ * The number of rows sampled for the estimation of the filtered data.
+ */
+#define OPNG_FILTER_SAMPLE_ROWS 64
+
+/*
+ * The maximum number of parameter combinations that are tried first,
+ * according to the results recorded in the cache.
+ */
+#define OPNG_WARM_START_MAX 3
+
 /*
  * The filter table.
  */
@@ -86,7 +123,8 @@ enum
     INPUT_HAS_ERRORS            = 0x0100,
     OUTPUT_NEEDS_NEW_FILE       = 0x1000,
     OUTPUT_NEEDS_NEW_IDAT       = 0x2000,
-    OUTPUT_HAS_ERRORS           = 0x4000
+    OUTPUT_HAS_ERRORS           = 0x4000,
+    OUTPUT_HAS_SKIPPED_TRIALS   = 0x8000
 };
 
 /*
@@ -125,9 +163,13 @@ static struct opng_process_struct
     opng_fsize_t in_idat_size, out_idat_size;
     opng_fsize_t best_idat_size, max_idat_size;
     png_uint_32 in_plte_trns_size, out_plte_trns_size;
+    opng_fsize_t in_fdat_size, out_fdat_size;
     png_uint_32 reductions;
     opng_bitset_t compr_level_set, mem_level_set, strategy_set, filter_set;
     int best_compr_level, best_mem_level, best_strategy, best_filter;
+    int best_rank;
+    int auto_level;   /* the optimization level selected under -o auto */
+    double deadline;  /* the end of the time budget, or 0 if unlimited */
 } process;
 
 /*
@@ -136,6 +178,55 @@ static struct opng_process_struct
 static const opng_fsize_t idat_size_max = PNG_UINT_31_MAX;
 static const char *idat_size_max_string = "2GB";
 
+/*
+ * The trial statistics.
+ * The filtered image data is counted as it is fed to the compressor, to
+ * tell how much of it has been skipped by the abandoned trials.
+ */
+static struct opng_trial_stats_struct
+{
+    int num_trials, num_abandoned, num_skipped;
+    opng_fsize_t data_size;      /* the filtered image data of all trials */
+    opng_fsize_t deflated_size;  /* the part of it that has been deflated */
+    opng_fsize_t idat_size;      /* the IDAT data produced by all trials */
+    int crt_pass;                /* the interlace pass of the current row */
+    png_uint_32 crt_pass_rows;   /* the rows remaining in the current pass */
+} trial_stats;
+
+/*
+ * The trial schedule.
+ */
+static struct opng_trial_schedule_struct
+{
+    int params[OPNG_TRIAL_RANK_MAX + 1][4];  /* zc, zm, zs, f */
+    unsigned char is_scheduled[OPNG_TRIAL_RANK_MAX + 1];
+    int count;
+    double estimates[OPNG_FILTER_MAX + 1];   /* 0 if not estimated */
+} trial_schedule;
+
+/*
+ * The statistics of the current file, reported on request.
+ */
+struct opng_trial_record
+{
+    int candidate, frame;
+    int compr_level, mem_level, strategy, filter;
+    double wall_time, cpu_time;
+    opng_fsize_t data_size, deflated_size, idat_size;
+    int is_abandoned;
+};
+
+static struct opng_file_stats_struct
+{
+    int enabled;
+    double wall_time, cpu_time;
+    double decode_time, reduction_time, trials_time, write_time;
+    int crt_candidate, crt_frame;
+    struct opng_trial_record *trials;
+    size_t num_trials, max_trials;
+    int num_skipped_trials;
+} file_stats;
+
 /*
  * The optimization process summary.
  */
@@ -175,6 +266,44 @@ static struct opng_image_struct
     int num_unknowns;
 } image;
 
+/*
+ * The alternative image candidates.
+ * They share the unknown chunks with the optimized image above.
+ */
+static struct opng_image_struct alt_images[OPNG_IMAGE_CANDIDATES_MAX - 1];
+static int num_alt_images;
+
+/*
+ * The APNG frames stored in fdAT.
+ * Their fcTL and fdAT chunks stay among the unknown chunks of the optimized
+ * image, and their rows are stacked below the rows of the optimized image,
+ * in the same memory block.
+ */
+static struct opng_frame_struct
+{
+    png_uint_32 width;             /* fcTL */
+    png_uint_32 height;
+    png_bytepp row_pointers;       /* fdAT */
+    png_bytep data;                /* sequence number slot + zlib stream */
+    png_uint_32 data_size;         /* zlib stream size */
+    png_uint_32 alloc_size;
+    int fdat_index;                /* first fdAT in image.unknowns */
+    int is_modified;               /* changed by the delta minimization */
+} *frames;
+static int num_frames;
+
+/*
+ * The APNG frames of the unreduced image candidate, and their fcTL data.
+ * They are exchanged with the frames above, along with the image candidate.
+ */
+static struct opng_frame_struct *alt_frames;
+static png_bytep alt_fctl_data;
+
+/*
+ * The output buffer of the encoded APNG frames.
+ */
+static struct opng_frame_struct *crt_frame;
+
 /*
  * The user options.
  */
@@ -188,6 +317,9 @@ static void (*usr_printf)(const char *fmt, ...);
 static void (*usr_print_cntrl)(int cntrl_code);
 static void (*usr_progress)(unsigned long num, unsigned long denom);
 static void (*usr_panic)(const char *msg);
+static void (*usr_stats_printf)(const char *fmt, ...);
+static void (*usr_trace)(const char *event, int phase,
+                         double timestamp, unsigned long bytes);
 
 
 /*
@@ -198,6 +330,35 @@ static png_infop read_info_ptr;
 static png_structp write_ptr;
 static png_infop write_info_ptr;
 
+/*
+ * The memory-mapped input file.
+ * The PNG datastream is read from the mapping, without going through
+ * the stdio buffers. The unchanged chunks are validated in the mapping,
+ * and copied from the file by opng_fcopyo().
+ */
+static struct opng_input_map_struct
+{
+    png_const_bytep data;  /* NULL if the input file is not mapped */
+    opng_fsize_t size;
+    opng_fsize_t pos;
+    int at_iend;
+} input_map;
+
+/*
+ * The result cache.
+ * The files are identified by the digests of their contents, prefixed by
+ * the digest of the options that affect the optimization results.
+ */
+static struct opng_result_cache_struct
+{
+    int enabled;
+    struct opng_cache records;
+    unsigned char options_digest[OPNG_DIGEST_SIZE];
+    unsigned char in_digest[OPNG_DIGEST_SIZE];
+    struct opng_cache_record known;  /* the best parameters, if known */
+    int has_known;
+} result_cache;
+
 
 /*
  * Internal debugging tool.
@@ -337,6 +498,16 @@ opng_print_image_info(int show_dim, int show_depth, int show_type,
     }
 }
 
+/*
+ * Trace event emission.
+ */
+static void
+opng_trace(const char *event, int phase, opng_fsize_t bytes)
+{
+    if (usr_trace != NULL)
+        usr_trace(event, phase, opng_os_wall_clock(), (unsigned long)bytes);
+}
+
 /*
  * Warning display.
  */
@@ -357,6 +528,25 @@ opng_print_error(const char *msg)
     usr_printf("Error: %s\n", msg);
 }
 
+/*
+ * JSON string display.
+ */
+static void
+opng_print_json_string(const char *str)
+{
+    usr_stats_printf("\"");
+    for ( ; *str != 0; ++str)
+    {
+        if (*str == '"' || *str == '\\')
+            usr_stats_printf("\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            usr_stats_printf("\\u%04x", (unsigned int)(unsigned char)*str);
+        else
+            usr_stats_printf("%c", *str);
+    }
+    usr_stats_printf("\"");
+}
+
 /*
  * Warning handler.
  */
@@ -376,11 +566,34 @@ opng_warning(png_structp png_ptr, png_const_charp msg)
 static void
 opng_error(png_structp png_ptr, png_const_charp msg)
 {
+    /* The message may be stored in a libpng stack frame, which is about
+     * to be unwound, or in a libpng structure, which may be destroyed
+     * before the message is printed.
+     */
+    static char msg_buf[256];
+
     /* Error in input or output file; processing must stop. */
     /* Recovery requires (re)compression of IDAT. */
     if (png_ptr == read_ptr)
         process.status |= (INPUT_HAS_ERRORS | OUTPUT_NEEDS_NEW_IDAT);
-    Throw msg;
+    strncpy(msg_buf, msg, sizeof(msg_buf) - 1);
+    msg_buf[sizeof(msg_buf) - 1] = 0;
+    Throw msg_buf;
+}
+
+/*
+ * Memory allocator.
+ */
+static void *
+opng_malloc(size_t size)
+{
+    /* This allocator must be compatible with opng_free() below. */
+    void *ptr;
+
+    ptr = malloc(size);
+    if (ptr == NULL)
+        Throw "Out of memory";
+    return ptr;
 }
 
 /*
@@ -534,6 +747,17 @@ opng_init_read_data(void)
      */
 }
 
+/*
+ * Finalization for input handler.
+ */
+static void
+opng_unmap_input_file(void)
+{
+    if (input_map.data != NULL)
+        opng_funmap(input_map.data, input_map.size);
+    memset(&input_map, 0, sizeof(input_map));
+}
+
 /*
  * Initialization for output handler.
  */
@@ -545,6 +769,36 @@ opng_init_write_data(void)
     process.out_idat_size = 0;
 }
 
+/*
+ * APNG frame buffer.
+ */
+static void
+opng_append_frame_data(struct opng_frame_struct *frame,
+                       png_const_bytep data, size_t length)
+{
+    png_bytep new_data;
+    png_uint_32 new_size;
+
+    if (length > PNG_UINT_31_MAX - 4 - frame->data_size)
+        Throw "fdAT sizes larger than the maximum chunk size "
+              "are currently unsupported";
+    new_size = 4 + frame->data_size + (png_uint_32)length;
+    if (frame->data == NULL || new_size > frame->alloc_size)
+    {
+        /* Grow the buffer geometrically. */
+        if (new_size < PNG_UINT_31_MAX / 2)
+            new_size *= 2;
+        new_data = (png_bytep)opng_malloc(new_size);
+        if (frame->data != NULL)
+            memcpy(new_data, frame->data, 4 + frame->data_size);
+        opng_free(frame->data);
+        frame->data = new_data;
+        frame->alloc_size = new_size;
+    }
+    memcpy(frame->data + 4 + frame->data_size, data, length);
+    frame->data_size += (png_uint_32)length;
+}
+
 /*
  * Input handler.
  */
@@ -556,15 +810,27 @@ opng_read_data(png_structp png_ptr, png_bytep data, size_t length)
     int io_state_loc = io_state & PNGX_IO_MASK_LOC;
     png_bytep chunk_sig;
 
-    /* Read the data. */
-    if (fread(data, 1, length, stream) != length)
+    /* Read the data, from the input file mapping if available. */
+    if (input_map.data != NULL)
+    {
+        if (process.in_file_size == 0)  /* first piece of PNG data */
+            input_map.pos = (opng_fsize_t)opng_ftello(stream);
+        if (input_map.pos > input_map.size ||
+            length > input_map.size - input_map.pos)
+            png_error(png_ptr,
+                      "Can't read the input file or unexpected end of file");
+        memcpy(data, input_map.data + input_map.pos, length);
+        input_map.pos += length;
+    }
+    else if (fread(data, 1, length, stream) != length)
         png_error(png_ptr,
                   "Can't read the input file or unexpected end of file");
 
     if (process.in_file_size == 0)  /* first piece of PNG data */
     {
         OPNG_ENSURE(length == 8, "PNG I/O must start with the first 8 bytes");
-        process.in_datastream_offset = opng_ftello(stream) - 8;
+        process.in_datastream_offset = (input_map.data != NULL) ?
+            (opng_foffset_t)input_map.pos - 8 : opng_ftello(stream) - 8;
         process.status |= INPUT_HAS_PNG_DATASTREAM;
         if (io_state_loc == PNGX_IO_SIGNATURE)
             process.status |= INPUT_HAS_PNG_SIGNATURE;
@@ -588,6 +854,7 @@ opng_read_data(png_structp png_ptr, png_bytep data, size_t length)
          */
         OPNG_ENSURE(length == 8, "Reading chunk header, expecting 8 bytes");
         chunk_sig = data + 4;
+        input_map.at_iend = (memcmp(chunk_sig, sig_IEND, 4) == 0);
 
         if (memcmp(chunk_sig, sig_IDAT, 4) == 0)
         {
@@ -628,6 +895,15 @@ opng_read_data(png_structp png_ptr, png_bytep data, size_t length)
     else if (io_state_loc == PNGX_IO_CHUNK_CRC)
     {
         OPNG_ENSURE(length == 4, "Reading chunk CRC, expecting 4 bytes");
+        /* Move the file position past the datastream read from the mapping,
+         * where the trailing data (if any) is looked for.
+         */
+        if (input_map.data != NULL && input_map.at_iend)
+        {
+            if (opng_fseeko(stream, (opng_foffset_t)input_map.pos,
+                            SEEK_SET) != 0)
+                png_error(png_ptr, "Can't reposition the input file");
+        }
     }
 }
 
@@ -684,9 +960,16 @@ opng_write_data(png_structp png_ptr, png_bytep data, size_t length)
         OPNG_ENSURE(length == 4, "Writing chunk CRC, expecting 4 bytes");
     }
 
-    /* Exit early if this is only a trial. */
+    /* Exit early if this is only a trial.
+     * The IDAT data of an APNG frame is collected in its fdAT buffer.
+     */
     if (stream == NULL)
+    {
+        if (crt_frame != NULL && crt_chunk_is_idat &&
+            io_state_loc == PNGX_IO_CHUNK_DATA)
+            opng_append_frame_data(crt_frame, data, length);
         return;
+    }
 
     /* Continue only if the current chunk type is allowed. */
     if (io_state_loc != PNGX_IO_SIGNATURE && !allow_crt_chunk)
@@ -784,125 +1067,235 @@ static void
 opng_clear_image_info(void)
 {
     memset(&image, 0, sizeof(image));
+    memset(alt_images, 0, sizeof(alt_images));
+    num_alt_images = 0;
 }
 
 /*
  * Image info transfer.
  */
 static void
-opng_load_image_info(png_structp png_ptr, png_infop info_ptr, int load_meta)
+opng_load_image_info(png_structp png_ptr, png_infop info_ptr,
+                     struct opng_image_struct *img, int load_meta)
 {
-    memset(&image, 0, sizeof(image));
+    memset(img, 0, sizeof(*img));
 
     png_get_IHDR(png_ptr, info_ptr,
-                 &image.width, &image.height, &image.bit_depth,
-                 &image.color_type, &image.interlace_type,
-                 &image.compression_type, &image.filter_type);
-    image.row_pointers = png_get_rows(png_ptr, info_ptr);
-    png_get_PLTE(png_ptr, info_ptr, &image.palette, &image.num_palette);
+                 &img->width, &img->height, &img->bit_depth,
+                 &img->color_type, &img->interlace_type,
+                 &img->compression_type, &img->filter_type);
+    img->row_pointers = png_get_rows(png_ptr, info_ptr);
+    png_get_PLTE(png_ptr, info_ptr, &img->palette, &img->num_palette);
     /* Transparency is not considered metadata, although tRNS is ancillary.
      * See the comment in opng_is_image_chunk() above.
      */
     if (png_get_tRNS(png_ptr, info_ptr,
-                     &image.trans_alpha,
-                     &image.num_trans, &image.trans_color_ptr))
+                     &img->trans_alpha,
+                     &img->num_trans, &img->trans_color_ptr))
     {
         /* Double copying (pointer + value) is necessary here
          * due to an inconsistency in the libpng design.
          */
-        if (image.trans_color_ptr != NULL)
+        if (img->trans_color_ptr != NULL)
         {
-            image.trans_color = *image.trans_color_ptr;
-            image.trans_color_ptr = &image.trans_color;
+            img->trans_color = *img->trans_color_ptr;
+            img->trans_color_ptr = &img->trans_color;
         }
     }
 
     if (!load_meta)
         return;
 
-    if (png_get_bKGD(png_ptr, info_ptr, &image.background_ptr))
+    if (png_get_bKGD(png_ptr, info_ptr, &img->background_ptr))
     {
         /* Same problem as in tRNS. */
-        image.background = *image.background_ptr;
-        image.background_ptr = &image.background;
+        img->background = *img->background_ptr;
+        img->background_ptr = &img->background;
     }
-    png_get_hIST(png_ptr, info_ptr, &image.hist);
-    if (png_get_sBIT(png_ptr, info_ptr, &image.sig_bit_ptr))
+    png_get_hIST(png_ptr, info_ptr, &img->hist);
+    if (png_get_sBIT(png_ptr, info_ptr, &img->sig_bit_ptr))
     {
         /* Same problem as in tRNS. */
-        image.sig_bit = *image.sig_bit_ptr;
-        image.sig_bit_ptr = &image.sig_bit;
+        img->sig_bit = *img->sig_bit_ptr;
+        img->sig_bit_ptr = &img->sig_bit;
     }
-    image.num_unknowns =
-        png_get_unknown_chunks(png_ptr, info_ptr, &image.unknowns);
+    img->num_unknowns =
+        png_get_unknown_chunks(png_ptr, info_ptr, &img->unknowns);
 }
 
 /*
  * Image info transfer.
  */
 static void
-opng_store_image_info(png_structp png_ptr, png_infop info_ptr, int store_meta)
+opng_store_image_info(png_structp png_ptr, png_infop info_ptr,
+                      const struct opng_image_struct *img, int store_meta)
 {
     int i;
 
-    OPNG_ENSURE(image.row_pointers != NULL, "No info in image");
+    OPNG_ENSURE(img->row_pointers != NULL, "No info in image");
 
     png_set_IHDR(png_ptr, info_ptr,
-                 image.width, image.height, image.bit_depth,
-                 image.color_type, image.interlace_type,
-                 image.compression_type, image.filter_type);
-    png_set_rows(write_ptr, write_info_ptr, image.row_pointers);
-    if (image.palette != NULL)
-        png_set_PLTE(png_ptr, info_ptr, image.palette, image.num_palette);
+                 img->width, img->height, img->bit_depth,
+                 img->color_type, img->interlace_type,
+                 img->compression_type, img->filter_type);
+    png_set_rows(png_ptr, info_ptr, img->row_pointers);
+    if (img->palette != NULL)
+        png_set_PLTE(png_ptr, info_ptr, img->palette, img->num_palette);
     /* Transparency is not considered metadata, although tRNS is ancillary.
      * See the comment in opng_is_image_chunk() above.
      */
-    if (image.trans_alpha != NULL || image.trans_color_ptr != NULL)
+    if (img->trans_alpha != NULL || img->trans_color_ptr != NULL)
         png_set_tRNS(png_ptr, info_ptr,
-                     image.trans_alpha,
-                     image.num_trans, image.trans_color_ptr);
+                     img->trans_alpha,
+                     img->num_trans, img->trans_color_ptr);
 
     if (!store_meta)
         return;
 
-    if (image.background_ptr != NULL)
-        png_set_bKGD(png_ptr, info_ptr, image.background_ptr);
-    if (image.hist != NULL)
-        png_set_hIST(png_ptr, info_ptr, image.hist);
-    if (image.sig_bit_ptr != NULL)
-        png_set_sBIT(png_ptr, info_ptr, image.sig_bit_ptr);
-    if (image.num_unknowns != 0)
+    if (img->background_ptr != NULL)
+        png_set_bKGD(png_ptr, info_ptr, img->background_ptr);
+    if (img->hist != NULL)
+        png_set_hIST(png_ptr, info_ptr, img->hist);
+    if (img->sig_bit_ptr != NULL)
+        png_set_sBIT(png_ptr, info_ptr, img->sig_bit_ptr);
+    if (img->num_unknowns != 0)
     {
         png_set_unknown_chunks(png_ptr, info_ptr,
-                               image.unknowns, image.num_unknowns);
+                               img->unknowns, img->num_unknowns);
         /* This should be handled by libpng. */
-        for (i = 0; i < image.num_unknowns; ++i)
+        for (i = 0; i < img->num_unknowns; ++i)
             png_set_unknown_chunk_location(png_ptr, info_ptr,
-                                           i, image.unknowns[i].location);
+                                           i, img->unknowns[i].location);
     }
 }
 
 /*
- * Image info destruction.
+ * Image info duplication.
+ * The unknown chunks are not duplicated; they stay with the source.
  */
 static void
-opng_destroy_image_info(void)
+opng_copy_image_info(struct opng_image_struct *dest,
+                     const struct opng_image_struct *src)
 {
+    static const int type_channels[8] = {1, 0, 3, 1, 2, 0, 4, 0};
+    pngx_alloc_size_t row_size, index_size, row_stride, block_size;
     png_uint_32 i;
+
+    OPNG_ENSURE(src->row_pointers != NULL, "No info in image");
+
+    /* Copy the values, and clear the pointers that must not be shared. */
+    *dest = *src;
+    dest->row_pointers = NULL;
+    dest->palette = NULL;
+    dest->trans_alpha = NULL;
+    dest->hist = NULL;
+    dest->unknowns = NULL;
+    dest->num_unknowns = 0;
+    if (src->background_ptr != NULL)
+        dest->background_ptr = &dest->background;
+    if (src->sig_bit_ptr != NULL)
+        dest->sig_bit_ptr = &dest->sig_bit;
+    if (src->trans_color_ptr != NULL)
+        dest->trans_color_ptr = &dest->trans_color;
+
+    /* Copy the rows into a single block, which starts with the row index,
+     * as in pngx_malloc_rows().
+     */
+    row_size = ((pngx_alloc_size_t)src->width *
+                type_channels[src->color_type & 7] * src->bit_depth + 7) / 8;
+    block_size = pngx_get_rows_layout(src->height, row_size,
+                                      &index_size, &row_stride);
+    if (block_size == 0 || (size_t)block_size != block_size)
+        Throw "Out of memory";
+    dest->row_pointers = (png_bytepp)opng_malloc((size_t)block_size);
+    pngx_advise_huge_pages(dest->row_pointers, block_size);
+    for (i = 0; i < src->height; ++i)
+    {
+        dest->row_pointers[i] =
+            (png_bytep)dest->row_pointers + index_size + row_stride * i;
+        memcpy(dest->row_pointers[i], src->row_pointers[i],
+               (size_t)row_size);
+    }
+
+    /* Copy the palette, the transparency and the histogram. */
+    if (src->palette != NULL && src->num_palette > 0)
+    {
+        dest->palette = (png_colorp)
+            opng_malloc(src->num_palette * sizeof(png_color));
+        memcpy(dest->palette, src->palette,
+               src->num_palette * sizeof(png_color));
+        if (src->hist != NULL)
+        {
+            dest->hist = (png_uint_16p)
+                opng_malloc(src->num_palette * sizeof(png_uint_16));
+            memcpy(dest->hist, src->hist,
+                   src->num_palette * sizeof(png_uint_16));
+        }
+    }
+    if (src->trans_alpha != NULL && src->num_trans > 0)
+    {
+        dest->trans_alpha = (png_bytep)opng_malloc((size_t)src->num_trans);
+        memcpy(dest->trans_alpha, src->trans_alpha, (size_t)src->num_trans);
+    }
+}
+
+/*
+ * Image info exchange.
+ * The unknown chunks are not exchanged; they stay in place.
+ */
+static void
+opng_swap_image_info(struct opng_image_struct *img1,
+                     struct opng_image_struct *img2)
+{
+    struct opng_image_struct tmp;
+    struct opng_image_struct *imgs[2];
+    int i;
+
+    tmp = *img1;
+    *img1 = *img2;
+    *img2 = tmp;
+
+    tmp.unknowns = img1->unknowns;
+    tmp.num_unknowns = img1->num_unknowns;
+    img1->unknowns = img2->unknowns;
+    img1->num_unknowns = img2->num_unknowns;
+    img2->unknowns = tmp.unknowns;
+    img2->num_unknowns = tmp.num_unknowns;
+
+    /* Fix the pointers that point inside the structures. */
+    imgs[0] = img1;
+    imgs[1] = img2;
+    for (i = 0; i < 2; ++i)
+    {
+        if (imgs[i]->background_ptr != NULL)
+            imgs[i]->background_ptr = &imgs[i]->background;
+        if (imgs[i]->sig_bit_ptr != NULL)
+            imgs[i]->sig_bit_ptr = &imgs[i]->sig_bit;
+        if (imgs[i]->trans_color_ptr != NULL)
+            imgs[i]->trans_color_ptr = &imgs[i]->trans_color;
+    }
+}
+
+/*
+ * Image info destruction.
+ */
+static void
+opng_free_image_info(struct opng_image_struct *img)
+{
     int j;
 
-    if (image.row_pointers == NULL)
+    if (img->row_pointers == NULL)
         return;  /* nothing to clean up */
 
-    for (i = 0; i < image.height; ++i)
-        opng_free(image.row_pointers[i]);
-    opng_free(image.row_pointers);
-    opng_free(image.palette);
-    opng_free(image.trans_alpha);
-    opng_free(image.hist);
-    for (j = 0; j < image.num_unknowns; ++j)
-        opng_free(image.unknowns[j].data);
-    opng_free(image.unknowns);
+    /* The rows are in the same memory block as the row index. */
+    if (!pngx_unmap_rows(img->row_pointers))
+        opng_free(img->row_pointers);
+    opng_free(img->palette);
+    opng_free(img->trans_alpha);
+    opng_free(img->hist);
+    for (j = 0; j < img->num_unknowns; ++j)
+        opng_free(img->unknowns[j].data);
+    opng_free(img->unknowns);
     /* DO NOT deallocate background_ptr, sig_bit_ptr, trans_color_ptr.
      * See the comments regarding double copying inside opng_load_image_info().
      */
@@ -910,104 +1303,1542 @@ opng_destroy_image_info(void)
     /* Clear the space here and do not worry about double-deallocation issues
      * that might arise later on.
      */
-    memset(&image, 0, sizeof(image));
+    memset(img, 0, sizeof(*img));
 }
 
 /*
- * Image file reading.
+ * APNG frame destruction of the unreduced image candidate.
  */
 static void
-opng_read_file(FILE *infile)
+opng_free_alt_apng_frames(void)
 {
-    const char *fmt_name;
-    int num_img;
-    png_uint_32 reductions;
+    int i;
+
+    if (alt_frames == NULL)
+        return;
+    for (i = 0; i < num_frames; ++i)
+        opng_free(alt_frames[i].data);
+    opng_free(alt_frames);
+    opng_free(alt_fctl_data);
+    alt_frames = NULL;
+    alt_fctl_data = NULL;
+}
+
+/*
+ * APNG frame destruction.
+ * The frame rows are in the same memory block as the optimized image rows.
+ */
+static void
+opng_free_apng_frames(void)
+{
+    int i;
+
+    opng_free_alt_apng_frames();
+    for (i = 0; i < num_frames; ++i)
+        opng_free(frames[i].data);
+    opng_free(frames);
+    frames = NULL;
+    num_frames = 0;
+}
+
+/*
+ * Image info destruction.
+ */
+static void
+opng_destroy_image_info(void)
+{
+    int i;
+
+    opng_free_apng_frames();
+    for (i = 0; i < num_alt_images; ++i)
+        opng_free_image_info(&alt_images[i]);
+    num_alt_images = 0;
+    opng_free_image_info(&image);
+}
+
+/*
+ * Image candidate reduction.
+ * The image data is transferred to a temporary libpng structure,
+ * where it is reduced, and then it is transferred back.
+ */
+static png_uint_32
+opng_reduce_image_candidate(struct opng_image_struct *img,
+                            png_uint_32 reductions)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_uint_32 result;
     const char * volatile err_msg;  /* volatile is required by cexcept */
 
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                     NULL, opng_error, opng_warning);
+    if (png_ptr == NULL)
+        Throw "Out of memory";
+    info_ptr = png_create_info_struct(png_ptr);
+    result = OPNG_REDUCE_NONE;
     Try
     {
-        read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-                                          NULL, opng_error, opng_warning);
-        read_info_ptr = png_create_info_struct(read_ptr);
-        if (read_info_ptr == NULL)
+        if (info_ptr == NULL)
             Throw "Out of memory";
+        opng_store_image_info(png_ptr, info_ptr, img, 1);
+        result = opng_reduce_image(png_ptr, info_ptr, reductions);
 
-        /* Override the default libpng settings. */
-        png_set_keep_unknown_chunks(read_ptr,
-                                    PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
-        png_set_user_limits(read_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
-
-        /* Read the input image file. */
-        opng_init_read_data();
-        pngx_set_read_fn(read_ptr, infile, opng_read_data);
-        fmt_name = NULL;
-        num_img = pngx_read_image(read_ptr, read_info_ptr, &fmt_name, NULL);
-        if (num_img <= 0)
-            Throw "Unrecognized image file format";
-        if (num_img > 1)
-            process.status |= INPUT_HAS_MULTIPLE_IMAGES;
-        if ((process.status & INPUT_IS_PNG_FILE) &&
-            (process.status & INPUT_HAS_MULTIPLE_IMAGES))
-        {
-            /* pngxtern can't distinguish between APNG and proper PNG. */
-            fmt_name = (process.status & INPUT_HAS_PNG_SIGNATURE) ?
-                       "APNG" : "APNG datastream";
-        }
-        OPNG_ENSURE(fmt_name != NULL, "No format name from pngxtern");
-
-        if (process.in_file_size == 0)
-        {
-            if (opng_fgetsize(infile, &process.in_file_size) < 0)
-            {
-                opng_print_warning("Can't get the correct file size");
-                process.in_file_size = 0;
-            }
-        }
+        /* PLTE, tRNS and hIST have been copied by libpng.
+         * Release the old copies and take over the new ones.
+         */
+        opng_free(img->palette);
+        opng_free(img->trans_alpha);
+        opng_free(img->hist);
+        img->palette = NULL;
+        img->trans_alpha = NULL;
+        img->hist = NULL;
+        png_data_freer(png_ptr, info_ptr,
+                       PNG_USER_WILL_FREE_DATA, PNG_FREE_ALL);
+        opng_load_image_info(png_ptr, info_ptr, img, 1);
 
         err_msg = NULL;  /* everything is ok */
     }
     Catch (err_msg)
     {
-        /* If the critical info has been loaded, treat all errors as warnings.
-         * This enables a more advanced data recovery.
-         */
-        if (opng_validate_image(read_ptr, read_info_ptr))
-        {
-            png_warning(read_ptr, err_msg);
-            err_msg = NULL;
-        }
     }
 
-    Try
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+    if (err_msg != NULL)
+        Throw err_msg;
+    return result;
+}
+
+/*
+ * Image candidate initialization.
+ * The first alternative image is the unreduced copy of the input image,
+ * which must have been saved before the reduction of the optimized image.
+ */
+static void
+opng_init_image_candidates(png_uint_32 reductions, int max_candidates)
+{
+    struct opng_image_struct *orig_img;
+
+    if (num_alt_images == 0)
+        return;
+    orig_img = &alt_images[0];
+
+    /* An image whose reduction required repairs can't be used unreduced. */
+    if ((process.reductions & OPNG_REDUCE_REPAIR) ||
+        (process.status & INPUT_HAS_ERRORS))
     {
-        if (err_msg != NULL)
-            Throw err_msg;
+        opng_free_alt_apng_frames();
+        opng_free_image_info(orig_img);
+        num_alt_images = 0;
+        return;
+    }
 
-        /* Display format and image information. */
-        if (strcmp(fmt_name, "PNG") != 0)
-        {
-            usr_printf("Importing %s", fmt_name);
-            if (process.status & INPUT_HAS_MULTIPLE_IMAGES)
-            {
-                if (!(process.status & INPUT_IS_PNG_FILE))
-                    usr_printf(" (multi-image or animation)");
-                if (options.snip)
-                    usr_printf("; snipping...");
-            }
-            usr_printf("\n");
-        }
-        opng_load_image_info(read_ptr, read_info_ptr, 1);
-        opng_print_image_info(1, 1, 1, 1);
-        usr_printf("\n");
+    /* The unreduced image must also have its transparent pixels cleaned,
+     * unless it's an APNG image, whose frames are kept as they are.
+     */
+    if ((reductions & OPNG_REDUCE_TRANSPARENT_COLOR) && num_frames == 0)
+        opng_reduce_image_candidate(orig_img,
+                                    reductions &
+                                    (OPNG_REDUCE_TRANSPARENT_COLOR |
+                                     OPNG_REDUCE_TRANSPARENT_FILTER_MASK));
+
+    /* Add the expanded palette image, reduced from RGB(A) if possible. */
+    if ((reductions & OPNG_REDUCE_PALETTE_TO_RGB) &&
+        orig_img->color_type == PNG_COLOR_TYPE_PALETTE &&
+        max_candidates >= num_alt_images + 2)
+    {
+        opng_copy_image_info(&alt_images[num_alt_images], orig_img);
+        ++num_alt_images;
+        opng_reduce_image_candidate(&alt_images[num_alt_images - 1],
+                                    OPNG_REDUCE_PALETTE_TO_RGB |
+                                    (reductions &
+                                     (OPNG_REDUCE_BIT_DEPTH |
+                                      OPNG_REDUCE_RGB_TO_GRAY |
+                                      OPNG_REDUCE_STRIP_ALPHA |
+                                      OPNG_REDUCE_TRANSPARENT_COLOR |
+                                      OPNG_REDUCE_TRANSPARENT_FILTER_MASK)));
+    }
 
-        /* Choose the applicable image reductions. */
-        reductions = OPNG_REDUCE_ALL & ~OPNG_REDUCE_METADATA;
-        if (options.nb)
-            reductions &= ~OPNG_REDUCE_BIT_DEPTH;
-        if (options.nc)
-            reductions &= ~OPNG_REDUCE_COLOR_TYPE;
+    /* The unreduced image is identical to the optimized image
+     * if no reduction (other than the transparent color cleaning) was done.
+     */
+    if ((process.reductions & ~OPNG_REDUCE_TRANSPARENT_COLOR) ==
+        OPNG_REDUCE_NONE)
+    {
+        opng_free_alt_apng_frames();
+        opng_free_image_info(orig_img);
+        --num_alt_images;
+        if (num_alt_images > 0)
+            opng_swap_image_info(orig_img, &alt_images[num_alt_images]);
+    }
+}
+
+/*
+ * Image candidate size (PLTE + tRNS, with the chunk overhead).
+ */
+static png_uint_32
+opng_get_plte_trns_size(const struct opng_image_struct *img)
+{
+    png_uint_32 size;
+
+    size = 0;
+    if (img->palette != NULL)
+        size += 3 * img->num_palette + 12;
+    if (img->trans_alpha != NULL || img->trans_color_ptr != NULL)
+    {
+        if (img->color_type == PNG_COLOR_TYPE_PALETTE)
+            size += img->num_trans + 12;
+        else if (img->color_type == PNG_COLOR_TYPE_RGB)
+            size += 6 + 12;
+        else if (img->color_type == PNG_COLOR_TYPE_GRAY)
+            size += 2 + 12;
+    }
+    return size;
+}
+
+/*
+ * Optimization preset selection.
+ */
+static int
+opng_get_preset_index(void)
+{
+    /* Get the preset index from options.optim_level, but leave the latter
+     * intact, because the effect of "optipng -o2 -z... -f..." is slightly
+     * different from the effect of "optipng -z... -f..." (without "-o").
+     */
+    if (options.optim_level == OPNG_OPTIM_LEVEL_AUTO)
+        return process.auto_level;
+    if (options.optim_level < 0)
+        return OPNG_OPTIM_LEVEL_DEFAULT;
+    else if (options.optim_level > OPNG_OPTIM_LEVEL_MAX)
+        return OPNG_OPTIM_LEVEL_MAX;
+    return options.optim_level;
+}
+
+/*
+ * Iteration initialization.
+ */
+static void
+opng_init_iteration(opng_bitset_t cmdline_set, opng_bitset_t mask_set,
+                    const char *preset, opng_bitset_t *output_set)
+{
+    opng_bitset_t preset_set;
+    int check;
+
+    *output_set = cmdline_set & mask_set;
+    if (*output_set == 0 && cmdline_set != 0)
+        Throw "Iteration parameter(s) out of range";
+    if (*output_set == 0 || options.optim_level >= 0 ||
+        options.optim_level == OPNG_OPTIM_LEVEL_AUTO)
+    {
+        check =
+            opng_strparse_rangeset_to_bitset(&preset_set, preset, mask_set);
+        OPNG_ENSURE(check == 0, "[internal] Invalid preset");
+        *output_set |= preset_set & mask_set;
+    }
+}
+
+/*
+ * Iteration sets initialization.
+ * Combines the user-defined values with the given optimization preset,
+ * and replaces the empty sets with the libpng's "best guess" heuristics.
+ */
+static void
+opng_get_iteration_sets(int preset_index,
+                        opng_bitset_t *compr_level_set,
+                        opng_bitset_t *mem_level_set,
+                        opng_bitset_t *strategy_set,
+                        opng_bitset_t *filter_set)
+{
+    opng_init_iteration(options.compr_level_set, OPNG_COMPR_LEVEL_SET_MASK,
+                        presets[preset_index].compr_level, compr_level_set);
+    opng_init_iteration(options.mem_level_set, OPNG_MEM_LEVEL_SET_MASK,
+                        presets[preset_index].mem_level, mem_level_set);
+    opng_init_iteration(options.strategy_set, OPNG_STRATEGY_SET_MASK,
+                        presets[preset_index].strategy, strategy_set);
+    opng_init_iteration(options.filter_set, OPNG_FILTER_SET_MASK,
+                        presets[preset_index].filter, filter_set);
+
+    if (*compr_level_set == 0)
+        opng_bitset_set(compr_level_set, Z_BEST_COMPRESSION);  /* -zc9 */
+    if (*mem_level_set == 0)
+        opng_bitset_set(mem_level_set, 8);
+    if (image.bit_depth < 8 || image.palette != NULL)
+    {
+        if (*strategy_set == 0)
+            opng_bitset_set(strategy_set, Z_DEFAULT_STRATEGY);  /* -zs0 */
+        if (*filter_set == 0)
+            opng_bitset_set(filter_set, 0);  /* -f0 */
+    }
+    else
+    {
+        if (*strategy_set == 0)
+            opng_bitset_set(strategy_set, Z_FILTERED);  /* -zs1 */
+        if (*filter_set == 0)
+            opng_bitset_set(filter_set, 5);  /* -f0 */
+    }
+}
+
+/*
+ * Iteration count.
+ * The Huffman-only and the RLE strategies are tried at a single compression
+ * level; see opng_iterate().
+ */
+static int
+opng_count_iterations(opng_bitset_t compr_level_set,
+                      opng_bitset_t mem_level_set,
+                      opng_bitset_t strategy_set,
+                      opng_bitset_t filter_set)
+{
+    opng_bitset_t strategy_singles_set;
+    int t1, t2;
+
+    strategy_singles_set = (1 << Z_HUFFMAN_ONLY) | (1 << Z_RLE);
+    t1 = opng_bitset_count(compr_level_set) *
+         opng_bitset_count(strategy_set & ~strategy_singles_set);
+    t2 = opng_bitset_count(strategy_set & strategy_singles_set);
+    return (t1 + t2) *
+           opng_bitset_count(mem_level_set) *
+           opng_bitset_count(filter_set);
+}
+
+/*
+ * Automatic optimization level selection.
+ * The cost of each level is estimated as the amount of image data fed to
+ * the compressor by its trials, on all the image candidates, regardless of
+ * the trials that may be abandoned early. The highest level whose cost
+ * fits in the allotted time (i.e. the time budget, if given) is selected.
+ */
+static int
+opng_select_auto_level(void)
+{
+    static const int type_channels[8] = {1, 0, 3, 1, 2, 0, 4, 0};
+    opng_bitset_t compr_level_set, mem_level_set, strategy_set, filter_set;
+    double data_size, max_cost, cost;
+    int level;
+
+    data_size = (double)image.height *
+                ((double)image.width * type_channels[image.color_type & 7] *
+                 image.bit_depth / 8 + 1);
+    max_cost = OPNG_AUTO_THROUGHPUT *
+               ((options.time_budget > 0) ?
+                options.time_budget / 1000.0 : OPNG_AUTO_TIME);
+    for (level = OPNG_OPTIM_LEVEL_MAX; level > 1; --level)
+    {
+        opng_get_iteration_sets(level, &compr_level_set, &mem_level_set,
+                                &strategy_set, &filter_set);
+        cost = data_size * presets[level].candidates *
+               opng_count_iterations(compr_level_set, mem_level_set,
+                                     strategy_set, filter_set);
+        if (cost <= max_cost)
+            break;
+    }
+    return level;
+}
+
+/*
+ * Transparent color normalization filter selection.
+ * The color of the fully transparent pixels is best predicted by the filter
+ * that will be used in compression, if a single static filter is selected.
+ * Otherwise, the transparent pixels are cleared to zero.
+ */
+static png_uint_32
+opng_get_transparent_reductions(void)
+{
+    opng_bitset_t filter_set;
+    int filter;
+
+    opng_init_iteration(options.filter_set, OPNG_FILTER_SET_MASK,
+                        presets[opng_get_preset_index()].filter, &filter_set);
+    filter = opng_bitset_find_first(filter_set);
+    if (opng_bitset_count(filter_set) != 1 || filter >= PNG_FILTER_VALUE_LAST)
+        filter = PNG_FILTER_VALUE_NONE;
+    return OPNG_REDUCE_TRANSPARENT_FILTER(filter);
+}
+
+/*
+ * APNG frame input stream.
+ */
+struct opng_frame_stream
+{
+    png_bytep data;
+    png_uint_32 size;
+    png_uint_32 pos;
+};
+
+/*
+ * APNG frame input handler.
+ */
+static void
+opng_read_frame_data(png_structp png_ptr, png_bytep data, size_t length)
+{
+    struct opng_frame_stream *stream =
+        (struct opng_frame_stream *)png_get_io_ptr(png_ptr);
+
+    if (length > stream->size - stream->pos)
+        png_error(png_ptr, "Unexpected end of fdAT data");
+    memcpy(data, stream->data + stream->pos, length);
+    stream->pos += (png_uint_32)length;
+}
+
+/*
+ * APNG frame chunk serialization.
+ */
+static png_bytep
+opng_put_frame_chunk(png_bytep buf, png_const_bytep chunk_type,
+                     png_const_bytep data, png_uint_32 length)
+{
+    png_save_uint_32(buf, length);
+    memcpy(buf + 4, chunk_type, 4);
+    if (length > 0)
+        memcpy(buf + 8, data, length);
+    png_save_uint_32(buf + 8 + length, crc32(0, buf + 4, 4 + length));
+    return buf + 12 + length;
+}
+
+/*
+ * APNG frame decoding.
+ * The fdAT data is wrapped in a PNG datastream that has the frame dimensions
+ * and the attributes of the input image, and is decoded by libpng.
+ * The frame is decoded into its row pointers, which are set by the caller.
+ */
+static void
+opng_decode_frame(const struct opng_frame_struct *frame)
+{
+    static const png_byte sig_PNG[8] =
+        { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a };
+    static const png_byte sig_IHDR[4] = { 0x49, 0x48, 0x44, 0x52 };
+    png_structp png_ptr;
+    png_infop info_ptr;
+    struct opng_frame_stream stream;
+    png_byte ihdr[13], plte[3 * PNG_MAX_PALETTE_LENGTH];
+    png_bytep ptr;
+    int i;
+    const char * volatile err_msg;  /* volatile is required by cexcept */
+
+    /* Build the datastream: signature, IHDR, PLTE, IDAT and IEND. */
+    stream.size = 8 + 25 + (12 + sizeof(plte)) + 12 + frame->data_size + 12;
+    stream.pos = 0;
+    stream.data = (png_bytep)opng_malloc(stream.size);
+    memcpy(stream.data, sig_PNG, 8);
+    png_save_uint_32(ihdr, frame->width);
+    png_save_uint_32(ihdr + 4, frame->height);
+    ihdr[8] = (png_byte)image.bit_depth;
+    ihdr[9] = (png_byte)image.color_type;
+    ihdr[10] = (png_byte)image.compression_type;
+    ihdr[11] = (png_byte)image.filter_type;
+    ihdr[12] = (png_byte)image.interlace_type;
+    ptr = opng_put_frame_chunk(stream.data + 8, sig_IHDR, ihdr, 13);
+    if (image.palette != NULL)
+    {
+        for (i = 0; i < image.num_palette; ++i)
+        {
+            plte[3 * i] = image.palette[i].red;
+            plte[3 * i + 1] = image.palette[i].green;
+            plte[3 * i + 2] = image.palette[i].blue;
+        }
+        ptr = opng_put_frame_chunk(ptr, sig_PLTE, plte,
+                                   3 * (png_uint_32)image.num_palette);
+    }
+    ptr = opng_put_frame_chunk(ptr, sig_IDAT,
+                               frame->data + 4, frame->data_size);
+    ptr = opng_put_frame_chunk(ptr, sig_IEND, NULL, 0);
+    stream.size = (png_uint_32)(ptr - stream.data);
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                     NULL, opng_error, opng_warning);
+    if (png_ptr == NULL)
+    {
+        opng_free(stream.data);
+        Throw "Out of memory";
+    }
+    info_ptr = png_create_info_struct(png_ptr);
+    Try
+    {
+        if (info_ptr == NULL)
+            Throw "Out of memory";
+        png_set_user_limits(png_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+        png_set_read_fn(png_ptr, &stream, opng_read_frame_data);
+        png_read_info(png_ptr, info_ptr);
+        png_read_image(png_ptr, frame->row_pointers);
+        png_read_end(png_ptr, NULL);
+        err_msg = NULL;  /* everything is ok */
+    }
+    Catch (err_msg)
+    {
+        /* The frame rows belong to the caller. */
+    }
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    opng_free(stream.data);
+
+    if (err_msg != NULL)
+        Throw err_msg;
+}
+
+/*
+ * APNG frame padding.
+ * The pixels that follow the frame in a stacked row are filled with copies
+ * of the last frame pixel, which do not affect the image reductions.
+ */
+static void
+opng_pad_frame_row(png_bytep row, png_uint_32 width, png_uint_32 full_width,
+                   int pixel_bits)
+{
+    png_uint_32 i;
+    png_bytep last;
+    unsigned int mask, shift, value;
+
+    if (pixel_bits >= 8)
+    {
+        last = row + (width - 1) * (pixel_bits / 8);
+        for (i = width; i < full_width; ++i)
+            memcpy(row + i * (pixel_bits / 8), last, pixel_bits / 8);
+        return;
+    }
+    mask = (1U << pixel_bits) - 1;
+    shift = 8 - pixel_bits - ((width - 1) * pixel_bits) % 8;
+    value = (row[(width - 1) * pixel_bits / 8] >> shift) & mask;
+    for (i = width; i < full_width; ++i)
+    {
+        shift = 8 - pixel_bits - (i * pixel_bits) % 8;
+        row[i * pixel_bits / 8] = (png_byte)
+            ((row[i * pixel_bits / 8] & ~(mask << shift)) | (value << shift));
+    }
+}
+
+/*
+ * APNG frame reading.
+ * The frames stored in fdAT are decoded, and their rows are stacked below
+ * the rows of the input image, so that the image reductions are applied
+ * to all the frames at once.
+ * Returns 1 on success, or 0 if the APNG chunks can't be processed reliably,
+ * in which case they are left intact.
+ */
+static int
+opng_read_apng_frames(void)
+{
+    static const int type_channels[8] = {1, 0, 3, 1, 2, 0, 4, 0};
+    png_unknown_chunkp chunk;
+    struct opng_frame_struct *frame;
+    png_bytepp stacked_rows, frame_rows;
+    png_uint_32 width, height, x_offset, y_offset, row_size;
+    volatile png_uint_32 total_height;  /* volatile is required by cexcept */
+    png_uint_32 y;
+    int count, num_actl, in_frame, after_idat, pixel_bits, i;
+    const char * volatile err_msg;  /* volatile is required by cexcept */
+
+    /* Validate the APNG chunk sequence and count the fdAT frames. */
+    count = num_actl = in_frame = 0;
+    total_height = image.height;
+    for (i = 0; i < image.num_unknowns; ++i)
+    {
+        chunk = &image.unknowns[i];
+        after_idat = (chunk->location & PNG_AFTER_IDAT) != 0;
+        if (memcmp(chunk->name, sig_acTL, 4) == 0)
+        {
+            if (after_idat || chunk->size != 8)
+                return 0;
+            ++num_actl;
+        }
+        else if (memcmp(chunk->name, sig_fcTL, 4) == 0)
+        {
+            if (chunk->size != 26 || in_frame == 1)
+                return 0;
+            width = png_get_uint_32(chunk->data + 4);
+            height = png_get_uint_32(chunk->data + 8);
+            x_offset = png_get_uint_32(chunk->data + 12);
+            y_offset = png_get_uint_32(chunk->data + 16);
+            if (width == 0 || width > image.width ||
+                x_offset > image.width - width ||
+                height == 0 || height > image.height ||
+                y_offset > image.height - height)
+                return 0;
+            if (!after_idat)
+            {
+                /* This frame is stored in IDAT. */
+                if (width != image.width || height != image.height)
+                    return 0;
+                in_frame = 0;
+                continue;
+            }
+            if (height > PNG_UINT_31_MAX - total_height)
+                return 0;
+            total_height += height;
+            in_frame = 1;
+            ++count;
+        }
+        else if (memcmp(chunk->name, sig_fdAT, 4) == 0)
+        {
+            if (!after_idat || in_frame == 0 || chunk->size < 4)
+                return 0;
+            in_frame = 2;
+        }
+    }
+    if (num_actl != 1 || in_frame == 1 || count == 0)
+        return 0;
+
+    /* Collect and decode the frames. */
+    frames = (struct opng_frame_struct *)
+        opng_malloc(count * sizeof(struct opng_frame_struct));
+    memset(frames, 0, count * sizeof(struct opng_frame_struct));
+    Try
+    {
+        for (i = 0; i < image.num_unknowns; ++i)
+        {
+            chunk = &image.unknowns[i];
+            if (!(chunk->location & PNG_AFTER_IDAT))
+                continue;
+            if (memcmp(chunk->name, sig_fcTL, 4) == 0)
+            {
+                frame = &frames[num_frames++];
+                frame->width = png_get_uint_32(chunk->data + 4);
+                frame->height = png_get_uint_32(chunk->data + 8);
+                frame->fdat_index = -1;
+            }
+            else if (memcmp(chunk->name, sig_fdAT, 4) == 0)
+            {
+                frame = &frames[num_frames - 1];
+                if (frame->fdat_index < 0)
+                    frame->fdat_index = i;
+                opng_append_frame_data(frame, chunk->data + 4,
+                                       (png_uint_32)chunk->size - 4);
+                process.in_fdat_size += chunk->size - 4;
+            }
+        }
+
+        /* Decode the frames below the input image, in the stacked rows. */
+        png_set_IHDR(read_ptr, read_info_ptr,
+                     image.width, total_height, image.bit_depth,
+                     image.color_type, image.interlace_type,
+                     image.compression_type, image.filter_type);
+        stacked_rows = pngx_malloc_rows(read_ptr, read_info_ptr, 0);
+        if (stacked_rows == NULL)
+            Throw "Out of memory";
+        png_data_freer(read_ptr, read_info_ptr,
+                       PNG_USER_WILL_FREE_DATA, PNG_FREE_ROWS);
+        pixel_bits = type_channels[image.color_type & 7] * image.bit_depth;
+        frame_rows = stacked_rows + image.height;
+        for (i = 0; i < num_frames; ++i)
+        {
+            frame = &frames[i];
+            frame->row_pointers = frame_rows;
+            opng_decode_frame(frame);
+            for (y = 0; y < frame->height; ++y)
+                opng_pad_frame_row(frame_rows[y],
+                                   frame->width, image.width, pixel_bits);
+            frame_rows += frame->height;
+        }
+
+        /* Stack the input image above the frames. */
+        row_size = (png_uint_32)png_get_rowbytes(read_ptr, read_info_ptr);
+        for (y = 0; y < image.height; ++y)
+            memcpy(stacked_rows[y], image.row_pointers[y], row_size);
+        if (!pngx_unmap_rows(image.row_pointers))
+            opng_free(image.row_pointers);
+        image.row_pointers = stacked_rows;
+        image.height = total_height;
+        err_msg = NULL;  /* everything is ok */
+    }
+    Catch (err_msg)
+    {
+        /* The frames are not stacked yet. */
+    }
+
+    if (err_msg != NULL)
+    {
+        /* The input image hasn't been stacked; restore its rows. */
+        if (png_get_rows(read_ptr, read_info_ptr) != image.row_pointers)
+            pngx_free_rows(read_ptr, read_info_ptr);
+        png_set_IHDR(read_ptr, read_info_ptr,
+                     image.width, image.height, image.bit_depth,
+                     image.color_type, image.interlace_type,
+                     image.compression_type, image.filter_type);
+        png_set_rows(read_ptr, read_info_ptr, image.row_pointers);
+        opng_free_apng_frames();
+        opng_print_warning(err_msg);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * APNG frame unstacking.
+ * The image reductions may have replaced the row index of the stacked rows.
+ */
+static void
+opng_unstack_apng_frames(png_uint_32 height)
+{
+    png_bytepp rows;
+    int i;
+
+    image.height = height;
+    rows = image.row_pointers + height;
+    for (i = 0; i < num_frames; ++i)
+    {
+        frames[i].row_pointers = rows;
+        rows += frames[i].height;
+    }
+}
+
+/*
+ * APNG frame duplication for the unreduced image candidate.
+ * The unreduced image must have been copied, with its stacked rows,
+ * to the first alternative image.
+ */
+static void
+opng_copy_apng_frames(void)
+{
+    png_bytep data, fctl_data;
+    int i;
+
+    alt_frames = (struct opng_frame_struct *)
+        opng_malloc(num_frames * sizeof(struct opng_frame_struct));
+    memset(alt_frames, 0, num_frames * sizeof(struct opng_frame_struct));
+    for (i = 0; i < num_frames; ++i)
+    {
+        data = (png_bytep)opng_malloc(4 + (size_t)frames[i].data_size);
+        memcpy(data, frames[i].data, 4 + (size_t)frames[i].data_size);
+        alt_frames[i] = frames[i];
+        alt_frames[i].row_pointers = alt_images[0].row_pointers +
+            (frames[i].row_pointers - image.row_pointers);
+        alt_frames[i].data = data;
+        alt_frames[i].alloc_size = 4 + frames[i].data_size;
+    }
+
+    /* The delta minimization will change the fcTL chunks in place.
+     * There is one fcTL per fdAT frame, and possibly one for IDAT.
+     */
+    alt_fctl_data = (png_bytep)opng_malloc((num_frames + 1) * 26);
+    for (fctl_data = alt_fctl_data, i = 0; i < image.num_unknowns; ++i)
+    {
+        if (memcmp(image.unknowns[i].name, sig_fcTL, 4) != 0)
+            continue;
+        memcpy(fctl_data, image.unknowns[i].data, 26);
+        fctl_data += 26;
+    }
+}
+
+/*
+ * APNG frame exchange with the frames of the unreduced image candidate.
+ * The fcTL chunks are exchanged along with the frames.
+ */
+static void
+opng_swap_apng_frames(void)
+{
+    struct opng_frame_struct *tmp_frames;
+    png_byte tmp_fctl_data[26];
+    png_bytep fctl_data;
+    int i;
+
+    if (alt_frames == NULL)
+        return;
+    tmp_frames = frames;
+    frames = alt_frames;
+    alt_frames = tmp_frames;
+    for (fctl_data = alt_fctl_data, i = 0; i < image.num_unknowns; ++i)
+    {
+        if (memcmp(image.unknowns[i].name, sig_fcTL, 4) != 0)
+            continue;
+        memcpy(tmp_fctl_data, image.unknowns[i].data, 26);
+        memcpy(image.unknowns[i].data, fctl_data, 26);
+        memcpy(fctl_data, tmp_fctl_data, 26);
+        fctl_data += 26;
+    }
+}
+
+/*
+ * APNG frame delta minimization.
+ * The animation is rendered in a 16-bit RGBA canvas model. Each frame
+ * is cropped to the pixels that change the canvas, and the dispose_op of
+ * the previous frame and the blend_op of the frame are chosen to minimize
+ * the frame data, as long as every rendered frame stays the same.
+ * A partially transparent pixel blended over a non-transparent pixel
+ * yields a result that depends on the decoder's arithmetic; such a result
+ * is stored in the canvas as a unique token, which matches only itself.
+ */
+#define OPNG_DISPOSE_OP_NONE        0
+#define OPNG_DISPOSE_OP_BACKGROUND  1
+#define OPNG_DISPOSE_OP_PREVIOUS    2
+#define OPNG_BLEND_OP_SOURCE        0
+#define OPNG_BLEND_OP_OVER          1
+
+struct opng_frame_region
+{
+    png_uint_32 x, y, width, height;
+    int dispose_op, blend_op;
+};
+
+struct opng_anim_frame
+{
+    png_bytep fctl_data;
+    png_bytepp row_pointers;
+    struct opng_frame_struct *frame;  /* NULL if the frame is in IDAT */
+    struct opng_frame_region orig;    /* as rendered by the input file */
+    struct opng_frame_region crop;    /* as rendered by the output file */
+};
+
+static struct opng_canvas_struct
+{
+    png_uint_32 width, height;
+    int pixel_bits;
+    png_uint_16p disp;       /* the displayed frame */
+    png_uint_16p orig_base;  /* the canvas under the input frame */
+    png_uint_16p new_base;   /* the canvas under the output frame */
+    png_uint_32 num_tokens;
+    png_uint_16 num_token_wraps;
+} canvas;
+
+static const png_uint_16 canvas_transparent[4] = { 0, 0, 0, 0 };
+
+static int
+opng_in_frame_region(const struct opng_frame_region *region,
+                     png_uint_32 x, png_uint_32 y)
+{
+    return x >= region->x && x - region->x < region->width &&
+           y >= region->y && y - region->y < region->height;
+}
+
+static int
+opng_is_transparent(const png_uint_16 *pixel)
+{
+    return memcmp(pixel, canvas_transparent, sizeof(canvas_transparent)) == 0;
+}
+
+static int
+opng_is_same_pixel(const png_uint_16 *pixel1, const png_uint_16 *pixel2)
+{
+    return memcmp(pixel1, pixel2, 4 * sizeof(png_uint_16)) == 0;
+}
+
+/*
+ * Frame pixel reading, in the 16-bit RGBA canvas model.
+ */
+static void
+opng_get_frame_pixel(png_const_bytep row, png_uint_32 x, png_uint_16 *pixel)
+{
+    png_uint_32 sample[4];
+    png_uint_32 max_sample, scale, pos;
+    int num_channels, i;
+
+    sample[0] = sample[1] = sample[2] = sample[3] = 0;
+    num_channels = canvas.pixel_bits / image.bit_depth;
+    max_sample = (1U << image.bit_depth) - 1;
+    scale = 65535 / max_sample;
+    if (image.bit_depth < 8)
+    {
+        pos = x * image.bit_depth;
+        sample[0] = (row[pos >> 3] >> (8 - image.bit_depth - (pos & 7))) &
+                    max_sample;
+    }
+    else if (image.bit_depth == 8)
+    {
+        row += x * num_channels;
+        for (i = 0; i < num_channels; ++i)
+            sample[i] = row[i];
+    }
+    else
+    {
+        row += x * num_channels * 2;
+        for (i = 0; i < num_channels; ++i)
+            sample[i] = png_get_uint_16(row + i * 2);
+    }
+
+    switch (image.color_type)
+    {
+    case PNG_COLOR_TYPE_PALETTE:
+        if ((int)sample[0] < image.num_palette)
+        {
+            pixel[0] = (png_uint_16)(image.palette[sample[0]].red * 257);
+            pixel[1] = (png_uint_16)(image.palette[sample[0]].green * 257);
+            pixel[2] = (png_uint_16)(image.palette[sample[0]].blue * 257);
+        }
+        else
+            pixel[0] = pixel[1] = pixel[2] = 0;
+        pixel[3] = (png_uint_16)((int)sample[0] < image.num_trans ?
+                                 image.trans_alpha[sample[0]] * 257 : 65535);
+        break;
+    case PNG_COLOR_TYPE_GRAY:
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        pixel[0] = pixel[1] = pixel[2] = (png_uint_16)(sample[0] * scale);
+        if (image.color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+            pixel[3] = (png_uint_16)(sample[1] * scale);
+        else if (image.trans_color_ptr != NULL &&
+                 sample[0] == image.trans_color.gray)
+            pixel[3] = 0;
+        else
+            pixel[3] = 65535;
+        break;
+    default:
+        pixel[0] = (png_uint_16)(sample[0] * scale);
+        pixel[1] = (png_uint_16)(sample[1] * scale);
+        pixel[2] = (png_uint_16)(sample[2] * scale);
+        if (image.color_type == PNG_COLOR_TYPE_RGB_ALPHA)
+            pixel[3] = (png_uint_16)(sample[3] * scale);
+        else if (image.trans_color_ptr != NULL &&
+                 sample[0] == image.trans_color.red &&
+                 sample[1] == image.trans_color.green &&
+                 sample[2] == image.trans_color.blue)
+            pixel[3] = 0;
+        else
+            pixel[3] = 65535;
+        break;
+    }
+
+    /* All fully transparent pixels look the same. */
+    if (pixel[3] == 0)
+        memcpy(pixel, canvas_transparent, sizeof(canvas_transparent));
+}
+
+/*
+ * Frame pixel copying, in the image format.
+ */
+static void
+opng_copy_frame_pixel(png_bytep dest_row, png_uint_32 dest_x,
+                      png_const_bytep src_row, png_uint_32 src_x)
+{
+    unsigned int mask, value, shift;
+    int pixel_bits;
+
+    pixel_bits = canvas.pixel_bits;
+    if (pixel_bits >= 8)
+    {
+        memcpy(dest_row + dest_x * (pixel_bits / 8),
+               src_row + src_x * (pixel_bits / 8), pixel_bits / 8);
+        return;
+    }
+    src_x *= pixel_bits;
+    dest_x *= pixel_bits;
+    mask = (1U << pixel_bits) - 1;
+    value = (src_row[src_x >> 3] >> (8 - pixel_bits - (src_x & 7))) & mask;
+    shift = 8 - pixel_bits - (dest_x & 7);
+    dest_row[dest_x >> 3] = (png_byte)
+        ((dest_row[dest_x >> 3] & ~(mask << shift)) | (value << shift));
+}
+
+/*
+ * Transparent pixel retrieval, in the image format.
+ * Returns 1 if the image format has a fully transparent pixel, or 0 if not.
+ */
+static int
+opng_get_transparent_pixel(png_bytep pixel)
+{
+    png_uint_16 rgba[4];
+    int i;
+
+    memset(pixel, 0, 8);
+    if (image.color_type == PNG_COLOR_TYPE_PALETTE)
+    {
+        for (i = 0; i < image.num_trans; ++i)
+            if (image.trans_alpha[i] == 0)
+                break;
+        if (i >= image.num_trans)
+            return 0;
+        pixel[0] = (png_byte)(i << (8 - image.bit_depth));
+    }
+    else if (!(image.color_type & PNG_COLOR_MASK_ALPHA))
+    {
+        if (image.trans_color_ptr == NULL)
+            return 0;
+        if (image.color_type == PNG_COLOR_TYPE_GRAY)
+        {
+            if (image.bit_depth == 16)
+                png_save_uint_16(pixel, image.trans_color.gray);
+            else
+                pixel[0] = (png_byte)
+                    (image.trans_color.gray << (8 - image.bit_depth));
+        }
+        else if (image.bit_depth == 16)
+        {
+            png_save_uint_16(pixel, image.trans_color.red);
+            png_save_uint_16(pixel + 2, image.trans_color.green);
+            png_save_uint_16(pixel + 4, image.trans_color.blue);
+        }
+        else
+        {
+            pixel[0] = (png_byte)image.trans_color.red;
+            pixel[1] = (png_byte)image.trans_color.green;
+            pixel[2] = (png_byte)image.trans_color.blue;
+        }
+    }
+
+    /* Make sure that the pixel is seen as transparent. */
+    opng_get_frame_pixel(pixel, 0, rgba);
+    return opng_is_transparent(rgba);
+}
+
+/*
+ * Pixel rendering.
+ * Returns 1 if the result is exact, or 0 if it's a blend between the pixel
+ * and the base.
+ */
+static int
+opng_render_pixel(const png_uint_16 *pixel, int blend_op,
+                  const png_uint_16 *base, png_uint_16 *result)
+{
+    if (blend_op == OPNG_BLEND_OP_OVER && pixel[3] != 65535)
+    {
+        if (pixel[3] == 0)
+        {
+            memcpy(result, base, 4 * sizeof(png_uint_16));
+            return 1;
+        }
+        if (!opng_is_transparent(base))
+            return 0;
+    }
+    memcpy(result, pixel, 4 * sizeof(png_uint_16));
+    return 1;
+}
+
+/*
+ * Pixel rendering comparison.
+ * Returns 1 if the pixel renders identically in both contexts, or 0 if not.
+ */
+static int
+opng_is_same_rendering(const png_uint_16 *pixel,
+                       int blend_op1, const png_uint_16 *base1,
+                       int blend_op2, const png_uint_16 *base2)
+{
+    png_uint_16 result1[4], result2[4];
+    int exact1, exact2;
+
+    exact1 = opng_render_pixel(pixel, blend_op1, base1, result1);
+    exact2 = opng_render_pixel(pixel, blend_op2, base2, result2);
+    if (exact1 && exact2)
+        return opng_is_same_pixel(result1, result2);
+    /* Blends are identical only if they have identical inputs. */
+    return !exact1 && !exact2 && opng_is_same_pixel(base1, base2);
+}
+
+/*
+ * Canvas base pixel retrieval.
+ * Returns the pixel under the next frame, after the disposal of the frame
+ * that covered the given region.
+ */
+static const png_uint_16 *
+opng_get_base_pixel(int dispose_op, const struct opng_frame_region *region,
+                    const png_uint_16 *prev_base, png_uint_32 x, png_uint_32 y)
+{
+    size_t offset;
+
+    offset = ((size_t)y * canvas.width + x) * 4;
+    if (opng_in_frame_region(region, x, y))
+    {
+        if (dispose_op == OPNG_DISPOSE_OP_BACKGROUND)
+            return canvas_transparent;
+        if (dispose_op == OPNG_DISPOSE_OP_PREVIOUS)
+            return prev_base + offset;
+    }
+    return canvas.disp + offset;
+}
+
+/*
+ * Canvas disposal.
+ * Turns the base under a frame into the base under the next frame.
+ */
+static void
+opng_dispose_canvas(png_uint_16p base, int dispose_op,
+                    const struct opng_frame_region *region)
+{
+    png_uint_32 y;
+    size_t offset, size;
+
+    if (dispose_op == OPNG_DISPOSE_OP_PREVIOUS)
+        return;
+    size = (size_t)region->width * 4 * sizeof(png_uint_16);
+    for (y = region->y; y < region->y + region->height; ++y)
+    {
+        offset = ((size_t)y * canvas.width + region->x) * 4;
+        if (dispose_op == OPNG_DISPOSE_OP_NONE)
+            memcpy(base + offset, canvas.disp + offset, size);
+        else
+            memset(base + offset, 0, size);
+    }
+}
+
+/*
+ * Canvas rendering.
+ * Draws the input frame over the input base into the displayed frame.
+ */
+static void
+opng_render_canvas(const struct opng_anim_frame *anim)
+{
+    const struct opng_frame_region *region;
+    png_uint_16 pixel[4];
+    png_uint_16p dest;
+    png_uint_32 x, y;
+    size_t offset;
+
+    region = &anim->orig;
+    for (y = 0; y < region->height; ++y)
+    {
+        for (x = 0; x < region->width; ++x)
+        {
+            offset = ((size_t)(region->y + y) * canvas.width +
+                      region->x + x) * 4;
+            dest = canvas.disp + offset;
+            opng_get_frame_pixel(anim->row_pointers[y], x, pixel);
+            if (!opng_render_pixel(pixel, region->blend_op,
+                                   canvas.orig_base + offset, dest))
+            {
+                /* Store a new blend token. */
+                dest[0] = (png_uint_16)(canvas.num_tokens >> 16);
+                dest[1] = (png_uint_16)(canvas.num_tokens & 0xffff);
+                dest[2] = (png_uint_16)(canvas.num_token_wraps + 1);
+                dest[3] = 0;
+                if (++canvas.num_tokens == 0)
+                    ++canvas.num_token_wraps;
+            }
+        }
+    }
+}
+
+/*
+ * Frame delta evaluation.
+ * Computes the crop region of the frame, if the previous frame is disposed
+ * with the given dispose_op, and marks the pixels that don't change the
+ * canvas. If use_transparency is set, these pixels are made transparent,
+ * and the frame is blended with OVER.
+ * Returns 1 if the frame renders identically, or 0 if not.
+ */
+static int
+opng_eval_frame_delta(const struct opng_anim_frame *prev,
+                      const struct opng_anim_frame *anim,
+                      int dispose_op, int use_transparency,
+                      struct opng_frame_region *crop, png_bytep unchanged)
+{
+    const struct opng_frame_region *region;
+    const png_uint_16 *orig_base, *new_base;
+    png_uint_16 pixel[4], result[4];
+    png_uint_32 x0, y0, x1, y1, x, y;
+    png_uint_32 left, top, right, bottom;
+    int blend_op, is_unchanged;
+
+    region = &anim->orig;
+    blend_op = use_transparency ? OPNG_BLEND_OP_OVER : region->blend_op;
+
+    /* Only the regions of the two frames can have different bases. */
+    x0 = (prev->orig.x < region->x) ? prev->orig.x : region->x;
+    y0 = (prev->orig.y < region->y) ? prev->orig.y : region->y;
+    x1 = (prev->orig.x + prev->orig.width > region->x + region->width) ?
+         prev->orig.x + prev->orig.width : region->x + region->width;
+    y1 = (prev->orig.y + prev->orig.height > region->y + region->height) ?
+         prev->orig.y + prev->orig.height : region->y + region->height;
+
+    left = top = PNG_UINT_32_MAX;
+    right = bottom = 0;
+    for (y = y0; y < y1; ++y)
+    {
+        for (x = x0; x < x1; ++x)
+        {
+            orig_base = canvas.orig_base + ((size_t)y * canvas.width + x) * 4;
+            new_base = opng_get_base_pixel(dispose_op, &prev->crop,
+                                           canvas.new_base, x, y);
+            if (!opng_in_frame_region(region, x, y))
+            {
+                if (!opng_is_same_pixel(orig_base, new_base))
+                    return 0;
+                continue;
+            }
+            /* A restored base must be restored identically. */
+            if (region->dispose_op == OPNG_DISPOSE_OP_PREVIOUS &&
+                !opng_is_same_pixel(orig_base, new_base))
+                return 0;
+            opng_get_frame_pixel(anim->row_pointers[y - region->y],
+                                 x - region->x, pixel);
+            is_unchanged =
+                opng_render_pixel(pixel, region->blend_op, orig_base,
+                                  result) &&
+                opng_is_same_pixel(result, new_base);
+            /* Without transparency, an unchanged pixel that falls inside
+             * the crop region is drawn as it is, over the new base.
+             */
+            if (is_unchanged && !use_transparency)
+                is_unchanged =
+                    opng_render_pixel(pixel, blend_op, new_base, result) &&
+                    opng_is_same_pixel(result, new_base);
+            unchanged[(size_t)(y - region->y) * region->width +
+                      (x - region->x)] = (png_byte)is_unchanged;
+            if (is_unchanged)
+            {
+                /* A cleared pixel may be left out only if it's clear. */
+                if (region->dispose_op != OPNG_DISPOSE_OP_BACKGROUND ||
+                    opng_is_transparent(new_base))
+                    continue;
+            }
+            else if (!opng_is_same_rendering(pixel, blend_op, new_base,
+                                             region->blend_op, orig_base))
+                return 0;
+            if (left > x)
+                left = x;
+            if (right < x)
+                right = x;
+            if (top > y)
+                top = y;
+            bottom = y;
+        }
+    }
+
+    *crop = *region;
+    crop->blend_op = blend_op;
+    if (left != PNG_UINT_32_MAX)
+    {
+        crop->x = left;
+        crop->y = top;
+        crop->width = right - left + 1;
+        crop->height = bottom - top + 1;
+    }
+    else
+    {
+        /* The frame changes nothing, but it can't be empty. */
+        crop->width = crop->height = 1;
+    }
+    return 1;
+}
+
+/*
+ * Frame delta construction.
+ * Stores the cropped frame rows contiguously, and returns their size.
+ */
+static size_t
+opng_build_frame_delta(const struct opng_anim_frame *anim,
+                       const struct opng_frame_region *crop,
+                       png_const_bytep unchanged,
+                       png_const_bytep transparent_pixel, png_bytep buf)
+{
+    png_uint_32 x, y, src_x, src_y;
+    size_t row_size;
+
+    row_size = ((size_t)crop->width * canvas.pixel_bits + 7) / 8;
+    for (y = 0; y < crop->height; ++y, buf += row_size)
+    {
+        memset(buf, 0, row_size);
+        src_y = crop->y - anim->orig.y + y;
+        for (x = 0; x < crop->width; ++x)
+        {
+            src_x = crop->x - anim->orig.x + x;
+            if (transparent_pixel != NULL &&
+                unchanged[(size_t)src_y * anim->orig.width + src_x])
+                opng_copy_frame_pixel(buf, x, transparent_pixel, 0);
+            else
+                opng_copy_frame_pixel(buf, x,
+                                      anim->row_pointers[src_y], src_x);
+        }
+    }
+    return row_size * crop->height;
+}
+
+/*
+ * APNG frame delta minimization.
+ * The candidate frames are ranked by the size of their deflated rows.
+ */
+static void
+opng_minimize_apng_frames(void)
+{
+    static const int type_channels[8] = {1, 0, 3, 1, 2, 0, 4, 0};
+    struct opng_anim_frame *anims, *anim, *prev;
+    struct opng_frame_region crop, best_crop;
+    png_byte transparent_pixel[8];
+    png_bytep block, unchanged, delta_buf, best_buf, zbuf, temp;
+    size_t num_pixels, row_size, rows_size, delta_size, best_size, total_size;
+    uLongf zsize;
+    opng_fsize_t in_area, out_area;
+    png_uint_32 y;
+    int num_anims, has_transparency, dispose_op;
+    int use_transparency, best_uses_transparency;
+    int is_modified, i, j, k;
+
+    /* Collect the animation frames, in the order of their fcTL chunks. */
+    num_anims = 0;
+    for (i = 0; i < image.num_unknowns; ++i)
+        if (memcmp(image.unknowns[i].name, sig_fcTL, 4) == 0)
+            ++num_anims;
+    if (num_anims < 2)
+        return;
+
+    /* Allocate the canvas model, unless it's too large. */
+    canvas.width = image.width;
+    canvas.height = image.height;
+    canvas.pixel_bits = type_channels[image.color_type & 7] * image.bit_depth;
+    if (image.height > ((size_t)(-1) / 64) / image.width)
+        return;
+    num_pixels = (size_t)image.width * image.height;
+    row_size = ((size_t)image.width * canvas.pixel_bits + 7) / 8;
+    rows_size = row_size * image.height;
+    if (rows_size > (uLong)(-1) / 2)
+        return;
+    total_size = num_anims * sizeof(struct opng_anim_frame) +
+                 num_pixels * 3 * 4 * sizeof(png_uint_16) +
+                 num_pixels + rows_size * 2 +
+                 compressBound((uLong)rows_size);
+    if (options.mem_limit > 0 && total_size > options.mem_limit)
+        return;
+    block = (png_bytep)opng_malloc(total_size);
+    anims = (struct opng_anim_frame *)block;
+    canvas.disp = (png_uint_16p)(block + num_anims * sizeof(*anims));
+    canvas.orig_base = canvas.disp + num_pixels * 4;
+    canvas.new_base = canvas.orig_base + num_pixels * 4;
+    unchanged = (png_bytep)(canvas.new_base + num_pixels * 4);
+    delta_buf = unchanged + num_pixels;
+    best_buf = delta_buf + rows_size;
+    zbuf = best_buf + rows_size;
+    memset(canvas.disp, 0, num_pixels * 3 * 4 * sizeof(png_uint_16));
+    canvas.num_tokens = 0;
+    canvas.num_token_wraps = 0;
+
+    for (i = j = k = 0; i < image.num_unknowns; ++i)
+    {
+        if (memcmp(image.unknowns[i].name, sig_fcTL, 4) != 0)
+            continue;
+        anim = &anims[j++];
+        anim->fctl_data = image.unknowns[i].data;
+        if (image.unknowns[i].location & PNG_AFTER_IDAT)
+        {
+            anim->frame = &frames[k++];
+            anim->row_pointers = anim->frame->row_pointers;
+        }
+        else
+        {
+            anim->frame = NULL;
+            anim->row_pointers = image.row_pointers;
+        }
+        anim->orig.width = png_get_uint_32(anim->fctl_data + 4);
+        anim->orig.height = png_get_uint_32(anim->fctl_data + 8);
+        anim->orig.x = png_get_uint_32(anim->fctl_data + 12);
+        anim->orig.y = png_get_uint_32(anim->fctl_data + 16);
+        anim->orig.dispose_op = anim->fctl_data[24];
+        anim->orig.blend_op = anim->fctl_data[25];
+        if (anim->orig.dispose_op > OPNG_DISPOSE_OP_PREVIOUS ||
+            anim->orig.blend_op > OPNG_BLEND_OP_OVER)
+        {
+            /* Leave the unknown operations alone. */
+            opng_free(block);
+            return;
+        }
+        anim->crop = anim->orig;
+    }
+    /* The first frame is disposed to the background, instead of itself. */
+    if (anims[0].orig.dispose_op == OPNG_DISPOSE_OP_PREVIOUS)
+        anims[0].orig.dispose_op = anims[0].crop.dispose_op =
+            OPNG_DISPOSE_OP_BACKGROUND;
+
+    has_transparency = opng_get_transparent_pixel(transparent_pixel);
+    in_area = out_area = (opng_fsize_t)anims[0].orig.width *
+                         anims[0].orig.height;
+    is_modified = 0;
+    opng_render_canvas(&anims[0]);
+    for (i = 1; i < num_anims; ++i)
+    {
+        prev = &anims[i - 1];
+        anim = &anims[i];
+        opng_dispose_canvas(canvas.orig_base,
+                            prev->orig.dispose_op, &prev->orig);
+
+        /* Try the disposals of the previous frame, with and without
+         * transparency in the current frame.
+         * The input operations are tried first, and kept on ties.
+         */
+        best_size = (size_t)(-1);
+        best_uses_transparency = 0;
+        for (j = 0; j < 6; ++j)
+        {
+            dispose_op = (prev->orig.dispose_op + j / 2) % 3;
+            use_transparency = j % 2;
+            if (dispose_op == OPNG_DISPOSE_OP_PREVIOUS && i == 1)
+                continue;
+            if (use_transparency && !has_transparency)
+                continue;
+            if (!opng_eval_frame_delta(prev, anim, dispose_op,
+                                       use_transparency, &crop, unchanged))
+                continue;
+            delta_size = opng_build_frame_delta(anim, &crop, unchanged,
+                use_transparency ? transparent_pixel : NULL, delta_buf);
+            zsize = compressBound((uLong)delta_size);
+            if (compress2(zbuf, &zsize, delta_buf, (uLong)delta_size,
+                          Z_DEFAULT_COMPRESSION) != Z_OK)
+                continue;
+            if ((size_t)zsize < best_size)
+            {
+                best_size = (size_t)zsize;
+                best_crop = crop;
+                best_uses_transparency = use_transparency;
+                prev->crop.dispose_op = dispose_op;
+                temp = best_buf;
+                best_buf = delta_buf;
+                delta_buf = temp;
+            }
+        }
+        OPNG_ENSURE(best_size != (size_t)(-1),
+                    "Can't reproduce APNG frame");
+
+        /* Advance the canvas model by one frame. */
+        opng_dispose_canvas(canvas.new_base,
+                            prev->crop.dispose_op, &prev->crop);
+        for (y = 0; y < prev->orig.height; ++y)
+            memcpy(canvas.disp +
+                       ((size_t)(prev->orig.y + y) * canvas.width +
+                        prev->orig.x) * 4,
+                   canvas.orig_base +
+                       ((size_t)(prev->orig.y + y) * canvas.width +
+                        prev->orig.x) * 4,
+                   (size_t)prev->orig.width * 4 * sizeof(png_uint_16));
+        opng_render_canvas(anim);
+
+        /* Store the minimized frame. */
+        best_crop.dispose_op = anim->orig.dispose_op;
+        anim->crop = best_crop;
+        in_area += (opng_fsize_t)anim->orig.width * anim->orig.height;
+        out_area += (opng_fsize_t)best_crop.width * best_crop.height;
+        if (memcmp(&best_crop, &anim->orig, sizeof(best_crop)) == 0 &&
+            !best_uses_transparency)
+            continue;
+        row_size = ((size_t)best_crop.width * canvas.pixel_bits + 7) / 8;
+        anim->row_pointers += best_crop.y - anim->orig.y;
+        for (y = 0; y < best_crop.height; ++y)
+            memcpy(anim->row_pointers[y], best_buf + y * row_size, row_size);
+        anim->frame->row_pointers = anim->row_pointers;
+        anim->frame->width = best_crop.width;
+        anim->frame->height = best_crop.height;
+        anim->frame->is_modified = 1;
+    }
+
+    /* Update the fcTL chunks. */
+    for (i = 0; i < num_anims; ++i)
+    {
+        anim = &anims[i];
+        if (memcmp(&anim->crop, &anim->orig, sizeof(anim->crop)) == 0)
+            continue;
+        png_save_uint_32(anim->fctl_data + 4, anim->crop.width);
+        png_save_uint_32(anim->fctl_data + 8, anim->crop.height);
+        png_save_uint_32(anim->fctl_data + 12, anim->crop.x);
+        png_save_uint_32(anim->fctl_data + 16, anim->crop.y);
+        if (anim->crop.dispose_op != anim->orig.dispose_op)
+            anim->fctl_data[24] = (png_byte)anim->crop.dispose_op;
+        anim->fctl_data[25] = (png_byte)anim->crop.blend_op;
+        is_modified = 1;
+    }
+    opng_free(block);
+
+    if (is_modified)
+        usr_printf("Reducing the APNG frame area from %" OPNG_FSIZE_PRIu
+                   " to %" OPNG_FSIZE_PRIu " pixels\n", in_area, out_area);
+}
+
+/*
+ * Image file reading.
+ */
+static void
+opng_read_file(FILE *infile)
+{
+    const char *fmt_name;
+    int num_img;
+    png_uint_32 reductions;
+    int max_candidates;
+    png_uint_32 height;
+    double start_time;
+    int i;
+    const char * volatile err_msg;  /* volatile is required by cexcept */
+
+    Try
+    {
+        read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                          NULL, opng_error, opng_warning);
+        read_info_ptr = png_create_info_struct(read_ptr);
+        if (read_info_ptr == NULL)
+            Throw "Out of memory";
+
+        /* Override the default libpng settings. */
+        png_set_keep_unknown_chunks(read_ptr,
+                                    PNG_HANDLE_CHUNK_ALWAYS, NULL, 0);
+        png_set_user_limits(read_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+        /* Do not limit the number and the size of the APNG chunks. */
+        png_set_chunk_cache_max(read_ptr, 0);
+        png_set_chunk_malloc_max(read_ptr, 0);
+
+        /* Read the input image file. */
+        opng_init_read_data();
+        pngx_set_read_fn(read_ptr, infile, opng_read_data);
+        fmt_name = NULL;
+        num_img = pngx_read_image(read_ptr, read_info_ptr, &fmt_name, NULL);
+        if (num_img <= 0)
+            Throw "Unrecognized image file format";
+        if (num_img > 1)
+            process.status |= INPUT_HAS_MULTIPLE_IMAGES;
+        if ((process.status & INPUT_IS_PNG_FILE) &&
+            (process.status & INPUT_HAS_MULTIPLE_IMAGES))
+        {
+            /* pngxtern can't distinguish between APNG and proper PNG. */
+            fmt_name = (process.status & INPUT_HAS_PNG_SIGNATURE) ?
+                       "APNG" : "APNG datastream";
+        }
+        OPNG_ENSURE(fmt_name != NULL, "No format name from pngxtern");
+
+        if (process.in_file_size == 0)
+        {
+            if (opng_fgetsize(infile, &process.in_file_size) < 0)
+            {
+                opng_print_warning("Can't get the correct file size");
+                process.in_file_size = 0;
+            }
+        }
+
+        err_msg = NULL;  /* everything is ok */
+    }
+    Catch (err_msg)
+    {
+        /* If the critical info has been loaded, treat all errors as warnings.
+         * This enables a more advanced data recovery.
+         */
+        if (opng_validate_image(read_ptr, read_info_ptr))
+        {
+            png_warning(read_ptr, err_msg);
+            err_msg = NULL;
+        }
+    }
+
+    Try
+    {
+        if (err_msg != NULL)
+            Throw err_msg;
+
+        /* Display format and image information. */
+        if (strcmp(fmt_name, "PNG") != 0)
+        {
+            usr_printf("Importing %s", fmt_name);
+            if (process.status & INPUT_HAS_MULTIPLE_IMAGES)
+            {
+                if (!(process.status & INPUT_IS_PNG_FILE))
+                    usr_printf(" (multi-image or animation)");
+                if (options.snip)
+                    usr_printf("; snipping...");
+            }
+            usr_printf("\n");
+        }
+        opng_load_image_info(read_ptr, read_info_ptr, &image, 1);
+        opng_print_image_info(1, 1, 1, 1);
+        usr_printf("\n");
+        if (pngx_rows_are_mapped(image.row_pointers))
+            usr_printf("Image data exceeds the memory limit; "
+                       "storing it out of core\n");
+
+        /* Select the optimization level, if required. */
+        if (options.optim_level == OPNG_OPTIM_LEVEL_AUTO)
+        {
+            process.auto_level = opng_select_auto_level();
+            usr_printf("Selecting optimization level %d\n",
+                       process.auto_level);
+        }
+
+        /* Choose the applicable image reductions. */
+        reductions = OPNG_REDUCE_ALL & ~OPNG_REDUCE_METADATA;
+        if (options.nb)
+            reductions &= ~OPNG_REDUCE_BIT_DEPTH;
+        if (options.nc)
+            reductions &= ~OPNG_REDUCE_COLOR_TYPE;
         if (options.np)
             reductions &= ~OPNG_REDUCE_PALETTE;
+        if (options.clean_alpha)
+            reductions |= opng_get_transparent_reductions();
         if (options.nz && (process.status & INPUT_HAS_PNG_DATASTREAM))
         {
             /* Do not reduce files with PNG datastreams under -nz. */
@@ -1018,29 +2849,93 @@ opng_read_file(FILE *infile)
             /* Do not reduce signed files. */
             reductions = OPNG_REDUCE_NONE;
         }
+        height = image.height;
         if ((process.status & INPUT_IS_PNG_FILE) &&
-            (process.status & INPUT_HAS_MULTIPLE_IMAGES) &&
-            (reductions != OPNG_REDUCE_NONE) && !options.snip)
+            (process.status & INPUT_HAS_MULTIPLE_IMAGES) && !options.snip)
         {
-            usr_printf(
-                "Can't reliably reduce APNG file; disabling reductions.\n"
-                "(Did you want to -snip and optimize the first frame?)\n");
-            reductions = OPNG_REDUCE_NONE;
+            /* Decode the APNG frames, unless IDAT recoding is disabled. */
+            if (options.nz ||
+                (process.status & INPUT_HAS_DIGITAL_SIGNATURE) ||
+                !opng_read_apng_frames())
+            {
+                if (reductions != OPNG_REDUCE_NONE)
+                    usr_printf(
+                        "Can't reliably reduce APNG file; "
+                        "disabling reductions.\n"
+                        "(Did you want to -snip and optimize "
+                        "the first frame?)\n");
+                reductions = OPNG_REDUCE_NONE;
+            }
+        }
+
+        /* Save the unreduced image, if alternative candidates are wanted,
+         * and if the copies of the image data fit in the memory limit.
+         * The reduced APNG frames may grow, so the unreduced APNG image
+         * is always saved, with its stacked frames. It is the only
+         * alternative candidate of an APNG image.
+         */
+        max_candidates = presets[opng_get_preset_index()].candidates;
+        if (num_frames > 0)
+            max_candidates = 2;
+        if (options.mem_limit > 0 &&
+            png_get_rowbytes(read_ptr, read_info_ptr) >
+                options.mem_limit / max_candidates / image.height)
+            max_candidates = 1;
+        if (max_candidates > 1 && reductions != OPNG_REDUCE_NONE)
+        {
+            opng_copy_image_info(&alt_images[0], &image);
+            num_alt_images = 1;
+            if (num_frames > 0)
+            {
+                opng_copy_apng_frames();
+                alt_images[0].height = height;
+            }
         }
 
-        /* Try to reduce the image. */
+        /* Try to reduce the image.
+         * The palette expansion is not a reduction; it is tried separately.
+         */
+        start_time = opng_os_wall_clock();
+        opng_trace("reduce", OPNG_TRACE_BEGIN, 0);
         process.reductions =
-            opng_reduce_image(read_ptr, read_info_ptr, reductions);
+            opng_reduce_image(read_ptr, read_info_ptr,
+                              reductions & ~OPNG_REDUCE_PALETTE_TO_RGB);
 
         /* If the image is reduced, enforce full compression. */
         if (process.reductions != OPNG_REDUCE_NONE)
         {
-            opng_load_image_info(read_ptr, read_info_ptr, 1);
-            usr_printf("Reducing image to ");
-            opng_print_image_info(0, 1, 1, 0);
-            usr_printf("\n");
+            opng_load_image_info(read_ptr, read_info_ptr, &image, 1);
+            if (process.reductions & OPNG_REDUCE_TRANSPARENT_COLOR)
+                usr_printf("Cleaning the color of transparent pixels\n");
+            if (process.reductions & ~OPNG_REDUCE_TRANSPARENT_COLOR)
+            {
+                usr_printf("Reducing image to ");
+                opng_print_image_info(0, 1, 1, 0);
+                usr_printf("\n");
+            }
+        }
+        if (num_frames > 0)
+        {
+            /* The delta minimization is not a reduction; -nx keeps it,
+             * and the unreduced image candidate gets it as well.
+             */
+            opng_unstack_apng_frames(height);
+            opng_minimize_apng_frames();
+            if (num_alt_images > 0)
+            {
+                opng_swap_image_info(&image, &alt_images[0]);
+                opng_swap_apng_frames();
+                opng_minimize_apng_frames();
+                opng_swap_image_info(&image, &alt_images[0]);
+                opng_swap_apng_frames();
+            }
         }
 
+        /* Prepare the alternative image candidates. */
+        opng_init_image_candidates(reductions, max_candidates);
+        file_stats.reduction_time = opng_os_wall_clock() - start_time;
+        opng_trace("reduce", OPNG_TRACE_END, 0);
+
         /* Change the interlace type if required. */
         if (options.interlace >= 0 &&
             image.interlace_type != options.interlace)
@@ -1049,13 +2944,23 @@ opng_read_file(FILE *infile)
             /* A change in interlacing requires IDAT recoding. */
             process.status |= OUTPUT_NEEDS_NEW_IDAT;
         }
+        for (i = 0; i < num_alt_images; ++i)
+        {
+            if (options.interlace >= 0)
+                alt_images[i].interlace_type = options.interlace;
+        }
     }
     Catch (err_msg)
     {
-        /* Do the cleanup, then rethrow the exception. */
+        /* Do the cleanup, then rethrow the exception.
+         * The rows must not be deallocated one by one.
+         */
+        pngx_free_rows(read_ptr, read_info_ptr);
         png_data_freer(read_ptr, read_info_ptr,
                        PNG_DESTROY_WILL_FREE_DATA, PNG_FREE_ALL);
         png_destroy_read_struct(&read_ptr, &read_info_ptr, NULL);
+        /* The image info, if loaded, pointed inside the destroyed data. */
+        memset(&image, 0, sizeof(image));
         Throw err_msg;
     }
 
@@ -1067,6 +2972,76 @@ opng_read_file(FILE *infile)
     png_destroy_read_struct(&read_ptr, &read_info_ptr, NULL);
 }
 
+/*
+ * Filtered row size, including the filter byte.
+ */
+static opng_fsize_t
+opng_get_filtered_row_size(png_uint_32 width)
+{
+    static const int type_channels[8] = {1, 0, 3, 1, 2, 0, 4, 0};
+    int pixel_bits;
+
+    pixel_bits = type_channels[image.color_type & 7] * image.bit_depth;
+    return ((opng_fsize_t)width * pixel_bits + 7) / 8 + 1;
+}
+
+/*
+ * Filtered image data size.
+ */
+static opng_fsize_t
+opng_get_filtered_data_size(void)
+{
+    opng_fsize_t data_size;
+    int pass;
+
+    if (image.interlace_type != PNG_INTERLACE_ADAM7)
+        return opng_get_filtered_row_size(image.width) * image.height;
+    data_size = 0;
+    for (pass = 0; pass < PNG_INTERLACE_ADAM7_PASSES; ++pass)
+    {
+        /* The empty passes are not written. */
+        if (PNG_PASS_COLS(image.width, pass) == 0)
+            continue;
+        data_size +=
+            opng_get_filtered_row_size(PNG_PASS_COLS(image.width, pass)) *
+            PNG_PASS_ROWS(image.height, pass);
+    }
+    return data_size;
+}
+
+/*
+ * Row write status handler.
+ * Counts the filtered image data fed to the compressor during the trials.
+ */
+static void
+opng_write_row_status(png_structp png_ptr, png_uint_32 row_number, int pass)
+{
+    /* The row number and the pass given by libpng are those of the next
+     * row, so the current interlace pass is tracked separately.
+     */
+    (void)png_ptr;  /* unused */
+    (void)row_number;  /* unused */
+    (void)pass;  /* unused */
+
+    if (image.interlace_type != PNG_INTERLACE_ADAM7)
+    {
+        trial_stats.deflated_size += opng_get_filtered_row_size(image.width);
+        return;
+    }
+    while (trial_stats.crt_pass_rows == 0)
+    {
+        ++trial_stats.crt_pass;
+        OPNG_ENSURE(trial_stats.crt_pass < PNG_INTERLACE_ADAM7_PASSES,
+                    "Too many interlaced rows");
+        if (PNG_PASS_COLS(image.width, trial_stats.crt_pass) > 0)
+            trial_stats.crt_pass_rows =
+                PNG_PASS_ROWS(image.height, trial_stats.crt_pass);
+    }
+    --trial_stats.crt_pass_rows;
+    trial_stats.deflated_size += opng_get_filtered_row_size(
+        PNG_PASS_COLS(image.width, trial_stats.crt_pass));
+}
+
 /*
  * PNG file writing.
  *
@@ -1124,15 +3099,32 @@ opng_write_file(FILE *outfile,
         png_set_user_limits(write_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
 
         /* Write the PNG stream. */
-        opng_store_image_info(write_ptr, write_info_ptr, (outfile != NULL));
+        opng_store_image_info(write_ptr, write_info_ptr, &image,
+                              (outfile != NULL));
         opng_init_write_data();
         pngx_set_write_fn(write_ptr, outfile, opng_write_data, NULL);
+        if (outfile == NULL)
+        {
+            ++trial_stats.num_trials;
+            trial_stats.data_size += opng_get_filtered_data_size();
+            trial_stats.crt_pass = -1;
+            trial_stats.crt_pass_rows = 0;
+            png_set_write_status_fn(write_ptr, opng_write_row_status);
+        }
         png_write_png(write_ptr, write_info_ptr, 0, NULL);
+        if (outfile == NULL)
+            trial_stats.idat_size += process.out_idat_size;
 
         err_msg = NULL;  /* everything is ok */
     }
     Catch (err_msg)
     {
+        if (outfile == NULL)
+        {
+            trial_stats.idat_size += process.out_idat_size;
+            if (err_msg == NULL)
+                ++trial_stats.num_abandoned;
+        }
         /* Set IDAT size to invalid. */
         process.out_idat_size = idat_size_max + 1;
     }
@@ -1144,6 +3136,37 @@ opng_write_file(FILE *outfile,
         Throw err_msg;
 }
 
+/*
+ * PNG chunk passthrough.
+ * The chunk is written as is, with its original CRC, bypassing libpng.
+ */
+static void
+opng_pass_chunk(FILE *infile, FILE *outfile, png_const_bytep chunk_hdr)
+{
+    png_uint_32 length = png_get_uint_32(chunk_hdr);
+    png_const_bytep chunk_sig = chunk_hdr + 4;
+    opng_foffset_t offset;
+
+    /* Do the output bookkeeping done by opng_write_data(). */
+    if (!opng_allow_chunk((png_bytep)chunk_sig))
+        return;
+    if (memcmp(chunk_sig, sig_IDAT, 4) == 0)
+        process.out_idat_size += length;
+    else if (memcmp(chunk_sig, sig_PLTE, 4) == 0 ||
+             memcmp(chunk_sig, sig_tRNS, 4) == 0)
+        process.out_plte_trns_size += length + 12;
+
+    /* The chunk header is at the current mapping position, or else, the
+     * chunk data is at the current file position. Either way, the chunk
+     * is copied from the input file, and the kernel can move it directly.
+     */
+    offset = (input_map.data != NULL) ?
+        (opng_foffset_t)input_map.pos : opng_ftello(infile) - 8;
+    if (opng_fcopyo(outfile, infile, offset, length + 12) != length + 12)
+        Throw "Can't write the output file";
+    process.out_file_size += length + 12;
+}
+
 /*
  * PNG file copying.
  */
@@ -1153,7 +3176,10 @@ opng_copy_file(FILE *infile, FILE *outfile)
     volatile png_bytep buf;  /* volatile is required by cexcept */
     const png_uint_32 buf_size_incr = 0x1000;
     png_uint_32 buf_size, length;
-    png_byte chunk_hdr[8];
+    png_byte chunk_hdr[8], next_chunk_hdr[8];
+    png_const_bytep chunk_data;
+    int is_first, is_idat, joining_idat;
+    int i;
     const char * volatile err_msg;
 
     write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
@@ -1167,6 +3193,8 @@ opng_copy_file(FILE *infile, FILE *outfile)
     {
         buf = NULL;
         buf_size = 0;
+        is_first = 1;
+        joining_idat = 0;
 
         /* Write the signature in the output file. */
         pngx_write_sig(write_ptr);
@@ -1175,30 +3203,103 @@ opng_copy_file(FILE *infile, FILE *outfile)
         /* Error checking is done only at a very basic level. */
         do
         {
-            if (fread(chunk_hdr, 8, 1, infile) != 1)  /* length + name */
+            if (input_map.data != NULL)
+            {
+                /* Take the chunks straight from the input file mapping. */
+                if (input_map.size - input_map.pos < 8)
+                    Throw "Read error";
+                memcpy(chunk_hdr, input_map.data + input_map.pos, 8);
+            }
+            else if (fread(chunk_hdr, 8, 1, infile) != 1)  /* length + name */
                 Throw "Read error";
             length = png_get_uint_32(chunk_hdr);
             if (length > PNG_UINT_31_MAX)
             {
-                if (buf == NULL && length == 0x89504e47UL)  /* "\x89PNG" */
+                if (is_first && length == 0x89504e47UL)  /* "\x89PNG" */
                 {
                     /* Skip the signature. */
+                    if (input_map.data != NULL)
+                        input_map.pos += 8;
+                    is_first = 0;
                     continue;
                 }
                 Throw "Data error";
             }
-            if (length + 4 > buf_size)
+            for (i = 4; i < 8; ++i)
             {
-                png_free(write_ptr, buf);
-                buf_size =
-                    (((length + 4) + (buf_size_incr - 1)) / buf_size_incr) *
-                    buf_size_incr;
-                buf = (png_bytep)png_malloc(write_ptr, buf_size);
-                /* Do not use realloc() here, it's slower. */
+                if (!((chunk_hdr[i] >= 'A' && chunk_hdr[i] <= 'Z') ||
+                      (chunk_hdr[i] >= 'a' && chunk_hdr[i] <= 'z')))
+                    Throw "Data error";
             }
-            if (fread(buf, length + 4, 1, infile) != 1)  /* data + crc */
+            if (input_map.data != NULL &&
+                input_map.size - input_map.pos < length + 12)
                 Throw "Read error";
-            png_write_chunk(write_ptr, chunk_hdr + 4, buf, length);
+            is_first = 0;
+
+            /* The chunks that are not going to be changed are passed
+             * through, without being recoded by libpng.
+             * The only exceptions are the split IDATs, which are joined,
+             * and the chunks that follow them, up to the first one that is
+             * written out, finalizing the joined IDAT in opng_write_data().
+             * The input had no errors, or else it would have been recoded.
+             */
+            is_idat = (memcmp(chunk_hdr + 4, sig_IDAT, 4) == 0);
+            if (is_idat && !joining_idat)
+            {
+                /* Look ahead for another IDAT. */
+                if (input_map.data != NULL)
+                {
+                    if (input_map.size - input_map.pos - 12 - length >= 8)
+                        memcpy(next_chunk_hdr,
+                               input_map.data + input_map.pos + 12 + length,
+                               8);
+                    else
+                        memset(next_chunk_hdr, 0, 8);
+                }
+                else if (opng_freado(infile, (opng_foffset_t)length + 4,
+                                     SEEK_CUR, next_chunk_hdr, 8) != 8)
+                    memset(next_chunk_hdr, 0, 8);
+                if (memcmp(next_chunk_hdr + 4, sig_IDAT, 4) == 0)
+                    joining_idat = 1;
+            }
+            else if (!is_idat && joining_idat &&
+                     opng_allow_chunk(chunk_hdr + 4))
+                joining_idat = -1;  /* finalize the joined IDAT */
+
+            if (!joining_idat)
+            {
+                opng_pass_chunk(infile, outfile, chunk_hdr);
+                if (input_map.data != NULL)
+                    input_map.pos += length + 12;
+                else if (opng_fseeko(infile, (opng_foffset_t)length + 4,
+                                     SEEK_CUR) != 0)
+                    Throw "Read error";
+                continue;
+            }
+            if (joining_idat < 0)
+                joining_idat = 0;
+
+            if (input_map.data != NULL)
+            {
+                chunk_data = input_map.data + input_map.pos + 8;
+                input_map.pos += length + 12;  /* hdr + data + crc */
+            }
+            else
+            {
+                if (length + 4 > buf_size)
+                {
+                    png_free(write_ptr, buf);
+                    buf_size =
+                        (((length + 4) + (buf_size_incr - 1)) /
+                         buf_size_incr) * buf_size_incr;
+                    buf = (png_bytep)png_malloc(write_ptr, buf_size);
+                    /* Do not use realloc() here, it's slower. */
+                }
+                if (fread(buf, length + 4, 1, infile) != 1)  /* data + crc */
+                    Throw "Read error";
+                chunk_data = buf;
+            }
+            png_write_chunk(write_ptr, chunk_hdr + 4, chunk_data, length);
         } while (memcmp(chunk_hdr + 4, sig_IEND, 4) != 0);
 
         err_msg = NULL;  /* everything is ok */
@@ -1214,28 +3315,6 @@ opng_copy_file(FILE *infile, FILE *outfile)
         Throw err_msg;
 }
 
-/*
- * Iteration initialization.
- */
-static void
-opng_init_iteration(opng_bitset_t cmdline_set, opng_bitset_t mask_set,
-                    const char *preset, opng_bitset_t *output_set)
-{
-    opng_bitset_t preset_set;
-    int check;
-
-    *output_set = cmdline_set & mask_set;
-    if (*output_set == 0 && cmdline_set != 0)
-        Throw "Iteration parameter(s) out of range";
-    if (*output_set == 0 || options.optim_level >= 0)
-    {
-        check =
-            opng_strparse_rangeset_to_bitset(&preset_set, preset, mask_set);
-        OPNG_ENSURE(check == 0, "[internal] Invalid preset");
-        *output_set |= preset_set & mask_set;
-    }
-}
-
 /*
  * Iteration initialization.
  */
@@ -1243,16 +3322,17 @@ static void
 opng_init_iterations(void)
 {
     opng_bitset_t compr_level_set, mem_level_set, strategy_set, filter_set;
-    opng_bitset_t strategy_singles_set;
-    int preset_index;
-    int t1, t2;
 
     /* Set the IDAT size limit. The trials that pass this limit will be
      * abandoned, as there will be no need to wait until their completion.
      * This limit may further decrease as iterations go on.
      */
-    if ((process.status & OUTPUT_NEEDS_NEW_IDAT) || options.full)
+    if ((process.status & OUTPUT_NEEDS_NEW_IDAT) || options.full ||
+        num_frames > 0)
+    {
+        /* The APNG frames may need a new IDAT, even if it grows. */
         process.max_idat_size = idat_size_max;
+    }
     else
     {
         OPNG_ENSURE(process.in_idat_size > 0, "No IDAT in input");
@@ -1266,90 +3346,611 @@ opng_init_iterations(void)
             process.in_idat_size + process.in_plte_trns_size;
     }
 
-    /* Get preset_index from options.optim_level, but leave the latter intact,
-     * because the effect of "optipng -o2 -z... -f..." is slightly different
-     * from the effect of "optipng -z... -f..." (without "-o").
-     */
-    preset_index = options.optim_level;
-    if (preset_index < 0)
-        preset_index = OPNG_OPTIM_LEVEL_DEFAULT;
-    else if (preset_index > OPNG_OPTIM_LEVEL_MAX)
-        preset_index = OPNG_OPTIM_LEVEL_MAX;
+    /* Initialize the iteration sets.
+     * Combine the user-defined values with the optimization presets.
+     */
+    opng_get_iteration_sets(opng_get_preset_index(),
+                            &compr_level_set, &mem_level_set,
+                            &strategy_set, &filter_set);
+
+    /* Skip the trials if the best parameters are known from the cache.
+     * The APNG frames may have other best parameters than the image.
+     */
+    if (result_cache.has_known && num_frames == 0)
+    {
+        compr_level_set = mem_level_set = strategy_set = filter_set = 0;
+        opng_bitset_set(&compr_level_set, result_cache.known.compr_level);
+        opng_bitset_set(&mem_level_set, result_cache.known.mem_level);
+        opng_bitset_set(&strategy_set, result_cache.known.strategy);
+        opng_bitset_set(&filter_set, result_cache.known.filter);
+    }
+
+    /* Store the results into process. */
+    process.compr_level_set = compr_level_set;
+    process.mem_level_set = mem_level_set;
+    process.strategy_set = strategy_set;
+    process.filter_set = filter_set;
+    process.num_iterations =
+        opng_count_iterations(compr_level_set, mem_level_set,
+                              strategy_set, filter_set);
+    OPNG_ENSURE(process.num_iterations > 0, "Invalid iteration parameters");
+}
+
+/*
+ * Trial parameter check.
+ * Returns 1 if the given parameters are among the current trials,
+ * or 0 otherwise.
+ */
+static int
+opng_is_trial(int compr_level, int mem_level, int strategy, int filter)
+{
+    if (compr_level < OPNG_COMPR_LEVEL_MIN ||
+        compr_level > OPNG_COMPR_LEVEL_MAX ||
+        mem_level < OPNG_MEM_LEVEL_MIN || mem_level > OPNG_MEM_LEVEL_MAX ||
+        strategy < OPNG_STRATEGY_MIN || strategy > OPNG_STRATEGY_MAX ||
+        filter < OPNG_FILTER_MIN || filter > OPNG_FILTER_MAX)
+        return 0;
+    if (!opng_bitset_test(process.filter_set, filter) ||
+        !opng_bitset_test(process.strategy_set, strategy) ||
+        !opng_bitset_test(process.mem_level_set, mem_level))
+        return 0;
+    /* See the compression level selection in opng_iterate(). */
+    if (strategy == Z_HUFFMAN_ONLY)
+        return (compr_level == 1);
+    if (strategy == Z_RLE)
+        return (compr_level == 9);
+    return opng_bitset_test(process.compr_level_set, compr_level);
+}
+
+/*
+ * Trial rank, in the canonical iteration order.
+ */
+static int
+opng_get_trial_rank(int compr_level, int mem_level, int strategy, int filter)
+{
+    return ((filter * (OPNG_STRATEGY_MAX + 1) + strategy) * 10 +
+            (OPNG_COMPR_LEVEL_MAX - compr_level)) * 10 +
+           (OPNG_MEM_LEVEL_MAX - mem_level);
+}
+
+/*
+ * Warm start.
+ * Selects the parameters that have won most often the trials on the images
+ * of the same type (and preferably of the same size) as the current image,
+ * according to the result cache. These parameters are tried first, to make
+ * the remaining trials abandon early.
+ * Returns the number of parameter combinations selected.
+ */
+static int
+opng_get_warm_start(int params[][4], int max_count)
+{
+    static unsigned long weights[OPNG_TRIAL_RANK_MAX + 1];
+    const struct opng_cache_record *record;
+    int best_rank, rank;
+    int count;
+    size_t i;
+
+    if (!result_cache.enabled || result_cache.records.num_records == 0)
+        return 0;
+
+    memset(weights, 0, sizeof(weights));
+    for (i = 0; i < result_cache.records.num_records; ++i)
+    {
+        record = &result_cache.records.records[i];
+        if (record->color_type != image.color_type ||
+            record->bit_depth != image.bit_depth ||
+            !opng_is_trial(record->compr_level, record->mem_level,
+                           record->strategy, record->filter))
+            continue;
+        rank = opng_get_trial_rank(record->compr_level, record->mem_level,
+                                   record->strategy, record->filter);
+        if (record->width == image.width && record->height == image.height)
+            weights[rank] += 4;
+        else
+            weights[rank] += 1;
+    }
+
+    /* Select the heaviest combinations. The ties are broken in favor of
+     * the combinations that come first in the canonical iteration order.
+     */
+    for (count = 0; count < max_count; ++count)
+    {
+        best_rank = 0;
+        for (rank = 1; rank <= OPNG_TRIAL_RANK_MAX; ++rank)
+        {
+            if (weights[best_rank] < weights[rank])
+                best_rank = rank;
+        }
+        if (weights[best_rank] == 0)
+            break;
+        weights[best_rank] = 0;
+        params[count][0] = OPNG_COMPR_LEVEL_MAX - (best_rank / 10) % 10;
+        params[count][1] = OPNG_MEM_LEVEL_MAX - best_rank % 10;
+        params[count][2] = (best_rank / 100) % (OPNG_STRATEGY_MAX + 1);
+        params[count][3] = best_rank / (100 * (OPNG_STRATEGY_MAX + 1));
+    }
+    return count;
+}
+
+/*
+ * Time budget check.
+ * Returns 1 if the time budget of the current file is exhausted,
+ * or 0 otherwise.
+ */
+static int
+opng_is_over_budget(void)
+{
+    return (process.deadline > 0 && opng_os_wall_clock() >= process.deadline);
+}
+
+/*
+ * Trial recording.
+ * Adds the statistics of the last trial to the file statistics.
+ * The trial statistics collected before the last trial are given.
+ */
+static void
+opng_add_trial_record(int compr_level, int mem_level,
+                      int strategy, int filter,
+                      double wall_time, double cpu_time,
+                      const struct opng_trial_stats_struct *saved_trial_stats)
+{
+    struct opng_trial_record *trial;
+    size_t max_trials;
+
+    if (file_stats.num_trials >= file_stats.max_trials)
+    {
+        max_trials =
+            (file_stats.max_trials > 0) ? 2 * file_stats.max_trials : 64;
+        trial = (struct opng_trial_record *)
+            realloc(file_stats.trials, max_trials * sizeof(*trial));
+        if (trial == NULL)
+            return;  /* not essential */
+        file_stats.trials = trial;
+        file_stats.max_trials = max_trials;
+    }
+    trial = &file_stats.trials[file_stats.num_trials++];
+    trial->candidate = file_stats.crt_candidate;
+    trial->frame = file_stats.crt_frame;
+    trial->compr_level = compr_level;
+    trial->mem_level = mem_level;
+    trial->strategy = strategy;
+    trial->filter = filter;
+    trial->wall_time = wall_time;
+    trial->cpu_time = cpu_time;
+    trial->data_size =
+        trial_stats.data_size - saved_trial_stats->data_size;
+    trial->deflated_size =
+        trial_stats.deflated_size - saved_trial_stats->deflated_size;
+    trial->idat_size =
+        trial_stats.idat_size - saved_trial_stats->idat_size;
+    trial->is_abandoned =
+        (trial_stats.num_abandoned != saved_trial_stats->num_abandoned);
+}
+
+/*
+ * Trial.
+ * The trial is displayed on request.
+ */
+static void
+opng_run_trial(int compr_level, int mem_level, int strategy, int filter,
+               int show_trials, int *counter, int *line_reused)
+{
+    struct opng_trial_stats_struct saved_trial_stats;
+    double wall_time, cpu_time;
+    char trace_name[64];
+    int rank;
+
+    if (show_trials)
+    {
+        usr_printf("  zc = %d  zm = %d  zs = %d  f = %d",
+                   compr_level, mem_level, strategy, filter);
+        usr_progress(*counter, process.num_iterations);
+    }
+    ++*counter;
+    saved_trial_stats = trial_stats;
+    if (usr_trace != NULL)
+    {
+        sprintf(trace_name, "trial zc=%d zm=%d zs=%d f=%d",
+                compr_level, mem_level, strategy, filter);
+        opng_trace(trace_name, OPNG_TRACE_BEGIN, 0);
+    }
+    if (file_stats.enabled)
+    {
+        wall_time = opng_os_wall_clock();
+        cpu_time = opng_os_cpu_clock();
+        opng_write_file(NULL, compr_level, mem_level, strategy, filter);
+        opng_add_trial_record(compr_level, mem_level, strategy, filter,
+                              opng_os_wall_clock() - wall_time,
+                              opng_os_cpu_clock() - cpu_time,
+                              &saved_trial_stats);
+    }
+    else
+        opng_write_file(NULL, compr_level, mem_level, strategy, filter);
+    if (usr_trace != NULL)
+        opng_trace(trace_name,
+                   (trial_stats.num_abandoned !=
+                    saved_trial_stats.num_abandoned) ?
+                       OPNG_TRACE_ABORT : OPNG_TRACE_END,
+                   trial_stats.idat_size - saved_trial_stats.idat_size);
+    if (process.out_idat_size > idat_size_max)
+    {
+        if (!show_trials)
+            return;
+        if (options.verbose)
+        {
+            usr_printf("\t\tIDAT too big\n");
+            *line_reused = 0;
+        }
+        else
+        {
+            usr_print_cntrl('\r');  /* CR: reset line */
+            *line_reused = 1;
+        }
+        return;
+    }
+    if (show_trials)
+        usr_printf("\t\tIDAT size = %" OPNG_FSIZE_PRIu "\n",
+                   process.out_idat_size);
+    *line_reused = 0;
+    if (process.best_idat_size < process.out_idat_size)
+    {
+        /* The current best size is smaller than the last size.
+         * Discard the last trial.
+         */
+        return;
+    }
+    rank = opng_get_trial_rank(compr_level, mem_level, strategy, filter);
+    if (process.best_idat_size == process.out_idat_size)
+    {
+        /* The current best size is equal to the last size.
+         * Select the same trial as the one that would have been selected
+         * if the trials had been run in the canonical order: the first
+         * trial of the fastest strategies, or else the last trial.
+         */
+        if (rank > process.best_rank ?
+            (process.best_strategy == Z_HUFFMAN_ONLY ||
+             process.best_strategy == Z_RLE) :
+            (strategy != Z_HUFFMAN_ONLY && strategy != Z_RLE))
+            return;
+    }
+    process.best_compr_level = compr_level;
+    process.best_mem_level = mem_level;
+    process.best_strategy = strategy;
+    process.best_filter = filter;
+    process.best_rank = rank;
+    process.best_idat_size = process.out_idat_size;
+    if (!options.full)
+        process.max_idat_size = process.out_idat_size;
+}
+
+/*
+ * Filtered residual.
+ * Returns the byte at the given position in the row, filtered with the
+ * given filter type.
+ */
+static int
+opng_get_residual(png_bytep row, png_bytep prev_row, size_t pos, size_t bpp,
+                  int filter)
+{
+    int a, b, c, p, pa, pb, pc;
+
+    a = (pos >= bpp) ? row[pos - bpp] : 0;
+    b = (prev_row != NULL) ? prev_row[pos] : 0;
+    c = (prev_row != NULL && pos >= bpp) ? prev_row[pos - bpp] : 0;
+    switch (filter)
+    {
+    case 1:  /* Sub */
+        return (row[pos] - a) & 0xff;
+    case 2:  /* Up */
+        return (row[pos] - b) & 0xff;
+    case 3:  /* Average */
+        return (row[pos] - (a + b) / 2) & 0xff;
+    case 4:  /* Paeth */
+        p = a + b - c;
+        pa = abs(p - a);
+        pb = abs(p - b);
+        pc = abs(p - c);
+        if (pa <= pb && pa <= pc)
+            return (row[pos] - a) & 0xff;
+        return (row[pos] - ((pb <= pc) ? b : c)) & 0xff;
+    default:  /* None */
+        return row[pos];
+    }
+}
+
+/*
+ * Order-0 entropy of a byte histogram, in bits.
+ */
+static double
+opng_get_entropy(const unsigned long histogram[256])
+{
+    unsigned long total;
+    double entropy;
+    int i;
+
+    total = 0;
+    entropy = 0;
+    for (i = 0; i < 256; ++i)
+    {
+        if (histogram[i] == 0)
+            continue;
+        total += histogram[i];
+        entropy -= histogram[i] * log((double)histogram[i]);
+    }
+    if (total > 0)
+        entropy += total * log((double)total);
+    return entropy / log(2.0);
+}
+
+/*
+ * Filter estimation.
+ * Estimates the compressibility of the image data under each filter as the
+ * order-0 entropy of the filtered bytes, over a sample of rows. Under the
+ * adaptive filtering, each row is filtered like libpng does, with the
+ * filter that yields the smallest sum of absolute residuals.
+ */
+static void
+opng_estimate_filters(double estimates[OPNG_FILTER_MAX + 1])
+{
+    static const int type_channels[8] = {1, 0, 3, 1, 2, 0, 4, 0};
+    static unsigned long histograms[OPNG_FILTER_MAX + 1][256];
+    unsigned long sums[OPNG_FILTER_MAX];
+    png_bytep row, prev_row;
+    png_uint_32 y, step;
+    size_t row_size, bpp, i;
+    int pixel_bits, filter, best_filter, residual;
+
+    memset(histograms, 0, sizeof(histograms));
+    pixel_bits = type_channels[image.color_type & 7] * image.bit_depth;
+    bpp = (pixel_bits + 7) / 8;
+    row_size = ((size_t)image.width * pixel_bits + 7) / 8;
+    step = image.height / OPNG_FILTER_SAMPLE_ROWS;
+    if (step == 0)
+        step = 1;
+    for (y = 0; y < image.height; y += step)
+    {
+        row = image.row_pointers[y];
+        prev_row = (y > 0) ? image.row_pointers[y - 1] : NULL;
+        memset(sums, 0, sizeof(sums));
+        for (i = 0; i < row_size; ++i)
+        {
+            for (filter = 0; filter < OPNG_FILTER_MAX; ++filter)
+            {
+                residual = opng_get_residual(row, prev_row, i, bpp, filter);
+                ++histograms[filter][residual];
+                sums[filter] += (residual < 128) ? residual : 256 - residual;
+            }
+        }
+        best_filter = 0;
+        for (filter = 1; filter < OPNG_FILTER_MAX; ++filter)
+        {
+            if (sums[best_filter] > sums[filter])
+                best_filter = filter;
+        }
+        for (i = 0; i < row_size; ++i)
+            ++histograms[OPNG_FILTER_MAX][
+                opng_get_residual(row, prev_row, i, bpp, best_filter)];
+    }
+    for (filter = 0; filter <= OPNG_FILTER_MAX; ++filter)
+        estimates[filter] = opng_get_entropy(histograms[filter]);
+}
+
+/*
+ * Trial scheduling.
+ * Appends the given parameters to the trial schedule, unless they are not
+ * among the current trials, or they have already been scheduled.
+ */
+static void
+opng_schedule_trial(int compr_level, int mem_level, int strategy, int filter)
+{
+    int rank;
+
+    if (!opng_is_trial(compr_level, mem_level, strategy, filter))
+        return;
+    rank = opng_get_trial_rank(compr_level, mem_level, strategy, filter);
+    if (trial_schedule.is_scheduled[rank])
+        return;
+    trial_schedule.is_scheduled[rank] = 1;
+    trial_schedule.params[trial_schedule.count][0] = compr_level;
+    trial_schedule.params[trial_schedule.count][1] = mem_level;
+    trial_schedule.params[trial_schedule.count][2] = strategy;
+    trial_schedule.params[trial_schedule.count][3] = filter;
+    ++trial_schedule.count;
+}
+
+/*
+ * Trial schedule initialization.
+ * The trials that are likely to produce the smallest IDAT are scheduled
+ * first, to make the remaining trials abandon early, and to minimize the
+ * amount of data compressed overall. The order of the trials does not
+ * affect the selection of the best trial (see opng_run_trial()).
+ */
+static void
+opng_init_trial_schedule(void)
+{
+    int warm_params[OPNG_WARM_START_MAX][4];
+    int num_warm_params;
+    double estimates[OPNG_FILTER_MAX + 1];
+    int filters[OPNG_FILTER_MAX + 1];
+    int num_filters;
+    int compr_level, mem_level, strategy, filter;
+    int i, j;
+
+    memset(trial_schedule.is_scheduled, 0,
+           sizeof(trial_schedule.is_scheduled));
+    memset(trial_schedule.estimates, 0, sizeof(trial_schedule.estimates));
+    trial_schedule.count = 0;
+
+    /* Start with the parameters that are likely to win. */
+    num_warm_params = (process.num_iterations > 1) ?
+        opng_get_warm_start(warm_params, OPNG_WARM_START_MAX) : 0;
+    for (i = 0; i < num_warm_params; ++i)
+        opng_schedule_trial(warm_params[i][0], warm_params[i][1],
+                            warm_params[i][2], warm_params[i][3]);
+
+    /* Continue with the libpng's "best guess" heuristics.
+     * See opng_init_iterations().
+     */
+    if (image.bit_depth < 8 || image.palette != NULL)
+        opng_schedule_trial(Z_BEST_COMPRESSION, 8, Z_DEFAULT_STRATEGY, 0);
+    else
+        opng_schedule_trial(Z_BEST_COMPRESSION, 8, Z_FILTERED, 5);
+
+    /* Sort the filters by their estimates, using the insertion sort. */
+    num_filters = 0;
+    for (filter = OPNG_FILTER_MIN; filter <= OPNG_FILTER_MAX; ++filter)
+    {
+        if (opng_bitset_test(process.filter_set, filter))
+            filters[num_filters++] = filter;
+    }
+    if (num_filters > 1)
+    {
+        opng_estimate_filters(estimates);
+        memcpy(trial_schedule.estimates, estimates, sizeof(estimates));
+        for (i = 1; i < num_filters; ++i)
+        {
+            filter = filters[i];
+            for (j = i; j > 0 && estimates[filters[j - 1]] > estimates[filter];
+                 --j)
+                filters[j] = filters[j - 1];
+            filters[j] = filter;
+        }
+    }
+
+    /* Schedule the remaining trials, filter by filter. Within each filter,
+     * keep the canonical order.
+     */
+    for (i = 0; i < num_filters; ++i)
+    {
+        for (strategy = OPNG_STRATEGY_MIN;
+             strategy <= OPNG_STRATEGY_MAX;
+             ++strategy)
+        {
+            for (compr_level = OPNG_COMPR_LEVEL_MAX;
+                 compr_level >= OPNG_COMPR_LEVEL_MIN;
+                 --compr_level)
+            {
+                for (mem_level = OPNG_MEM_LEVEL_MAX;
+                     mem_level >= OPNG_MEM_LEVEL_MIN;
+                     --mem_level)
+                    opng_schedule_trial(compr_level, mem_level, strategy,
+                                        filters[i]);
+            }
+        }
+    }
+    OPNG_ENSURE(trial_schedule.count == process.num_iterations,
+                "Inconsistent trial schedule");
+}
+
+/*
+ * Trial size projection.
+ * Returns the IDAT size of the last trial, or, if the trial has been
+ * abandoned, the size extrapolated from the point of abandonment.
+ * Returns 0 if the size can't be projected.
+ */
+static double
+opng_project_trial_size(const struct opng_trial_stats_struct *saved_stats)
+{
+    if (trial_stats.num_abandoned == saved_stats->num_abandoned)
+        return (process.out_idat_size <= idat_size_max) ?
+               (double)process.out_idat_size : 0;
+    if (trial_stats.deflated_size == saved_stats->deflated_size)
+        return 0;
+    return (double)(trial_stats.idat_size - saved_stats->idat_size) *
+           (trial_stats.data_size - saved_stats->data_size) /
+           (trial_stats.deflated_size - saved_stats->deflated_size);
+}
 
-    /* Initialize the iteration sets.
-     * Combine the user-defined values with the optimization presets.
-     */
-    opng_init_iteration(options.compr_level_set, OPNG_COMPR_LEVEL_SET_MASK,
-                        presets[preset_index].compr_level, &compr_level_set);
-    opng_init_iteration(options.mem_level_set, OPNG_MEM_LEVEL_SET_MASK,
-                        presets[preset_index].mem_level, &mem_level_set);
-    opng_init_iteration(options.strategy_set, OPNG_STRATEGY_SET_MASK,
-                        presets[preset_index].strategy, &strategy_set);
-    opng_init_iteration(options.filter_set, OPNG_FILTER_SET_MASK,
-                        presets[preset_index].filter, &filter_set);
+/*
+ * Convergence check.
+ * Returns 1 if the trials of the given filter can't plausibly beat the
+ * current best trial, or 0 otherwise.
+ * The smallest IDAT size of each filter tried so far, divided by the
+ * entropy estimate of that filter, calibrates the estimates. The size
+ * predicted for the given filter is its estimate, times the most optimistic
+ * calibration factor. It must exceed the size to beat by a margin that is
+ * proportional to the observed spread, i.e. the spread of the calibration
+ * factors, or the average spread of the sizes yielded by the compression
+ * levels and strategies under the same filter, whichever is larger.
+ * The margin grows with the confidence required.
+ */
+static int
+opng_is_hopeless_filter(int filter,
+                        const double min_sizes[OPNG_FILTER_MAX + 1],
+                        const double max_sizes[OPNG_FILTER_MAX + 1])
+{
+    double factor, min_factor, max_factor;
+    double target_size, spread, param_spread;
+    int num_factors;
+    int i;
 
-    /* Replace the empty sets with the libpng's "best guess" heuristics. */
-    if (compr_level_set == 0)
-        opng_bitset_set(&compr_level_set, Z_BEST_COMPRESSION);  /* -zc9 */
-    if (mem_level_set == 0)
-        opng_bitset_set(&mem_level_set, 8);
-    if (image.bit_depth < 8 || image.palette != NULL)
-    {
-        if (strategy_set == 0)
-            opng_bitset_set(&strategy_set, Z_DEFAULT_STRATEGY);  /* -zs0 */
-        if (filter_set == 0)
-            opng_bitset_set(&filter_set, 0);  /* -f0 */
-    }
+    if (options.converge <= 0 || trial_schedule.estimates[filter] <= 0 ||
+        min_sizes[filter] > 0)
+        return 0;
+    if (process.best_idat_size <= idat_size_max)
+        target_size = (double)process.best_idat_size;
+    else if (process.max_idat_size < idat_size_max)
+        target_size = (double)process.max_idat_size;
     else
+        return 0;  /* nothing to beat */
+
+    num_factors = 0;
+    min_factor = max_factor = param_spread = 0;
+    for (i = OPNG_FILTER_MIN; i <= OPNG_FILTER_MAX; ++i)
     {
-        if (strategy_set == 0)
-            opng_bitset_set(&strategy_set, Z_FILTERED);  /* -zs1 */
-        if (filter_set == 0)
-            opng_bitset_set(&filter_set, 5);  /* -f0 */
+        if (min_sizes[i] <= 0 || trial_schedule.estimates[i] <= 0)
+            continue;
+        factor = min_sizes[i] / trial_schedule.estimates[i];
+        if (num_factors == 0 || min_factor > factor)
+            min_factor = factor;
+        if (num_factors == 0 || max_factor < factor)
+            max_factor = factor;
+        param_spread += (max_sizes[i] - min_sizes[i]) / min_sizes[i];
+        ++num_factors;
     }
-
-    /* Store the results into process. */
-    process.compr_level_set = compr_level_set;
-    process.mem_level_set = mem_level_set;
-    process.strategy_set = strategy_set;
-    process.filter_set = filter_set;
-    strategy_singles_set = (1 << Z_HUFFMAN_ONLY) | (1 << Z_RLE);
-    t1 = opng_bitset_count(compr_level_set) *
-         opng_bitset_count(strategy_set & ~strategy_singles_set);
-    t2 = opng_bitset_count(strategy_set & strategy_singles_set);
-    process.num_iterations = (t1 + t2) *
-                             opng_bitset_count(mem_level_set) *
-                             opng_bitset_count(filter_set);
-    OPNG_ENSURE(process.num_iterations > 0, "Invalid iteration parameters");
+    if (num_factors < 2)
+        return 0;  /* not enough data to judge the spread */
+    spread = (max_factor - min_factor) / min_factor;
+    param_spread /= num_factors;
+    if (spread < param_spread)
+        spread = param_spread;
+    return (trial_schedule.estimates[filter] * min_factor >
+            target_size *
+            (1 + spread * options.converge / (100 - options.converge)));
 }
 
 /*
  * Iteration.
+ * The trials are displayed on request.
  */
 static void
-opng_iterate(void)
+opng_iterate(int show_trials)
 {
-    opng_bitset_t compr_level_set, mem_level_set, strategy_set, filter_set;
-    int compr_level, mem_level, strategy, filter;
+    struct opng_trial_stats_struct saved_trial_stats;
+    double min_sizes[OPNG_FILTER_MAX + 1], max_sizes[OPNG_FILTER_MAX + 1];
+    double size;
     int counter;
     int line_reused;
+    int num_converged, num_exhausted;
+    int filter;
+    int i, j;
 
     OPNG_ENSURE(process.num_iterations > 0, "Iterations not initialized");
 
-    compr_level_set = process.compr_level_set;
-    mem_level_set = process.mem_level_set;
-    strategy_set = process.strategy_set;
-    filter_set = process.filter_set;
-
     if ((process.num_iterations == 1) &&
-        (process.status & OUTPUT_NEEDS_NEW_IDAT))
+        (process.status & OUTPUT_NEEDS_NEW_IDAT) &&
+        (num_alt_images == 0))
     {
         /* There is only one combination. Select it and return. */
         process.best_idat_size = 0;  /* unknown */
-        process.best_compr_level = opng_bitset_find_first(compr_level_set);
-        process.best_mem_level = opng_bitset_find_first(mem_level_set);
-        process.best_strategy = opng_bitset_find_first(strategy_set);
-        process.best_filter = opng_bitset_find_first(filter_set);
+        process.best_compr_level =
+            opng_bitset_find_first(process.compr_level_set);
+        process.best_mem_level =
+            opng_bitset_find_first(process.mem_level_set);
+        process.best_strategy =
+            opng_bitset_find_first(process.strategy_set);
+        process.best_filter =
+            opng_bitset_find_first(process.filter_set);
         return;
     }
 
@@ -1359,115 +3960,347 @@ opng_iterate(void)
     process.best_mem_level = -1;
     process.best_strategy = -1;
     process.best_filter = -1;
+    process.best_rank = -1;
+    memset(&trial_stats, 0, sizeof(trial_stats));
+    opng_init_trial_schedule();
 
-    /* Iterate through the "hyper-rectangle" (zc, zm, zs, f). */
-    usr_printf("\nTrying:\n");
+    if (show_trials)
+        usr_printf("\nTrying:\n");
     line_reused = 0;
     counter = 0;
-    for (filter = OPNG_FILTER_MIN;
-         filter <= OPNG_FILTER_MAX;
-         ++filter)
+    num_converged = num_exhausted = 0;
+    memset(min_sizes, 0, sizeof(min_sizes));
+    memset(max_sizes, 0, sizeof(max_sizes));
+
+    /* Iterate through the "hyper-rectangle" (zc, zm, zs, f),
+     * in the scheduled order.
+     * When the time budget is exhausted, stop launching new trials, and
+     * keep the best trial so far. The most promising trials come first,
+     * and at least one trial is run.
+     * Under -converge, skip the groups of trials of the filters that are
+     * unlikely to beat the best trial so far.
+     */
+    for (i = 0; i < trial_schedule.count; ++i)
     {
-        if (!opng_bitset_test(filter_set, filter))
-            continue;
-        for (strategy = OPNG_STRATEGY_MIN;
-             strategy <= OPNG_STRATEGY_MAX;
-             ++strategy)
+        if (i > 0 && opng_is_over_budget())
         {
-            if (!opng_bitset_test(strategy_set, strategy))
-                continue;
-            if (strategy == Z_HUFFMAN_ONLY)
+            num_exhausted = trial_schedule.count - i;
+            process.status |= OUTPUT_HAS_SKIPPED_TRIALS;
+            break;
+        }
+        filter = trial_schedule.params[i][3];
+        if (i > 0 && filter != trial_schedule.params[i - 1][3] &&
+            opng_is_hopeless_filter(filter, min_sizes, max_sizes))
+        {
+            for (j = i + 1; j < trial_schedule.count; ++j)
             {
-                /* Under Z_HUFFMAN_ONLY, all compression levels
-                 * (deflate_fast and deflate_slow combined)
-                 * produce the same output. Pick level 1.
-                 */
-                compr_level_set = 0;
-                opng_bitset_set(&compr_level_set, 1);
+                if (trial_schedule.params[j][3] != filter)
+                    break;
             }
-            else if (strategy == Z_RLE)
+            num_converged += j - i;
+            i = j - 1;
+            continue;
+        }
+        saved_trial_stats = trial_stats;
+        opng_run_trial(trial_schedule.params[i][0],
+                       trial_schedule.params[i][1],
+                       trial_schedule.params[i][2],
+                       filter,
+                       show_trials, &counter, &line_reused);
+        size = opng_project_trial_size(&saved_trial_stats);
+        if (size > 0 && (min_sizes[filter] <= 0 || min_sizes[filter] > size))
+            min_sizes[filter] = size;
+        if (max_sizes[filter] < size)
+            max_sizes[filter] = size;
+    }
+    if (line_reused)
+        usr_print_cntrl(-31);  /* minus N: erase N chars from start of line */
+
+    trial_stats.num_skipped = num_converged + num_exhausted;
+    file_stats.num_skipped_trials += trial_stats.num_skipped;
+    OPNG_ENSURE(counter + trial_stats.num_skipped == process.num_iterations,
+                "Inconsistent iteration counter");
+    if (show_trials)
+        usr_progress(counter, process.num_iterations);
+    if (show_trials && num_converged > 0)
+        usr_printf("Converged: %d trial(s) skipped\n", num_converged);
+    if (show_trials && num_exhausted > 0)
+        usr_printf("Time budget exhausted: %d trial(s) skipped\n",
+                   num_exhausted);
+
+    if (show_trials && options.verbose)
+    {
+        usr_printf("Trials: %d (%d abandoned early)\n",
+                   trial_stats.num_trials, trial_stats.num_abandoned);
+        usr_printf("Trial bytes: %" OPNG_FSIZE_PRIu " deflated into %"
+                   OPNG_FSIZE_PRIu ", %" OPNG_FSIZE_PRIu " saved\n",
+                   trial_stats.deflated_size, trial_stats.idat_size,
+                   trial_stats.data_size - trial_stats.deflated_size);
+    }
+}
+
+/*
+ * APNG chunk update.
+ * Each frame is stored in a single fdAT, and the sequence numbers of
+ * the fcTL and fdAT chunks are renumbered accordingly.
+ */
+static void
+opng_update_apng_chunks(void)
+{
+    png_unknown_chunkp chunk;
+    struct opng_frame_struct *frame;
+    png_uint_32 seq_num;
+    int i, j, k;
+
+    seq_num = 0;
+    for (i = j = k = 0; i < image.num_unknowns; ++i)
+    {
+        chunk = &image.unknowns[i];
+        if (memcmp(chunk->name, sig_fcTL, 4) == 0)
+            png_save_uint_32(chunk->data, seq_num++);
+        else if (memcmp(chunk->name, sig_fdAT, 4) == 0)
+        {
+            opng_free(chunk->data);
+            chunk->data = NULL;
+            if (k >= num_frames || frames[k].fdat_index != i)
+                continue;  /* drop the continuation chunk */
+            /* Hand over the frame data to the chunk. */
+            frame = &frames[k++];
+            png_save_uint_32(frame->data, seq_num++);
+            chunk->data = frame->data;
+            chunk->size = 4 + (size_t)frame->data_size;
+            frame->data = NULL;
+            frame->data_size = frame->alloc_size = 0;
+            frame->fdat_index = j;
+        }
+        image.unknowns[j++] = *chunk;
+    }
+    image.num_unknowns = j;
+}
+
+/*
+ * Iteration over the APNG frames.
+ * Each frame is swapped into the optimized image, and goes through the same
+ * trials as the image. A frame is recompressed only if it gets smaller,
+ * unless the image reductions require its recompression.
+ * The frames are processed sequentially, because the engine is not
+ * thread-safe.
+ */
+static void
+opng_iterate_frames(int is_reduced)
+{
+    static struct opng_frame_struct new_frame;  /* static is required */
+    struct opng_process_struct saved_process;                /* by cexcept */
+    struct opng_frame_struct *frame;
+    png_uint_32 width, height;
+    png_bytepp row_pointers;
+    opng_fsize_t fdat_size;
+    int must_recode;
+    int i;
+    const char * volatile err_msg;  /* volatile is required by cexcept */
+
+    if (num_frames == 0)
+        return;
+
+    usr_printf("\nOptimizing %d APNG frames\n", num_frames);
+    saved_process = process;
+    must_recode = is_reduced || (process.status & OUTPUT_NEEDS_NEW_IDAT);
+    width = image.width;
+    height = image.height;
+    row_pointers = image.row_pointers;
+    fdat_size = 0;
+    Try
+    {
+        for (i = 0; i < num_frames; ++i)
+        {
+            usr_progress(i, num_frames);
+            frame = &frames[i];
+            image.width = frame->width;
+            image.height = frame->height;
+            image.row_pointers = frame->row_pointers;
+            process.max_idat_size =
+                (must_recode || frame->is_modified) ?
+                idat_size_max : frame->data_size;
+            file_stats.crt_frame = i + 1;
+            if (!must_recode && !frame->is_modified && opng_is_over_budget())
             {
-                /* Under Z_RLE, all deflate_fast compression levels produce
-                 * the same output. Ditto about the deflate_slow levels.
-                 * Pick level 9, in preference for deflate_slow.
-                 */
-                compr_level_set = 0;
-                opng_bitset_set(&compr_level_set, 9);
+                /* Keep the frame as it is. */
+                process.status |= OUTPUT_HAS_SKIPPED_TRIALS;
+                process.best_idat_size = idat_size_max + 1;
             }
             else
+                opng_iterate(0);
+            if (process.best_idat_size <= idat_size_max)
             {
-                /* Restore compr_level_set. */
-                compr_level_set = process.compr_level_set;
-            }
-            for (compr_level = OPNG_COMPR_LEVEL_MAX;
-                 compr_level >= OPNG_COMPR_LEVEL_MIN;
-                 --compr_level)
-            {
-                if (!opng_bitset_test(compr_level_set, compr_level))
-                    continue;
-                for (mem_level = OPNG_MEM_LEVEL_MAX;
-                     mem_level >= OPNG_MEM_LEVEL_MIN;
-                     --mem_level)
+                /* Encode the frame with the best parameters. */
+                process.max_idat_size = idat_size_max;
+                crt_frame = &new_frame;
+                opng_write_file(NULL,
+                                process.best_compr_level,
+                                process.best_mem_level,
+                                process.best_strategy,
+                                process.best_filter);
+                crt_frame = NULL;
+                if (must_recode || frame->is_modified ||
+                    new_frame.data_size < frame->data_size)
                 {
-                    if (!opng_bitset_test(mem_level_set, mem_level))
-                        continue;
-                    usr_printf("  zc = %d  zm = %d  zs = %d  f = %d",
-                               compr_level, mem_level, strategy, filter);
-                    usr_progress(counter, process.num_iterations);
-                    ++counter;
-                    opng_write_file(NULL,
-                                    compr_level, mem_level, strategy, filter);
-                    if (process.out_idat_size > idat_size_max)
-                    {
-                        if (options.verbose)
-                        {
-                            usr_printf("\t\tIDAT too big\n");
-                            line_reused = 0;
-                        }
-                        else
-                        {
-                            usr_print_cntrl('\r');  /* CR: reset line */
-                            line_reused = 1;
-                        }
-                        continue;
-                    }
-                    usr_printf("\t\tIDAT size = %" OPNG_FSIZE_PRIu "\n",
-                               process.out_idat_size);
-                    line_reused = 0;
-                    if (process.best_idat_size < process.out_idat_size)
-                    {
-                        /* The current best size is smaller than the last size.
-                         * Discard the last iteration.
-                         */
-                        continue;
-                    }
-                    if (process.best_idat_size == process.out_idat_size &&
-                        (process.best_strategy == Z_HUFFMAN_ONLY ||
-                         process.best_strategy == Z_RLE))
-                    {
-                        /* The current best size is equal to the last size;
-                         * the current best strategy is already the fastest.
-                         * Discard the last iteration.
-                         */
-                        continue;
-                    }
-                    process.best_compr_level = compr_level;
-                    process.best_mem_level = mem_level;
-                    process.best_strategy = strategy;
-                    process.best_filter = filter;
-                    process.best_idat_size = process.out_idat_size;
-                    if (!options.full)
-                        process.max_idat_size = process.out_idat_size;
+                    opng_free(frame->data);
+                    frame->data = new_frame.data;
+                    frame->data_size = new_frame.data_size;
+                    frame->alloc_size = new_frame.alloc_size;
                 }
+                else
+                    opng_free(new_frame.data);
+                memset(&new_frame, 0, sizeof(new_frame));
             }
+            OPNG_ENSURE(frame->data != NULL, "No data in APNG frame");
+            if (options.verbose)
+                usr_printf("  frame %d\t\tfdAT size = %" OPNG_FSIZE_PRIu
+                           "\n", i + 1, (opng_fsize_t)frame->data_size);
+            fdat_size += frame->data_size;
         }
+        usr_progress(num_frames, num_frames);
+        err_msg = NULL;  /* everything is ok */
     }
-    if (line_reused)
-        usr_print_cntrl(-31);  /* minus N: erase N chars from start of line */
+    Catch (err_msg)
+    {
+        crt_frame = NULL;
+        opng_free(new_frame.data);
+        memset(&new_frame, 0, sizeof(new_frame));
+    }
+    file_stats.crt_frame = 0;
+
+    /* Restore the optimized image and the results of its trials. */
+    image.width = width;
+    image.height = height;
+    image.row_pointers = row_pointers;
+    saved_process.status |= (process.status & OUTPUT_HAS_SKIPPED_TRIALS);
+    process = saved_process;
+    if (err_msg != NULL)
+        Throw err_msg;
 
-    OPNG_ENSURE(counter == process.num_iterations,
-                "Inconsistent iteration counter");
-    usr_progress(counter, process.num_iterations);
+    process.out_fdat_size = fdat_size;
+}
+
+/*
+ * Iteration over the image candidates.
+ * The APNG frames go through their trials along with their candidate.
+ */
+static void
+opng_iterate_candidates(void)
+{
+    opng_fsize_t best_size, crt_size, best_fdat_size, crt_fdat_size;
+    png_uint_32 best_plte_trns_size, crt_plte_trns_size;
+    int best_compr_level, best_mem_level, best_strategy, best_filter;
+    int best_index;
+    int i;
+
+    if (num_alt_images == 0)
+    {
+        /* There is only one candidate: the optimized image. */
+        file_stats.crt_candidate = 1;
+        opng_init_iterations();
+        opng_iterate(1);
+        if (num_frames > 0)
+        {
+            opng_iterate_frames(process.reductions != OPNG_REDUCE_NONE);
+            opng_update_apng_chunks();
+        }
+        return;
+    }
+
+    /* Run the trials on each candidate. The candidate that yields the
+     * smallest IDAT + PLTE + tRNS (+ fdAT) wins. The first candidate is
+     * the optimized image itself; the others are swapped in and out of it.
+     * The alternative candidate of an APNG image is the unreduced image,
+     * whose frames are swapped in and out along with it.
+     */
+    best_index = -1;
+    best_size = best_fdat_size = 0;
+    best_plte_trns_size = 0;
+    best_compr_level = best_mem_level = best_strategy = best_filter = -1;
+    for (i = 0; i <= num_alt_images; ++i)
+    {
+        if (i > 0 && opng_is_over_budget())
+        {
+            usr_printf("\nTime budget exhausted: %d image candidate(s) "
+                       "skipped\n", num_alt_images + 1 - i);
+            process.status |= OUTPUT_HAS_SKIPPED_TRIALS;
+            break;
+        }
+        if (i > 0)
+        {
+            opng_swap_image_info(&image, &alt_images[i - 1]);
+            opng_swap_apng_frames();
+        }
+        usr_printf("\nImage candidate %d: ", i + 1);
+        opng_print_image_info(0, 1, 1, 0);
+        usr_printf("\n");
+        crt_plte_trns_size = opng_get_plte_trns_size(&image);
+        file_stats.crt_candidate = i + 1;
+        opng_init_iterations();
+        if (best_index >= 0)
+        {
+            /* Abandon the trials that can't beat the best candidate. */
+            if (best_size <= crt_plte_trns_size)
+                process.max_idat_size = 0;
+            else if (process.max_idat_size > best_size - crt_plte_trns_size)
+                process.max_idat_size = best_size - crt_plte_trns_size;
+        }
+        opng_iterate(1);
+        if (process.best_idat_size <= idat_size_max)
+        {
+            crt_fdat_size = 0;
+            if (num_frames > 0)
+            {
+                opng_iterate_frames(i == 0 &&
+                                    process.reductions != OPNG_REDUCE_NONE);
+                crt_fdat_size = process.out_fdat_size;
+            }
+            crt_size = process.best_idat_size + crt_plte_trns_size +
+                       crt_fdat_size;
+            if (best_index < 0 || crt_size < best_size)
+            {
+                best_index = i;
+                best_size = crt_size;
+                best_plte_trns_size = crt_plte_trns_size;
+                best_fdat_size = crt_fdat_size;
+                best_compr_level = process.best_compr_level;
+                best_mem_level = process.best_mem_level;
+                best_strategy = process.best_strategy;
+                best_filter = process.best_filter;
+            }
+        }
+        if (i > 0)
+        {
+            opng_swap_image_info(&image, &alt_images[i - 1]);
+            opng_swap_apng_frames();
+        }
+    }
+
+    if (best_index < 0)
+    {
+        /* No trial has been completed. Keep the optimized image. */
+        process.best_idat_size = idat_size_max + 1;
+        process.out_plte_trns_size = opng_get_plte_trns_size(&image);
+        return;
+    }
+    file_stats.crt_candidate = best_index + 1;
+    if (best_index > 0)
+    {
+        usr_printf("\nSelecting image candidate %d\n", best_index + 1);
+        opng_swap_image_info(&image, &alt_images[best_index - 1]);
+        opng_swap_apng_frames();
+    }
+    if (num_frames > 0)
+        opng_update_apng_chunks();
+    process.best_idat_size = best_size - best_plte_trns_size - best_fdat_size;
+    process.out_plte_trns_size = best_plte_trns_size;
+    process.out_fdat_size = best_fdat_size;
+    process.best_compr_level = best_compr_level;
+    process.best_mem_level = best_mem_level;
+    process.best_strategy = best_strategy;
+    process.best_filter = best_filter;
 }
 
 /*
@@ -1476,8 +4309,10 @@ opng_iterate(void)
 static void
 opng_finish_iterations(void)
 {
-    if (process.best_idat_size + process.out_plte_trns_size <
-        process.in_idat_size + process.in_plte_trns_size)
+    if (process.best_idat_size + process.out_plte_trns_size +
+        process.out_fdat_size <
+        process.in_idat_size + process.in_plte_trns_size +
+        process.in_fdat_size)
         process.status |= OUTPUT_NEEDS_NEW_IDAT;
     if (process.status & OUTPUT_NEEDS_NEW_IDAT)
     {
@@ -1504,6 +4339,177 @@ opng_finish_iterations(void)
     }
 }
 
+/*
+ * Options digest computation.
+ * The options that do not affect the output are left out.
+ */
+static void
+opng_digest_options(unsigned char digest[OPNG_DIGEST_SIZE])
+{
+    struct opng_digest_ctx ctx;
+    unsigned long time_budget;
+    char buf[256];
+
+    /* The level selected by -o auto depends on the time budget.
+     * The memory limit may drop the image candidates and the APNG frame
+     * delta minimization.
+     */
+    time_budget = (options.optim_level == OPNG_OPTIM_LEVEL_AUTO) ?
+                  options.time_budget : 0;
+    sprintf(buf, PROGRAM_NAME " " PROGRAM_VERSION
+            " o%d i%d nb%d nc%d np%d nz%d zc%x zm%x zs%x f%x zw%d"
+            " fix%d force%d cleanalpha%d snip%d strip%d converge%d"
+            " budget%lu memlimit%lu",
+            options.optim_level, options.interlace,
+            options.nb, options.nc, options.np, options.nz,
+            options.compr_level_set, options.mem_level_set,
+            options.strategy_set, options.filter_set, options.window_bits,
+            options.fix, options.force,
+            options.clean_alpha, options.snip, options.strip_all,
+            options.converge, time_budget, options.mem_limit);
+    opng_digest_init(&ctx);
+    opng_digest_update(&ctx, buf, strlen(buf));
+    opng_digest_final(&ctx, digest);
+}
+
+/*
+ * File digest computation.
+ * The file contents are taken from the mapping, if available, or else
+ * they are read from the beginning of the stream, which is then rewound.
+ */
+static int
+opng_digest_file(unsigned char digest[OPNG_DIGEST_SIZE],
+                 FILE *stream, png_const_bytep map, opng_fsize_t map_size)
+{
+    struct opng_digest_ctx ctx;
+    png_byte buf[0x4000];
+    size_t length;
+
+    opng_digest_init(&ctx);
+    opng_digest_update(&ctx, result_cache.options_digest, OPNG_DIGEST_SIZE);
+    if (map != NULL)
+        opng_digest_update(&ctx, map, (size_t)map_size);
+    else
+    {
+        while ((length = fread(buf, 1, sizeof(buf), stream)) > 0)
+            opng_digest_update(&ctx, buf, length);
+        if (ferror(stream))
+            return -1;
+        rewind(stream);
+    }
+    opng_digest_final(&ctx, digest);
+    return 0;
+}
+
+/*
+ * Result cache lookup.
+ * Returns 1 if the input file is known to be optimized, or 0 otherwise.
+ * The best parameters are also looked up, if the input file is known.
+ */
+static int
+opng_lookup_result_cache(FILE *infile)
+{
+    const struct opng_cache_record *record;
+
+    result_cache.has_known = 0;
+    if (!result_cache.enabled)
+        return 0;
+    if (opng_digest_file(result_cache.in_digest, infile,
+                         input_map.data, input_map.size) != 0)
+        Throw "Error reading the input file";
+
+    /* The output of a previous run needs no further processing,
+     * unless it is written somewhere else.
+     */
+    if (!options.force && options.out_name == NULL && options.dir_name == NULL)
+    {
+        if (opng_cache_find(&result_cache.records,
+                            result_cache.in_digest, 1) != NULL)
+            return 1;
+    }
+
+    record = opng_cache_find(&result_cache.records, result_cache.in_digest, 0);
+    if (record != NULL &&
+        record->compr_level >= OPNG_COMPR_LEVEL_MIN &&
+        record->compr_level <= OPNG_COMPR_LEVEL_MAX &&
+        record->mem_level >= OPNG_MEM_LEVEL_MIN &&
+        record->mem_level <= OPNG_MEM_LEVEL_MAX &&
+        record->strategy >= OPNG_STRATEGY_MIN &&
+        record->strategy <= OPNG_STRATEGY_MAX &&
+        record->filter >= OPNG_FILTER_MIN &&
+        record->filter <= OPNG_FILTER_MAX)
+    {
+        result_cache.known = *record;
+        result_cache.has_known = 1;
+    }
+    return 0;
+}
+
+/*
+ * Result cache update.
+ * If the output file name is NULL, the input file is already optimized.
+ */
+static void
+opng_update_result_cache(const char *outfile_name)
+{
+    struct opng_cache_record record;
+    FILE *outfile;
+    png_const_bytep map;
+    opng_fsize_t map_size;
+    int result;
+
+    map_size = 0;
+    if (!result_cache.enabled)
+        return;
+    /* The results of an incomplete optimization are not worth caching. */
+    if (process.status & OUTPUT_HAS_SKIPPED_TRIALS)
+        return;
+
+    memcpy(record.in_digest, result_cache.in_digest, OPNG_DIGEST_SIZE);
+    if (outfile_name == NULL)
+        memcpy(record.out_digest, result_cache.in_digest, OPNG_DIGEST_SIZE);
+    else
+    {
+        if ((outfile = fopen(outfile_name, "rb")) == NULL)
+            result = -1;
+        else
+        {
+            map = (png_const_bytep)opng_fmap(outfile, &map_size);
+            result = opng_digest_file(record.out_digest,
+                                      outfile, map, map_size);
+            if (map != NULL)
+                opng_funmap(map, map_size);
+            fclose(outfile);
+        }
+        if (result != 0)
+        {
+            opng_print_warning("Can't read the output file into the cache");
+            return;
+        }
+    }
+
+    /* Keep the parameters only if they have been used to encode IDAT. */
+    if ((process.status & OUTPUT_NEEDS_NEW_IDAT) &&
+        process.best_idat_size <= idat_size_max)
+    {
+        record.compr_level = process.best_compr_level;
+        record.mem_level = process.best_mem_level;
+        record.strategy = process.best_strategy;
+        record.filter = process.best_filter;
+    }
+    else
+        record.compr_level = record.mem_level =
+            record.strategy = record.filter = -1;
+
+    record.color_type = image.color_type;
+    record.bit_depth = image.bit_depth;
+    record.width = image.width;
+    record.height = image.height;
+
+    if (opng_cache_add(&result_cache.records, &record) != 0)
+        opng_print_warning("Can't update the result cache");
+}
+
 /*
  * Image file optimization.
  */
@@ -1513,22 +4519,36 @@ opng_optimize_impl(const char *infile_name)
     static FILE *infile, *outfile;         /* static or volatile is required */
     static const char *infile_name_local;                      /* by cexcept */
     static const char *outfile_name, *bakfile_name;
-    static int new_outfile, has_backup;
+    static int new_outfile, has_backup, is_cached_output;
+    static double start_time;
     char name_buf[FILENAME_MAX], tmp_buf[FILENAME_MAX];
     const char * volatile err_msg;
 
     memset(&process, 0, sizeof(process));
     if (options.force)
         process.status |= OUTPUT_NEEDS_NEW_IDAT;
+    if (options.time_budget > 0)
+        process.deadline = opng_os_wall_clock() + options.time_budget / 1000.0;
 
     err_msg = NULL;  /* prepare for error handling */
 
     infile_name_local = infile_name;
     if ((infile = fopen(infile_name_local, "rb")) == NULL)
         Throw "Can't open the input file";
+    /* The mapping outlives the stream; it is released in opng_optimize(). */
+    input_map.data = (png_const_bytep)opng_fmap(infile, &input_map.size);
     Try
     {
-        opng_read_file(infile);
+        is_cached_output = opng_lookup_result_cache(infile);
+        if (!is_cached_output)
+        {
+            start_time = opng_os_wall_clock();
+            opng_trace("read", OPNG_TRACE_BEGIN, 0);
+            opng_read_file(infile);
+            file_stats.decode_time = opng_os_wall_clock() - start_time -
+                                     file_stats.reduction_time;
+            opng_trace("read", OPNG_TRACE_END, process.in_file_size);
+        }
     }
     Catch (err_msg)
     {
@@ -1538,6 +4558,14 @@ opng_optimize_impl(const char *infile_name)
     if (err_msg != NULL)
         Throw err_msg;  /* rethrow */
 
+    /* Stop here if the input file is the output of a previous run. */
+    if (is_cached_output)
+    {
+        usr_printf("Found in the result cache.\n");
+        usr_printf("\n%s is already optimized.\n", infile_name_local);
+        return;
+    }
+
     /* Check the error flag. This must be the first check. */
     if (process.status & INPUT_HAS_ERRORS)
     {
@@ -1686,15 +4714,23 @@ opng_optimize_impl(const char *infile_name)
     if (process.status & INPUT_HAS_PNG_DATASTREAM)
         usr_printf("Input IDAT size = %" OPNG_FSIZE_PRIu " bytes\n",
                    process.in_idat_size);
+    if (num_frames > 0)
+        usr_printf("Input fdAT size = %" OPNG_FSIZE_PRIu " bytes\n",
+                   process.in_fdat_size);
     usr_printf("Input file size = %" OPNG_FSIZE_PRIu " bytes\n",
                process.in_file_size);
 
     /* Find the best parameters and see if it's worth recompressing. */
     if (!options.nz || (process.status & OUTPUT_NEEDS_NEW_IDAT))
     {
-        opng_init_iterations();
-        opng_iterate();
+        if (result_cache.has_known && num_frames == 0)
+            usr_printf("Using the best parameters from the result cache.\n");
+        start_time = opng_os_wall_clock();
+        opng_trace("trials", OPNG_TRACE_BEGIN, 0);
+        opng_iterate_candidates();
         opng_finish_iterations();
+        file_stats.trials_time = opng_os_wall_clock() - start_time;
+        opng_trace("trials", OPNG_TRACE_END, process.best_idat_size);
     }
     if (process.status & OUTPUT_NEEDS_NEW_IDAT)
     {
@@ -1707,7 +4743,10 @@ opng_optimize_impl(const char *infile_name)
     {
         usr_printf("\n%s is already optimized.\n", infile_name_local);
         if (!new_outfile)
+        {
+            opng_update_result_cache(NULL);
             return;
+        }
     }
     if (options.simulate)
     {
@@ -1738,6 +4777,8 @@ opng_optimize_impl(const char *infile_name)
         has_backup = 1;
     }
 
+    start_time = opng_os_wall_clock();
+    opng_trace("write", OPNG_TRACE_BEGIN, 0);
     outfile = fopen(outfile_name, "wb");
     Try
     {
@@ -1752,18 +4793,25 @@ opng_optimize_impl(const char *infile_name)
         }
         else
         {
-            /* Copy the input PNG datastream to the output. */
+            /* Copy the input PNG datastream to the output.
+             * If the input file is mapped, the chunks are validated in the
+             * mapping, which is still valid, even if the input file has been
+             * renamed to the backup file.
+             */
             infile = fopen(new_outfile ? infile_name_local : bakfile_name,
                            "rb");
             if (infile == NULL)
                 Throw "Can't reopen the input file";
             Try
             {
-                if (process.in_datastream_offset > 0 &&
-                    opng_fseeko(infile, process.in_datastream_offset,
-                                SEEK_SET) != 0)
+                if (input_map.data != NULL)
+                    input_map.pos = (opng_fsize_t)process.in_datastream_offset;
+                else if (process.in_datastream_offset > 0 &&
+                         opng_fseeko(infile, process.in_datastream_offset,
+                                     SEEK_SET) != 0)
                     Throw "Can't reposition the input file";
                 process.best_idat_size = process.in_idat_size;
+                process.out_fdat_size = process.in_fdat_size;
                 opng_copy_file(infile, outfile);
             }
             Catch (err_msg)
@@ -1800,6 +4848,8 @@ opng_optimize_impl(const char *infile_name)
     }
     /* assert(err_msg == NULL); */
     fclose(outfile);
+    file_stats.write_time = opng_os_wall_clock() - start_time;
+    opng_trace("write", OPNG_TRACE_END, process.out_file_size);
 
     /* Preserve file attributes (e.g. ownership, access rights, time stamps)
      * on request, if possible.
@@ -1825,11 +4875,88 @@ opng_optimize_impl(const char *infile_name)
                                     process.out_idat_size, 0);
         usr_printf(")");
     }
+    if (num_frames > 0)
+    {
+        usr_printf("\nOutput fdAT size = %" OPNG_FSIZE_PRIu " bytes (",
+                   process.out_fdat_size);
+        opng_print_fsize_difference(process.in_fdat_size,
+                                    process.out_fdat_size, 0);
+        usr_printf(")");
+    }
     usr_printf("\nOutput file size = %" OPNG_FSIZE_PRIu " bytes (",
                process.out_file_size);
     opng_print_fsize_difference(process.in_file_size,
                                 process.out_file_size, 1);
     usr_printf(")\n");
+
+    opng_update_result_cache(outfile_name);
+}
+
+/*
+ * File statistics display.
+ * The statistics are displayed as a JSON object, on a single line.
+ */
+static void
+opng_print_file_stats(const char *infile_name, const char *err_msg)
+{
+    const struct opng_trial_record *trial;
+    size_t i;
+
+    usr_stats_printf("{\"file\":");
+    opng_print_json_string(infile_name);
+    if (err_msg == NULL)
+        usr_stats_printf(",\"status\":\"ok\"");
+    else
+    {
+        usr_stats_printf(",\"status\":\"error\",\"error\":");
+        opng_print_json_string(err_msg);
+    }
+    usr_stats_printf(",\"width\":%lu,\"height\":%lu",
+                     (unsigned long)image.width, (unsigned long)image.height);
+    usr_stats_printf(",\"in_file_size\":%" OPNG_FSIZE_PRIu
+                     ",\"in_idat_size\":%" OPNG_FSIZE_PRIu
+                     ",\"out_file_size\":%" OPNG_FSIZE_PRIu
+                     ",\"out_idat_size\":%" OPNG_FSIZE_PRIu,
+                     process.in_file_size, process.in_idat_size,
+                     process.out_file_size, process.out_idat_size);
+    usr_stats_printf(",\"wall_time\":%.6f,\"cpu_time\":%.6f"
+                     ",\"decode_time\":%.6f,\"reduction_time\":%.6f"
+                     ",\"trials_time\":%.6f,\"write_time\":%.6f",
+                     file_stats.wall_time, file_stats.cpu_time,
+                     file_stats.decode_time, file_stats.reduction_time,
+                     file_stats.trials_time, file_stats.write_time);
+    usr_stats_printf(",\"skipped_trials\":%d", file_stats.num_skipped_trials);
+    usr_stats_printf(",\"trials\":[");
+    for (i = 0; i < file_stats.num_trials; ++i)
+    {
+        trial = &file_stats.trials[i];
+        usr_stats_printf("%s{\"candidate\":%d,\"frame\":%d"
+                         ",\"zc\":%d,\"zm\":%d,\"zs\":%d,\"f\":%d"
+                         ",\"wall_time\":%.6f,\"cpu_time\":%.6f"
+                         ",\"bytes_fed\":%" OPNG_FSIZE_PRIu
+                         ",\"bytes_total\":%" OPNG_FSIZE_PRIu
+                         ",\"compressed_bytes\":%" OPNG_FSIZE_PRIu
+                         ",\"aborted\":%s",
+                         (i > 0) ? "," : "",
+                         trial->candidate, trial->frame,
+                         trial->compr_level, trial->mem_level,
+                         trial->strategy, trial->filter,
+                         trial->wall_time, trial->cpu_time,
+                         trial->deflated_size, trial->data_size,
+                         trial->idat_size,
+                         trial->is_abandoned ? "true" : "false");
+        if (trial->is_abandoned)
+        {
+            /* The point at which the trial was abandoned, as a fraction
+             * of the image data.
+             */
+            usr_stats_printf(",\"abort_point\":%.4f",
+                (trial->data_size > 0) ?
+                (double)trial->deflated_size / trial->data_size : 0.0);
+        }
+        usr_stats_printf("}");
+    }
+    usr_stats_printf("]}\n");
 }
 
 /*
@@ -1844,6 +4971,8 @@ opng_initialize(const struct opng_options *init_options,
     usr_print_cntrl = init_ui->print_cntrl_fn;
     usr_progress = init_ui->progress_fn;
     usr_panic = init_ui->panic_fn;
+    usr_stats_printf = init_ui->stats_printf_fn;  /* optional */
+    usr_trace = init_ui->trace_fn;                /* optional */
     if (usr_printf == NULL ||
         usr_print_cntrl == NULL ||
         usr_progress == NULL ||
@@ -1857,6 +4986,24 @@ opng_initialize(const struct opng_options *init_options,
         options.nb = options.nc = options.np = 1;
         options.nz = 1;
     }
+    pngx_set_rows_memory_limit((pngx_alloc_size_t)options.mem_limit);
+
+    /* Open the result cache. */
+    memset(&result_cache, 0, sizeof(result_cache));
+    if (options.cache_name != NULL)
+    {
+        if (opng_cache_open(&result_cache.records, options.cache_name) == 0)
+        {
+            opng_digest_options(result_cache.options_digest);
+            result_cache.enabled = 1;
+        }
+        else
+            opng_print_warning("Can't open the result cache file");
+    }
+
+    /* Report the file statistics on request. */
+    memset(&file_stats, 0, sizeof(file_stats));
+    file_stats.enabled = (usr_stats_printf != NULL);
 
     /* Start the engine. */
     memset(&summary, 0, sizeof(summary));
@@ -1870,7 +5017,7 @@ opng_initialize(const struct opng_options *init_options,
 int
 opng_optimize(const char *infile_name)
 {
-    const char *err_msg;
+    const char * volatile err_msg;  /* volatile is required by cexcept */
     volatile int result;  /* volatile not needed, but keeps compilers happy */
 
     OPNG_ENSURE(engine.started, "The OptiPNG engine is not running");
@@ -1878,6 +5025,14 @@ opng_optimize(const char *infile_name)
     usr_printf("** Processing: %s\n", infile_name);
     ++summary.file_count;
     opng_clear_image_info();
+    file_stats.wall_time = opng_os_wall_clock();
+    file_stats.cpu_time = opng_os_cpu_clock();
+    file_stats.decode_time = file_stats.reduction_time = 0;
+    file_stats.trials_time = file_stats.write_time = 0;
+    file_stats.crt_candidate = file_stats.crt_frame = 0;
+    file_stats.num_trials = 0;
+    file_stats.num_skipped_trials = 0;
+    opng_trace("optimize", OPNG_TRACE_BEGIN, 0);
     Try
     {
         opng_optimize_impl(infile_name);
@@ -1899,7 +5054,18 @@ opng_optimize(const char *infile_name)
         opng_print_error(err_msg);
         result = -1;
     }
+    if (file_stats.enabled)
+    {
+        file_stats.wall_time = opng_os_wall_clock() - file_stats.wall_time;
+        file_stats.cpu_time = opng_os_cpu_clock() - file_stats.cpu_time;
+        opng_print_file_stats(infile_name, (result == 0) ? NULL : err_msg);
+    }
+    if (result == 0)
+        opng_trace("optimize", OPNG_TRACE_END, process.out_file_size);
+    else
+        opng_trace("optimize", OPNG_TRACE_ABORT, 0);
     opng_destroy_image_info();
+    opng_unmap_input_file();
     usr_printf("\n");
     return result;
 }
@@ -1930,6 +5096,15 @@ opng_finalize(void)
         }
     }
 
+    /* Close the result cache. */
+    if (result_cache.enabled)
+        opng_cache_close(&result_cache.records);
+    memset(&result_cache, 0, sizeof(result_cache));
+
+    /* Release the file statistics. */
+    free(file_stats.trials);
+    memset(&file_stats, 0, sizeof(file_stats));
+
     /* Stop the engine. */
     engine.started = 0;
     return 0;
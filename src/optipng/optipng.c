@@ -56,13 +56,13 @@ static const char *msg_help_synopsis =
 static const char *msg_help_basic_options =
     "Basic options:\n"
     "    -?, -h, -help\tshow the extended help\n"
-    "    -o <level>\t\toptimization level (0-7)\t\t[default: 2]\n"
+    "    -o <level>\t\toptimization level (0-7 or auto)\t[default: 2]\n"
     "    -v\t\t\trun in verbose mode / show copyright and version info\n";
 
 static const char *msg_help_options =
     "Basic options:\n"
     "    -?, -h, -help\tshow this help\n"
-    "    -o <level>\t\toptimization level (0-7)\t\t[default: 2]\n"
+    "    -o <level>\t\toptimization level (0-7 or auto)\t[default: 2]\n"
     "    -v\t\t\trun in verbose mode / show copyright and version info\n"
     "General options:\n"
     "    -backup, -keep\tkeep a backup of the modified files\n"
@@ -78,8 +78,14 @@ static const char *msg_help_options =
     "    -out <file>\t\twrite output file to <file>\n"
     "    -dir <directory>\twrite output file(s) to <directory>\n"
     "    -log <file>\t\tlog messages to <file>\n"
+    "    -cache <file>\tcache the optimization results in <file>\n"
+    "    -stats json\t\twrite the statistics of each file to stdout\n"
+    "    -trace <file>\twrite a trace of the processing stages to <file>\n"
+    "    -memlimit <size>\tkeep larger image data out of core (e.g. 512M)\n"
+    "    -time-budget <ms>\tstop the trials after <ms> milliseconds per file\n"
     "    --\t\t\tstop option switch parsing\n"
     "Optimization options:\n"
+    "    -converge <pct>\tskip the filters that are unlikely to win (1-99)\n"
     "    -f <filters>\tPNG delta filters (0-5)\t\t\t[default: 0,5]\n"
     "    -i <type>\t\tPNG interlace type (0-1)\n"
     "    -zc <levels>\tzlib compression levels (1-9)\t\t[default: 9]\n"
@@ -93,6 +99,7 @@ static const char *msg_help_options =
     "    -nx\t\t\tno reductions\n"
     "    -nz\t\t\tno IDAT recoding\n"
     "Editing options:\n"
+    "    -cleanalpha\tclean the color of fully transparent pixels\n"
     "    -snip\t\tcut one image out of multi-image or animation files\n"
     "    -strip <objects>\tstrip metadata objects (e.g. \"all\")\n"
     "Optimization levels:\n"
@@ -108,6 +115,8 @@ static const char *msg_help_options =
     "    -o7 -zm1-9\t<=>\t-zc1-9 -zm1-9 -zs0-3 -f0-5\t\t(1080 trials)\n"
     "Notes:\n"
     "    The combination for -o1 is chosen heuristically.\n"
+    "    The levels -o3 and higher also run the trials on alternative images\n"
+    "    (e.g. unreduced, or expanded from palette), and select the smallest.\n"
     "    Exhaustive combinations such as \"-o7 -zm1-9\" are not generally recommended.\n";
 
 static const char *msg_help_examples =
@@ -130,6 +139,8 @@ static enum
 static struct
 {
     int help;
+    int stats;
+    const char *trace_name;
     int version;
 } local_options;
 
@@ -137,6 +148,15 @@ static struct opng_options options;
 
 static FILE *con_file;
 static FILE *log_file;
+static FILE *trace_file;
+
+static struct
+{
+    const char *file_name;  /* the file being processed */
+    double start_time;
+    int num_events;
+    int depth;
+} trace_state;
 
 static int start_of_line;
 
@@ -484,6 +504,7 @@ parse_args(int argc, char *argv[])
     int simple_opt, stop_switch;
     opng_bitset_t set;
     int val;
+    unsigned long uval;
     unsigned int file_count;
     int i;
 
@@ -544,6 +565,11 @@ parse_args(int argc, char *argv[])
             /* -c | ... | -clobber */
             options.clobber = 1;
         }
+        else if (strncmp("cleanalpha", opt, opt_len) == 0 && opt_len >= 3)
+        {
+            /* -cle | ... | -cleanalpha */
+            options.clean_alpha = 1;
+        }
         else if (strcmp("debug", opt) == 0)
         {
             /* -debug */
@@ -655,9 +681,12 @@ parse_args(int argc, char *argv[])
         }
         else if (strcmp("o", opt) == 0)
         {
-            /* -o NUM */
-            val = check_num_option("-o", xopt, 0, INT_MAX);
-            if (options.optim_level < 0)
+            /* -o NUM | -o auto */
+            if (opng_strcasecmp("auto", xopt) == 0)
+                val = OPNG_OPTIM_LEVEL_AUTO;
+            else
+                val = check_num_option("-o", xopt, 0, INT_MAX);
+            if (options.optim_level == -1)  /* unset */
                 options.optim_level = val;
             else if (options.optim_level != val)
                 error("Multiple optimization levels are not permitted");
@@ -704,12 +733,48 @@ parse_args(int argc, char *argv[])
             else if (options.window_bits != val)
                 error("Multiple window sizes are not permitted");
         }
+        else if (strncmp("memlimit", opt, opt_len) == 0 && opt_len >= 2)
+        {
+            /* -me SIZE | ... | -memlimit SIZE */
+            /* Allow the 'k', 'M', 'G' suffixes. */
+            if (opng_str2ulong(&uval, xopt, 1) != 0 || uval == 0)
+                err_option_arg("-memlimit", xopt);
+            if (options.mem_limit == 0)
+                options.mem_limit = uval;
+            else if (options.mem_limit != uval)
+                error("Multiple memory limits are not permitted");
+        }
+        else if (strncmp("converge", opt, opt_len) == 0 && opt_len >= 3)
+        {
+            /* -con NUM | ... | -converge NUM */
+            val = check_num_option("-converge", xopt, 1, 99);
+            if (options.converge == 0)
+                options.converge = val;
+            else if (options.converge != val)
+                error("Multiple confidence thresholds are not permitted");
+        }
+        else if (strncmp("time-budget", opt, opt_len) == 0 && opt_len >= 2)
+        {
+            /* -ti NUM | ... | -time-budget NUM */
+            val = check_num_option("-time-budget", xopt, 1, INT_MAX);
+            if (options.time_budget == 0)
+                options.time_budget = (unsigned long)val;
+            else if (options.time_budget != (unsigned long)val)
+                error("Multiple time budgets are not permitted");
+        }
         else if (strncmp("strip", opt, opt_len) == 0 && opt_len >= 2)
         {
             /* -st OBJ | ... | -strip OBJ */
             check_obj_option("-strip", xopt);
             options.strip_all = 1;
         }
+        else if (strncmp("stats", opt, opt_len) == 0 && opt_len >= 3)
+        {
+            /* -sta FMT | ... | -stats FMT */
+            if (opng_strcasecmp("json", xopt) != 0)
+                err_option_arg("-stats", xopt);
+            local_options.stats = 1;
+        }
         else if (strncmp("out", opt, opt_len) == 0 && opt_len >= 2)
         {
             /* -ou PATH | -out PATH */
@@ -728,6 +793,15 @@ parse_args(int argc, char *argv[])
                 err_option_arg("-dir", NULL);
             options.dir_name = xopt;
         }
+        else if (strncmp("cache", opt, opt_len) == 0 && opt_len >= 2)
+        {
+            /* -ca PATH | ... | -cache PATH */
+            if (options.cache_name != NULL)
+                error("Multiple cache file names are not permitted");
+            if (xopt[0] == 0)
+                err_option_arg("-cache", NULL);
+            options.cache_name = xopt;
+        }
         else if (strncmp("log", opt, opt_len) == 0)
         {
             /* -l PATH | ... | -log PATH */
@@ -737,6 +811,15 @@ parse_args(int argc, char *argv[])
                 err_option_arg("-log", NULL);
             options.log_name = xopt;
         }
+        else if (strncmp("trace", opt, opt_len) == 0 && opt_len >= 2)
+        {
+            /* -tr PATH | ... | -trace PATH */
+            if (local_options.trace_name != NULL)
+                error("Multiple trace file names are not permitted");
+            if (xopt[0] == 0)
+                err_option_arg("-trace", NULL);
+            local_options.trace_name = xopt;
+        }
         else
         {
             error("Unrecognized option: %s", arg);
@@ -793,6 +876,86 @@ app_printf(const char *fmt, ...)
     }
 }
 
+/*
+ * Application-defined statistics printf callback.
+ */
+static void
+app_stats_printf(const char *fmt, ...)
+{
+    va_list arg_ptr;
+
+    va_start(arg_ptr, fmt);
+    vfprintf(stdout, fmt, arg_ptr);
+    va_end(arg_ptr);
+    /* Deliver each record as soon as it is complete. */
+    if (fmt[0] != 0 && fmt[strlen(fmt) - 1] == '\n')
+        fflush(stdout);
+}
+
+/*
+ * Writes a string to the trace file, in JSON format.
+ */
+static void
+app_trace_string(const char *str)
+{
+    fputc('"', trace_file);
+    for ( ; *str != 0; ++str)
+    {
+        if (*str == '"' || *str == '\\')
+            fprintf(trace_file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(trace_file, "\\u%04x", (unsigned int)*str);
+        else
+            fputc(*str, trace_file);
+    }
+    fputc('"', trace_file);
+}
+
+/*
+ * Application-defined trace callback.
+ * The events are written in the Chrome trace event format, which can be
+ * loaded in chrome://tracing, Perfetto, Speedscope, etc.
+ */
+static void
+app_trace(const char *event, int phase, double timestamp, unsigned long bytes)
+{
+    if (trace_state.num_events++ == 0)
+        trace_state.start_time = timestamp;
+    else
+        fputs(",\n", trace_file);
+    if (phase == OPNG_TRACE_BEGIN)
+        ++trace_state.depth;
+    else if (strcmp(event, "optimize") == 0)
+    {
+        /* Close the stages that have been left open by an error. */
+        for ( ; trace_state.depth > 1; --trace_state.depth)
+            fprintf(trace_file,
+                    "{\"ph\":\"E\",\"ts\":%.0f,\"pid\":1,\"tid\":1},\n",
+                    (timestamp - trace_state.start_time) * 1e6);
+    }
+    fputs("{\"name\":", trace_file);
+    app_trace_string(event);
+    fprintf(trace_file, ",\"ph\":\"%s\",\"ts\":%.0f,\"pid\":1,\"tid\":1",
+            (phase == OPNG_TRACE_BEGIN) ? "B" : "E",
+            (timestamp - trace_state.start_time) * 1e6);
+    if (phase == OPNG_TRACE_BEGIN)
+    {
+        if (strcmp(event, "optimize") == 0)
+        {
+            fputs(",\"args\":{\"file\":", trace_file);
+            app_trace_string(trace_state.file_name);
+            fputs("}", trace_file);
+        }
+    }
+    else
+    {
+        --trace_state.depth;
+        fprintf(trace_file, ",\"args\":{\"bytes\":%lu%s}", bytes,
+                (phase == OPNG_TRACE_ABORT) ? ",\"aborted\":true" : "");
+    }
+    fputs("}", trace_file);
+}
+
 /*
  * Application-defined control print callback.
  */
@@ -884,6 +1047,14 @@ app_init(void)
         app_printf("** Warning: %s\n\n",
                    "The option -log is deprecated; use shell redirection");
     }
+
+    if (local_options.trace_name != NULL && operation == OP_RUN)
+    {
+        /* Open the trace file, and start the array of trace events. */
+        if ((trace_file = fopen(local_options.trace_name, "w")) == NULL)
+            error("Can't open trace file: %s\n", local_options.trace_name);
+        fputs("[\n", trace_file);
+    }
 }
 
 /*
@@ -897,6 +1068,12 @@ app_finish(void)
         /* Close the log file. */
         fclose(log_file);
     }
+    if (trace_file != NULL)
+    {
+        /* End the array of trace events, and close the trace file. */
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+    }
 }
 
 /*
@@ -914,6 +1091,8 @@ process_files(int argc, char *argv[])
     ui.print_cntrl_fn = app_print_cntrl;
     ui.progress_fn = app_progress;
     ui.panic_fn = panic;
+    ui.stats_printf_fn = local_options.stats ? app_stats_printf : NULL;
+    ui.trace_fn = (trace_file != NULL) ? app_trace : NULL;
     if (opng_initialize(&options, &ui) != 0)
         panic("Can't initialize optimization engine");
 
@@ -923,6 +1102,7 @@ process_files(int argc, char *argv[])
     {
         if (argv[i] == NULL || argv[i][0] == 0)
             continue;  /* this was an "-option" */
+        trace_state.file_name = argv[i];
         if (opng_optimize(argv[i]) != 0)
             result = EXIT_FAILURE;
     }
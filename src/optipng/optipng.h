@@ -38,6 +38,10 @@ struct opng_options
     const char *out_name;
     const char *dir_name;
     const char *log_name;
+    const char *cache_name;
+    unsigned long mem_limit;
+    unsigned long time_budget;  /* in milliseconds, 0 if unlimited */
+    int converge;               /* the confidence in percents, 0 if off */
 
     /* Optimization options. */
     int interlace;
@@ -50,6 +54,7 @@ struct opng_options
     int window_bits;
 
     /* Editing options. */
+    int clean_alpha;
     int snip;
     int strip_all;
 };
@@ -64,8 +69,21 @@ struct opng_ui
     void (*print_cntrl_fn)(int cntrl_code);
     void (*progress_fn)(unsigned long current_step, unsigned long total_steps);
     void (*panic_fn)(const char *msg);
+    void (*stats_printf_fn)(const char *fmt, ...);  /* NULL if not needed */
+    void (*trace_fn)(const char *event, int phase,
+                     double timestamp, unsigned long bytes);  /* ditto */
 };
 
+/*
+ * Trace event phases.
+ * The trace callback is invoked at the beginning and at the end of the
+ * main processing stages; the timestamps are wall clock seconds.
+ * An abandoned trial ends with OPNG_TRACE_ABORT instead of OPNG_TRACE_END.
+ */
+#define OPNG_TRACE_BEGIN  0
+#define OPNG_TRACE_END    1
+#define OPNG_TRACE_ABORT  2
+
 
 /*
  * Engine initialization.
@@ -90,6 +108,7 @@ int opng_finalize(void);
 #define OPNG_OPTIM_LEVEL_DEFAULT    2
 #define OPNG_OPTIM_LEVEL_MIN        0
 #define OPNG_OPTIM_LEVEL_MAX        7
+#define OPNG_OPTIM_LEVEL_AUTO       (-2)  /* selected for each file */
 
 #define OPNG_COMPR_LEVEL_MIN        1
 #define OPNG_COMPR_LEVEL_MAX        9
@@ -0,0 +1,791 @@
+/*
+ * apng_test.c
+ * Round-trip test for the APNG optimization.
+ *
+ * Copyright (C) 2001-2017 Cosmin Truta and the Contributing Authors.
+ *
+ * This software is distributed under the zlib license.
+ * Please see the accompanying LICENSE file.
+ *
+ * The test writes APNG animations, optimizes them with the optipng program
+ * given in the command line, and checks that the input and the output
+ * render the same frames, when they are composited on the canvas.
+ */
+
+#include "zlib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define IN_FILE_NAME   "test/apng_test.in.png"
+#define OUT_FILE_NAME  "test/apng_test.out.png"
+
+#define MAX_WIDTH   256
+#define MAX_HEIGHT  16
+#define MAX_FRAMES  8
+#define MAX_COLORS  8
+#define MAX_FILE_SIZE  (1024 * 1024)
+
+#define DISPOSE_OP_NONE        0
+#define DISPOSE_OP_BACKGROUND  1
+#define DISPOSE_OP_PREVIOUS    2
+#define BLEND_OP_SOURCE        0
+#define BLEND_OP_OVER          1
+
+/*
+ * An animation, as written by the test.
+ * The pixels are indices in the color table, which is stored in a format
+ * that depends on the color type.
+ */
+struct anim_frame
+{
+    unsigned int x, y, width, height;
+    int dispose_op, blend_op;
+    unsigned char pixels[MAX_HEIGHT][MAX_WIDTH];
+};
+
+struct anim
+{
+    unsigned int width, height;
+    int color_type;
+    unsigned char colors[MAX_COLORS][4];  /* RGBA */
+    int num_colors;
+    int num_frames;
+    struct anim_frame frames[MAX_FRAMES];
+};
+
+/*
+ * A rendered animation, in 16-bit RGBA.
+ */
+struct rendering
+{
+    unsigned int width, height;
+    int num_frames;
+    unsigned short canvas[MAX_FRAMES][MAX_HEIGHT][MAX_WIDTH][4];
+};
+
+static struct rendering in_rendering, out_rendering;
+
+static int num_tests = 0;
+static int num_errors = 0;
+
+
+/*
+ * The deterministic pseudo-random generator of the test animations.
+ */
+static unsigned long seed;
+
+static unsigned int
+get_random(unsigned int limit)
+{
+    seed = (seed * 1103515245UL + 12345UL) & 0xffffffffUL;
+    return (unsigned int)((seed >> 16) & 0x7fff) % limit;
+}
+
+/*
+ * Big-endian integer storage and retrieval.
+ */
+static void
+put_uint32(unsigned char *buf, unsigned long value)
+{
+    buf[0] = (unsigned char)(value >> 24);
+    buf[1] = (unsigned char)(value >> 16);
+    buf[2] = (unsigned char)(value >> 8);
+    buf[3] = (unsigned char)value;
+}
+
+static unsigned long
+get_uint32(const unsigned char *buf)
+{
+    return ((unsigned long)buf[0] << 24) | ((unsigned long)buf[1] << 16) |
+           ((unsigned long)buf[2] << 8) | (unsigned long)buf[3];
+}
+
+/*
+ * Chunk writing.
+ */
+static void
+write_chunk(FILE *stream, const char *name,
+            const unsigned char *data, size_t size)
+{
+    unsigned char buf[4];
+    uLong crc;
+
+    put_uint32(buf, (unsigned long)size);
+    fwrite(buf, 1, 4, stream);
+    fwrite(name, 1, 4, stream);
+    if (size > 0)
+        fwrite(data, 1, size, stream);
+    crc = crc32(crc32(0, Z_NULL, 0), (const Bytef *)name, 4);
+    if (size > 0)
+        crc = crc32(crc, data, (uInt)size);
+    put_uint32(buf, crc);
+    fwrite(buf, 1, 4, stream);
+}
+
+/*
+ * APNG writing.
+ * The frames are stored unfiltered and deflated, the first one in IDAT.
+ */
+static int
+write_anim(const char *file_name, const struct anim *anim)
+{
+    static const int type_channels[7] = {1, 0, 3, 1, 2, 0, 4};
+    static unsigned char raw[MAX_HEIGHT * (MAX_WIDTH * 4 + 1)];
+    static unsigned char buf[4 + MAX_HEIGHT * (MAX_WIDTH * 4 + 1) + 1024];
+    const struct anim_frame *frame;
+    const unsigned char *color;
+    unsigned char *ptr;
+    unsigned long seq_num;
+    uLongf zsize;
+    unsigned int x, y;
+    int channels, i;
+    FILE *stream;
+
+    if ((stream = fopen(file_name, "wb")) == NULL)
+        return -1;
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, stream);
+    put_uint32(buf, anim->width);
+    put_uint32(buf + 4, anim->height);
+    buf[8] = 8;
+    buf[9] = (unsigned char)anim->color_type;
+    buf[10] = buf[11] = buf[12] = 0;
+    write_chunk(stream, "IHDR", buf, 13);
+    if (anim->color_type == 3)
+    {
+        for (i = 0; i < anim->num_colors; ++i)
+            memcpy(buf + 3 * i, anim->colors[i], 3);
+        write_chunk(stream, "PLTE", buf, 3 * anim->num_colors);
+        for (i = 0; i < anim->num_colors; ++i)
+            buf[i] = anim->colors[i][3];
+        write_chunk(stream, "tRNS", buf, anim->num_colors);
+    }
+    else if (anim->color_type == 0 || anim->color_type == 2)
+    {
+        /* The transparent color, if any, is the one with alpha 0. */
+        for (i = 0; i < anim->num_colors; ++i)
+        {
+            if (anim->colors[i][3] != 0)
+                continue;
+            memset(buf, 0, 6);
+            buf[1] = anim->colors[i][0];
+            buf[3] = anim->colors[i][1];
+            buf[5] = anim->colors[i][2];
+            write_chunk(stream, "tRNS", buf, (anim->color_type == 0) ? 2 : 6);
+            break;
+        }
+    }
+    put_uint32(buf, anim->num_frames);
+    put_uint32(buf + 4, 0);
+    write_chunk(stream, "acTL", buf, 8);
+
+    channels = type_channels[anim->color_type];
+    seq_num = 0;
+    for (i = 0; i < anim->num_frames; ++i)
+    {
+        frame = &anim->frames[i];
+        put_uint32(buf, seq_num++);
+        put_uint32(buf + 4, frame->width);
+        put_uint32(buf + 8, frame->height);
+        put_uint32(buf + 12, frame->x);
+        put_uint32(buf + 16, frame->y);
+        buf[20] = 0;
+        buf[21] = 1;
+        buf[22] = 0;
+        buf[23] = 10;
+        buf[24] = (unsigned char)frame->dispose_op;
+        buf[25] = (unsigned char)frame->blend_op;
+        write_chunk(stream, "fcTL", buf, 26);
+
+        ptr = raw;
+        for (y = 0; y < frame->height; ++y)
+        {
+            *ptr++ = 0;  /* filter type None */
+            for (x = 0; x < frame->width; ++x)
+            {
+                color = anim->colors[frame->pixels[y][x]];
+                if (anim->color_type == 3)
+                    *ptr++ = frame->pixels[y][x];
+                else
+                {
+                    memcpy(ptr, color, (channels >= 3) ? 3 : 1);
+                    ptr += (channels >= 3) ? 3 : 1;
+                    if (channels == 2 || channels == 4)
+                        *ptr++ = color[3];
+                }
+            }
+        }
+        zsize = sizeof(buf) - 4;
+        if (compress2(buf + 4, &zsize, raw, (uLong)(ptr - raw), 9) != Z_OK)
+        {
+            fclose(stream);
+            return -1;
+        }
+        if (i == 0)
+            write_chunk(stream, "IDAT", buf + 4, zsize);
+        else
+        {
+            put_uint32(buf, seq_num++);
+            write_chunk(stream, "fdAT", buf, 4 + zsize);
+        }
+    }
+    write_chunk(stream, "IEND", NULL, 0);
+    return (fclose(stream) == 0) ? 0 : -1;
+}
+
+/*
+ * Pixel reading, in 16-bit RGBA.
+ */
+static void
+get_pixel(const unsigned char *row, unsigned int x,
+          int bit_depth, int color_type,
+          const unsigned char *plte, int num_plte,
+          const unsigned char *trns, int num_trns,
+          unsigned short *pixel)
+{
+    static const int type_channels[7] = {1, 0, 3, 1, 2, 0, 4};
+    unsigned int sample[4], max_sample, pos;
+    int channels, i;
+
+    channels = type_channels[color_type];
+    max_sample = (1U << bit_depth) - 1;
+    sample[0] = sample[1] = sample[2] = sample[3] = 0;
+    if (bit_depth < 8)
+    {
+        pos = x * bit_depth;
+        sample[0] = (row[pos >> 3] >> (8 - bit_depth - (pos & 7))) &
+                    max_sample;
+    }
+    else
+    {
+        for (i = 0; i < channels; ++i)
+        {
+            if (bit_depth == 8)
+                sample[i] = row[x * channels + i];
+            else
+                sample[i] = (row[(x * channels + i) * 2] << 8) |
+                            row[(x * channels + i) * 2 + 1];
+        }
+    }
+
+    switch (color_type)
+    {
+    case 3:
+        if ((int)sample[0] < num_plte)
+        {
+            pixel[0] = (unsigned short)(plte[3 * sample[0]] * 257);
+            pixel[1] = (unsigned short)(plte[3 * sample[0] + 1] * 257);
+            pixel[2] = (unsigned short)(plte[3 * sample[0] + 2] * 257);
+        }
+        else
+            pixel[0] = pixel[1] = pixel[2] = 0;
+        pixel[3] = (unsigned short)
+            (((int)sample[0] < num_trns) ? trns[sample[0]] * 257 : 65535);
+        break;
+    case 0:
+    case 4:
+        pixel[0] = pixel[1] = pixel[2] =
+            (unsigned short)(sample[0] * (65535 / max_sample));
+        if (color_type == 4)
+            pixel[3] = (unsigned short)(sample[1] * (65535 / max_sample));
+        else if (num_trns >= 2 &&
+                 sample[0] == ((unsigned int)trns[0] << 8 | trns[1]))
+            pixel[3] = 0;
+        else
+            pixel[3] = 65535;
+        break;
+    default:
+        for (i = 0; i < 3; ++i)
+            pixel[i] = (unsigned short)(sample[i] * (65535 / max_sample));
+        if (color_type == 6)
+            pixel[3] = (unsigned short)(sample[3] * (65535 / max_sample));
+        else if (num_trns >= 6 &&
+                 sample[0] == ((unsigned int)trns[0] << 8 | trns[1]) &&
+                 sample[1] == ((unsigned int)trns[2] << 8 | trns[3]) &&
+                 sample[2] == ((unsigned int)trns[4] << 8 | trns[5]))
+            pixel[3] = 0;
+        else
+            pixel[3] = 65535;
+        break;
+    }
+}
+
+/*
+ * Pixel compositing, as specified by APNG.
+ */
+static void
+blend_pixel(const unsigned short *src, int blend_op, unsigned short *dest)
+{
+    double src_alpha, dest_alpha, out_alpha;
+    int i;
+
+    if (blend_op == BLEND_OP_SOURCE || src[3] == 65535)
+    {
+        memcpy(dest, src, 4 * sizeof(unsigned short));
+        return;
+    }
+    if (src[3] == 0)
+        return;
+    src_alpha = src[3] / 65535.0;
+    dest_alpha = dest[3] / 65535.0;
+    out_alpha = src_alpha + dest_alpha * (1 - src_alpha);
+    for (i = 0; i < 3; ++i)
+        dest[i] = (unsigned short)
+            ((src[i] * src_alpha + dest[i] * dest_alpha * (1 - src_alpha)) /
+             out_alpha + 0.5);
+    dest[3] = (unsigned short)(out_alpha * 65535 + 0.5);
+}
+
+/*
+ * Frame decoding.
+ * Returns 0 on success, or -1 if the frame can't be decoded.
+ */
+static int
+decode_frame(const unsigned char *zdata, size_t zsize,
+             unsigned int width, unsigned int height,
+             int bit_depth, int color_type, unsigned char *rows)
+{
+    static const int type_channels[7] = {1, 0, 3, 1, 2, 0, 4};
+    unsigned char *row, *prev_row;
+    size_t row_size, bpp, i;
+    uLongf size;
+    int a, b, c, p, pa, pb, pc;
+    unsigned int y;
+
+    row_size = ((size_t)width * type_channels[color_type] * bit_depth + 7)
+               / 8;
+    bpp = (type_channels[color_type] * bit_depth + 7) / 8;
+    size = (uLongf)((row_size + 1) * height);
+    if (uncompress(rows, &size, zdata, (uLong)zsize) != Z_OK ||
+        size != (row_size + 1) * height)
+        return -1;
+    prev_row = NULL;
+    for (y = 0; y < height; ++y)
+    {
+        row = rows + y * (row_size + 1);
+        for (i = 1; i <= row_size; ++i)
+        {
+            a = (i > bpp) ? row[i - bpp] : 0;
+            b = (prev_row != NULL) ? prev_row[i] : 0;
+            c = (prev_row != NULL && i > bpp) ? prev_row[i - bpp] : 0;
+            switch (row[0])
+            {
+            case 0:
+                break;
+            case 1:
+                row[i] = (unsigned char)(row[i] + a);
+                break;
+            case 2:
+                row[i] = (unsigned char)(row[i] + b);
+                break;
+            case 3:
+                row[i] = (unsigned char)(row[i] + (a + b) / 2);
+                break;
+            case 4:
+                p = a + b - c;
+                pa = abs(p - a);
+                pb = abs(p - b);
+                pc = abs(p - c);
+                row[i] = (unsigned char)(row[i] +
+                    ((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c));
+                break;
+            default:
+                return -1;
+            }
+        }
+        prev_row = row;
+    }
+    return 0;
+}
+
+/*
+ * Frame rendering.
+ * The frame is composited on the current canvas, which is then disposed
+ * into the canvas of the next frame.
+ */
+static void
+render_frame(struct rendering *rendering, const unsigned char *fctl,
+             const unsigned char *rows, int bit_depth, int color_type,
+             const unsigned char *plte, int num_plte,
+             const unsigned char *trns, int num_trns)
+{
+    static const int type_channels[7] = {1, 0, 3, 1, 2, 0, 4};
+    static unsigned short prev_canvas[MAX_HEIGHT][MAX_WIDTH][4];
+    unsigned short (*canvas)[MAX_WIDTH][4];
+    unsigned short pixel[4];
+    unsigned int width, height, x_offset, y_offset, x, y;
+    size_t row_size;
+    int frame_index, dispose_op, blend_op;
+
+    width = (unsigned int)get_uint32(fctl + 4);
+    height = (unsigned int)get_uint32(fctl + 8);
+    x_offset = (unsigned int)get_uint32(fctl + 12);
+    y_offset = (unsigned int)get_uint32(fctl + 16);
+    dispose_op = fctl[24];
+    blend_op = fctl[25];
+    row_size = ((size_t)width * type_channels[color_type] * bit_depth + 7)
+               / 8;
+
+    frame_index = rendering->num_frames++;
+    canvas = rendering->canvas[frame_index];
+    if (frame_index == 0 && dispose_op == DISPOSE_OP_PREVIOUS)
+        dispose_op = DISPOSE_OP_BACKGROUND;
+    memcpy(prev_canvas, canvas, sizeof(prev_canvas));
+    for (y = 0; y < height; ++y)
+    {
+        for (x = 0; x < width; ++x)
+        {
+            get_pixel(rows + y * (row_size + 1) + 1, x, bit_depth, color_type,
+                      plte, num_plte, trns, num_trns, pixel);
+            blend_pixel(pixel, blend_op, canvas[y_offset + y][x_offset + x]);
+        }
+    }
+    /* The colors of the fully transparent pixels are not rendered. */
+    for (y = 0; y < rendering->height; ++y)
+    {
+        for (x = 0; x < rendering->width; ++x)
+        {
+            if (canvas[y][x][3] == 0)
+                memset(canvas[y][x], 0, 4 * sizeof(unsigned short));
+        }
+    }
+
+    if (frame_index + 1 >= MAX_FRAMES)
+        return;
+    memcpy(rendering->canvas[frame_index + 1], canvas, sizeof(prev_canvas));
+    canvas = rendering->canvas[frame_index + 1];
+    for (y = y_offset; y < y_offset + height; ++y)
+    {
+        for (x = x_offset; x < x_offset + width; ++x)
+        {
+            if (dispose_op == DISPOSE_OP_BACKGROUND)
+                memset(canvas[y][x], 0, 4 * sizeof(unsigned short));
+            else if (dispose_op == DISPOSE_OP_PREVIOUS)
+                memcpy(canvas[y][x], prev_canvas[y][x],
+                       4 * sizeof(unsigned short));
+        }
+    }
+}
+
+/*
+ * APNG rendering.
+ * Returns 0 on success, or -1 if the file can't be rendered.
+ */
+static int
+render_anim(const char *file_name, struct rendering *rendering)
+{
+    static unsigned char file_buf[MAX_FILE_SIZE];
+    static unsigned char zbuf[MAX_FILE_SIZE];
+    static unsigned char rows[MAX_HEIGHT * (MAX_WIDTH * 8 + 1)];
+    const unsigned char *chunk, *data, *fctl;
+    const unsigned char *plte, *trns;
+    size_t file_size, zsize, pos, length;
+    unsigned int width, height;
+    int bit_depth, color_type, num_plte, num_trns;
+    FILE *stream;
+
+    if ((stream = fopen(file_name, "rb")) == NULL)
+        return -1;
+    file_size = fread(file_buf, 1, sizeof(file_buf), stream);
+    fclose(stream);
+    if (file_size < 8 || memcmp(file_buf, "\x89PNG\r\n\x1a\n", 8) != 0)
+        return -1;
+
+    memset(rendering, 0, sizeof(*rendering));
+    plte = trns = fctl = NULL;
+    num_plte = num_trns = 0;
+    bit_depth = color_type = 0;
+    zsize = 0;
+    for (pos = 8; pos + 12 <= file_size; pos += length + 12)
+    {
+        chunk = file_buf + pos;
+        data = chunk + 8;
+        length = get_uint32(chunk);
+        if (length > file_size - pos - 12)
+            return -1;
+        if (memcmp(chunk + 4, "IHDR", 4) == 0)
+        {
+            rendering->width = (unsigned int)get_uint32(data);
+            rendering->height = (unsigned int)get_uint32(data + 4);
+            bit_depth = data[8];
+            color_type = data[9];
+            if (rendering->width > MAX_WIDTH ||
+                rendering->height > MAX_HEIGHT ||
+                color_type > 6 || data[12] != 0)
+                return -1;  /* interlacing is not supported */
+        }
+        else if (memcmp(chunk + 4, "PLTE", 4) == 0)
+        {
+            plte = data;
+            num_plte = (int)(length / 3);
+        }
+        else if (memcmp(chunk + 4, "tRNS", 4) == 0)
+        {
+            trns = data;
+            num_trns = (int)length;
+        }
+        else if (memcmp(chunk + 4, "fcTL", 4) == 0 ||
+                 memcmp(chunk + 4, "IEND", 4) == 0)
+        {
+            if (fctl != NULL)
+            {
+                width = (unsigned int)get_uint32(fctl + 4);
+                height = (unsigned int)get_uint32(fctl + 8);
+                if (rendering->num_frames >= MAX_FRAMES ||
+                    get_uint32(fctl + 12) + width > rendering->width ||
+                    get_uint32(fctl + 16) + height > rendering->height ||
+                    decode_frame(zbuf, zsize, width, height,
+                                 bit_depth, color_type, rows) != 0)
+                    return -1;
+                render_frame(rendering, fctl, rows, bit_depth, color_type,
+                             plte, num_plte, trns, num_trns);
+            }
+            if (chunk[4] == 'I')
+                return (rendering->num_frames > 0) ? 0 : -1;
+            fctl = data;
+            zsize = 0;
+        }
+        else if (memcmp(chunk + 4, "IDAT", 4) == 0)
+        {
+            /* The default image is a frame only if it has an fcTL. */
+            if (fctl == NULL)
+                continue;
+            memcpy(zbuf + zsize, data, length);
+            zsize += length;
+        }
+        else if (memcmp(chunk + 4, "fdAT", 4) == 0)
+        {
+            if (fctl == NULL || length < 4)
+                return -1;
+            memcpy(zbuf + zsize, data + 4, length - 4);
+            zsize += length - 4;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Color table generation.
+ * The colors must be representable in the given color type.
+ */
+static void
+make_colors(struct anim *anim)
+{
+    unsigned char *color;
+    int i;
+
+    anim->num_colors = 2 + (int)get_random(MAX_COLORS - 1);
+    for (i = 0; i < anim->num_colors; ++i)
+    {
+        color = anim->colors[i];
+        color[0] = (unsigned char)get_random(256);
+        color[1] = (unsigned char)get_random(256);
+        color[2] = (unsigned char)get_random(256);
+        switch (get_random(4))
+        {
+        case 0:
+            color[3] = 0;
+            break;
+        case 1:
+            color[3] = (unsigned char)(1 + get_random(254));
+            break;
+        default:
+            color[3] = 255;
+            break;
+        }
+        if (anim->color_type == 0 || anim->color_type == 4)
+            color[1] = color[2] = color[0];
+        if (anim->color_type == 0 || anim->color_type == 2)
+        {
+            /* At most one color, the first one, can be transparent. */
+            color[3] = (unsigned char)((i == 0 && color[3] == 0) ? 0 : 255);
+        }
+    }
+}
+
+/*
+ * Animation generation.
+ * Each frame changes a few pixels of a picture that evolves over time,
+ * so that the frames have plenty of unchanged pixels to crop.
+ */
+static void
+make_anim(struct anim *anim, int color_type)
+{
+    static unsigned char picture[MAX_HEIGHT][MAX_WIDTH];
+    struct anim_frame *frame;
+    unsigned int x, y;
+    int i, j;
+
+    memset(anim, 0, sizeof(*anim));
+    anim->width = 8 + get_random(17);
+    anim->height = 4 + get_random(MAX_HEIGHT - 3);
+    anim->color_type = color_type;
+    make_colors(anim);
+    anim->num_frames = 2 + (int)get_random(MAX_FRAMES - 1);
+    for (y = 0; y < anim->height; ++y)
+        for (x = 0; x < anim->width; ++x)
+            picture[y][x] = (unsigned char)get_random(anim->num_colors);
+    for (i = 0; i < anim->num_frames; ++i)
+    {
+        frame = &anim->frames[i];
+        if (i == 0 || get_random(3) == 0)
+        {
+            frame->width = anim->width;
+            frame->height = anim->height;
+        }
+        else
+        {
+            frame->x = get_random(anim->width);
+            frame->y = get_random(anim->height);
+            frame->width = 1 + get_random(anim->width - frame->x);
+            frame->height = 1 + get_random(anim->height - frame->y);
+        }
+        frame->dispose_op = (int)get_random(3);
+        frame->blend_op = (int)get_random(2);
+        for (j = (int)(anim->width * anim->height / 8); j >= 0; --j)
+            picture[get_random(anim->height)][get_random(anim->width)] =
+                (unsigned char)get_random(anim->num_colors);
+        for (y = 0; y < frame->height; ++y)
+            for (x = 0; x < frame->width; ++x)
+                frame->pixels[y][x] = picture[frame->y + y][frame->x + x];
+    }
+}
+
+/*
+ * The animation in which a semi-transparent pixel is blended over
+ * an identical pixel of the previous frame, disposed to the background.
+ */
+static void
+make_over_anim(struct anim *anim)
+{
+    static const unsigned char colors[MAX_COLORS][4] =
+    {
+        {255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 128},
+        {10, 20, 30, 255}, {200, 100, 50, 255}, {5, 5, 5, 200},
+        {90, 90, 90, 255}, {0, 128, 128, 255}
+    };
+    unsigned int x;
+    int i;
+
+    memset(anim, 0, sizeof(*anim));
+    anim->width = MAX_WIDTH;
+    anim->height = 1;
+    anim->color_type = 6;
+    memcpy(anim->colors, colors, sizeof(colors));
+    anim->num_colors = MAX_COLORS;
+    anim->num_frames = 2;
+    for (i = 0; i < anim->num_frames; ++i)
+    {
+        anim->frames[i].width = anim->width;
+        anim->frames[i].height = anim->height;
+        for (x = 0; x < anim->width; ++x)
+        {
+            anim->frames[i].pixels[0][x] = (unsigned char)((x / 7) % 8);
+            if (anim->frames[i].pixels[0][x] == 2)
+                anim->frames[i].pixels[0][x] = 3;
+        }
+        anim->frames[i].pixels[0][30] = 2;
+    }
+    anim->frames[0].dispose_op = DISPOSE_OP_BACKGROUND;
+    anim->frames[0].blend_op = BLEND_OP_SOURCE;
+    anim->frames[1].dispose_op = DISPOSE_OP_NONE;
+    anim->frames[1].blend_op = BLEND_OP_OVER;
+    anim->frames[1].pixels[0][29] = 0;
+    anim->frames[1].pixels[0][31] = 1;
+}
+
+/*
+ * Rendering comparison.
+ */
+static int
+is_same_rendering(const struct rendering *rendering1,
+                  const struct rendering *rendering2)
+{
+    if (rendering1->width != rendering2->width ||
+        rendering1->height != rendering2->height ||
+        rendering1->num_frames != rendering2->num_frames)
+        return 0;
+    return memcmp(rendering1->canvas, rendering2->canvas,
+                  rendering1->num_frames * sizeof(rendering1->canvas[0]))
+           == 0;
+}
+
+/*
+ * Round-trip testing.
+ */
+static void
+test_anim(const char *optipng, const struct anim *anim,
+          const char *options, const char *description)
+{
+    static char command[1024];
+
+    ++num_tests;
+    sprintf(command, "%s -quiet %s -clobber %s -out %s",
+            optipng, options, IN_FILE_NAME, OUT_FILE_NAME);
+    remove(OUT_FILE_NAME);
+    if (write_anim(IN_FILE_NAME, anim) != 0 ||
+        render_anim(IN_FILE_NAME, &in_rendering) != 0)
+    {
+        printf("FAILED: cannot write: %s\n", description);
+        ++num_errors;
+        return;
+    }
+    if (system(command) != 0 ||
+        render_anim(OUT_FILE_NAME, &out_rendering) != 0)
+    {
+        printf("FAILED: %s: %s\n", command, description);
+        ++num_errors;
+        return;
+    }
+    if (!is_same_rendering(&in_rendering, &out_rendering))
+    {
+        printf("FAILED: %s: %s: rendering mismatch\n", options, description);
+        ++num_errors;
+        return;
+    }
+    printf("%s: %s\n", options, description);
+}
+
+/*
+ * The main function.
+ */
+int
+main(int argc, char *argv[])
+{
+    static const int color_types[5] = {6, 4, 3, 2, 0};
+    static const char *options[3] = {"-o1", "-o1 -nx", "-o2"};
+    static struct anim anim;
+    static char description[64];
+    unsigned long anim_seed;
+    int i, j;
+
+    if (argc != 2)
+    {
+        printf("Usage: %s <optipng>\n", argv[0]);
+        return 2;
+    }
+
+    make_over_anim(&anim);
+    for (j = 0; j < 3; ++j)
+        test_anim(argv[1], &anim, options[j], "semi-transparent over");
+    for (anim_seed = 1; anim_seed <= 25; ++anim_seed)
+    {
+        i = (int)(anim_seed % 5);
+        sprintf(description, "color type %d, seed %lu",
+                color_types[i], anim_seed);
+        seed = anim_seed;
+        make_anim(&anim, color_types[i]);
+        for (j = 0; j < 3; ++j)
+            test_anim(argv[1], &anim, options[j], description);
+    }
+
+    if (num_errors != 0)
+    {
+        printf("** %d/%d tests FAILED **\n", num_errors, num_tests);
+        return 1;
+    }
+    printf("** %d tests passed **\n", num_tests);
+    return 0;
+}
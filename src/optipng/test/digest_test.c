@@ -0,0 +1,137 @@
+/*
+ * digest_test.c
+ * Test for digest.
+ *
+ * Copyright (C) 2001-2017 Cosmin Truta and the Contributing Authors.
+ *
+ * This software is distributed under the zlib license.
+ * Please see the accompanying LICENSE file.
+ */
+
+#include "digest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+static int num_tests = 0;
+static int num_errors = 0;
+
+static void
+test_digest_impl(const char *test_name, const unsigned char *data,
+                 size_t size, size_t chunk_size, const char *expected)
+{
+    struct opng_digest_ctx ctx;
+    unsigned char digest[OPNG_DIGEST_SIZE], digest2[OPNG_DIGEST_SIZE];
+    char hex[OPNG_DIGEST_HEX_SIZE];
+    size_t pos, count;
+
+    ++num_tests;
+    opng_digest_init(&ctx);
+    for (pos = 0; pos < size; pos += count)
+    {
+        count = (size - pos < chunk_size) ? (size - pos) : chunk_size;
+        opng_digest_update(&ctx, data + pos, count);
+    }
+    opng_digest_final(&ctx, digest);
+    opng_digest_to_hex(hex, digest);
+    if (strcmp(hex, expected) != 0)
+    {
+        ++num_errors;
+        printf("FAILED: %s (chunk size: %lu), result: %s, expected: %s\n",
+               test_name, (unsigned long)chunk_size, hex, expected);
+        return;
+    }
+    if (opng_digest_from_hex(digest2, hex) != 0 ||
+        memcmp(digest, digest2, OPNG_DIGEST_SIZE) != 0)
+    {
+        ++num_errors;
+        printf("FAILED: %s, can't convert the digest back from: %s\n",
+               test_name, hex);
+    }
+}
+
+static void
+test_digest(const char *test_name, const unsigned char *data, size_t size,
+            const char *expected)
+{
+    static const size_t chunk_sizes[] = { 1, 7, 55, 56, 63, 64, 65, 1000 };
+    size_t i;
+
+    test_digest_impl(test_name, data, size, size + 1, expected);
+    for (i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++i)
+    {
+        if (chunk_sizes[i] < size)
+            test_digest_impl(test_name, data, size, chunk_sizes[i], expected);
+    }
+}
+
+static void
+test_from_hex(const char *hex, int expected)
+{
+    unsigned char digest[OPNG_DIGEST_SIZE];
+    int result;
+
+    ++num_tests;
+    result = opng_digest_from_hex(digest, hex);
+    if (result != expected)
+    {
+        ++num_errors;
+        printf("FAILED: opng_digest_from_hex(\"%s\"), result: %d, "
+               "expected: %d\n", hex, result, expected);
+    }
+}
+
+static void
+run_tests()
+{
+    static unsigned char buf[1000000];
+    size_t i;
+
+    /* The test vectors from FIPS PUB 180-2. */
+    test_digest("empty", (const unsigned char *)"", 0,
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    test_digest("abc", (const unsigned char *)"abc", 3,
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    test_digest("two blocks", (const unsigned char *)
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56,
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    memset(buf, 'a', sizeof(buf));
+    test_digest("million a's", buf, sizeof(buf),
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+    /* All byte values, with the size ending near a block boundary. */
+    for (i = 0; i < 3 * 256; ++i)
+        buf[i] = (unsigned char)i;
+    memset(buf + 3 * 256, 'x', 55);
+    test_digest("byte values", buf, 3 * 256 + 55,
+        "1d099a857037971bbd4c2e0a22e35939ef393d1831523e67d125d194e77ee949");
+
+    /* The conversion from hexadecimal. */
+    test_from_hex(
+        "BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD", 0);
+    test_from_hex(
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015a", -1);
+    test_from_hex(
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad0",
+        -1);
+    test_from_hex(
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ag",
+        -1);
+}
+
+int
+main()
+{
+    run_tests();
+    if (num_errors != 0)
+    {
+        printf("** %d/%d tests FAILED **\n", num_errors, num_tests);
+        return 1;
+    }
+    else
+    {
+        printf("** %d tests passed **\n", num_tests);
+        return 0;
+    }
+}
@@ -7,12 +7,168 @@
  */
 
 #include "pngxutil.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined __unix__ || defined __unix || \
+    (defined __APPLE__ && defined __MACH__)
+#include <unistd.h>
+#if defined _POSIX_MAPPED_FILES && _POSIX_MAPPED_FILES > 0
+#include <sys/mman.h>
+#define PNGX_MMAP_SUPPORTED
+#endif
+#endif
+
 
 #ifdef PNG_INFO_IMAGE_SUPPORTED
 
 
+/* The row blocks larger than this value are backed by huge pages,
+ * if the system supports them.
+ */
+#define PNGX_HUGE_PAGE_THRESHOLD ((pngx_alloc_size_t)32 << 20)
+#define PNGX_HUGE_PAGE_SIZE ((pngx_alloc_size_t)2 << 20)
+
+/* The row blocks larger than this value are stored out of core. */
+static pngx_alloc_size_t pngx_rows_memory_limit = 0;
+
+#ifdef PNGX_MMAP_SUPPORTED
+
+/* The out-of-core row blocks currently in use. */
+#define PNGX_MAPPED_BLOCKS_MAX 8
+static struct
+{
+   png_voidp ptr;
+   pngx_alloc_size_t size;
+} pngx_mapped_blocks[PNGX_MAPPED_BLOCKS_MAX];
+
+/* Map a memory block to a new, unnamed scratch file.
+ * The scratch file is created in $TMPDIR, or in /tmp by default,
+ * and it is removed from the file system right away.
+ * Return the mapped block, or NULL on failure.
+ */
+static png_voidp /* PRIVATE */
+pngx_map_scratch_block(pngx_alloc_size_t size)
+{
+   const char *dir_name;
+   char file_name[FILENAME_MAX];
+   png_voidp ptr;
+   int fd, k;
+
+   for (k = 0; k < PNGX_MAPPED_BLOCKS_MAX; ++k)
+   {
+      if (pngx_mapped_blocks[k].ptr == NULL)
+         break;
+   }
+   if (k == PNGX_MAPPED_BLOCKS_MAX)
+      return NULL;  /* too many out-of-core blocks */
+   if ((pngx_alloc_size_t)(off_t)size != size || (off_t)size < 0)
+      return NULL;  /* the scratch file would be too large */
+
+   dir_name = getenv("TMPDIR");
+   if (dir_name == NULL || dir_name[0] == 0)
+      dir_name = "/tmp";
+   if (strlen(dir_name) + sizeof("/pngxXXXXXX") > sizeof(file_name))
+      return NULL;
+   sprintf(file_name, "%s/pngxXXXXXX", dir_name);
+   fd = mkstemp(file_name);
+   if (fd < 0)
+      return NULL;
+   unlink(file_name);
+   if (ftruncate(fd, (off_t)size) != 0)
+   {
+      close(fd);
+      return NULL;
+   }
+   ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);  /* the mapping keeps the file alive */
+   if (ptr == MAP_FAILED)
+      return NULL;
+
+   pngx_mapped_blocks[k].ptr = ptr;
+   pngx_mapped_blocks[k].size = size;
+   return ptr;
+}
+
+#endif /* PNGX_MMAP_SUPPORTED */
+
+
+void PNGAPI
+pngx_set_rows_memory_limit(pngx_alloc_size_t limit)
+{
+   pngx_rows_memory_limit = limit;
+}
+
+int PNGAPI
+pngx_rows_are_mapped(png_bytepp rows)
+{
+#ifdef PNGX_MMAP_SUPPORTED
+   int k;
+
+   if (rows == NULL)
+      return 0;
+   for (k = 0; k < PNGX_MAPPED_BLOCKS_MAX; ++k)
+   {
+      if (pngx_mapped_blocks[k].ptr == (png_voidp)rows)
+         return 1;
+   }
+#else
+   (void)rows;
+#endif
+   return 0;
+}
+
+int PNGAPI
+pngx_unmap_rows(png_bytepp rows)
+{
+#ifdef PNGX_MMAP_SUPPORTED
+   int k;
+
+   if (rows == NULL)
+      return 0;
+   for (k = 0; k < PNGX_MAPPED_BLOCKS_MAX; ++k)
+   {
+      if (pngx_mapped_blocks[k].ptr == (png_voidp)rows)
+      {
+         munmap(pngx_mapped_blocks[k].ptr, pngx_mapped_blocks[k].size);
+         pngx_mapped_blocks[k].ptr = NULL;
+         pngx_mapped_blocks[k].size = 0;
+         return 1;
+      }
+   }
+#else
+   (void)rows;
+#endif
+   return 0;
+}
+
+
+pngx_alloc_size_t PNGAPI
+pngx_get_rows_layout(png_uint_32 height, pngx_alloc_size_t row_size,
+   pngx_alloc_size_t *index_size, pngx_alloc_size_t *row_stride)
+{
+   pngx_alloc_size_t index_bytes, stride;
+
+   if (height == 0 || row_size == 0 ||
+       (pngx_alloc_size_t)height >
+          ((pngx_alloc_size_t)(-1) - (PNGX_ROW_ALIGNMENT - 1)) /
+          sizeof(png_bytep) ||
+       row_size > (pngx_alloc_size_t)(-1) - (PNGX_ROW_ALIGNMENT - 1))
+      return 0;
+   index_bytes = (pngx_alloc_size_t)height * sizeof(png_bytep);
+   index_bytes += (PNGX_ROW_ALIGNMENT - 1) - (index_bytes - 1) %
+                  PNGX_ROW_ALIGNMENT;
+   stride = row_size + (PNGX_ROW_ALIGNMENT - 1) - (row_size - 1) %
+            PNGX_ROW_ALIGNMENT;
+   if (stride >
+       ((pngx_alloc_size_t)(-1) - index_bytes) / (pngx_alloc_size_t)height)
+      return 0;
+   *index_size = index_bytes;
+   *row_stride = stride;
+   return index_bytes + stride * (pngx_alloc_size_t)height;
+}
+
 png_bytepp PNGAPI
 pngx_malloc_rows(png_structp png_ptr, png_infop info_ptr, int filler)
 {
@@ -23,7 +179,7 @@ png_bytepp PNGAPI
 pngx_malloc_rows_extended(png_structp png_ptr, png_infop info_ptr,
    pngx_alloc_size_t min_row_size, int filler)
 {
-   pngx_alloc_size_t row_size;
+   pngx_alloc_size_t row_size, row_stride, index_size, block_size;
    png_bytep row;
    png_bytepp rows;
    png_uint_32 height, i;
@@ -33,51 +189,92 @@ pngx_malloc_rows_extended(png_structp png_ptr, png_infop info_ptr,
    if (height == 0)
       png_error(png_ptr, "Missing IHDR");
    row_size = png_get_rowbytes(png_ptr, info_ptr);
-   /* libpng sets row_size to 0 when the width is too large to process. */
-   if (row_size == 0 ||
-       (pngx_alloc_size_t)height > (pngx_alloc_size_t)(-1) / sizeof(png_bytep))
-      png_error(png_ptr, "Can't handle exceedingly large image dimensions");
    if (row_size < min_row_size)
       row_size = min_row_size;
 
+   /* Calculate the size of the row block.
+    * libpng sets row_size to 0 when the width is too large to process.
+    */
+   block_size = pngx_get_rows_layout(height, row_size,
+      &index_size, &row_stride);
+   if (block_size == 0)
+      png_error(png_ptr, "Can't handle exceedingly large image dimensions");
+
    /* Deallocate the currently-existing rows. */
    png_free_data(png_ptr, info_ptr, PNG_FREE_ROWS, 0);
 
-   /* Allocate memory for the row index. */
-   rows = (png_bytepp)png_malloc(png_ptr,
-      (pngx_alloc_size_t)(height * sizeof(png_bytep)));
+   /* Allocate memory for the row index and for all the rows,
+    * in a single block.
+    * If the block exceeds the memory limit, store it out of core.
+    */
+   rows = NULL;
+#ifdef PNGX_MMAP_SUPPORTED
+   if (pngx_rows_memory_limit > 0 && block_size > pngx_rows_memory_limit)
+   {
+      rows = (png_bytepp)pngx_map_scratch_block(block_size);
+      if (rows == NULL)
+         png_warning(png_ptr,
+            "Can't store the image rows out of core; using the memory");
+   }
+#endif
    if (rows == NULL)
-      return NULL;
-
-   /* Allocate memory for each row. */
-   for (i = 0; i < height; ++i)
    {
-      row = (png_bytep)png_malloc(png_ptr, row_size);
-      if (row == NULL)
-      {
-         /* Release the memory allocated up to the point of failure. */
-         while (i > 0)
-            png_free(png_ptr, rows[--i]);
-         png_free(png_ptr, rows);
+      rows = (png_bytepp)png_malloc(png_ptr, block_size);
+      if (rows == NULL)
          return NULL;
-      }
-      if (filler >= 0)
-         memset(row, filler, row_size);
-      rows[i] = row;
+      pngx_advise_huge_pages(rows, block_size);
    }
 
+   /* Set up the row index. */
+   row = (png_bytep)rows + index_size;
+   for (i = 0; i < height; ++i, row += row_stride)
+      rows[i] = row;
+   /* The scratch files are already filled with zeroes. */
+   if (filler > 0 || (filler == 0 && !pngx_rows_are_mapped(rows)))
+      memset(rows[0], filler, row_stride * (pngx_alloc_size_t)height);
+
    /* Set the row pointers. */
    png_set_rows(png_ptr, info_ptr, rows);
    return rows;
 }
 
-#if 0  /* not necessary */
 void PNGAPI
 pngx_free_rows(png_structp png_ptr, png_infop info_ptr)
 {
-   png_free_data(png_ptr, info_ptr, PNG_FREE_ROWS, 0);
+   png_bytepp rows;
+
+   rows = png_get_rows(png_ptr, info_ptr);
+   if (rows == NULL)
+      return;
+   /* Prevent libpng from deallocating the rows one by one. */
+   png_data_freer(png_ptr, info_ptr, PNG_USER_WILL_FREE_DATA, PNG_FREE_ROWS);
+   png_set_rows(png_ptr, info_ptr, NULL);
+   png_set_invalid(png_ptr, info_ptr, PNG_INFO_IDAT);
+   if (!pngx_unmap_rows(rows))
+      png_free(png_ptr, rows);
 }
-#endif
 
 
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
+
+
+void PNGAPI
+pngx_advise_huge_pages(png_voidp ptr, pngx_alloc_size_t size)
+{
+#ifdef MADV_HUGEPAGE
+   pngx_alloc_size_t offset;
+
+   /* The advice applies to the huge pages that fit entirely in the block. */
+   if (size < PNGX_HUGE_PAGE_THRESHOLD)
+      return;
+   offset = (PNGX_HUGE_PAGE_SIZE - 1) -
+            ((pngx_alloc_size_t)ptr - 1) % PNGX_HUGE_PAGE_SIZE;
+   size = (size - offset) - (size - offset) % PNGX_HUGE_PAGE_SIZE;
+   if (size > 0)
+      madvise((png_bytep)ptr + offset, size, MADV_HUGEPAGE);
+#else
+   /* Huge pages are not supported on this system. */
+   (void)ptr;
+   (void)size;
+#endif
+}
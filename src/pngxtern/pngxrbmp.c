@@ -107,6 +107,62 @@ bmp_get_dword(png_bytep ptr)
 }
 
 
+/*****************************************************************************/
+/* BMP buffered input                                                        */
+/*****************************************************************************/
+
+/* The pixel array is read in blocks, and decoded from memory. */
+#define BMP_BUFFER_SIZE     16384
+
+typedef struct bmp_reader_struct
+{
+   FILE *stream;
+   size_t pos, len;
+   png_byte buf[BMP_BUFFER_SIZE];
+} bmp_reader;
+
+static int
+bmp_fill_buffer(bmp_reader *reader)
+{
+   reader->pos = 0;
+   reader->len = fread(reader->buf, 1, BMP_BUFFER_SIZE, reader->stream);
+   return (reader->len > 0) ? 1 : 0;
+}
+
+static int
+bmp_getc(bmp_reader *reader)
+{
+   if (reader->pos >= reader->len && !bmp_fill_buffer(reader))
+      return EOF;
+   return reader->buf[reader->pos++];
+}
+
+static size_t
+bmp_read(bmp_reader *reader, png_bytep ptr, size_t len)
+{
+   size_t result, count;
+
+   for (result = 0; result < len; result += count)
+   {
+      if (reader->pos >= reader->len)
+      {
+         /* Bypass the buffer when reading large blocks. */
+         if (len - result >= BMP_BUFFER_SIZE)
+            return result + fread(ptr + result, 1, len - result,
+                                  reader->stream);
+         if (!bmp_fill_buffer(reader))
+            break;
+      }
+      count = reader->len - reader->pos;
+      if (count > len - result)
+         count = len - result;
+      memcpy(ptr + result, reader->buf + reader->pos, count);
+      reader->pos += count;
+   }
+   return result;
+}
+
+
 /*****************************************************************************/
 /* BMP helpers                                                               */
 /*****************************************************************************/
@@ -136,18 +192,19 @@ bmp_memset_halfbytes(png_bytep ptr, size_t offset, int ch, size_t len)
 }
 
 static size_t
-bmp_fread_bytes(png_bytep ptr, size_t offset, size_t len, FILE *stream)
+bmp_fread_bytes(png_bytep ptr, size_t offset, size_t len, bmp_reader *reader)
 {
    size_t result;
 
-   result = fread(ptr + offset, 1, len, stream);
+   result = bmp_read(reader, ptr + offset, len);
    if (len & 1)
-      getc(stream);  /* skip padding */
+      bmp_getc(reader);  /* skip padding */
    return result;
 }
 
 static size_t
-bmp_fread_halfbytes(png_bytep ptr, size_t offset, size_t len, FILE *stream)
+bmp_fread_halfbytes(png_bytep ptr, size_t offset, size_t len,
+                    bmp_reader *reader)
 {
    size_t result;
    int ch;
@@ -159,7 +216,7 @@ bmp_fread_halfbytes(png_bytep ptr, size_t offset, size_t len, FILE *stream)
    {
       for (result = 0; result < len - 1; result += 2)
       {
-         ch = getc(stream);
+         ch = bmp_getc(reader);
          if (ch == EOF)
             break;
          *ptr = (png_byte)((*ptr & 0xf0) | ((ch & 0xf0) >> 4));
@@ -169,10 +226,10 @@ bmp_fread_halfbytes(png_bytep ptr, size_t offset, size_t len, FILE *stream)
    }
    else
    {
-      result = fread(ptr, 1, (len + 1) / 2, stream) * 2;
+      result = bmp_read(reader, ptr, (len + 1) / 2) * 2;
    }
    if (len & 2)
-      getc(stream);  /* skip padding */
+      bmp_getc(reader);  /* skip padding */
    return (result <= len) ? result : len;
 }
 
@@ -211,7 +268,7 @@ bmp_process_mask(png_uint_32 bmp_mask, png_bytep sig_bit, png_bytep shift_bit)
 
 static size_t
 bmp_read_rows(png_bytepp begin_row, png_bytepp end_row, size_t row_size,
-              unsigned int compression, FILE *stream)
+              unsigned int compression, bmp_reader *reader)
 {
    size_t result;
    png_bytepp crt_row;
@@ -220,7 +277,7 @@ bmp_read_rows(png_bytepp begin_row, png_bytepp end_row, size_t row_size,
    unsigned int len, b1, b2;
    int ch;
    void (*bmp_memset_fn)(png_bytep, size_t, int, size_t);
-   size_t (*bmp_fread_fn)(png_bytep, size_t, size_t, FILE *);
+   size_t (*bmp_fread_fn)(png_bytep, size_t, size_t, bmp_reader *);
 
    if (row_size == 0)
       return 0;  /* this should not happen */
@@ -248,7 +305,7 @@ bmp_read_rows(png_bytepp begin_row, png_bytepp end_row, size_t row_size,
       /* Read uncompressed bitmap. */
       for (crt_row = begin_row; crt_row != end_row; crt_row += inc)
       {
-         crtn = bmp_fread_fn(*crt_row, 0, endn, stream);
+         crtn = bmp_fread_fn(*crt_row, 0, endn, reader);
          if (crtn != endn)
             break;
          ++result;
@@ -269,8 +326,8 @@ bmp_read_rows(png_bytepp begin_row, png_bytepp end_row, size_t row_size,
       }
       for (crt_row = begin_row; crt_row != end_row; )
       {
-         ch = getc(stream); b1 = (unsigned int)ch;
-         ch = getc(stream); b2 = (unsigned int)ch;
+         ch = bmp_getc(reader); b1 = (unsigned int)ch;
+         ch = bmp_getc(reader); b2 = (unsigned int)ch;
          if (ch == EOF)
             break;
          if (b1 == 0)  /* escape */
@@ -282,16 +339,7 @@ bmp_read_rows(png_bytepp begin_row, png_bytepp end_row, size_t row_size,
                crtn = 0;
                ++result;
                if (crt_row == end_row)  /* all rows are read */
-               {
-                  ch = getc(stream);  /* check for the end of bitmap */
-                  if (ch != EOF && ch != 0)
-                  {
-                     ungetc(ch, stream);  /* forget about the end of bitmap */
-                     break;
-                  }
-                  getc(stream);  /* expect 1, but break the loop anyway */
-                  break;
-               }
+                  break;  /* the end of bitmap is not needed */
             }
             else if (b2 == 1)  /* end of bitmap */
             {
@@ -304,8 +352,8 @@ bmp_read_rows(png_bytepp begin_row, png_bytepp end_row, size_t row_size,
             }
             else if (b2 == 2)  /* delta */
             {
-               ch = getc(stream); b1 = (unsigned int)ch;  /* horiz. offset */
-               ch = getc(stream); b2 = (unsigned int)ch;  /* vert. offset */
+               ch = bmp_getc(reader); b1 = (unsigned int)ch;  /* horiz. */
+               ch = bmp_getc(reader); b2 = (unsigned int)ch;  /* vert. */
                if (ch == EOF)
                   break;
                dcrtn = (b1 < endn - crtn) ? (crtn + b1) : endn;
@@ -324,7 +372,7 @@ bmp_read_rows(png_bytepp begin_row, png_bytepp end_row, size_t row_size,
             else  /* b2 >= 3 bytes in absolute mode */
             {
                len = (b2 <= endn - crtn) ? b2 : (unsigned int)(endn - crtn);
-               if (bmp_fread_fn(*crt_row, crtn, len, stream) != len)
+               if (bmp_fread_fn(*crt_row, crtn, len, reader) != len)
                   break;
                crtn += len;
             }
@@ -361,11 +409,13 @@ bmp_to_png_rows(png_bytepp row_pointers,
                 png_bytep rgba_sig, png_bytep rgba_shift)
 {
    png_bytep src_ptr, dest_ptr;
-   unsigned int rgba_mask[4];
+   png_byte rgba_table[4][256];
+   unsigned int rgba_mask[4], rgba_offset[4];
    unsigned int num_samples, sample, mask;
    unsigned int wpix;
    png_uint_32 dwpix;
    png_uint_32 x, y;
+   png_byte r, g, b, a;
    unsigned int i;
 
    if (pixdepth == 24)  /* BGR -> RGB */
@@ -383,9 +433,14 @@ bmp_to_png_rows(png_bytepp row_pointers,
       return;
    }
 
+   /* Precompute the sample scaling; the masks have at most 8 bits. */
    num_samples = (rgba_sig[3] != 0) ? 4 : 3;
    for (i = 0; i < num_samples; ++i)
-      rgba_mask[i] = (1U << rgba_sig[i]) - 1;
+   {
+      rgba_mask[i] = mask = (1U << rgba_sig[i]) - 1;
+      for (sample = 0; sample <= mask; ++sample)
+         rgba_table[i][sample] = (png_byte)((sample * 255 + mask / 2) / mask);
+   }
 
    if (pixdepth == 16)
    {
@@ -398,16 +453,54 @@ bmp_to_png_rows(png_bytepp row_pointers,
             /* Inline bmp_get_word() for performance reasons. */
             wpix = (unsigned int)src_ptr[0] + ((unsigned int)src_ptr[1] << 8);
             for (i = 0; i < num_samples; ++i)
-            {
-               mask = rgba_mask[i];
-               sample = (wpix >> rgba_shift[i]) & mask;
-               dest_ptr[i] = (png_byte)((sample * 255 + mask / 2) / mask);
-            }
+               dest_ptr[i] =
+                  rgba_table[i][(wpix >> rgba_shift[i]) & rgba_mask[i]];
          }
       }
    }
    else if (pixdepth == 32)
    {
+      for (i = 0; i < num_samples; ++i)
+      {
+         if (rgba_sig[i] != 8 || rgba_shift[i] % 8 != 0)
+            break;
+         rgba_offset[i] = rgba_shift[i] / 8;
+      }
+      if (i == num_samples)
+      {
+         /* The samples are whole bytes (e.g. BGRA -> RGBA). */
+         for (y = 0; y < height; ++y)
+         {
+            src_ptr = dest_ptr = row_pointers[y];
+            if (num_samples == 4)
+            {
+               for (x = 0; x < width; ++x, src_ptr += 4, dest_ptr += 4)
+               {
+                  r = src_ptr[rgba_offset[0]];
+                  g = src_ptr[rgba_offset[1]];
+                  b = src_ptr[rgba_offset[2]];
+                  a = src_ptr[rgba_offset[3]];
+                  dest_ptr[0] = r;
+                  dest_ptr[1] = g;
+                  dest_ptr[2] = b;
+                  dest_ptr[3] = a;
+               }
+            }
+            else
+            {
+               for (x = 0; x < width; ++x, src_ptr += 4, dest_ptr += 3)
+               {
+                  r = src_ptr[rgba_offset[0]];
+                  g = src_ptr[rgba_offset[1]];
+                  b = src_ptr[rgba_offset[2]];
+                  dest_ptr[0] = r;
+                  dest_ptr[1] = g;
+                  dest_ptr[2] = b;
+               }
+            }
+         }
+         return;
+      }
       for (y = 0; y < height; ++y)
       {
          src_ptr = dest_ptr = row_pointers[y];
@@ -417,11 +510,8 @@ bmp_to_png_rows(png_bytepp row_pointers,
             dwpix = (png_uint_32)src_ptr[0] + ((png_uint_32)src_ptr[1] << 8) +
             ((png_uint_32)src_ptr[2] << 16) + ((png_uint_32)src_ptr[3] << 24);
             for (i = 0; i < num_samples; ++i)
-            {
-               mask = rgba_mask[i];
-               sample = (dwpix >> rgba_shift[i]) & mask;
-               dest_ptr[i] = (png_byte)((sample * 255 + mask / 2) / mask);
-            }
+               dest_ptr[i] =
+                  rgba_table[i][(dwpix >> rgba_shift[i]) & rgba_mask[i]];
          }
       }
    }
@@ -485,6 +575,7 @@ pngx_read_bmp(png_structp png_ptr, png_infop info_ptr, FILE *stream)
    png_color palette[256];
    png_color_8 sig_bit;
    png_bytepp row_pointers, begin_row, end_row;
+   bmp_reader *reader;
    unsigned int i;
    size_t y;
 
@@ -617,7 +708,14 @@ pngx_read_bmp(png_structp png_ptr, png_infop info_ptr, FILE *stream)
       if (ungetc(getc(stream), stream) == 0)  /* IHDR is likely to follow */
          png_set_sig_bytes(png_ptr, 8);
       png_set_read_fn(png_ptr, stream, NULL);
-      png_read_png(png_ptr, info_ptr, 0, NULL);
+      /* Read the rows into a single block, like the other image formats.
+       * This is what png_read_png() does, minus its row allocation.
+       */
+      png_read_info(png_ptr, info_ptr);
+      png_set_interlace_handling(png_ptr);
+      png_read_update_info(png_ptr, info_ptr);
+      png_read_image(png_ptr, pngx_malloc_rows(png_ptr, info_ptr, 0));
+      png_read_end(png_ptr, info_ptr);
       /* TODO: Check for mismatches between the BMP and PNG info. */
       return 1;
    default:
@@ -720,7 +818,11 @@ pngx_read_bmp(png_structp png_ptr, png_infop info_ptr, FILE *stream)
    }
    if (skip > 0)
       fseek(stream, (long)skip, SEEK_CUR);
-   y = bmp_read_rows(begin_row, end_row, rowsize, compression, stream);
+   reader = (bmp_reader *)png_malloc(png_ptr, sizeof(bmp_reader));
+   reader->stream = stream;
+   reader->pos = reader->len = 0;
+   y = bmp_read_rows(begin_row, end_row, rowsize, compression, reader);
+   png_free(png_ptr, reader);
 
    /* Postprocess the image data, even if it has not been read entirely. */
    if (pixdepth > 8)
@@ -100,12 +100,19 @@ pnm_fpeek_eof(pnm_struct *pnm_ptr, FILE *stream)
 int /* PRIVATE */
 pngx_read_pnm(png_structp png_ptr, png_infop info_ptr, FILE *stream)
 {
+   static const int color_types[] =
+   {
+      PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+      PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA
+   };
    pnm_struct pnminfo;
    unsigned int format, depth, width, height, maxval;
    unsigned int max_width, num_samples, sample_size;
    unsigned int *pnmrow;
+   png_uint_16p scale_table;
    size_t row_size;
    png_bytepp row_pointers;
+   png_bytep row;
    png_color_8 sig_bit;
    unsigned int i, j;
    int failed, overflow;
@@ -118,8 +125,8 @@ pngx_read_pnm(png_structp png_ptr, png_infop info_ptr, FILE *stream)
    width = pnminfo.width;
    height = pnminfo.height;
    maxval = pnminfo.maxval;
-   if (format > PNM_P6)
-      png_error(png_ptr, "Can't handle PNM formats newer than PPM (\"P6\")");
+   if (depth > 4)
+      png_error(png_ptr, "Can't handle PAM depths larger than 4");
    max_width =
       (sizeof(size_t) <= sizeof(unsigned int)) ?
          UINT_MAX / sizeof(unsigned int) / depth : UINT_MAX;
@@ -139,11 +146,14 @@ pngx_read_pnm(png_structp png_ptr, png_infop info_ptr, FILE *stream)
       row_size *= 2;
    }
 
-   /* Set the PNG image type. */
+   /* Set the PNG image type.
+    * The PAM tuple type is implied by the depth: GRAYSCALE, GRAYSCALE_ALPHA,
+    * RGB or RGB_ALPHA. (BLACKANDWHITE is GRAYSCALE with maxval = 1.)
+    */
    png_set_IHDR(png_ptr, info_ptr,
       width, height,
       (maxval <= 255) ? 8 : 16,
-      (depth == 1) ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB,
+      color_types[depth - 1],
       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
    for (i = 1, j = 2; j - 1 < maxval; ++i, j <<= 1) { }
    if (j - 1 != maxval)
@@ -152,73 +162,103 @@ pngx_read_pnm(png_structp png_ptr, png_infop info_ptr, FILE *stream)
    else if (i % 8 != 0 && (depth > 1 || 8 % i != 0))
    {
       sig_bit.red = sig_bit.green = sig_bit.blue = sig_bit.gray = (png_byte)i;
-      sig_bit.alpha = 0;
+      sig_bit.alpha = (png_byte)((depth % 2 == 0) ? i : 0);
       png_set_sBIT(png_ptr, info_ptr, &sig_bit);
    }
 
-   /* Allocate memory. */
+   /* Allocate memory.
+    * The raw samples are read directly into row_pointers; only the plain
+    * (ASCII) samples need an intermediate row.
+    * The samples are rescaled through a lookup table, unless maxval is
+    * already 255 or 65535.
+    */
    row_pointers = pngx_malloc_rows(png_ptr, info_ptr, -1);
-   if ((format >= PNM_P4) && (maxval == 255 || maxval == 65535))
-      pnmrow = NULL;  /* can read raw data directly into row_pointers */
+   if (format >= PNM_P4)
+      pnmrow = NULL;
    else
       pnmrow = (unsigned int *)
          png_malloc(png_ptr, num_samples * sizeof(unsigned int));
+   if (maxval == 255 || maxval == 65535)
+      scale_table = NULL;
+   else
+   {
+      scale_table = (png_uint_16p)
+         png_malloc(png_ptr, (maxval + 1) * sizeof(png_uint_16));
+      for (j = 0; j <= maxval; ++j)
+         scale_table[j] = (png_uint_16)
+            (((png_uint_32)j * ((sample_size == 1) ? 255 : 65535) + maxval/2)
+             / maxval);
+   }
 
    /* Read the image data. */
    failed = 0;
    overflow = 0;
-   if (pnmrow != NULL)
+   for (i = 0; i < height; ++i)
    {
-      for (i = 0; i < height; ++i)
+      row = row_pointers[i];
+      if (pnmrow != NULL)
       {
          if (pnm_fget_values(&pnminfo, pnmrow, 1, stream) <= 0)
             failed = 1;
          /* Transfer the samples, even on partial (unsuccessful) reads. */
-         if (maxval <= 255)
+         for (j = 0; j < num_samples; ++j)
+         {
+            png_uint_32 val = pnmrow[j];
+            if (val > maxval)
+            {
+               val = (sample_size == 1) ? 255 : 65535;
+               overflow = 1;
+            }
+            else if (scale_table != NULL)
+               val = scale_table[val];
+            if (sample_size == 1)
+               row[j] = (png_byte)val;
+            else
+            {
+               row[2 * j] = (png_byte)(val >> 8);
+               row[2 * j + 1] = (png_byte)(val & 0xff);
+            }
+         }
+      }
+      else
+      {
+         if (pnm_fget_bytes(&pnminfo, row, sample_size, 1, stream) <= 0)
+            failed = 1;
+         /* Rescale the samples in place, even on partial reads. */
+         if (scale_table != NULL && sample_size == 1)
          {
             for (j = 0; j < num_samples; ++j)
             {
-               unsigned int val = pnmrow[j];
-               if (val > maxval)
+               if (row[j] > maxval)
                {
-                  val = 255;
+                  row[j] = 255;
                   overflow = 1;
                }
-               else if (maxval != 255)
-                  val = (val * 255 + maxval/2) / maxval;
-               row_pointers[i][j] = (png_byte)val;
+               else
+                  row[j] = (png_byte)scale_table[row[j]];
             }
          }
-         else  /* maxval > 255 */
+         else if (scale_table != NULL)  /* sample_size == 2 */
          {
-            for (j = 0; j < num_samples; ++j)
+            for (j = 0; j < 2 * num_samples; j += 2)
             {
-               png_uint_32 val = pnmrow[j];
+               png_uint_32 val = ((png_uint_32)row[j] << 8) + row[j + 1];
                if (val > maxval)
                {
                   val = 65535;
                   overflow = 1;
                }
-               else if (maxval != 65535)
-                  val = (val * 65535 + maxval/2) / maxval;
-               row_pointers[i][2 * j] = (png_byte)(val >> 8);
-               row_pointers[i][2 * j + 1] = (png_byte)(val & 0xff);
+               else
+                  val = scale_table[val];
+               row[j] = (png_byte)(val >> 8);
+               row[j + 1] = (png_byte)(val & 0xff);
             }
          }
-         if (failed)
-            break;
       }
-   }
-   else  /* read the raw data directly */
-   {
-      for (i = 0; i < height; ++i)
+      if (failed)
       {
-         if (pnm_fget_bytes(&pnminfo,
-             row_pointers[i], sample_size, 1, stream) <= 0)
-         {
-            failed = 1;
-            break;
-         }
+         ++i;
+         break;
       }
    }
 
@@ -226,9 +266,11 @@ pngx_read_pnm(png_structp png_ptr, png_infop info_ptr, FILE *stream)
    for ( ; i < height; ++i)
       memset(row_pointers[i], 0, row_size);
 
-   /* Deallocate the temporary row buffer. */
+   /* Deallocate the temporary buffers. */
    if (pnmrow != NULL)
       png_free(png_ptr, pnmrow);
+   if (scale_table != NULL)
+      png_free(png_ptr, scale_table);
 
    /* Check the results. */
    if (overflow)
@@ -43,10 +43,14 @@ pngx_sig_is_tiff(png_bytep sig, size_t sig_size,
 
 /* FIXME: Not thread-safe. */
 static png_structp err_png_ptr = NULL;
+static struct minitiff_info *err_tiff_info_ptr = NULL;
 static unsigned int num_extra_images;
 
 static void pngx_tiff_error(const char *msg)
 {
+   /* Release the minitiff buffers before jumping out. */
+   minitiff_destroy_info(err_tiff_info_ptr);
+   minitiff_init_info(err_tiff_info_ptr);
    png_error(err_png_ptr, msg);
 }
 
@@ -78,6 +82,7 @@ pngx_read_tiff(png_structp png_ptr, png_infop info_ptr, FILE *stream)
    unsigned int i, j, k;
 
    err_png_ptr = png_ptr;
+   err_tiff_info_ptr = &tiff_info;
    num_extra_images = 0;
    minitiff_init_info(&tiff_info);
    tiff_info.error_handler = pngx_tiff_error;
@@ -104,12 +109,12 @@ pngx_read_tiff(png_structp png_ptr, png_infop info_ptr, FILE *stream)
       color_type = PNG_COLOR_TYPE_RGB_ALPHA;
       break;
    default:
-      png_error(png_ptr, "Unsupported TIFF color space");
+      pngx_tiff_error("Unsupported TIFF color space");
       /* NOTREACHED */
       return 0;  /* avoid "uninitialized color_type" warning */
    }
    if (sample_depth > 16)
-      png_error(png_ptr, "Unsupported TIFF sample depth");
+      pngx_tiff_error("Unsupported TIFF sample depth");
    sample_max = (1 << sample_depth) - 1;
    sample_overflow = 0;
 
@@ -119,12 +124,16 @@ pngx_read_tiff(png_structp png_ptr, png_infop info_ptr, FILE *stream)
       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
    row_pointers = pngx_malloc_rows(png_ptr, info_ptr, 0);
 
+   /* Read the image strip by strip; minitiff inverts the MINWHITE samples. */
+   for (i = k = 0; i < height; ++k)
+      i += (unsigned int)
+         minitiff_read_strip(&tiff_info, row_pointers + i, k, stream);
+
    if (sample_depth <= 8)
    {
       for (i = 0; i < height; ++i)
       {
          row = row_pointers[i];
-         minitiff_read_row(&tiff_info, row, i, stream);
          if (sample_depth < 8)
          {
             for (j = 0; j < pixel_size * width; ++j)
@@ -138,11 +147,6 @@ pngx_read_tiff(png_structp png_ptr, png_infop info_ptr, FILE *stream)
                row[j] = (png_byte)((b * 255 + sample_max / 2) / sample_max);
             }
          }
-         if (tiff_info.photometric == 0)
-         {
-            for (j = 0; j < pixel_size * width; ++j)
-               row[j] = (png_byte)(255 - row[j]);
-         }
       }
    }
    else
@@ -150,7 +154,6 @@ pngx_read_tiff(png_structp png_ptr, png_infop info_ptr, FILE *stream)
       for (i = 0; i < height; ++i)
       {
          row = row_pointers[i];
-         minitiff_read_row(&tiff_info, row, i, stream);
          if (tiff_info.byte_order == 'I')
          {
             /* "Intel" byte order => swap row bytes */
@@ -163,7 +166,7 @@ pngx_read_tiff(png_structp png_ptr, png_infop info_ptr, FILE *stream)
          }
          if (sample_depth < 16)
          {
-            for (j = k = 0; k < pixel_size * width; ++j, k+=2)
+            for (j = k = 0; j < pixel_size * width; ++j, k+=2)
             {
                unsigned int b = (row[k] << 8) + row[k + 1];
                if (b > sample_max)
@@ -34,7 +34,22 @@ typedef png_uint_32 pngx_alloc_size_t;
 #endif
 
 #ifdef PNG_INFO_IMAGE_SUPPORTED
+/* The row offsets inside the row blocks are aligned to this value. */
+#define PNGX_ROW_ALIGNMENT 16
+
+/* Calculate the layout of a row block: the row index comes first,
+ * followed by the rows, all aligned to PNGX_ROW_ALIGNMENT.
+ * Store the size of the row index and the distance between the rows,
+ * and return the size of the row block, or 0 if it is too large.
+ */
+pngx_alloc_size_t PNGAPI pngx_get_rows_layout
+   (png_uint_32 height, pngx_alloc_size_t row_size,
+    pngx_alloc_size_t *index_size, pngx_alloc_size_t *row_stride);
+
 /* Allocate memory for the row pointers.
+ * The row index and the rows are allocated in a single memory block,
+ * which starts with the row index. The rows are contiguous, and their
+ * offsets inside the block are aligned (see pngx_get_rows_layout()).
  * Use filler to initialize the rows if it is non-negative.
  * On success return the newly-allocated row pointers.
  * On failure issue a png_error() or return NULL,
@@ -45,8 +60,40 @@ png_bytepp PNGAPI pngx_malloc_rows
 png_bytepp PNGAPI pngx_malloc_rows_extended
    (png_structp png_ptr, png_infop info_ptr,
     pngx_alloc_size_t min_row_size, int filler);
+
+/* Deallocate the rows allocated by pngx_malloc_rows().
+ * Since the rows are in the same block as the row index,
+ * this is equivalent to deallocating the row index alone,
+ * unless the block is stored out of core (see pngx_unmap_rows()).
+ */
+void PNGAPI pngx_free_rows
+   (png_structp png_ptr, png_infop info_ptr);
 #endif
 
+/* Set the memory limit for the row blocks allocated by pngx_malloc_rows().
+ * The row blocks that exceed this limit are stored out of core,
+ * in memory-mapped scratch files, if the system supports them.
+ * The value 0 means that there is no limit.
+ */
+void PNGAPI pngx_set_rows_memory_limit
+   (pngx_alloc_size_t limit);
+
+/* Check if the given row block is stored out of core. */
+int PNGAPI pngx_rows_are_mapped
+   (png_bytepp rows);
+
+/* Release the given row block, if it is stored out of core, and return 1.
+ * Otherwise, return 0; the caller must deallocate the row block itself.
+ */
+int PNGAPI pngx_unmap_rows
+   (png_bytepp rows);
+
+/* Advise the system to back the given memory block with huge pages,
+ * if the block is large enough and if the system supports huge pages.
+ */
+void PNGAPI pngx_advise_huge_pages
+   (png_voidp ptr, pngx_alloc_size_t size);
+
 
 /*
  * I/O states were introduced in libpng-1.4.0, but they can be reliably used
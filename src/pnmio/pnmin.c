@@ -109,11 +109,81 @@ static int pnm_fscan_uint(FILE *stream, unsigned int *value)
 }
 
 
+/**
+ * Reads (scans) a word from a file stream.
+ * Words longer than the buffer are truncated.
+ * Returns 1 on success, or EOF on input failure.
+ **/
+static int pnm_fscan_word(FILE *stream, char *buf, size_t buf_size)
+{
+    int ch;
+    size_t i;
+
+    /* skip the leading whitespaces */
+    do
+    {
+        ch = pnm_fget_char(stream);
+    } while (pnm_is_space(ch));
+    if (ch == EOF)  /* input failure */
+        return EOF;
+
+    /* read the word, up to and including the trailing whitespace */
+    for (i = 0; ch != EOF && !pnm_is_space(ch); ch = getc(stream))
+    {
+        if (i < buf_size - 1)
+            buf[i++] = (char)ch;
+    }
+    buf[i] = '\0';
+    return 1;
+}
+
+
+/**
+ * Reads a PAM header from a file stream, after the "P7" signature.
+ * The tuple type is not stored; it is implied by the depth.
+ * Returns 1 on success, or -1 on input or matching failure.
+ **/
+static int pnm_fget_pam_header(pnm_struct *pnm_ptr, FILE *stream)
+{
+    char word[16];
+    unsigned int *field;
+    int ch;
+
+    for ( ; ; )
+    {
+        if (pnm_fscan_word(stream, word, sizeof(word)) != 1)
+            return -1;
+        if (strcmp(word, "ENDHDR") == 0)
+            return 1;
+        if (strcmp(word, "TUPLTYPE") == 0)
+        {
+            /* skip the tuple type until the end of line */
+            do
+            {
+                ch = pnm_fget_char(stream);
+            } while (ch != EOF && ch != '\n');
+            continue;
+        }
+        if (strcmp(word, "WIDTH") == 0)
+            field = &pnm_ptr->width;
+        else if (strcmp(word, "HEIGHT") == 0)
+            field = &pnm_ptr->height;
+        else if (strcmp(word, "DEPTH") == 0)
+            field = &pnm_ptr->depth;
+        else if (strcmp(word, "MAXVAL") == 0)
+            field = &pnm_ptr->maxval;
+        else  /* unknown header line */
+            return -1;
+        if (pnm_fscan_uint(stream, field) != 1)
+            return -1;
+    }
+}
+
+
 /**
  * Reads a PNM header structure from a file stream and validates it.
  * Returns 1 on success, 0 on validation failure,
  * or -1 on input or matching failure.
- * Reading PAM ("P7") headers is not currently implemented.
  **/
 int pnm_fget_header(pnm_struct *pnm_ptr, FILE *stream)
 {
@@ -155,7 +225,13 @@ int pnm_fget_header(pnm_struct *pnm_ptr, FILE *stream)
         }
         return pnm_is_valid(pnm_ptr) ? 1 : 0;
     }
-    else  /* TODO: if (format == PNM_P7) ... */
+    else if (format == PNM_P7)  /* PAM header */
+    {
+        if (pnm_fget_pam_header(pnm_ptr, stream) != 1)
+            return -1;
+        return pnm_is_valid(pnm_ptr) ? 1 : 0;
+    }
+    else
         return -1;
 }
 
@@ -370,7 +446,8 @@ int pnm_fget_bytes(const pnm_struct *pnm_ptr,
     /* check the result */
     if (i < num_samples)
     {
-        memset(sample_bytes + i, 0, sample_size * num_samples - i);
+        memset(sample_bytes + i * sample_size, 0,
+               sample_size * (num_samples - i));
         return -1;
     }
     return 1;
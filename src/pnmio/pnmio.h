@@ -47,7 +47,7 @@ enum
     PNM_P4 = 4,  /* raw PBM */
     PNM_P5 = 5,  /* raw PGM */
     PNM_P6 = 6,  /* raw PPM */
-    PNM_P7 = 7   /* PAM (only partially implemented) */
+    PNM_P7 = 7   /* PAM */
 };
 
 